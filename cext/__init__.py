@@ -7,11 +7,20 @@ _primitive_gen_module = tf.load_op_library(os.path.join(_current_path, 'libprimi
 
 # octree ops
 octree_database = _primitive_gen_module.octree_database
+octree_pack = _primitive_gen_module.octree_pack
+octree_packed_database = _primitive_gen_module.octree_packed_database
+octree_prefetch_database = _primitive_gen_module.octree_prefetch_database
 octree_conv = _primitive_gen_module.octree_conv
 octree_pooling = _primitive_gen_module.octree_pooling
+octree_conv_relu_pool = _primitive_gen_module.octree_conv_relu_pool
+points_to_octree = _primitive_gen_module.points_to_octree
+octree_augment = _primitive_gen_module.octree_augment
+octree_encode = _primitive_gen_module.octree_encode
+octree_decode_points = _primitive_gen_module.octree_decode_points
 
 octree_conv_grad = _primitive_gen_module.octree_conv_grad
 octree_pooling_grad = _primitive_gen_module.octree_pooling_grad
+octree_conv_relu_pool_grad = _primitive_gen_module.octree_conv_relu_pool_grad
 
 # primitive ops
 primitive_mutex_loss = _primitive_gen_module.primitive_mutex_loss
@@ -24,6 +33,10 @@ primitive_aligning_loss = _primitive_gen_module.primitive_aligning_loss
 primitive_cube_volume = _primitive_gen_module.primitive_cube_volume
 primitive_cube_area_average_loss = _primitive_gen_module.primitive_cube_area_average_loss
 primitive_points_suffix_index = _primitive_gen_module.primitive_points_suffix_index
+primitive_points_morton_sort = _primitive_gen_module.primitive_points_morton_sort
+primitive_cube_transforms = _primitive_gen_module.primitive_cube_transforms
+primitive_point_cube_assignment = _primitive_gen_module.primitive_point_cube_assignment
+primitive_coverage_assigned_loss = _primitive_gen_module.primitive_coverage_assigned_loss
 
 primitive_mutex_loss_grad = _primitive_gen_module.primitive_mutex_loss_grad
 primitive_cube_coverage_loss_grad = _primitive_gen_module.primitive_cube_coverage_loss_grad
@@ -32,13 +45,16 @@ primitive_consistency_loss_grad = _primitive_gen_module.primitive_consistency_lo
 primitive_symmetry_loss_grad = _primitive_gen_module.primitive_symmetry_loss_grad
 primitive_aligning_loss_grad = _primitive_gen_module.primitive_aligning_loss_grad
 primitive_cube_area_average_loss_grad = _primitive_gen_module.primitive_cube_area_average_loss_grad
+primitive_coverage_assigned_loss_grad = _primitive_gen_module.primitive_coverage_assigned_loss_grad
 
 # mask prediction
 primitive_coverage_split_loss = _primitive_gen_module.primitive_coverage_split_loss
+primitive_coverage_split_assigned_loss = _primitive_gen_module.primitive_coverage_split_assigned_loss
 primitive_consistency_split_loss = _primitive_gen_module.primitive_consistency_split_loss
 primitive_tree_generation = _primitive_gen_module.primitive_tree_generation
 
 primitive_coverage_split_loss_grad = _primitive_gen_module.primitive_coverage_split_loss_grad
+primitive_coverage_split_assigned_loss_grad = _primitive_gen_module.primitive_coverage_split_assigned_loss_grad
 primitive_consistency_split_loss_grad = _primitive_gen_module.primitive_consistency_split_loss_grad
 
 # cube update
@@ -51,9 +67,19 @@ primitive_consistency_select_loss_grad = _primitive_gen_module.primitive_consist
 primitive_mutex_select_loss_grad = _primitive_gen_module.primitive_mutex_select_loss_grad
 
 
+ops.NotDifferentiable('OctreeAugment')
 ops.NotDifferentiable('OctreeDatabase')
+ops.NotDifferentiable('OctreeDecodePoints')
+ops.NotDifferentiable('OctreeEncode')
+ops.NotDifferentiable('OctreePack')
+ops.NotDifferentiable('OctreePackedDatabase')
+ops.NotDifferentiable('OctreePrefetchDatabase')
+ops.NotDifferentiable('PointsToOctree')
 ops.NotDifferentiable('PtimitiveGroupPoints')
+ops.NotDifferentiable('PrimitiveCubeTransforms')
 ops.NotDifferentiable('PrimitiveCubeVolume')
+ops.NotDifferentiable('PrimitivePointCubeAssignment')
+ops.NotDifferentiable('PrimitivePointsMortonSort')
 ops.NotDifferentiable('PrimitivePointsSuffixIndex')
 ops.NotDifferentiable('PrimitiveTreeGeneration')
 
@@ -67,7 +93,8 @@ def _OctreeConvGrad(op, grad):
                           op.get_attr('curr_depth'),
                           op.get_attr('num_output'),
                           op.get_attr('kernel_size'),
-                          op.get_attr('stride')) + \
+                          op.get_attr('stride'),
+                          sparse=op.get_attr('sparse')) + \
          (None,)
 
 
@@ -81,13 +108,28 @@ def _OctreePoolingGrad(op, *grad):
           None]
 
 
+@ops.RegisterGradient('OctreeConvReluPool')
+def _OctreeConvReluPoolGrad(op, *grad):
+  return octree_conv_relu_pool_grad(grad[0],
+                                    op.inputs[0],
+                                    op.inputs[1],
+                                    op.inputs[2],
+                                    op.outputs[0],
+                                    op.outputs[1],
+                                    op.get_attr('curr_depth'),
+                                    op.get_attr('num_output')) + \
+         (None,)
+
+
 @ops.RegisterGradient('PrimitiveMutexLoss')
 def _PrimitiveMutexLossGrad(op, grad):
   return primitive_mutex_loss_grad(grad,
                                    op.inputs[0],
                                    op.inputs[1],
                                    op.inputs[2],
-                                   op.get_attr('scale'))
+                                   op.inputs[3],
+                                   op.get_attr('scale')) + \
+         (None,)
 
 
 @ops.RegisterGradient('PrimitiveCoverageLoss')
@@ -96,8 +138,21 @@ def _PrimitiveCoverageLossGrad(op, grad):
                                          op.inputs[0],
                                          op.inputs[1],
                                          op.inputs[2],
-                                         op.inputs[3]) + \
-         (None,)
+                                         op.inputs[3],
+                                         op.inputs[4]) + \
+         (None, None)
+
+
+@ops.RegisterGradient('PrimitiveCoverageAssignedLoss')
+def _PrimitiveCoverageAssignedLossGrad(op, grad):
+  return primitive_coverage_assigned_loss_grad(grad,
+                                               op.inputs[0],
+                                               op.inputs[1],
+                                               op.inputs[2],
+                                               op.inputs[3],
+                                               op.inputs[4],
+                                               op.inputs[5]) + \
+         (None, None, None)
 
 
 @ops.RegisterGradient('PrimitiveConsistencyLoss')
@@ -107,9 +162,10 @@ def _PrimitiveConsistencyLossGrad(op, grad):
                                          op.inputs[1],
                                          op.inputs[2],
                                          op.inputs[3],
+                                         op.inputs[4],
                                          op.get_attr('scale'),
                                          op.get_attr('num_sample')) + \
-         (None,)
+         (None, None)
 
 
 @ops.RegisterGradient('PrimitiveSymmetryLoss')
@@ -118,8 +174,10 @@ def _PrimitiveSymmetryLossGrad(op, grad):
                                       op.inputs[0],
                                       op.inputs[1],
                                       op.inputs[2],
+                                      op.inputs[3],
                                       op.get_attr('scale'),
-                                      op.get_attr('depth'))
+                                      op.get_attr('depth')) + \
+         (None,)
 
 
 @ops.RegisterGradient('PrimitiveAligningLoss')
@@ -141,8 +199,20 @@ def _PrimitiveCoverageSplitLossGrad(op, *grad):
                                             op.inputs[0],
                                             op.inputs[1],
                                             op.inputs[2],
-                                            op.inputs[3]) + \
-         (None,)
+                                            op.inputs[3],
+                                            op.inputs[4]) + \
+         (None, None)
+
+@ops.RegisterGradient('PrimitiveCoverageSplitAssignedLoss')
+def _PrimitiveCoverageSplitAssignedLossGrad(op, grad):
+  return primitive_coverage_split_assigned_loss_grad(grad,
+                                                     op.inputs[0],
+                                                     op.inputs[1],
+                                                     op.inputs[2],
+                                                     op.inputs[3],
+                                                     op.inputs[4],
+                                                     op.inputs[5]) + \
+         (None, None, None)
 
 @ops.RegisterGradient('PrimitiveConsistencySplitLoss')
 def _PrimitiveConsistencySplitLossGrad(op, grad):
@@ -151,9 +221,10 @@ def _PrimitiveConsistencySplitLossGrad(op, grad):
                                                op.inputs[1],
                                                op.inputs[2],
                                                op.inputs[3],
+                                               op.inputs[4],
                                                op.get_attr('scale'),
                                                op.get_attr('num_sample')) + \
-         (None,)
+         (None, None)
 
 @ops.RegisterGradient('PrimitiveCubeCoverageLoss')
 def _PrimitiveCubeCoverageLossGrad(op, *grad):
@@ -163,8 +234,9 @@ def _PrimitiveCubeCoverageLossGrad(op, *grad):
                                            op.inputs[2],
                                            op.inputs[3],
                                            op.inputs[4],
+                                           op.inputs[5],
                                            op.get_attr('n_src_cube')) + \
-         (None, None)
+         (None, None, None)
 
 @ops.RegisterGradient("PrimitiveMutexSelectLoss")
 def _PrimitiveMutexSelectLossGrad(op, grad):
@@ -173,8 +245,9 @@ def _PrimitiveMutexSelectLossGrad(op, grad):
                                       op.inputs[1],
                                       op.inputs[2],
                                       op.inputs[3],
+                                      op.inputs[4],
                                       op.get_attr("scale")) + \
-         (None,)
+         (None, None)
 
 @ops.RegisterGradient("PrimitiveCoverageSelectLoss")
 def _PrimitiveCoverageSelectLossGrad(op, grad):
@@ -183,8 +256,9 @@ def _PrimitiveCoverageSelectLossGrad(op, grad):
                                          op.inputs[1],
                                          op.inputs[2],
                                          op.inputs[3],
-                                         op.inputs[4]) + \
-         (None, None)
+                                         op.inputs[4],
+                                         op.inputs[5]) + \
+         (None, None, None)
 
 @ops.RegisterGradient("PrimitiveConsistencySelectLoss")
 def _PrimitiveConsistencySelectLossGrad(op, grad):
@@ -194,6 +268,7 @@ def _PrimitiveConsistencySelectLossGrad(op, grad):
                                             op.inputs[2],
                                             op.inputs[3],
                                             op.inputs[4],
+                                            op.inputs[5],
                                             op.get_attr("scale"),
                                             op.get_attr("num_sample")) + \
-         (None, None)
+         (None, None, None)
@@ -0,0 +1,34 @@
+// Micro-benchmarks of the CPU kernels. The kernels are called directly with
+// a hand-made OpKernelContext, so no graph or session is involved, e.g.
+//   ./primitive_benchmark --filter=coverage --n_cube=64 --n_point=1000000
+#include <cstdio>
+
+#include "benchmark_util.h"
+
+namespace tensorflow {
+namespace benchmark {
+
+void run_octree_benchmarks(const BenchmarkConfig& config,
+    BenchmarkDevice* device);
+void run_primitive_loss_benchmarks(const BenchmarkConfig& config,
+    BenchmarkDevice* device);
+
+}  // namespace benchmark
+}  // namespace tensorflow
+
+int main(int argc, char** argv) {
+  using namespace tensorflow::benchmark;
+  BenchmarkConfig config;
+  if (!config.parse(argc, argv)) {
+    std::fprintf(stderr, "%s", BenchmarkConfig::usage().c_str());
+    return 1;
+  }
+
+  print_header();
+  for (int threads : config.threads) {
+    BenchmarkDevice device(threads);
+    run_octree_benchmarks(config, &device);
+    run_primitive_loss_benchmarks(config, &device);
+  }
+  return 0;
+}
@@ -0,0 +1,330 @@
+#include "benchmark_util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "octree.h"
+
+namespace tensorflow {
+
+namespace benchmark {
+
+// --- CountingAllocator ---
+void* CountingAllocator::AllocateRaw(size_t alignment, size_t num_bytes) {
+  void* ptr = cpu_allocator()->AllocateRaw(alignment, num_bytes);
+  std::lock_guard<std::mutex> lock(mu_);
+  sizes_[ptr] = num_bytes;
+  bytes_ += num_bytes;
+  total_bytes_ += num_bytes;
+  num_allocs_ += 1;
+  peak_bytes_ = std::max(peak_bytes_, bytes_);
+  return ptr;
+}
+
+void CountingAllocator::DeallocateRaw(void* ptr) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = sizes_.find(ptr);
+    if (it != sizes_.end()) {
+      bytes_ -= it->second;
+      sizes_.erase(it);
+    }
+  }
+  cpu_allocator()->DeallocateRaw(ptr);
+}
+
+void CountingAllocator::reset() {
+  std::lock_guard<std::mutex> lock(mu_);
+  peak_bytes_ = bytes_;
+  total_bytes_ = 0;
+  num_allocs_ = 0;
+}
+
+// --- BenchmarkDevice ---
+BenchmarkDevice::BenchmarkDevice(int num_threads)
+    : DeviceBase(Env::Default()), num_threads_(num_threads) {
+  pool_.reset(new Eigen::ThreadPool(num_threads));
+  eigen_device_.reset(new CPUDevice(pool_.get(), num_threads));
+  set_eigen_cpu_device(eigen_device_.get());
+  params_.device = this;
+}
+
+std::unique_ptr<OpKernelContext> BenchmarkDevice::new_context() {
+  // the kernels only allocate temporaries, no output is needed
+  return std::unique_ptr<OpKernelContext>(new OpKernelContext(&params_, 0));
+}
+
+// --- BenchmarkConfig ---
+static bool parse_list(const string& value, std::vector<int>* list) {
+  list->clear();
+  std::stringstream ss(value);
+  string item;
+  while (std::getline(ss, item, ',')) {
+    char* end = nullptr;
+    long v = std::strtol(item.c_str(), &end, 10);
+    if (item.empty() || *end != '\0' || v <= 0) return false;
+    list->push_back(static_cast<int>(v));
+  }
+  return !list->empty();
+}
+
+BenchmarkConfig::BenchmarkConfig()
+    : batch_size({ 8 }), n_cube({ 4, 16, 64, 256, 512 }),
+      n_point({ 1000, 10000, 100000, 1000000 }), depth({ 5, 6, 7, 8 }),
+      threads({ static_cast<int>(std::max(1u,
+                std::thread::hardware_concurrency())) }),
+      channel(16), repeat(5), filter() {}
+
+bool BenchmarkConfig::parse(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == string::npos) return false;
+    string key = arg.substr(2, eq - 2);
+    string value = arg.substr(eq + 1);
+    std::vector<int> single;
+    bool ok = true;
+    if (key == "batch_size") ok = parse_list(value, &batch_size);
+    else if (key == "n_cube") ok = parse_list(value, &n_cube);
+    else if (key == "n_point") ok = parse_list(value, &n_point);
+    else if (key == "depth") ok = parse_list(value, &depth);
+    else if (key == "threads") ok = parse_list(value, &threads);
+    else if (key == "filter") filter = value;
+    else if (key == "channel" || key == "repeat") {
+      ok = parse_list(value, &single) && single.size() == 1;
+      if (ok) (key == "channel" ? channel : repeat) = single[0];
+    }
+    else ok = false;
+    if (!ok) return false;
+  }
+  return true;
+}
+
+string BenchmarkConfig::usage() {
+  return
+    "usage: primitive_benchmark [--filter=<substr>] [--batch_size=8]\n"
+    "    [--n_cube=4,16,64,256,512] [--n_point=1000,10000,100000,1000000]\n"
+    "    [--depth=5,6,7,8] [--threads=<cores>] [--channel=16] [--repeat=5]\n"
+    "lists are comma separated, every combination is run; n_point is the\n"
+    "total point number of the batch\n";
+}
+
+bool BenchmarkConfig::selected(const string& name) const {
+  return filter.empty() || name.find(filter) != string::npos;
+}
+
+// --- timing and report ---
+BenchmarkResult run_benchmark(BenchmarkDevice* device, const string& name,
+    const string& params, int64 elements, int repeat,
+    const std::function<void(OpKernelContext*)>& fn) {
+  typedef std::chrono::steady_clock clock;
+  BenchmarkResult result;
+  result.name = name;
+  result.params = params;
+  result.elements = std::max<int64>(elements, 1);
+  result.threads = device->num_threads();
+
+  // warm up, the thread pool and the allocator are hot afterwards
+  {
+    std::unique_ptr<OpKernelContext> ctx = device->new_context();
+    fn(ctx.get());
+  }
+
+  double best = 0, sum = 0;
+  for (int i = 0; i < repeat; ++i) {
+    device->allocator()->reset();
+    std::unique_ptr<OpKernelContext> ctx = device->new_context();
+    clock::time_point t0 = clock::now();
+    fn(ctx.get());
+    clock::time_point t1 = clock::now();
+    CHECK(ctx->status().ok()) << name << ": " << ctx->status();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    best = i == 0 ? ns : std::min(best, ns);
+    sum += ns;
+  }
+  result.best_ns = best;
+  result.mean_ns = sum / std::max(repeat, 1);
+  result.peak_bytes = device->allocator()->peak_bytes();
+  result.alloc_bytes = device->allocator()->total_bytes();
+  return result;
+}
+
+void print_header() {
+  std::printf("%-32s %-40s %12s %10s %12s %12s %12s %7s\n", "benchmark",
+      "params", "elements", "ns/elem", "best(ms)", "mean(ms)", "bytes",
+      "threads");
+}
+
+void print_result(const BenchmarkResult& r) {
+  std::printf("%-32s %-40s %12lld %10.3f %12.3f %12.3f %12lld %7d\n",
+      r.name.c_str(), r.params.c_str(), static_cast<long long>(r.elements),
+      r.best_ns / r.elements, r.best_ns * 1e-6, r.mean_ns * 1e-6,
+      static_cast<long long>(r.alloc_bytes), r.threads);
+  std::fflush(stdout);
+}
+
+// --- synthetic inputs ---
+void random_cubes(int batch_size, int n_cube, unsigned seed,
+    std::vector<float>* in_z, std::vector<float>* in_q,
+    std::vector<float>* in_t) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> size(0.02f, 0.2f);
+  std::uniform_real_distribution<float> pos(-0.4f, 0.4f);
+  std::normal_distribution<float> rot(0.0f, 1.0f);
+  in_z->resize(batch_size * n_cube * 3);
+  in_q->resize(batch_size * n_cube * 4);
+  in_t->resize(batch_size * n_cube * 3);
+  for (int i = 0; i < batch_size * n_cube; ++i) {
+    float q[4], norm = 0;
+    for (int j = 0; j < 4; ++j) {
+      q[j] = rot(rng);
+      norm += q[j] * q[j];
+    }
+    norm = std::sqrt(norm);
+    for (int j = 0; j < 4; ++j) (*in_q)[i * 4 + j] = q[j] / norm;
+    for (int j = 0; j < 3; ++j) {
+      (*in_z)[i * 3 + j] = size(rng);
+      (*in_t)[i * 3 + j] = pos(rng);
+    }
+  }
+}
+
+// a point near the sphere of radius 0.35 centered at the origin
+static void sphere_point(std::mt19937* rng, float* p) {
+  std::normal_distribution<float> dir(0.0f, 1.0f);
+  std::uniform_real_distribution<float> noise(-0.01f, 0.01f);
+  float norm = 0;
+  for (int j = 0; j < 3; ++j) {
+    p[j] = dir(*rng);
+    norm += p[j] * p[j];
+  }
+  norm = std::sqrt(norm) + 1e-12f;
+  for (int j = 0; j < 3; ++j) p[j] = 0.35f * p[j] / norm + noise(*rng);
+}
+
+void random_points(int batch_size, int n_point, unsigned seed,
+    std::vector<float>* in_pos) {
+  std::mt19937 rng(seed);
+  in_pos->resize(4 * n_point);
+  float* pos = in_pos->data();
+  for (int i = 0; i < n_point; ++i) {
+    float p[3];
+    sphere_point(&rng, p);
+    for (int j = 0; j < 3; ++j) pos[j * n_point + i] = p[j];
+    // the points of a shape are contiguous, like the batched input data
+    int64 b = static_cast<int64>(i) * batch_size / n_point;
+    pos[3 * n_point + i] = static_cast<float>(b);
+  }
+}
+
+string random_octree(int depth, int full_layer, int n_point, unsigned seed) {
+  CHECK(depth > 0 && depth <= 8) << "Invalid octree depth " << depth;
+  std::mt19937 rng(seed);
+  const unsigned bound = 1u << depth;
+
+  // occupied leaf keys and the averaged normal of each leaf
+  std::vector<std::pair<unsigned, int>> leaf(n_point);
+  std::vector<float> pts(3 * n_point);
+  for (int i = 0; i < n_point; ++i) {
+    float* p = pts.data() + 3 * i;
+    sphere_point(&rng, p);
+    unsigned xyz[3];
+    for (int j = 0; j < 3; ++j) {
+      int v = static_cast<int>((p[j] + 0.5f) * bound);
+      xyz[j] = static_cast<unsigned>(std::min(std::max(v, 0),
+                                              static_cast<int>(bound) - 1));
+    }
+    leaf[i] = std::make_pair(
+        octree::morton_encode(xyz[0] | xyz[1] << 8 | xyz[2] << 16), i);
+  }
+  std::sort(leaf.begin(), leaf.end());
+
+  // the occupied keys of every layer, sorted
+  std::vector<std::vector<unsigned>> occupied(depth + 1);
+  for (int d = 0; d < depth + 1; ++d) {
+    std::vector<unsigned>& keys = occupied[d];
+    for (size_t i = 0; i < leaf.size(); ++i) {
+      unsigned k = leaf[i].first >> 3 * (depth - d);
+      if (keys.empty() || keys.back() != k) keys.push_back(k);
+    }
+  }
+
+  // top-down build, the 8 children of every non-empty node are created
+  std::vector<std::vector<unsigned>> nodes(depth + 1);
+  std::vector<std::vector<int>> children(depth + 1);
+  nodes[0].push_back(0);
+  for (int d = 0; d < depth + 1; ++d) {
+    int count = 0;
+    for (unsigned key : nodes[d]) {
+      bool nempty = d < full_layer ||
+          std::binary_search(occupied[d].begin(), occupied[d].end(), key);
+      children[d].push_back(nempty ? count++ : -1);
+      if (nempty && d < depth) {
+        for (unsigned j = 0; j < 8; ++j) nodes[d + 1].push_back(key << 3 | j);
+      }
+    }
+  }
+
+  // header
+  std::vector<int> node_num(depth + 1), node_num_accu(depth + 2, 0);
+  for (int d = 0; d < depth + 1; ++d) {
+    node_num[d] = static_cast<int>(nodes[d].size());
+    node_num_accu[d + 1] = node_num_accu[d] + node_num[d];
+  }
+  int total_node_num = node_num_accu[depth + 1];
+  int final_node_num = node_num[depth];
+  std::vector<int> buffer;
+  buffer.push_back(total_node_num);
+  buffer.push_back(final_node_num);
+  buffer.push_back(depth);
+  buffer.push_back(full_layer);
+  buffer.insert(buffer.end(), node_num.begin(), node_num.end());
+  buffer.insert(buffer.end(), node_num_accu.begin(), node_num_accu.end());
+
+  // key, the xyz form of the shuffled keys, and children
+  for (int d = 0; d < depth + 1; ++d) {
+    std::vector<unsigned> xyz(nodes[d].size());
+    octree::morton_decode(xyz.data(), nodes[d].data(), xyz.size());
+    buffer.insert(buffer.end(), xyz.begin(), xyz.end());
+  }
+  for (int d = 0; d < depth + 1; ++d) {
+    buffer.insert(buffer.end(), children[d].begin(), children[d].end());
+  }
+
+  // signal, the averaged normal of the points inside each leaf, and misc
+  std::vector<float> signal(3 * final_node_num, 0.0f);
+  size_t i = 0;
+  for (int n = 0; n < final_node_num; ++n) {
+    unsigned key = nodes[depth][n];
+    for (; i < leaf.size() && leaf[i].first < key; ++i) {}
+    for (; i < leaf.size() && leaf[i].first == key; ++i) {
+      const float* p = pts.data() + 3 * leaf[i].second;
+      for (int c = 0; c < 3; ++c) signal[c * final_node_num + n] += p[c];
+    }
+    float norm = 0;
+    for (int c = 0; c < 3; ++c) {
+      norm += signal[c * final_node_num + n] * signal[c * final_node_num + n];
+    }
+    norm = std::sqrt(norm);
+    for (int c = 0; c < 3 && norm > 0; ++c) {
+      signal[c * final_node_num + n] /= norm;
+    }
+  }
+  size_t offset = buffer.size();
+  buffer.resize(offset + signal.size() + final_node_num, 0);
+  memcpy(buffer.data() + offset, signal.data(), signal.size() * sizeof(float));
+
+  return string(reinterpret_cast<const char*>(buffer.data()),
+                buffer.size() * sizeof(int));
+}
+
+}  // namespace benchmark
+
+}  // namespace tensorflow
@@ -0,0 +1,130 @@
+#ifndef TENSORFLOW_USER_OPS_BENCHMARK_UTIL_H_
+#define TENSORFLOW_USER_OPS_BENCHMARK_UTIL_H_
+
+#define EIGEN_USE_THREADS
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/framework/device_base.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/tensor.h"
+
+namespace tensorflow {
+
+typedef Eigen::ThreadPoolDevice CPUDevice;
+
+namespace benchmark {
+
+// forwards to cpu_allocator() and records the bytes handed out, so that a
+// benchmark can report the temporaries requested through allocate_temp()
+class CountingAllocator : public Allocator {
+ public:
+  CountingAllocator() : bytes_(0), peak_bytes_(0), total_bytes_(0),
+    num_allocs_(0) {}
+
+  string Name() override { return "benchmark_counting"; }
+  void* AllocateRaw(size_t alignment, size_t num_bytes) override;
+  void DeallocateRaw(void* ptr) override;
+
+  void reset();
+  int64 peak_bytes() const { return peak_bytes_; }
+  int64 total_bytes() const { return total_bytes_; }
+  int64 num_allocs() const { return num_allocs_; }
+
+ private:
+  std::mutex mu_;
+  std::map<void*, size_t> sizes_;
+  int64 bytes_;
+  int64 peak_bytes_;
+  int64 total_bytes_;
+  int64 num_allocs_;
+};
+
+// an intra-op thread pool plus the bits of a device an OpKernelContext needs,
+// the kernels are called directly without building a graph or a session
+class BenchmarkDevice : public DeviceBase {
+ public:
+  explicit BenchmarkDevice(int num_threads);
+
+  Allocator* GetAllocator(AllocatorAttributes attr) override {
+    return &allocator_;
+  }
+
+  const CPUDevice& cpu_device() const { return *eigen_device_; }
+  CountingAllocator* allocator() { return &allocator_; }
+  int num_threads() const { return num_threads_; }
+
+  // a fresh context whose allocate_temp() goes through allocator()
+  std::unique_ptr<OpKernelContext> new_context();
+
+ private:
+  int num_threads_;
+  std::unique_ptr<Eigen::ThreadPool> pool_;
+  std::unique_ptr<CPUDevice> eigen_device_;
+  CountingAllocator allocator_;
+  OpKernelContext::Params params_;
+};
+
+// the parameter lists swept by the benchmarks, set from the command line
+struct BenchmarkConfig {
+  std::vector<int> batch_size;
+  std::vector<int> n_cube;
+  std::vector<int> n_point;
+  std::vector<int> depth;
+  std::vector<int> threads;
+  int channel;
+  int repeat;
+  string filter;
+
+  BenchmarkConfig();
+  bool parse(int argc, char** argv);
+  static string usage();
+  bool selected(const string& name) const;
+};
+
+// timing summary of a single benchmark case
+struct BenchmarkResult {
+  string name;
+  string params;
+  int64 elements;
+  double best_ns;
+  double mean_ns;
+  int64 peak_bytes;
+  int64 alloc_bytes;
+  int threads;
+};
+
+// run fn once to warm up, then `repeat` times, the bytes are the ones
+// allocated through the device during the last run
+BenchmarkResult run_benchmark(BenchmarkDevice* device, const string& name,
+    const string& params, int64 elements, int repeat,
+    const std::function<void(OpKernelContext*)>& fn);
+
+void print_header();
+void print_result(const BenchmarkResult& result);
+
+/// synthetic inputs, all generators are deterministic for a given seed
+// random cubes, z [batch_size, 3 * n_cube], q [batch_size, 4 * n_cube] and
+// t [batch_size, 3 * n_cube], placed inside the unit cube centered at 0
+void random_cubes(int batch_size, int n_cube, unsigned seed,
+    std::vector<float>* in_z, std::vector<float>* in_q,
+    std::vector<float>* in_t);
+// n_point points in [4, n_point] layout, sampled near a sphere surface and
+// spread evenly over the batch; row 3 holds the batch index
+void random_points(int batch_size, int n_point, unsigned seed,
+    std::vector<float>* in_pos);
+// serialized octree of the given depth in the layout read by OctreeParser,
+// built from n_point points sampled near a sphere surface
+string random_octree(int depth, int full_layer, int n_point, unsigned seed);
+
+}  // namespace benchmark
+
+}  // namespace tensorflow
+
+#endif  // !TENSORFLOW_USER_OPS_BENCHMARK_UTIL_H_
@@ -0,0 +1,441 @@
+#include "benchmark_util.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+
+#include "octree.h"
+
+namespace tensorflow {
+
+namespace octree {
+
+// defined with the pooling op
+void max_pooling_pad_forward(const CPUDevice& d, OpKernelContext* ctx,
+    float* top_data, int top_h, uint8* bottom_mask, const float* bottom_data,
+    int bottom_h, int channel, const int* children);
+
+}  // namespace octree
+
+namespace benchmark {
+
+// ni for kernel_size=3, the same table as init_neigh_index()
+static std::vector<int> neigh_index() {
+  std::vector<int> ni(216);
+  int id = 0;
+  for (int i = 0; i < 2; ++i) {
+    for (int j = 0; j < 2; ++j) {
+      for (int k = 0; k < 2; ++k) {
+        for (int x = 0; x < 3; ++x) {
+          for (int y = 0; y < 3; ++y) {
+            for (int z = 0; z < 3; ++z) {
+              ni[id++] = ((x + i) << 4) | ((y + j) << 2) | (z + k);
+            }
+          }
+        }
+      }
+    }
+  }
+  return ni;
+}
+
+static Tensor octree_buffer(int batch_size, int depth, int n_point) {
+  Tensor buffer(DT_STRING, TensorShape({ batch_size }));
+  auto buffer_flat = buffer.flat<string>();
+  for (int i = 0; i < batch_size; ++i) {
+    buffer_flat(i) = random_octree(depth, 2, n_point / batch_size, 17 + i);
+  }
+  return buffer;
+}
+
+// the former hash table version of octree::calc_neighbor(), as a reference
+static void calc_neighbor_hash_table(int* neigh, const unsigned* key,
+    int node_num, int displacement) {
+  typedef unsigned char ubyte;
+
+  // build hash table
+  std::vector<std::pair<unsigned, int>> entries(node_num);
+  for (int id = 0; id < node_num; ++id) {
+    entries[id] = std::make_pair(key[id], id + displacement);
+  }
+  std::unordered_map<unsigned, int> hash_table(entries.begin(), entries.end());
+
+  // calc neighborhood
+  for (int id = 0; id < node_num; id += 8) {
+    int* ngh = neigh + id * 8;
+    const ubyte* k0 = (const ubyte*)(key + id);
+    ubyte k1[4] = { 0, 0, 0, k0[3] };
+    for (ubyte x = 0; x < 4; ++x) {
+      k1[0] = k0[0] + x - 1;
+      for (ubyte y = 0; y < 4; ++y) {
+        k1[1] = k0[1] + y - 1;
+        for (ubyte z = 0; z < 4; ++z) {
+          k1[2] = k0[2] + z - 1;
+          unsigned* k2 = reinterpret_cast<unsigned*>(k1);
+          auto rst = hash_table.find(*k2);
+          ubyte i = (x << 4) | (y << 2) | z;
+          ngh[i] = rst != hash_table.end() ? rst->second : -1;
+        }
+      }
+    }
+  }
+}
+
+static void benchmark_calc_neighbor(const BenchmarkConfig& config,
+    BenchmarkDevice* device, int depth, int n_point) {
+  string octree = random_octree(depth, 2, n_point, 17);
+  OctreeParser parser(octree.data());
+  const unsigned* key = reinterpret_cast<const unsigned*>(parser.key_) +
+      parser.node_num_accu_[depth];
+  int node_num = parser.node_num_[depth];
+  std::vector<int> neigh(node_num * OctreeInfo::AVG_NGH_NUM);
+  std::vector<int> neigh_ref(node_num * OctreeInfo::AVG_NGH_NUM);
+
+  std::stringstream params;
+  params << "depth=" << depth << " n_point=" << n_point;
+  print_result(run_benchmark(device, "calc_neighbor", params.str(), node_num,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::calc_neighbor(neigh.data(), key, node_num, 0);
+      }));
+  print_result(run_benchmark(device, "calc_neighbor_hash_table",
+      params.str(), node_num, config.repeat, [&](OpKernelContext* ctx) {
+        calc_neighbor_hash_table(neigh_ref.data(), key, node_num, 0);
+      }));
+  // the sphere stays away from the boundary, where the byte keys of the
+  // hash table version wrap around at depth 8
+  CHECK(neigh == neigh_ref) << "calc_neighbor mismatch at depth " << depth;
+}
+
+static void benchmark_morton(const BenchmarkConfig& config,
+    BenchmarkDevice* device, int depth) {
+  // the keys of a full layer, capped at depth 7
+  const int full_depth = std::min(depth, 7);
+  const int node_num = 1 << 3 * full_depth;
+  std::vector<unsigned> code(node_num), xyz(node_num), code_ref(node_num);
+  for (int i = 0; i < node_num; ++i) code_ref[i] = i;
+
+  std::stringstream params;
+  params << "depth=" << full_depth;
+  const bool bmi2 = octree::morton_use_bmi2();
+  for (bool use_bmi2 : { true, false }) {
+    if (use_bmi2 && !bmi2) continue;
+    octree::morton_use_bmi2(use_bmi2);
+    const string suffix = use_bmi2 ? "_bmi2" : "_lut";
+    print_result(run_benchmark(device, "morton_decode" + suffix, params.str(),
+        node_num, config.repeat, [&](OpKernelContext* ctx) {
+          octree::morton_decode(xyz.data(), code_ref.data(), node_num);
+        }));
+    print_result(run_benchmark(device, "morton_encode" + suffix, params.str(),
+        node_num, config.repeat, [&](OpKernelContext* ctx) {
+          octree::morton_encode(code.data(), xyz.data(), node_num);
+        }));
+    CHECK(code == code_ref) << "morton codec mismatch at depth " << depth;
+  }
+  octree::morton_use_bmi2(bmi2);
+
+  // the key and neighbor tables of the full layers
+  std::vector<int> key(node_num), neigh(node_num * OctreeInfo::AVG_NGH_NUM);
+  print_result(run_benchmark(device, "generate_key", params.str(), node_num,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::generate_key_cpu(key.data(), full_depth, 1);
+      }));
+  print_result(run_benchmark(device, "calc_neigh", params.str(), node_num,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::calc_neigh_cpu(neigh.data(), full_depth, 1);
+      }));
+}
+
+static void benchmark_points_to_octree(const BenchmarkConfig& config,
+    BenchmarkDevice* device, int depth, int n_point) {
+  // the sphere points, their directions are the normals
+  std::vector<float> pos;
+  random_points(1, n_point, 17, &pos);
+  std::stringstream params;
+  params << "depth=" << depth << " n_point=" << n_point;
+  const CPUDevice& d = device->cpu_device();
+  string octree;
+  print_result(run_benchmark(device, "points_to_octree", params.str(),
+      n_point, config.repeat, [&](OpKernelContext* ctx) {
+        octree::points_to_octree(d, &octree, pos.data(), pos.data(), n_point,
+            depth, 2, 0.5f);
+      }));
+}
+
+static void benchmark_set_octreebatch(const BenchmarkConfig& config,
+    BenchmarkDevice* device, int batch_size, int depth, int n_point) {
+  Tensor buffer = octree_buffer(batch_size, depth, n_point);
+  int64 total_node_num = 0;
+  auto buffer_flat = buffer.flat<string>();
+  for (int i = 0; i < batch_size; ++i) {
+    total_node_num += OctreeParser(buffer_flat(i).data()).total_node_number();
+  }
+
+  std::stringstream params;
+  params << "batch=" << batch_size << " depth=" << depth
+         << " n_point=" << n_point;
+  print_result(run_benchmark(device, "set_octreebatch", params.str(),
+      total_node_num, config.repeat, [&](OpKernelContext* ctx) {
+        OctreeBatch octree_batch;
+        octree_batch.set_octreebatch(ctx, buffer);
+      }));
+}
+
+static void benchmark_octree_decode(const BenchmarkConfig& config,
+    BenchmarkDevice* device, int batch_size, int depth, int n_point) {
+  Tensor buffer = octree_buffer(batch_size, depth, n_point);
+  auto buffer_flat = buffer.flat<string>();
+  // the records hold the 5000 points of the training data
+  std::vector<float> pos;
+  random_points(1, 5000, 17, &pos);
+  std::vector<string> records(batch_size), octrees(batch_size);
+  int64 total_node_num = 0, raw_bytes = 0, bytes = 0;
+  for (int i = 0; i < batch_size; ++i) {
+    octree::encode_octree(&records[i], buffer_flat(i).data(), pos.data(),
+        5000);
+    total_node_num += OctreeParser(buffer_flat(i).data()).total_node_number();
+    raw_bytes += buffer_flat(i).size() + pos.size() * sizeof(float);
+    bytes += records[i].size();
+  }
+
+  std::stringstream params;
+  params << "batch=" << batch_size << " depth=" << depth
+         << " n_point=" << n_point << " ratio=" << std::setprecision(3)
+         << double(raw_bytes) / bytes;
+  print_result(run_benchmark(device, "octree_decode", params.str(),
+      total_node_num, config.repeat, [&](OpKernelContext* ctx) {
+        for (int i = 0; i < batch_size; ++i) {
+          octree::decode_octree(&octrees[i], records[i].data(),
+              records[i].size());
+        }
+      }));
+}
+
+static void benchmark_octree_augment(const BenchmarkConfig& config,
+    BenchmarkDevice* device, int batch_size, int depth, int n_point) {
+  Tensor buffer = octree_buffer(batch_size, depth, n_point);
+  OctreeBatch octree_batch;
+  {
+    auto ctx = device->new_context();
+    octree_batch.set_octreebatch(ctx.get(), buffer);
+  }
+  const Tensor& octree = octree_batch.octree_;
+  const Tensor& data = octree_batch.data_;
+  std::vector<int> des_octree(octree.NumElements());
+  std::vector<float> des_data(data.NumElements());
+  // all the shapes turned by the same rotation of 120 degrees
+  std::vector<int> transform(batch_size, 3 << 3);
+  OctreeBatchParser parser;
+  parser.set_cpu(octree.flat<int>().data());
+  const int64 total_node_num = parser.total_node_num();
+
+  std::stringstream params;
+  params << "batch=" << batch_size << " depth=" << depth
+         << " n_point=" << n_point;
+  const CPUDevice& d = device->cpu_device();
+  print_result(run_benchmark(device, "octree_augment", params.str(),
+      total_node_num, config.repeat, [&](OpKernelContext* ctx) {
+        octree::augment_octree(d, des_octree.data(), des_data.data(),
+            octree.flat<int>().data(), data.flat<float>().data(),
+            transform.data());
+      }));
+}
+
+static void benchmark_octree2col(const BenchmarkConfig& config,
+    BenchmarkDevice* device, int batch_size, int depth, int n_point) {
+  // the batched octree with neighbor information
+  Tensor buffer = octree_buffer(batch_size, depth, n_point);
+  OctreeBatch octree_batch;
+  {
+    std::unique_ptr<OpKernelContext> ctx = device->new_context();
+    octree_batch.set_octreebatch(ctx.get(), buffer);
+  }
+  OctreeBatchParser parser;
+  parser.set_cpu(octree_batch.octree_.flat<int>().data());
+  const int* neigh = parser.neighbor_cpu(depth);
+  const int height = parser.node_num(depth);
+  std::vector<int> ni = neigh_index();
+
+  // skip the cases whose workspace exceeds the one used by OctreeConv
+  const int channel = config.channel;
+  const int64 col_num = static_cast<int64>(channel) * 27 * height;
+  std::stringstream params;
+  params << "batch=" << batch_size << " depth=" << depth
+         << " n_point=" << n_point << " c=" << channel;
+  if (col_num * static_cast<int64>(sizeof(float)) >
+      octree::get_workspace_maxsize()) {
+    std::printf("%-32s %-40s skipped, workspace too large\n", "octree2col",
+        params.str().c_str());
+    return;
+  }
+
+  std::mt19937 rng(17);
+  std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+  std::vector<float> data(channel * height), col(col_num);
+  for (float& v : data) v = uniform(rng);
+  for (float& v : col) v = uniform(rng);
+
+  const CPUDevice& d = device->cpu_device();
+  print_result(run_benchmark(device, "octree2col_cpu", params.str(), col_num,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree2col_cpu(col.data(), data.data(), channel, height, 3, 1,
+            neigh, ni.data(), height, 0);
+      }));
+  print_result(run_benchmark(device, "octree2col", params.str(), col_num,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree2col(d, ctx, col.data(), data.data(), channel, height,
+            3, 1, neigh, ni.data(), height, 0);
+      }));
+  print_result(run_benchmark(device, "col2octree_cpu", params.str(), col_num,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::col2octree_cpu(col.data(), data.data(), channel, height, 3, 1,
+            neigh, ni.data(), height, 0);
+      }));
+  print_result(run_benchmark(device, "col2octree", params.str(), col_num,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::col2octree(d, ctx, col.data(), data.data(), channel, height,
+            3, 1, neigh, ni.data(), height, 0);
+      }));
+}
+
+static void benchmark_octree_conv(const BenchmarkConfig& config,
+    BenchmarkDevice* device, int batch_size, int depth, int n_point) {
+  Tensor buffer = octree_buffer(batch_size, depth, n_point);
+  OctreeBatch octree_batch;
+  {
+    std::unique_ptr<OpKernelContext> ctx = device->new_context();
+    octree_batch.set_octreebatch(ctx.get(), buffer);
+  }
+  OctreeBatchParser parser;
+  parser.set_cpu(octree_batch.octree_.flat<int>().data());
+  const int* neigh = parser.neighbor_cpu(depth);
+  const int height = parser.node_num(depth);
+  std::vector<int> ni = neigh_index();
+
+  // the layers of the encoder keep the channel number in and out
+  const int channel = config.channel, num_output = config.channel;
+  const int kernel_dim = channel * 27;
+  std::mt19937 rng(17);
+  std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+  std::vector<float> data(channel * height), filter(num_output * kernel_dim);
+  std::vector<float> top(num_output * height), grad_data(channel * height);
+  std::vector<float> grad_filter(num_output * kernel_dim);
+  for (float& v : data) v = uniform(rng);
+  for (float& v : filter) v = uniform(rng);
+  for (float& v : top) v = uniform(rng);
+
+  // one multiply-add of the GEMM per element
+  const int64 macs = static_cast<int64>(num_output) * kernel_dim * height;
+  std::stringstream params;
+  params << "batch=" << batch_size << " depth=" << depth
+         << " n_point=" << n_point << " c=" << channel;
+  const CPUDevice& d = device->cpu_device();
+  print_result(run_benchmark(device, "octree_conv", params.str(), macs,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree_conv(d, ctx, top.data(), data.data(), filter.data(),
+            channel, num_output, height, neigh, ni.data());
+      }));
+  print_result(run_benchmark(device, "octree_conv_grad", params.str(), macs,
+      config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree_conv_grad(d, ctx, grad_data.data(), grad_filter.data(),
+            top.data(), data.data(), filter.data(), channel, num_output,
+            height, neigh, ni.data());
+      }));
+
+  // the same layer over the non-empty nodes only, the work is reported as
+  // the dense one so the rates compare directly
+  const int* children_curr = parser.children_cpu(depth);
+  print_result(run_benchmark(device, "octree_conv_sparse", params.str(),
+      macs, config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree_conv_sparse(d, ctx, top.data(), data.data(),
+            filter.data(), channel, num_output, height, neigh, ni.data(),
+            children_curr);
+      }));
+  print_result(run_benchmark(device, "octree_conv_sparse_grad", params.str(),
+      macs, config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree_conv_sparse_grad(d, ctx, grad_data.data(),
+            grad_filter.data(), top.data(), data.data(), filter.data(),
+            channel, num_output, height, neigh, ni.data(), children_curr);
+      }));
+
+  // the encoder block, the convolution with relu and pooling fused against
+  // the three kernels in a row
+  const int top_h = parser.node_num(depth - 1);
+  const int* children = parser.children_cpu(depth - 1);
+  std::vector<float> pooled(num_output * top_h);
+  std::vector<uint8> mask(num_output * height / 8);
+  print_result(run_benchmark(device, "octree_conv_relu_pool", params.str(),
+      macs, config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree_conv_relu_pool(d, ctx, pooled.data(), top_h,
+            mask.data(), data.data(), filter.data(), channel, num_output,
+            height, neigh, ni.data(), children);
+      }));
+  print_result(run_benchmark(device, "octree_conv_relu_pool_unfused",
+      params.str(), macs, config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree_conv(d, ctx, top.data(), data.data(), filter.data(),
+            channel, num_output, height, neigh, ni.data());
+        for (float& v : top) v = std::max(v, 0.0f);
+        octree::max_pooling_pad_forward(d, ctx, pooled.data(), top_h,
+            mask.data(), top.data(), height, num_output, children);
+      }));
+
+  // the former path of the CPU kernel, the whole layer as one workspace
+  // chunk followed by one GEMM
+  const int64 col_num = static_cast<int64>(kernel_dim) * height;
+  if (col_num * static_cast<int64>(sizeof(float)) >
+      octree::get_workspace_maxsize()) {
+    std::printf("%-32s %-40s skipped, workspace too large\n",
+        "octree_conv_chunked", params.str().c_str());
+    return;
+  }
+  std::vector<float> col(col_num);
+  print_result(run_benchmark(device, "octree_conv_chunked", params.str(),
+      macs, config.repeat, [&](OpKernelContext* ctx) {
+        octree::octree2col(d, ctx, col.data(), data.data(), channel, height,
+            3, 1, neigh, ni.data(), height, 0);
+        octree::gemm(d, ctx, false, false, num_output, height, kernel_dim,
+            1.0f, filter.data(), col.data(), 0.0f, top.data());
+      }));
+}
+
+void run_octree_benchmarks(const BenchmarkConfig& config,
+    BenchmarkDevice* device) {
+  for (int depth : config.depth) {
+    if (config.selected("morton")) {
+      benchmark_morton(config, device, depth);
+    }
+    for (int n_point : config.n_point) {
+      if (config.selected("calc_neighbor")) {
+        benchmark_calc_neighbor(config, device, depth, n_point);
+      }
+      if (config.selected("points_to_octree")) {
+        benchmark_points_to_octree(config, device, depth, n_point);
+      }
+      for (int batch_size : config.batch_size) {
+        if (config.selected("set_octreebatch")) {
+          benchmark_set_octreebatch(config, device, batch_size, depth,
+              n_point);
+        }
+        if (config.selected("octree_decode")) {
+          benchmark_octree_decode(config, device, batch_size, depth, n_point);
+        }
+        if (config.selected("octree_augment")) {
+          benchmark_octree_augment(config, device, batch_size, depth,
+              n_point);
+        }
+        if (config.selected("octree2col") || config.selected("col2octree")) {
+          benchmark_octree2col(config, device, batch_size, depth, n_point);
+        }
+        if (config.selected("octree_conv")) {
+          benchmark_octree_conv(config, device, batch_size, depth, n_point);
+        }
+      }
+    }
+  }
+}
+
+}  // namespace benchmark
+
+}  // namespace tensorflow
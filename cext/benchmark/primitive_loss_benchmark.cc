@@ -0,0 +1,346 @@
+#include "benchmark_util.h"
+#include "primitive_util.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <sstream>
+
+namespace tensorflow {
+
+// the CPU paths of the losses, defined in the primitive_*_loss.cc files
+void compute_coverage_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, float* loss_ptr);
+void compute_coverage_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
+void compute_coverage_split_loss(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_cube, const int n_point,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr, int* count_ptr);
+void compute_coverage_split_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const float* loss, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
+void compute_consistency_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr);
+void compute_consistency_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
+void compute_mutex_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr);
+void compute_mutex_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t);
+void compute_symmetry_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const int depth, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr);
+void compute_symmetry_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const int depth, const float scale,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t);
+void compute_cube_coverage_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int n_src_cube,
+    const int batch_size, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, const int* point_group_index, float* loss_ptr,
+    int* relatoin_ptr);
+void compute_cube_coverage_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int n_src_cube, const int batch_size, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* point_group_index, float* grad_z, float* grad_q, float* grad_t);
+void assign_points_to_cubes(const CPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const int batch_size,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    int* index, float* distance, int* count);
+void compute_coverage_assigned_loss(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const bool split, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* in_index, float* loss_ptr);
+void compute_coverage_assigned_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const bool split, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* in_index, float* grad_z, float* grad_q, float* grad_t);
+void morton_sort_points(const CPUDevice& d, OpKernelContext* context,
+    const int n_point, const int depth, const float* in_pos, float* out_pos,
+    int* out_index);
+
+namespace benchmark {
+
+// inputs and outputs shared by the loss benchmarks of one parameter set
+struct LossData {
+  int batch_size;
+  int n_cube;
+  int n_point;
+  std::vector<float> in_z, in_q, in_t, in_pos;
+  std::vector<float> packed;  // the output of PrimitiveCubeTransforms
+  std::vector<float> grad_z, grad_q, grad_t;
+  float loss;
+
+  LossData(const CPUDevice& d, int batch_size, int n_cube, int n_point)
+      : batch_size(batch_size), n_cube(n_cube), n_point(n_point),
+        loss(1.0f) {
+    random_cubes(batch_size, n_cube, 17, &in_z, &in_q, &in_t);
+    random_points(batch_size, n_point, 19, &in_pos);
+    packed.resize(primitive::kCubeTransformRows * stride());
+    primitive::cube_transforms(d, batch_size * n_cube, in_z.data(),
+        in_q.data(), in_t.data(), stride(), packed.data());
+    grad_z.resize(in_z.size());
+    grad_q.resize(in_q.size());
+    grad_t.resize(in_t.size());
+  }
+
+  int stride() const {
+    return primitive::cube_transform_stride(batch_size * n_cube);
+  }
+  primitive::CubeTransforms transforms() const {
+    return { packed.data(), stride() };
+  }
+};
+
+static void benchmark_point_losses(const BenchmarkConfig& config,
+    BenchmarkDevice* device, LossData* x) {
+  const CPUDevice& d = device->cpu_device();
+  const int n_cube = x->n_cube, n_point = x->n_point;
+  const int batch_size = x->batch_size;
+  std::stringstream ss;
+  ss << "batch=" << batch_size << " n_cube=" << n_cube
+     << " n_point=" << n_point;
+  const string params = ss.str();
+
+  // one point-cube distance per element
+  const int64 pairs = static_cast<int64>(n_point) * n_cube;
+  if (config.selected("coverage_loss")) {
+    print_result(run_benchmark(device, "coverage_loss", params, pairs,
+        config.repeat, [&](OpKernelContext* ctx) {
+          compute_coverage_loss(d, ctx, n_cube, n_point, x->in_z.data(),
+              x->in_q.data(), x->in_t.data(), x->transforms(), x->in_pos.data(),
+              &x->loss);
+        }));
+    print_result(run_benchmark(device, "coverage_loss_grad", params, pairs,
+        config.repeat, [&](OpKernelContext* ctx) {
+          compute_coverage_loss_grad(d, ctx, n_cube, n_point, batch_size,
+              &x->loss, x->in_z.data(), x->in_q.data(), x->in_t.data(),
+              x->transforms(), x->in_pos.data(), x->grad_z.data(),
+              x->grad_q.data(), x->grad_t.data());
+        }));
+  }
+
+  if (config.selected("coverage_split_loss")) {
+    std::vector<float> loss(batch_size * n_cube);
+    std::vector<int> count(batch_size * n_cube);
+    print_result(run_benchmark(device, "coverage_split_loss", params, pairs,
+        config.repeat, [&](OpKernelContext* ctx) {
+          compute_coverage_split_loss(d, ctx, batch_size, n_cube, n_point,
+              x->in_z.data(), x->in_q.data(), x->in_t.data(), x->transforms(),
+              x->in_pos.data(), loss.data(), count.data());
+        }));
+    print_result(run_benchmark(device, "coverage_split_loss_grad", params,
+        pairs, config.repeat, [&](OpKernelContext* ctx) {
+          compute_coverage_split_loss_grad(d, ctx, n_cube, n_point, batch_size,
+              loss.data(), x->in_z.data(), x->in_q.data(), x->in_t.data(),
+              x->transforms(), x->in_pos.data(), x->grad_z.data(),
+              x->grad_q.data(), x->grad_t.data());
+        }));
+  }
+
+  // the nearest cubes searched once, then the coverage loss on them
+  if (config.selected("point_cube_assignment")) {
+    std::vector<int> index(n_point), count(batch_size * n_cube);
+    std::vector<float> distance(n_point);
+    print_result(run_benchmark(device, "point_cube_assignment", params, pairs,
+        config.repeat, [&](OpKernelContext* ctx) {
+          assign_points_to_cubes(d, ctx, n_point, n_cube, batch_size,
+              x->in_z.data(), x->in_q.data(), x->in_t.data(), x->transforms(),
+              x->in_pos.data(), index.data(), distance.data(), count.data());
+        }));
+    print_result(run_benchmark(device, "coverage_assigned_loss", params,
+        n_point, config.repeat, [&](OpKernelContext* ctx) {
+          compute_coverage_assigned_loss(d, ctx, n_cube, n_point, batch_size,
+              false, x->in_z.data(), x->in_q.data(), x->in_t.data(),
+              x->transforms(), x->in_pos.data(), index.data(), &x->loss);
+        }));
+    print_result(run_benchmark(device, "coverage_assigned_loss_grad", params,
+        n_point, config.repeat, [&](OpKernelContext* ctx) {
+          compute_coverage_assigned_loss_grad(d, ctx, n_cube, n_point,
+              batch_size, false, &x->loss, x->in_z.data(), x->in_q.data(),
+              x->in_t.data(), x->transforms(), x->in_pos.data(), index.data(),
+              x->grad_z.data(), x->grad_q.data(), x->grad_t.data());
+        }));
+  }
+
+  // one sample-point distance per element
+  const int num_sample = 26;
+  const float scale = 0.9f;
+  const int64 sample_pairs = pairs * num_sample;
+  if (config.selected("consistency_loss")) {
+    print_result(run_benchmark(device, "consistency_loss", params,
+        sample_pairs, config.repeat, [&](OpKernelContext* ctx) {
+          compute_consistency_loss(d, ctx, n_cube, n_point, batch_size,
+              num_sample, scale, x->in_z.data(), x->in_q.data(), x->in_t.data(),
+              x->transforms(), x->in_pos.data(), &x->loss);
+        }));
+    print_result(run_benchmark(device, "consistency_loss_grad", params,
+        sample_pairs, config.repeat, [&](OpKernelContext* ctx) {
+          compute_consistency_loss_grad(d, ctx, n_cube, n_point, batch_size,
+              num_sample, scale, &x->loss, x->in_z.data(), x->in_q.data(),
+              x->in_t.data(), x->transforms(), x->in_pos.data(),
+              x->grad_z.data(), x->grad_q.data(), x->grad_t.data());
+        }));
+  }
+
+  // the points are split evenly among half of the cubes of their shape
+  if (config.selected("cube_coverage_loss")) {
+    const int n_src_cube = std::max(n_cube / 2, 1);
+    std::vector<int> group_index(n_point);
+    std::vector<int> relation(batch_size * n_src_cube);
+    std::mt19937 rng(23);
+    std::uniform_int_distribution<int> group(0, n_src_cube - 1);
+    for (int i = 0; i < n_point; ++i) {
+      int b = static_cast<int>(x->in_pos[3 * n_point + i]);
+      group_index[i] = b * n_src_cube + group(rng);
+    }
+    print_result(run_benchmark(device, "cube_coverage_loss", params, pairs,
+        config.repeat, [&](OpKernelContext* ctx) {
+          compute_cube_coverage_loss(d, ctx, n_cube, n_point, n_src_cube,
+              batch_size, x->in_z.data(), x->in_q.data(), x->in_t.data(),
+              x->transforms(), x->in_pos.data(), group_index.data(), &x->loss,
+              relation.data());
+        }));
+    print_result(run_benchmark(device, "cube_coverage_loss_grad", params,
+        pairs, config.repeat, [&](OpKernelContext* ctx) {
+          compute_cube_coverage_loss_grad(d, ctx, n_cube, n_point, n_src_cube,
+              batch_size, &x->loss, x->in_z.data(), x->in_q.data(),
+              x->in_t.data(), x->transforms(), x->in_pos.data(),
+              group_index.data(), x->grad_z.data(), x->grad_q.data(),
+              x->grad_t.data());
+        }));
+  }
+}
+
+// the sort and the point losses on the points sorted along a Morton curve
+static void benchmark_morton_sort(const BenchmarkConfig& config,
+    BenchmarkDevice* device, LossData* x) {
+  const CPUDevice& d = device->cpu_device();
+  const int n_point = x->n_point;
+  std::stringstream ss;
+  ss << "batch=" << x->batch_size << " n_point=" << n_point;
+  std::vector<float> sorted(4 * n_point);
+  std::vector<int> index(n_point);
+  print_result(run_benchmark(device, "morton_sort", ss.str(), n_point,
+      config.repeat, [&](OpKernelContext* ctx) {
+        morton_sort_points(d, ctx, n_point, 10, x->in_pos.data(),
+            sorted.data(), index.data());
+      }));
+
+  // all the point losses, to compare against the unsorted runs
+  LossData y = *x;
+  y.in_pos = sorted;
+  BenchmarkConfig all = config;
+  all.filter.clear();
+  std::printf("-- the point losses on the Morton-sorted points\n");
+  benchmark_point_losses(all, device, &y);
+}
+
+static void benchmark_cube_losses(const BenchmarkConfig& config,
+    BenchmarkDevice* device, LossData* x) {
+  const CPUDevice& d = device->cpu_device();
+  const int n_cube = x->n_cube, batch_size = x->batch_size;
+  const float scale = 0.9f;
+  std::stringstream ss;
+  ss << "batch=" << batch_size << " n_cube=" << n_cube;
+  const string params = ss.str();
+
+  // the transforms shared by all the losses, one cube per element
+  if (config.selected("cube_transforms")) {
+    print_result(run_benchmark(device, "cube_transforms", params,
+        batch_size * n_cube, config.repeat, [&](OpKernelContext* ctx) {
+          primitive::cube_transforms(d, batch_size * n_cube, x->in_z.data(),
+              x->in_q.data(), x->in_t.data(), x->stride(), x->packed.data());
+        }));
+  }
+
+  // one volume sample against one other cube per element
+  const int64 pairs = static_cast<int64>(batch_size) * n_cube * n_cube * 27;
+  if (config.selected("mutex_loss")) {
+    print_result(run_benchmark(device, "mutex_loss", params, pairs,
+        config.repeat, [&](OpKernelContext* ctx) {
+          compute_mutex_loss(d, ctx, n_cube, batch_size, scale, x->in_z.data(),
+              x->in_q.data(), x->in_t.data(), x->transforms(), &x->loss);
+        }));
+    print_result(run_benchmark(device, "mutex_loss_grad", params, pairs,
+        config.repeat, [&](OpKernelContext* ctx) {
+          compute_mutex_loss_grad(d, ctx, n_cube, batch_size, scale, &x->loss,
+              x->in_z.data(), x->in_q.data(), x->in_t.data(), x->transforms(),
+              x->grad_z.data(), x->grad_q.data(), x->grad_t.data());
+        }));
+  }
+
+  for (int depth : config.depth) {
+    if (!config.selected("symmetry_loss")) break;
+    string depth_params = params + " depth=" + std::to_string(depth);
+    print_result(run_benchmark(device, "symmetry_loss", depth_params, pairs,
+        config.repeat, [&](OpKernelContext* ctx) {
+          compute_symmetry_loss(d, ctx, n_cube, batch_size, depth, scale,
+              x->in_z.data(), x->in_q.data(), x->in_t.data(), x->transforms(),
+              &x->loss);
+        }));
+    print_result(run_benchmark(device, "symmetry_loss_grad", depth_params,
+        pairs, config.repeat, [&](OpKernelContext* ctx) {
+          compute_symmetry_loss_grad(d, ctx, n_cube, batch_size, depth, scale,
+              &x->loss, x->in_z.data(), x->in_q.data(), x->in_t.data(),
+              x->transforms(), x->grad_z.data(), x->grad_q.data(),
+              x->grad_t.data());
+        }));
+  }
+}
+
+void run_primitive_loss_benchmarks(const BenchmarkConfig& config,
+    BenchmarkDevice* device) {
+  for (int batch_size : config.batch_size) {
+    for (int n_cube : config.n_cube) {
+      // the cube-only losses do not depend on the points
+      LossData cubes(device->cpu_device(), batch_size, n_cube, batch_size);
+      benchmark_cube_losses(config, device, &cubes);
+      for (int n_point : config.n_point) {
+        if (n_point < batch_size) continue;
+        LossData x(device->cpu_device(), batch_size, n_cube, n_point);
+        benchmark_point_losses(config, device, &x);
+        if (config.selected("morton_sort")) {
+          benchmark_morton_sort(config, device, &x);
+        }
+      }
+    }
+  }
+}
+
+}  // namespace benchmark
+
+}  // namespace tensorflow
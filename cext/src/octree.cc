@@ -1,6 +1,24 @@
+#define EIGEN_USE_THREADS
+
 #include "octree.h"
+#include "scratch_arena.h"
+
+#include "third_party/eigen3/Eigen/Core"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define OCTREE_MORTON_BMI2 1
+#endif
 
+#if GOOGLE_CUDA
 #include <cuda_runtime.h>
+#endif
 
 namespace tensorflow {
 
@@ -61,7 +79,7 @@ void col2octree_cpu(const float* data_col, float* data_octree, int channel,
   const int octree_h = height << 3 * (stride - 1);
   const int kernel = kernel_size * kernel_size * kernel_size;
   // set data_octree to zero once when n == 0
-  memset(data_octree, 0, channel * octree_h * sizeof(float));
+  if (n == 0) memset(data_octree, 0, channel * octree_h * sizeof(float));
   for (int c = 0; c < channel; ++c) {
     for (int k = 0; k < kernel; ++k) {
       int h_start = n * height_col;
@@ -95,20 +113,32 @@ void generate_key_cpu(int* key_split, const int* key, const int* children,
   }
 }
 
+namespace {
+
+// the keys of a full layer of one octree, the nodes are in Morton order so
+// the key of node k is the decoded k
+void full_layer_key_cpu(int* key, int depth) {
+  const int node_num = 1 << 3 * depth;
+  unsigned* ukey = reinterpret_cast<unsigned*>(key);
+  for (int k = 0; k < node_num; ++k) ukey[k] = k;
+  morton_decode(ukey, ukey, node_num);
+}
+
+}  // namespace
+
 void generate_key_cpu(int* key, const int depth, const int batch_size) {
+  // the other octrees of the batch only differ in the highest byte
+  CHECK_LT(batch_size, 256) << "The 32-bit keys hold the batch index in a byte";
   const int node_num = 1 << 3 * depth;
+  const int* key0 = full_layer_key(depth);
+  if (key0 == nullptr) {
+    full_layer_key_cpu(key, depth);
+    key0 = key;
+  }
   for (int n = 0; n < batch_size; ++n) {
-    for (int k = 0; k < node_num; ++k) {
-      unsigned xyz = 0;
-      unsigned char* ptr = reinterpret_cast<unsigned char*>(&xyz);
-      for (int d = 0; d < depth; ++d) {
-        ptr[0] |= (k & (1 << 3 * d + 2)) >> (2 * d + 2);
-        ptr[1] |= (k & (1 << 3 * d + 1)) >> (2 * d + 1);
-        ptr[2] |= (k & (1 << 3 * d + 0)) >> (2 * d + 0);
-      }
-      ptr[3] = n;
-      key[n * node_num + k] = xyz;
-    }
+    const unsigned id = static_cast<unsigned>(n) << 24;
+    unsigned* key_n = reinterpret_cast<unsigned*>(key) + n * node_num;
+    for (int k = 0; k < node_num; ++k) key_n[k] = key0[k] | id;
   }
 }
 
@@ -137,111 +167,1638 @@ void generate_key_cpu(int* key, const int depth, const int batch_size) {
 //  }
 //}
 
-void calc_neigh_cpu(int* neigh, const int depth, const int batch_size) {
+namespace {
+
+// the neighbors of a full layer of one octree
+void full_layer_neigh_cpu(int* neigh, int depth) {
   unsigned node_num = 1 << 3 * depth;
   const unsigned bound = 1 << depth;
-  for (unsigned n = 0; n < batch_size; ++n) {
-    for (unsigned i = 0; i < node_num; i += 8) {
-      // key to xyz
-      unsigned x0 = 0, y0 = 0, z0 = 0;
-      for (unsigned d = 0; d < depth; ++d) {
-        x0 |= (i & (1 << 3 * d + 2)) >> (2 * d + 2);
-        y0 |= (i & (1 << 3 * d + 1)) >> (2 * d + 1);
-        z0 |= (i & (1 << 3 * d + 0)) >> (2 * d + 0);
-      }
-
-      for (unsigned x = 0; x < 4; ++x) {
-        for (unsigned y = 0; y < 4; ++y) {
-          for (unsigned z = 0; z < 4; ++z) {
-            unsigned x1 = x0 + x - 1;
-            unsigned y1 = y0 + y - 1;
-            unsigned z1 = z0 + z - 1;
-
-            int v = -1;
-            if ((x1 & bound) == 0 && (y1 & bound) == 0 && (z1 & bound) == 0) {
-              unsigned key1 = 0;
-              for (int d = 0; d < depth; ++d) {
-                unsigned mask = 1u << d;
-                key1 |=
-                  ((x1 & mask) << (2 * d + 2)) |
-                  ((y1 & mask) << (2 * d + 1)) |
-                  ((z1 & mask) << (2 * d + 0));
-              }
-              v = key1 + n*node_num;
-            }
+  unsigned xyz1[64];
+  for (unsigned i = 0; i < node_num; i += 8) {
+    // key to xyz
+    const unsigned xyz0 = morton_decode(i);
+    const unsigned x0 = xyz0 & 0xFF, y0 = xyz0 >> 8 & 0xFF, z0 = xyz0 >> 16;
 
-            unsigned xyz = (x << 4) | (y << 2) | z;
-            neigh[xyz + i * 8 + n * node_num * 8] = v;
+    // the 4x4x4 neighbors of the siblings, the ones out of bound are
+    // encoded as the origin and dropped afterwards
+    uint64 outside = 0;
+    for (unsigned x = 0; x < 4; ++x) {
+      for (unsigned y = 0; y < 4; ++y) {
+        for (unsigned z = 0; z < 4; ++z) {
+          unsigned x1 = x0 + x - 1;
+          unsigned y1 = y0 + y - 1;
+          unsigned z1 = z0 + z - 1;
+          unsigned j = (x << 4) | (y << 2) | z;
+          if ((x1 & bound) == 0 && (y1 & bound) == 0 && (z1 & bound) == 0) {
+            xyz1[j] = x1 | (y1 << 8) | (z1 << 16);
+          } else {
+            xyz1[j] = 0;
+            outside |= uint64(1) << j;
           }
         }
       }
     }
+    int* ngh = neigh + i * 8;
+    morton_encode(reinterpret_cast<unsigned*>(ngh), xyz1, 64);
+    for (int j = 0; j < 64; ++j) {
+      if (outside >> j & 1) ngh[j] = -1;
+    }
   }
 }
 
-void calc_neighbor(int* neigh, const unsigned* key, int node_num,
+// neigh of node_num nodes shifted by displacement, -1 stays
+void offset_neigh(int* neigh, const int* src, int node_num,
     int displacement) {
-  typedef unsigned char ubyte;
+  const int n = node_num * OctreeInfo::AVG_NGH_NUM;
+  if (displacement == 0) {
+    memcpy(neigh, src, n * sizeof(int));
+    return;
+  }
+  for (int j = 0; j < n; ++j) {
+    neigh[j] = src[j] == -1 ? -1 : src[j] + displacement;
+  }
+}
+
+// Tables of a full layer only depend on its depth, so they are built once
+// per process and shared. The deeper layers are seldom full and would take
+// too much memory, depth 6 holds 2M neighbors.
+const int kFullLayerCacheDepth = 6;
+
+struct FullLayerTable {
+  std::vector<int> key;
+  std::vector<int> neigh;
+};
+
+const FullLayerTable* full_layer_table(int depth) {
+  if (depth < 0 || depth > kFullLayerCacheDepth) return nullptr;
+  static std::once_flag flags[kFullLayerCacheDepth + 1];
+  static FullLayerTable tables[kFullLayerCacheDepth + 1];
+  std::call_once(flags[depth], [depth]() {
+    FullLayerTable& t = tables[depth];
+    const int node_num = 1 << 3 * depth;
+    t.key.resize(node_num);
+    full_layer_key_cpu(t.key.data(), depth);
+    t.neigh.resize(node_num * OctreeInfo::AVG_NGH_NUM);
+    if (depth > 0) full_layer_neigh_cpu(t.neigh.data(), depth);
+  });
+  return &tables[depth];
+}
+
+}  // namespace
+
+const int* full_layer_key(int depth) {
+  const FullLayerTable* t = full_layer_table(depth);
+  return t == nullptr ? nullptr : t->key.data();
+}
+
+const int* full_layer_neigh(int depth) {
+  const FullLayerTable* t = full_layer_table(depth);
+  return t == nullptr ? nullptr : t->neigh.data();
+}
+
+void calc_neigh_cpu(int* neigh, const int depth, const int batch_size) {
+  // the other octrees of the batch are shifted copies of the first one
+  const int node_num = 1 << 3 * depth;
+  const int* neigh0 = full_layer_neigh(depth);
+  if (neigh0 == nullptr) {
+    full_layer_neigh_cpu(neigh, depth);
+    neigh0 = neigh;
+  }
+  for (int n = 0; n < batch_size; ++n) {
+    int* neigh_n = neigh + n * node_num * OctreeInfo::AVG_NGH_NUM;
+    if (neigh_n != neigh0) {
+      offset_neigh(neigh_n, neigh0, node_num, n * node_num);
+    }
+  }
+}
+
+namespace {
+
+// the neighbors of a full layer from the cached table, false if the layer is
+// not full or too deep to be cached
+bool copy_full_layer_neigh(int* neigh, int node_num, int depth,
+    int displacement) {
+  const bool full = depth <= kFullLayerCacheDepth &&
+      node_num == 1 << 3 * depth;
+  const int* neigh0 = full ? full_layer_neigh(depth) : nullptr;
+  if (neigh0 == nullptr) return false;
+  offset_neigh(neigh, neigh0, node_num, displacement);
+  return true;
+}
+
+}  // namespace
+
+void calc_layer_neighbor(int* neigh, const unsigned* key, int node_num,
+    int depth, int displacement) {
+  if (!copy_full_layer_neigh(neigh, node_num, depth, displacement)) {
+    calc_neighbor(neigh, key, node_num, displacement);
+  }
+}
+
+void calc_layer_neighbor64(int* neigh, const int* key, int node_num,
+    int depth, int displacement) {
+  if (!copy_full_layer_neigh(neigh, node_num, depth, displacement)) {
+    calc_neighbor64(neigh, key, node_num, displacement);
+  }
+}
+
+void copy_batch_key(int* des, bool des_key64, const int* src, bool src_key64,
+    int node_num, int batch_id) {
+  if (!des_key64) {
+    // the batch index goes to the highest byte
+    CHECK(!src_key64 && batch_id < 256);
+    for (int j = 0; j < node_num; ++j) {
+      des[j] = src[j];
+      reinterpret_cast<unsigned char*>(des + j)[3] = batch_id;
+    }
+    return;
+  }
+
+  // the 64-bit keys take the batch index in the highest 16 bits
+  const uint64 id = static_cast<uint64>(batch_id) << 48;
+  if (src_key64) {
+    for (int j = 0; j < node_num; ++j) {
+      store_key64(des, j, (load_key64(src, j) & 0x0000FFFFFFFFFFFFull) | id);
+    }
+  } else {
+    for (int j = 0; j < node_num; ++j) {
+      const unsigned k = src[j];
+      store_key64(des, j, uint64(k & 0xFF) | (uint64(k >> 8 & 0xFF) << 16) |
+          (uint64(k >> 16 & 0xFF) << 32) | id);
+    }
+  }
+}
+
+namespace {
+
+// the layout of the 32-bit and 64-bit keys, the xyz part holds one
+// coordinate of AXIS_BITS per axis and the hash is Fibonacci hashing of it.
+// Both are read from and written to the int buffers of the octrees
+template <typename Key> struct KeyTraits;
+template <> struct KeyTraits<unsigned> {
+  static const int AXIS_BITS = 8;
+  static unsigned xyz(unsigned k) { return k & 0x00FFFFFFu; }
+  static unsigned hash(unsigned k, int bits) {
+    return (k * 2654435761u) >> (32 - bits);
+  }
+  static unsigned load(const int* key, int i) {
+    return static_cast<unsigned>(key[i]);
+  }
+  static void store(int* key, int i, unsigned k) {
+    key[i] = static_cast<int>(k);
+  }
+};
+template <> struct KeyTraits<uint64> {
+  static const int AXIS_BITS = 16;
+  static uint64 xyz(uint64 k) { return k & 0x0000FFFFFFFFFFFFull; }
+  static unsigned hash(uint64 k, int bits) {
+    return (k * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+  }
+  static uint64 load(const int* key, int i) { return load_key64(key, i); }
+  static void store(int* key, int i, uint64 k) { store_key64(key, i, k); }
+};
 
-  // build hash table
-  std::vector<std::pair<unsigned, int>> entries(node_num);
-  for (int id = 0; id < node_num; ++id) {
-    entries[id] = std::make_pair(key[id], id + displacement);
+template <typename Key>
+void calc_neighbor_impl(int* neigh, const int* key, int node_num,
+    int displacement) {
+  typedef KeyTraits<Key> Traits;
+  const int axis_bits = Traits::AXIS_BITS;
+  const int axis_max = (1 << axis_bits) - 1;
+
+  // The nodes of a layer come in groups of 8 siblings, and the 4x4x4
+  // neighborhood of a group is covered by the 27 groups around it. So the
+  // table only holds the key of the first node of each group, and it is an
+  // open addressing table whose buffer is reused by the calling thread.
+  const int group_num = node_num / 8;
+  int bits = 1;
+  while ((1 << bits) < 2 * group_num) ++bits;
+  const unsigned capacity = 1u << bits, mask = capacity - 1;
+  static thread_local std::vector<std::pair<Key, int>> table;
+  if (table.size() < capacity) table.resize(capacity);
+  const Key empty = ~Key(0);
+  for (unsigned i = 0; i < capacity; ++i) table[i].first = empty;
+
+  // build the table of the xyz parts
+  for (int g = 0; g < group_num; ++g) {
+    Key k = Traits::xyz(Traits::load(key, 8 * g));
+    unsigned h = Traits::hash(k, bits);
+    while (table[h].first != empty) h = (h + 1) & mask;
+    table[h] = std::make_pair(k, g);
   }
-  std::unordered_map<unsigned, int> hash_table(entries.begin(), entries.end());
 
   // calc neighborhood
-  for (int id = 0; id < node_num; id += 8) {
-    // the neighborhood volume
-    int* ngh = neigh + id * 8;
-    const ubyte* k0 = (const ubyte*)(key + id);
-    // currently the maximize octree depth is 8
-    ubyte k1[4] = { 0, 0, 0, k0[3] };
-    for (ubyte x = 0; x < 4; ++x) {
-      k1[0] = k0[0] + x - 1;
-      for (ubyte y = 0; y < 4; ++y) {
-        k1[1] = k0[1] + y - 1;
-        for (ubyte z = 0; z < 4; ++z) {
-          k1[2] = k0[2] + z - 1;
-
-          // find
-          unsigned* k2 = reinterpret_cast<unsigned*>(k1);
-          auto rst = hash_table.find(*k2);
-          ubyte i = (x << 4) | (y << 2) | z;
-          if (rst != hash_table.end()) {
-            ngh[i] = rst->second;
+  for (int g0 = 0; g0 < group_num; ++g0) {
+    // the 27 neighbor groups, their first nodes are 2 apart in each axis
+    const Key k0 = Traits::load(key, 8 * g0);
+    const int x0 = k0 & axis_max;
+    const int y0 = (k0 >> axis_bits) & axis_max;
+    const int z0 = (k0 >> 2 * axis_bits) & axis_max;
+    int group[27];
+    for (int i = 0; i < 27; ++i) {
+      int x = x0 + 2 * (i / 9) - 2;
+      int y = y0 + 2 * ((i / 3) % 3) - 2;
+      int z = z0 + 2 * (i % 3) - 2;
+      group[i] = -1;
+      if (x < 0 || y < 0 || z < 0 || x > axis_max || y > axis_max ||
+          z > axis_max) {
+        continue;
+      }
+      Key k = Key(x) | (Key(y) << axis_bits) | (Key(z) << 2 * axis_bits);
+      unsigned h = Traits::hash(k, bits);
+      for (; table[h].first != empty; h = (h + 1) & mask) {
+        if (table[h].first == k) {
+          group[i] = table[h].second;
+          break;
+        }
+      }
+    }
+
+    // the neighbor (x, y, z) lies at (x0 + x - 1, y0 + y - 1, z0 + z - 1)
+    int* ngh = neigh + g0 * 64;
+    for (int x = 0; x < 4; ++x) {
+      for (int y = 0; y < 4; ++y) {
+        for (int z = 0; z < 4; ++z) {
+          int g = group[((x + 1) / 2) * 9 + ((y + 1) / 2) * 3 + (z + 1) / 2];
+          int j = ((x + 1) & 1) << 2 | ((y + 1) & 1) << 1 | ((z + 1) & 1);
+          ngh[(x << 4) | (y << 2) | z] =
+              g == -1 ? -1 : 8 * g + j + displacement;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+void calc_neighbor(int* neigh, const unsigned* key, int node_num,
+    int displacement) {
+  calc_neighbor_impl<unsigned>(neigh, reinterpret_cast<const int*>(key),
+      node_num, displacement);
+}
+
+void calc_neighbor64(int* neigh, const int* key, int node_num,
+    int displacement) {
+  calc_neighbor_impl<uint64>(neigh, key, node_num, displacement);
+}
+
+namespace {
+
+// spread[b] holds the bits of the byte b two bits apart, the bit i goes to
+// the bit 3i; compact[c] gathers every third bit of the 9-bit chunk c into
+// one byte per axis, the xyz form of 3 levels, and compact64[c] into the
+// 16 bits per axis of the 64-bit keys
+struct MortonTable {
+  unsigned spread[256];
+  unsigned compact[512];
+  uint64 compact64[512];
+  MortonTable() {
+    for (unsigned b = 0; b < 256; ++b) {
+      spread[b] = 0;
+      for (int i = 0; i < 8; ++i) spread[b] |= (b >> i & 1u) << (3 * i);
+    }
+    for (unsigned c = 0; c < 512; ++c) {
+      unsigned x = 0, y = 0, z = 0;
+      for (int i = 0; i < 3; ++i) {
+        x |= (c >> (3 * i + 2) & 1u) << i;
+        y |= (c >> (3 * i + 1) & 1u) << i;
+        z |= (c >> (3 * i + 0) & 1u) << i;
+      }
+      compact[c] = x | (y << 8) | (z << 16);
+      compact64[c] = uint64(x) | (uint64(y) << 16) | (uint64(z) << 32);
+    }
+  }
+};
+const MortonTable kMortonTable;
+
+inline unsigned morton_encode_lut(unsigned xyz) {
+  const unsigned* t = kMortonTable.spread;
+  return (t[xyz & 0xFF] << 2) | (t[xyz >> 8 & 0xFF] << 1) | t[xyz >> 16 & 0xFF];
+}
+
+inline unsigned morton_decode_lut(unsigned code) {
+  const unsigned* t = kMortonTable.compact;
+  return t[code & 0x1FF] | (t[code >> 9 & 0x1FF] << 3) |
+      (t[code >> 18 & 0x1FF] << 6);
+}
+
+void morton_encode_lut(unsigned* code, const unsigned* xyz, int n) {
+  for (int i = 0; i < n; ++i) code[i] = morton_encode_lut(xyz[i]);
+}
+
+void morton_decode_lut(unsigned* xyz, const unsigned* code, int n) {
+  for (int i = 0; i < n; ++i) xyz[i] = morton_decode_lut(code[i]);
+}
+
+inline uint64 morton_spread16(uint64 v) {
+  const unsigned* t = kMortonTable.spread;
+  return t[v & 0xFF] | (uint64(t[v >> 8 & 0xFF]) << 24);
+}
+
+inline uint64 morton_encode64_lut(uint64 xyz) {
+  return (morton_spread16(xyz & 0xFFFF) << 2) |
+      (morton_spread16(xyz >> 16 & 0xFFFF) << 1) |
+      morton_spread16(xyz >> 32 & 0xFFFF);
+}
+
+inline uint64 morton_decode64_lut(uint64 code) {
+  const uint64* t = kMortonTable.compact64;
+  uint64 xyz = 0;
+  for (int i = 0; i < 6; ++i) xyz |= t[code >> 9 * i & 0x1FF] << 3 * i;
+  return xyz;
+}
+
+#ifdef OCTREE_MORTON_BMI2
+// the bits of x, y and z in the code, and of one axis in the xyz form
+const unsigned kMortonMaskX = 0x924924u, kMortonMaskY = 0x492492u;
+const unsigned kMortonMaskZ = 0x249249u;
+
+__attribute__((target("bmi2")))
+void morton_encode_bmi2(unsigned* code, const unsigned* xyz, int n) {
+  for (int i = 0; i < n; ++i) {
+    const unsigned k = xyz[i];
+    code[i] = _pdep_u32(k, kMortonMaskX) |
+        _pdep_u32(k >> 8, kMortonMaskY) | _pdep_u32(k >> 16, kMortonMaskZ);
+  }
+}
+
+__attribute__((target("bmi2")))
+void morton_decode_bmi2(unsigned* xyz, const unsigned* code, int n) {
+  for (int i = 0; i < n; ++i) {
+    const unsigned c = code[i];
+    xyz[i] = _pext_u32(c, kMortonMaskX) | (_pext_u32(c, kMortonMaskY) << 8) |
+        (_pext_u32(c, kMortonMaskZ) << 16);
+  }
+}
+
+const uint64 kMortonMaskX64 = 0x924924924924ull;
+const uint64 kMortonMaskY64 = 0x492492492492ull;
+const uint64 kMortonMaskZ64 = 0x249249249249ull;
+
+__attribute__((target("bmi2")))
+void morton_encode64_bmi2(uint64* code, const uint64* xyz, int n) {
+  for (int i = 0; i < n; ++i) {
+    const uint64 k = xyz[i];
+    code[i] = _pdep_u64(k, kMortonMaskX64) |
+        _pdep_u64(k >> 16, kMortonMaskY64) |
+        _pdep_u64(k >> 32, kMortonMaskZ64);
+  }
+}
+
+__attribute__((target("bmi2")))
+void morton_decode64_bmi2(uint64* xyz, const uint64* code, int n) {
+  for (int i = 0; i < n; ++i) {
+    const uint64 c = code[i];
+    xyz[i] = _pext_u64(c, kMortonMaskX64) |
+        (_pext_u64(c, kMortonMaskY64) << 16) |
+        (_pext_u64(c, kMortonMaskZ64) << 32);
+  }
+}
+
+bool morton_bmi2_supported() {
+  return __builtin_cpu_supports("bmi2");
+}
+#else
+bool morton_bmi2_supported() { return false; }
+#endif
+
+// the batch codec is picked once from the CPU features
+std::atomic<bool> morton_bmi2(morton_bmi2_supported());
+
+}  // namespace
+
+bool morton_use_bmi2(bool enable) {
+  morton_bmi2 = enable && morton_bmi2_supported();
+  return morton_bmi2;
+}
+
+bool morton_use_bmi2() {
+  return morton_bmi2;
+}
+
+unsigned morton_encode(unsigned xyz) {
+  return morton_encode_lut(xyz);
+}
+
+unsigned morton_decode(unsigned code) {
+  return morton_decode_lut(code);
+}
+
+void morton_encode(unsigned* code, const unsigned* xyz, int n) {
+#ifdef OCTREE_MORTON_BMI2
+  if (morton_bmi2) return morton_encode_bmi2(code, xyz, n);
+#endif
+  morton_encode_lut(code, xyz, n);
+}
+
+void morton_decode(unsigned* xyz, const unsigned* code, int n) {
+#ifdef OCTREE_MORTON_BMI2
+  if (morton_bmi2) return morton_decode_bmi2(xyz, code, n);
+#endif
+  morton_decode_lut(xyz, code, n);
+}
+
+uint64 morton_encode64(uint64 xyz) {
+  return morton_encode64_lut(xyz);
+}
+
+uint64 morton_decode64(uint64 code) {
+  return morton_decode64_lut(code);
+}
+
+void morton_encode64(uint64* code, const uint64* xyz, int n) {
+#ifdef OCTREE_MORTON_BMI2
+  if (morton_bmi2) return morton_encode64_bmi2(code, xyz, n);
+#endif
+  for (int i = 0; i < n; ++i) code[i] = morton_encode64_lut(xyz[i]);
+}
+
+void morton_decode64(uint64* xyz, const uint64* code, int n) {
+#ifdef OCTREE_MORTON_BMI2
+  if (morton_bmi2) return morton_decode64_bmi2(xyz, code, n);
+#endif
+  for (int i = 0; i < n; ++i) xyz[i] = morton_decode64_lut(code[i]);
+}
+
+void compute_key(int& key, const int* pt, int depth) {
+  const unsigned mask = (1u << depth) - 1;
+  key = morton_encode((pt[0] & mask) | (pt[1] & mask) << 8 |
+      (pt[2] & mask) << 16);
+}
+
+void compute_pt(int* pt, const int& key, int depth) {
+  const unsigned xyz = morton_decode(key & ((1u << 3 * depth) - 1));
+  pt[0] = xyz & 0xFF;
+  pt[1] = xyz >> 8 & 0xFF;
+  pt[2] = xyz >> 16 & 0xFF;
+}
+
+int get_workspace_maxsize() {
+  return 256 * 1024 * 1024;
+}
+
+// the channels are independent, so the CPU overloads shard them over the
+// intra-op thread pool and run the serial *_cpu version on each shard
+void pad_forward(const CPUDevice& d, OpKernelContext* ctx, float* Y, int Hy,
+    int Cy, const float* X, int Hx, const int* label) {
+  d.parallelFor(Cy, Eigen::TensorOpCost(8 * Hy, 4 * Hy, Hy),
+      [&](Eigen::Index c0, Eigen::Index c1) {
+        pad_forward_cpu(Y + c0 * Hy, Hy, c1 - c0, X + c0 * Hx, Hx, label);
+      });
+}
+
+void pad_backward(const CPUDevice& d, OpKernelContext* ctx, float* X, int Hx,
+    int Cx, const float* Y, int Hy, const int* label) {
+  d.parallelFor(Cx, Eigen::TensorOpCost(8 * Hy, 4 * Hy, Hy),
+      [&](Eigen::Index c0, Eigen::Index c1) {
+        pad_backward_cpu(X + c0 * Hx, Hx, c1 - c0, Y + c0 * Hy, Hy, label);
+      });
+}
+
+void octree2col(const CPUDevice& d, OpKernelContext* ctx, float* data_col,
+    const float* data_octree, int channel, int height, int kernel_size,
+    int stride, const int* neigh, const int* ni, int height_col, int n) {
+  const int octree_h = height << 3 * (stride - 1);
+  const int kernel = kernel_size * kernel_size * kernel_size;
+  const int col_h = kernel * height_col;
+  d.parallelFor(channel, Eigen::TensorOpCost(12 * col_h, 4 * col_h, 4 * col_h),
+      [&](Eigen::Index c0, Eigen::Index c1) {
+        octree2col_cpu(data_col + c0 * col_h, data_octree + c0 * octree_h,
+            c1 - c0, height, kernel_size, stride, neigh, ni, height_col, n);
+      });
+}
+
+void col2octree(const CPUDevice& d, OpKernelContext* ctx,
+    const float* data_col, float* data_octree, int channel, int height,
+    int kernel_size, int stride, const int* neigh, const int* ni,
+    int height_col, int n) {
+  const int octree_h = height << 3 * (stride - 1);
+  const int kernel = kernel_size * kernel_size * kernel_size;
+  const int col_h = kernel * height_col;
+  d.parallelFor(channel, Eigen::TensorOpCost(16 * col_h, 4 * col_h, 4 * col_h),
+      [&](Eigen::Index c0, Eigen::Index c1) {
+        col2octree_cpu(data_col + c0 * col_h, data_octree + c0 * octree_h,
+            c1 - c0, height, kernel_size, stride, neigh, ni, height_col, n);
+      });
+}
+
+void gemm(const CPUDevice& d, OpKernelContext* ctx, bool transa, bool transb,
+    uint64 m, uint64 n, uint64 k, float alpha, const float* a, const float* b,
+    float beta, float* c) {
+  typedef Eigen::TensorMap<Eigen::Tensor<const float, 2, Eigen::RowMajor>>
+      ConstMatrix;
+  typedef Eigen::TensorMap<Eigen::Tensor<float, 2, Eigen::RowMajor>> Matrix;
+  ConstMatrix A(a, transa ? k : m, transa ? m : k);
+  ConstMatrix B(b, transb ? n : k, transb ? k : n);
+  Matrix C(c, m, n);
+  Eigen::array<Eigen::IndexPair<Eigen::DenseIndex>, 1> dims;
+  dims[0] = Eigen::IndexPair<Eigen::DenseIndex>(transa ? 0 : 1, transb ? 1 : 0);
+  if (beta == 0) {
+    C.device(d) = A.contract(B, dims) * alpha;
+  } else {
+    C.device(d) = C * beta + A.contract(B, dims) * alpha;
+  }
+}
+
+int get_workspace_cpu_maxsize() {
+  // 256 KB of columns per thread, which leaves room in a typical L2 cache
+  // for the filter rows streamed by the GEMM
+  return 64 * 1024;
+}
+
+int get_workspace_maxsize(const CPUDevice& d) {
+  return get_workspace_cpu_maxsize() * std::max(d.numThreads(), 1);
+}
+
+// node number of one tile, a multiple of 8 so that the sibling groups are
+// not split, and no larger than the layer
+static int conv_tile_height(int kernel_dim, int height) {
+  int tile_h = std::max(get_workspace_cpu_maxsize() / kernel_dim / 8 * 8, 8);
+  return std::min(tile_h, (height + 7) / 8 * 8);
+}
+
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+    RowMatrix;
+typedef Eigen::Map<const RowMatrix, 0, Eigen::OuterStride<>> ConstMatrixMap;
+typedef Eigen::Map<RowMatrix, 0, Eigen::OuterStride<>> MatrixMap;
+
+// nodes of one block of the implicit GEMM, four sibling groups
+const int kConvBlockH = 32;
+// channels gathered at once, the panel of 27 * kConvPanelC neighbor rows of
+// a block takes 14 KB and stays in the L1 cache
+const int kConvPanelC = 4;
+
+typedef Eigen::Array<float, 8, 1> ConvColumn;
+
+// stores the sums of the microkernel to num <= 8 nodes of a row of Y
+static inline void conv_store(float* y, int num, const ConvColumn& acc,
+    bool accumulate) {
+  for (int j = 0; j < num; ++j) y[j] = accumulate ? y[j] + acc(j) : acc(j);
+}
+
+// Y[4, num] (+)= W[4, rows] * panel[rows, num] for num <= 8 nodes, the rows of
+// Y are height apart, the ones of W kernel_dim and the ones of the panel
+// kConvBlockH apart. The 4 x 8 sums stay in SIMD registers.
+static void conv_microkernel_4x8(float* Y, int height, int num,
+    const float* W, int kernel_dim, const float* panel, int rows,
+    bool accumulate) {
+  ConvColumn acc0 = ConvColumn::Zero(), acc1 = ConvColumn::Zero();
+  ConvColumn acc2 = ConvColumn::Zero(), acc3 = ConvColumn::Zero();
+  const float* w0 = W;
+  const float* w1 = W + kernel_dim;
+  const float* w2 = W + 2 * kernel_dim;
+  const float* w3 = W + 3 * kernel_dim;
+  for (int r = 0; r < rows; ++r) {
+    const ConvColumn x = Eigen::Map<const ConvColumn>(panel + r * kConvBlockH);
+    acc0 += w0[r] * x;
+    acc1 += w1[r] * x;
+    acc2 += w2[r] * x;
+    acc3 += w3[r] * x;
+  }
+  conv_store(Y, num, acc0, accumulate);
+  conv_store(Y + height, num, acc1, accumulate);
+  conv_store(Y + 2 * height, num, acc2, accumulate);
+  conv_store(Y + 3 * height, num, acc3, accumulate);
+}
+
+// the remaining output channels, one at a time
+static void conv_microkernel_1x8(float* Y, int num, const float* W,
+    const float* panel, int rows, bool accumulate) {
+  ConvColumn acc = ConvColumn::Zero();
+  for (int r = 0; r < rows; ++r) {
+    acc += W[r] * Eigen::Map<const ConvColumn>(panel + r * kConvBlockH);
+  }
+  conv_store(Y, num, acc, accumulate);
+}
+
+// Y[num_output, num] of the nodes [h0, h0 + num) of the layer, or of the
+// nodes listed in nodes[h0, h0 + num) if nodes is given, the rows of Y are ldy
+// apart. index and panel are the scratch of the calling thread.
+static void octree_conv_block(float* Y, int ldy, const float* X,
+    const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni, const int* nodes, int h0, int num,
+    int* index, float* panel) {
+  const int kernel_dim = channel * 27;
+  // the neighbors of the block are shared by all the channels
+  for (int k = 0; k < 27; ++k) {
+    for (int j = 0; j < kConvBlockH; ++j) {
+      if (j >= num) {
+        index[k * kConvBlockH + j] = -1;
+        continue;
+      }
+      const int h = nodes == nullptr ? h0 + j : nodes[h0 + j];
+      index[k * kConvBlockH + j] = neigh[(h >> 3 << 6) + ni[(h % 8) * 27 + k]];
+    }
+  }
+
+  for (int c0 = 0; c0 < channel; c0 += kConvPanelC) {
+    // gather the rows of octree2col() for this block and these channels
+    const int rows = std::min(kConvPanelC, channel - c0) * 27;
+    for (int r = 0; r < rows; ++r) {
+      const float* x = X + (c0 + r / 27) * height;
+      const int* idx = index + (r % 27) * kConvBlockH;
+      float* col = panel + r * kConvBlockH;
+      for (int j = 0; j < kConvBlockH; ++j) {
+        col[j] = idx[j] == -1 ? float(0) : x[idx[j]];
+      }
+    }
+
+    const float* w = W + c0 * 27;
+    const bool accumulate = c0 > 0;
+    for (int s = 0; s < num; s += 8) {
+      const int n = std::min(8, num - s);
+      int o = 0;
+      for (; o + 4 <= num_output; o += 4) {
+        conv_microkernel_4x8(Y + o * ldy + s, ldy, n, w + o * kernel_dim,
+            kernel_dim, panel + s, rows, accumulate);
+      }
+      for (; o < num_output; ++o) {
+        conv_microkernel_1x8(Y + o * ldy + s, n, w + o * kernel_dim,
+            panel + s, rows, accumulate);
+      }
+    }
+  }
+}
+
+// the nodes of the layer with children, the compacted index list of the sparse
+// convolution
+static std::vector<int> nonempty_nodes(const int* children, int height) {
+  std::vector<int> nodes;
+  for (int h = 0; h < height; ++h) {
+    if (children[h] != -1) nodes.push_back(h);
+  }
+  return nodes;
+}
+
+// octree_conv() of all the nodes, or of the node_num ones listed in nodes,
+// whose columns of Y are the only ones written
+static void octree_conv_nodes(const CPUDevice& d, float* Y, const float* X,
+    const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni, const int* nodes, int node_num) {
+  const int kernel_dim = channel * 27;
+  const int block_num = (node_num + kConvBlockH - 1) / kConvBlockH;
+  const double flops = 2.0 * num_output * kernel_dim * kConvBlockH;
+  d.parallelFor(block_num, Eigen::TensorOpCost(4.0 * kernel_dim * kConvBlockH,
+      4.0 * num_output * kConvBlockH, flops),
+      [&](Eigen::Index b0, Eigen::Index b1) {
+    int index[27 * kConvBlockH];
+    float panel[27 * kConvPanelC * kConvBlockH];
+    std::vector<float> block;
+    if (nodes != nullptr) block.resize(num_output * kConvBlockH);
+    for (Eigen::Index b = b0; b < b1; ++b) {
+      const int h0 = b * kConvBlockH;
+      const int num = std::min(kConvBlockH, node_num - h0);
+      if (nodes == nullptr) {
+        octree_conv_block(Y + h0, height, X, W, channel, num_output, height,
+            neigh, ni, nullptr, h0, num, index, panel);
+        continue;
+      }
+      // the listed nodes are scattered to their columns
+      octree_conv_block(block.data(), kConvBlockH, X, W, channel, num_output,
+          height, neigh, ni, nodes, h0, num, index, panel);
+      for (int o = 0; o < num_output; ++o) {
+        for (int j = 0; j < num; ++j) {
+          Y[o * height + nodes[h0 + j]] = block[o * kConvBlockH + j];
+        }
+      }
+    }
+  });
+}
+
+// sets the columns of Y of the nodes without children to zero
+static void zero_empty_nodes(const CPUDevice& d, float* Y, int channel,
+    int height, const int* children) {
+  d.parallelFor(channel, Eigen::TensorOpCost(4.0 * height, 4.0 * height,
+      height), [&](Eigen::Index c0, Eigen::Index c1) {
+    for (Eigen::Index c = c0; c < c1; ++c) {
+      for (int h = 0; h < height; ++h) {
+        if (children[h] == -1) Y[c * height + h] = float(0);
+      }
+    }
+  });
+}
+
+void octree_conv(const CPUDevice& d, OpKernelContext* ctx, float* Y,
+    const float* X, const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni) {
+  octree_conv_nodes(d, Y, X, W, channel, num_output, height, neigh, ni,
+      nullptr, height);
+}
+
+void octree_conv_sparse(const CPUDevice& d, OpKernelContext* ctx, float* Y,
+    const float* X, const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni, const int* children) {
+  std::vector<int> nodes = nonempty_nodes(children, height);
+  zero_empty_nodes(d, Y, num_output, height, children);
+  octree_conv_nodes(d, Y, X, W, channel, num_output, height, neigh, ni,
+      nodes.data(), nodes.size());
+}
+
+void octree_conv_relu_pool(const CPUDevice& d, OpKernelContext* ctx,
+    float* top, int top_h, uint8* mask, const float* X, const float* W,
+    int channel, int num_output, int height, const int* neigh, const int* ni,
+    const int* children) {
+  // the parent of each sibling group, the inverse of pad_forward()'s label
+  const int group_num = height / 8;
+  std::vector<int> parent(group_num, -1);
+  for (int p = 0; p < top_h; ++p) {
+    if (children[p] != -1) parent[children[p]] = p;
+  }
+  // the empty parents are padded with zero
+  for (int p = 0; p < top_h; ++p) {
+    if (children[p] != -1) continue;
+    for (int o = 0; o < num_output; ++o) top[o * top_h + p] = float(0);
+  }
+
+  const int kernel_dim = channel * 27;
+  const int block_num = (height + kConvBlockH - 1) / kConvBlockH;
+  const double flops = 2.0 * num_output * kernel_dim * kConvBlockH;
+  d.parallelFor(block_num, Eigen::TensorOpCost(4.0 * kernel_dim * kConvBlockH,
+      num_output * kConvBlockH / 8.0 * 5, flops),
+      [&](Eigen::Index b0, Eigen::Index b1) {
+    int index[27 * kConvBlockH];
+    float panel[27 * kConvPanelC * kConvBlockH];
+    // the convolution of a block lives in the cache only
+    std::vector<float> block(num_output * kConvBlockH);
+    for (Eigen::Index b = b0; b < b1; ++b) {
+      const int h0 = b * kConvBlockH;
+      const int num = std::min(kConvBlockH, height - h0);
+      octree_conv_block(block.data(), kConvBlockH, X, W, channel, num_output,
+          height, neigh, ni, nullptr, h0, num, index, panel);
+
+      // the maximum of relu(y), the first one wins as in
+      // max_pooling_forward() after the relu, so a group with no positive
+      // value takes its first node
+      for (int g = 0; g < num / 8; ++g) {
+        const int p = parent[h0 / 8 + g];
+        for (int o = 0; o < num_output; ++o) {
+          const float* y = block.data() + o * kConvBlockH + 8 * g;
+          float max_val = std::max(y[0], float(0));
+          int max_idx = 0;
+          for (int j = 1; j < 8; ++j) {
+            const float v = std::max(y[j], float(0));
+            if (v > max_val) {
+              max_val = v;
+              max_idx = j;
+            }
           }
-          else {
-            ngh[i] = -1;
+          const int i = o * group_num + h0 / 8 + g;
+          mask[i] = static_cast<uint8>(max_idx);
+          if (p != -1) top[o * top_h + p] = max_val;
+        }
+      }
+    }
+  });
+}
+
+void relu_pool_backward(const CPUDevice& d, OpKernelContext* ctx,
+    float* bottom_diff, int bottom_h, const uint8* mask, const float* top,
+    const float* top_diff, int top_h, int channel, const int* children) {
+  // pad_backward(), max_pooling_backward() and the relu gradient, which is
+  // zero where the pooled output is not positive
+  const int group_num = bottom_h >> 3;
+  d.parallelFor(channel, Eigen::TensorOpCost(8.0 * top_h, 4.0 * bottom_h,
+      2.0 * top_h + bottom_h), [&](Eigen::Index begin, Eigen::Index end) {
+    for (Eigen::Index c = begin; c < end; ++c) {
+      float* diff = bottom_diff + c * bottom_h;
+      memset(diff, 0, bottom_h * sizeof(float));
+      for (int p = 0; p < top_h; ++p) {
+        const int g = children[p];
+        const int i = c * top_h + p;
+        if (g == -1 || top[i] <= 0) continue;
+        diff[8 * g + mask[c * group_num + g]] = top_diff[i];
+      }
+    }
+  });
+}
+
+// gradient of the filter summed over all the nodes, or over the node_num ones
+// listed in nodes, grad_W is overwritten
+static void octree_conv_grad_filter(const CPUDevice& d, OpKernelContext* ctx,
+    float* grad_W, const float* grad_Y, const float* X, int channel,
+    int num_output, int height, const int* neigh, const int* ni,
+    const int* nodes, int node_num) {
+  const int kernel_dim = channel * 27;
+  const int tile_h = conv_tile_height(kernel_dim, std::max(node_num, 1));
+  const int tile_num = (node_num + tile_h - 1) / tile_h;
+  const int slot_num = d.numThreads() + 1;
+
+  // each thread sums its tiles up in its own slot, the tiles of listed nodes
+  // also gather their columns of grad_Y
+  Tensor workspace, grad_W_slots;
+  const int64 tile_size = static_cast<int64>(kernel_dim) * tile_h;
+  const int64 grad_Y_size = nodes == nullptr ? 0 : num_output * tile_h;
+  const int64 grad_W_size = static_cast<int64>(num_output) * kernel_dim;
+  OP_REQUIRES_OK(ctx, allocate_scratch(d, ctx, DT_FLOAT,
+      TensorShape({ slot_num, tile_size + grad_Y_size }), &workspace));
+  OP_REQUIRES_OK(ctx, allocate_scratch(d, ctx, DT_FLOAT,
+      TensorShape({ slot_num, grad_W_size }), &grad_W_slots));
+  float* workspace_ptr = workspace.flat<float>().data();
+  float* grad_W_slots_ptr = grad_W_slots.flat<float>().data();
+  // a slot is only touched by the thread owning it
+  std::vector<char> slot_used(slot_num, 0);
+
+  d.parallelFor(tile_num, Eigen::TensorOpCost(4 * tile_size,
+      4 * (tile_size + num_output * tile_h), 2 * num_output * tile_size),
+      [&](Eigen::Index t0, Eigen::Index t1) {
+    const int slot = d.currentThreadId() + 1;
+    float* col = workspace_ptr + slot * (tile_size + grad_Y_size);
+    float* grad_Y_tile = col + tile_size;
+    MatrixMap gw(grad_W_slots_ptr + slot * grad_W_size, num_output,
+        kernel_dim, Eigen::OuterStride<>(kernel_dim));
+    if (!slot_used[slot]) {
+      gw.setZero();
+      slot_used[slot] = 1;
+    }
+    for (Eigen::Index t = t0; t < t1; ++t) {
+      const int h0 = t * tile_h;
+      const int num = std::min(tile_h, node_num - h0);
+      if (nodes == nullptr) {
+        octree2col_cpu(col, X, channel, height, 3, 1, neigh, ni, tile_h, t);
+        const ConstMatrixMap c(col, kernel_dim, num,
+            Eigen::OuterStride<>(tile_h));
+        const ConstMatrixMap g(grad_Y + h0, num_output, num,
+            Eigen::OuterStride<>(height));
+        gw.noalias() += g * c.transpose();
+        continue;
+      }
+      // octree2col() of the listed nodes
+      for (int j = 0; j < num; ++j) {
+        const int h = nodes[h0 + j];
+        const int* neigh_h = neigh + (h >> 3 << 6);
+        const int* ni_h = ni + (h % 8) * 27;
+        for (int c = 0; c < channel; ++c) {
+          const float* x = X + c * height;
+          float* col_c = col + c * 27 * tile_h + j;
+          for (int k = 0; k < 27; ++k) {
+            const int p = neigh_h[ni_h[k]];
+            col_c[k * tile_h] = p == -1 ? float(0) : x[p];
           }
         }
+        for (int o = 0; o < num_output; ++o) {
+          grad_Y_tile[o * tile_h + j] = grad_Y[o * height + h];
+        }
+      }
+      const ConstMatrixMap c(col, kernel_dim, num,
+          Eigen::OuterStride<>(tile_h));
+      const ConstMatrixMap g(grad_Y_tile, num_output, num,
+          Eigen::OuterStride<>(tile_h));
+      gw.noalias() += g * c.transpose();
+    }
+  });
+
+  std::vector<const float*> slots;
+  for (int i = 0; i < slot_num; ++i) {
+    if (slot_used[i]) slots.push_back(grad_W_slots_ptr + i * grad_W_size);
+  }
+  const int used_num = slots.size();
+  d.parallelFor(grad_W_size, Eigen::TensorOpCost(4 * used_num, 4, used_num),
+      [&](Eigen::Index i0, Eigen::Index i1) {
+    for (Eigen::Index i = i0; i < i1; ++i) {
+      float sum = 0;
+      for (int s = 0; s < used_num; ++s) sum += slots[s][i];
+      grad_W[i] = sum;
+    }
+  });
+}
+
+// gradient of the data. Node q is the k-th neighbor of node p if and only if
+// p is the (26 - k)-th neighbor of q, so the scatter of col2octree() turns
+// into a convolution of grad_Y with the transposed and flipped filter, and
+// the tiles need no synchronization
+static void octree_conv_grad_data(const CPUDevice& d, OpKernelContext* ctx,
+    float* grad_X, const float* grad_Y, const float* W, int channel,
+    int num_output, int height, const int* neigh, const int* ni) {
+  Tensor filter_t;
+  OP_REQUIRES_OK(ctx, allocate_scratch(d, ctx, DT_FLOAT,
+      TensorShape({ channel, num_output * 27 }), &filter_t));
+  float* filter_t_ptr = filter_t.flat<float>().data();
+  for (int c = 0; c < channel; ++c) {
+    for (int o = 0; o < num_output; ++o) {
+      for (int k = 0; k < 27; ++k) {
+        filter_t_ptr[(c * num_output + o) * 27 + k] =
+            W[(o * channel + c) * 27 + 26 - k];
+      }
+    }
+  }
+  octree_conv(d, ctx, grad_X, grad_Y, filter_t_ptr, num_output, channel,
+      height, neigh, ni);
+}
+
+void octree_conv_grad(const CPUDevice& d, OpKernelContext* ctx,
+    float* grad_X, float* grad_W, const float* grad_Y, const float* X,
+    const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni) {
+  octree_conv_grad_filter(d, ctx, grad_W, grad_Y, X, channel, num_output,
+      height, neigh, ni, nullptr, height);
+  if (!ctx->status().ok()) return;
+  octree_conv_grad_data(d, ctx, grad_X, grad_Y, W, channel, num_output,
+      height, neigh, ni);
+}
+
+void octree_conv_sparse_grad(const CPUDevice& d, OpKernelContext* ctx,
+    float* grad_X, float* grad_W, const float* grad_Y, const float* X,
+    const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni, const int* children) {
+  // the outputs of the empty nodes are constant, their gradients are dropped
+  std::vector<int> nodes = nonempty_nodes(children, height);
+  octree_conv_grad_filter(d, ctx, grad_W, grad_Y, X, channel, num_output,
+      height, neigh, ni, nodes.data(), nodes.size());
+  if (!ctx->status().ok()) return;
+
+  Tensor grad_Y_nonempty;
+  OP_REQUIRES_OK(ctx, allocate_scratch(d, ctx, DT_FLOAT,
+      TensorShape({ num_output, height }), &grad_Y_nonempty));
+  float* grad_Y_ptr = grad_Y_nonempty.flat<float>().data();
+  memcpy(grad_Y_ptr, grad_Y, sizeof(float) * num_output * height);
+  zero_empty_nodes(d, grad_Y_ptr, num_output, height, children);
+  octree_conv_grad_data(d, ctx, grad_X, grad_Y_ptr, W, channel, num_output,
+      height, neigh, ni);
+}
+
+void radix_sort_codes(const CPUDevice& d, unsigned* code, int* index, int n,
+    int bits) {
+  // LSD passes of 8 bits. The pairs are cut into chunks which count their
+  // digits in parallel, the offsets are laid out digit by digit and chunk by
+  // chunk, so the scatter of the chunks in parallel keeps the sort stable
+  const int kChunkSize = 16384;
+  const int chunk_num = std::max(1, std::min((n + kChunkSize - 1) / kChunkSize,
+      4 * d.numThreads()));
+  const int chunk = (n + chunk_num - 1) / chunk_num;
+  std::vector<unsigned> code_buffer(n);
+  std::vector<int> index_buffer(n);
+  std::vector<int> offset(256 * chunk_num);
+  unsigned* src_code = code;
+  int* src_index = index;
+  unsigned* des_code = code_buffer.data();
+  int* des_index = index_buffer.data();
+  const Eigen::TensorOpCost cost(8.0 * chunk, 8.0 * chunk, 4.0 * chunk);
+  for (int shift = 0; shift < bits; shift += 8) {
+    std::fill(offset.begin(), offset.end(), 0);
+    d.parallelFor(chunk_num, cost, [&](Eigen::Index c0, Eigen::Index c1) {
+      for (Eigen::Index c = c0; c < c1; ++c) {
+        int* count = offset.data() + 256 * c;
+        const int end = std::min(n, static_cast<int>(c + 1) * chunk);
+        for (int i = c * chunk; i < end; ++i) {
+          ++count[(src_code[i] >> shift) & 0xFF];
+        }
+      }
+    });
+    int sum = 0;
+    for (int b = 0; b < 256; ++b) {
+      for (int c = 0; c < chunk_num; ++c) {
+        const int count = offset[256 * c + b];
+        offset[256 * c + b] = sum;
+        sum += count;
       }
     }
+    d.parallelFor(chunk_num, cost, [&](Eigen::Index c0, Eigen::Index c1) {
+      for (Eigen::Index c = c0; c < c1; ++c) {
+        int* pos = offset.data() + 256 * c;
+        const int end = std::min(n, static_cast<int>(c + 1) * chunk);
+        for (int i = c * chunk; i < end; ++i) {
+          const int p = pos[(src_code[i] >> shift) & 0xFF]++;
+          des_code[p] = src_code[i];
+          des_index[p] = src_index[i];
+        }
+      }
+    });
+    std::swap(src_code, des_code);
+    std::swap(src_index, des_index);
+  }
+  if (src_code != code) {
+    memcpy(code, src_code, n * sizeof(unsigned));
+    memcpy(index, src_index, n * sizeof(int));
   }
 }
 
-inline void compute_key(int& key, const int* pt, int depth) {
-  key = 0;
-  for (int i = 0; i < depth; ++i) {
-    int mask = 1u << i;
-    for (int j = 0; j < 3; j++) {
-      key |= (pt[j] & mask) << (2 * i + 2 - j);
+namespace {
+
+// the serialized octree of the sorted Morton codes of the non-empty nodes of
+// each layer, the layers below full_layer are complete. Its signal and misc
+// are left zero, the signal is returned
+float* serialize_octree(string* octree,
+    const std::vector<std::vector<unsigned>>& nempty, int depth,
+    int full_layer) {
+  // all the nodes, the 8 children of every non-empty node of the layer above,
+  // and their indices among the non-empty ones
+  std::vector<std::vector<unsigned>> nodes(depth + 1);
+  std::vector<std::vector<int>> children(depth + 1);
+  nodes[0].push_back(0);
+  for (int l = 0; l < depth + 1; ++l) {
+    if (l > 0) {
+      nodes[l].resize(8 * nempty[l - 1].size());
+      for (size_t k = 0; k < nempty[l - 1].size(); ++k) {
+        for (unsigned j = 0; j < 8; ++j) {
+          nodes[l][8 * k + j] = nempty[l - 1][k] << 3 | j;
+        }
+      }
+    }
+    children[l].resize(nodes[l].size());
+    size_t k = 0;
+    for (size_t h = 0; h < nodes[l].size(); ++h) {
+      const bool is_nempty = k < nempty[l].size() && nempty[l][k] == nodes[l][h];
+      children[l][h] = is_nempty ? static_cast<int>(k++) : -1;
+    }
+  }
+
+  // header
+  std::vector<int> node_num(depth + 1), node_num_accu(depth + 2, 0);
+  for (int l = 0; l < depth + 1; ++l) {
+    node_num[l] = nodes[l].size();
+    node_num_accu[l + 1] = node_num_accu[l] + node_num[l];
+  }
+  const int total_node_num = node_num_accu[depth + 1];
+  const int final_node_num = node_num[depth];
+  const bool key64 = depth > OctreeParser::KEY32_MAX_DEPTH;
+  const size_t header_size = 4 + 2 * depth + 3;
+  const int key_ints = key64 ? 2 : 1;
+  const size_t size = header_size + (key_ints + 1) * total_node_num +
+                      4 * final_node_num;
+  octree->assign(size * sizeof(int), 0);
+  int* buffer = reinterpret_cast<int*>(&(*octree)[0]);
+  buffer[0] = total_node_num;
+  buffer[1] = final_node_num;
+  buffer[2] = depth;
+  buffer[3] = full_layer;
+  std::copy(node_num.begin(), node_num.end(), buffer + 4);
+  std::copy(node_num_accu.begin(), node_num_accu.end(), buffer + 5 + depth);
+
+  // key, the xyz form of the codes, and children
+  int* key = buffer + header_size;
+  int* child = key + key_ints * total_node_num;
+  for (int l = 0; l < depth + 1; ++l) {
+    if (key64) {
+      int* des = key + 2 * node_num_accu[l];
+      for (int h = 0; h < node_num[l]; ++h) {
+        store_key64(des, h, morton_decode64(nodes[l][h]));
+      }
+    } else {
+      morton_decode(reinterpret_cast<unsigned*>(key) + node_num_accu[l],
+          nodes[l].data(), node_num[l]);
     }
+    std::copy(children[l].begin(), children[l].end(),
+        child + node_num_accu[l]);
   }
+  return reinterpret_cast<float*>(child + total_node_num);
 }
 
-inline void compute_pt(int* pt, const int& key, int depth) {
-  for (int i = 0; i < 3; pt[i++] = 0u);
-  for (int i = 0; i < depth; ++i) {
+}  // namespace
+
+void points_to_octree(const CPUDevice& d, string* octree, const float* pts,
+    const float* normals, int n_point, int depth, int full_layer,
+    float radius) {
+  // the cube of the octree, the bounding cube of the points if no radius
+  float center[3] = { 0.0f, 0.0f, 0.0f };
+  if (radius <= 0 && n_point > 0) {
     for (int j = 0; j < 3; ++j) {
-      int mask = 1u << (3 * i + 2 - j);
-      pt[j] |= (key & mask) >> (2 * i + 2 - j);
+      const float* p = pts + j * n_point;
+      auto range = std::minmax_element(p, p + n_point);
+      center[j] = 0.5f * (*range.first + *range.second);
+      radius = std::max(radius, 0.5f * (*range.second - *range.first));
+    }
+  }
+  if (radius <= 0) radius = 1.0f;
+
+  // the Morton codes of the leaves holding the points, they take 30 bits at
+  // most; past KEY32_MAX_DEPTH the coordinates only fit in the 64-bit keys
+  const bool key64 = depth > OctreeParser::KEY32_MAX_DEPTH;
+  const int bound = 1 << depth;
+  const float scale = bound / (2 * radius);
+  std::vector<unsigned> code(n_point);
+  std::vector<int> index(n_point);
+  d.parallelFor(n_point, Eigen::TensorOpCost(12, 8, 20),
+      [&](Eigen::Index begin, Eigen::Index end) {
+    for (Eigen::Index i = begin; i < end; ++i) {
+      uint64 xyz = 0;
+      for (int j = 0; j < 3; ++j) {
+        int v = static_cast<int>((pts[j * n_point + i] - center[j] + radius) *
+                                 scale);
+        xyz |= static_cast<uint64>(std::min(std::max(v, 0), bound - 1))
+               << (key64 ? 16 : 8) * j;
+      }
+      code[i] = key64 ? static_cast<unsigned>(morton_encode64(xyz)) :
+                        static_cast<unsigned>(xyz);
+      index[i] = i;
+    }
+    if (!key64) {
+      morton_encode(code.data() + begin, code.data() + begin, end - begin);
+    }
+  });
+  radix_sort_codes(d, code.data(), index.data(), n_point, 3 * depth);
+
+  // the non-empty nodes of every layer bottom-up, the leaves are the runs of
+  // equal codes and the parents of a sorted layer stay sorted
+  std::vector<std::vector<unsigned>> nempty(depth + 1);
+  std::vector<int> run;
+  for (int i = 0; i < n_point; ++i) {
+    if (i == 0 || code[i] != code[i - 1]) {
+      nempty[depth].push_back(code[i]);
+      run.push_back(i);
+    }
+  }
+  run.push_back(n_point);
+  for (int l = depth - 1; l >= 0; --l) {
+    for (unsigned c : nempty[l + 1]) {
+      if (nempty[l].empty() || nempty[l].back() != c >> 3) {
+        nempty[l].push_back(c >> 3);
+      }
+    }
+  }
+  for (int l = 0; l < full_layer && l < depth; ++l) {
+    nempty[l].resize(1 << 3 * l);
+    for (int k = 0; k < (1 << 3 * l); ++k) nempty[l][k] = k;
+  }
+
+  float* signal = serialize_octree(octree, nempty, depth, full_layer);
+  OctreeParser parser(octree->data());
+  const int final_node_num = parser.final_node_number();
+
+  // signal, the averaged normal of the points in each leaf; misc stays zero
+  const int* leaf = parser.children_ + parser.node_num_accu_[depth];
+  d.parallelFor(final_node_num, Eigen::TensorOpCost(8, 12, 16),
+      [&](Eigen::Index begin, Eigen::Index end) {
+    for (Eigen::Index h = begin; h < end; ++h) {
+      const int k = leaf[h];
+      if (k == -1) continue;
+      float n[3] = { 0.0f, 0.0f, 0.0f };
+      for (int i = run[k]; i < run[k + 1]; ++i) {
+        for (int j = 0; j < 3; ++j) n[j] += normals[j * n_point + index[i]];
+      }
+      const float norm = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      for (int j = 0; j < 3; ++j) {
+        signal[j * final_node_num + h] = norm > 0 ? n[j] / norm : n[j];
+      }
+    }
+  });
+}
+
+namespace {
+
+// the layout of a compressed record: the header, the occupancy bytes, the
+// signal as int16 [3, signal_num], the misc as int32 [signal_num] and the
+// points as uint16 [3, n_point], each part starts at a multiple of 4 bytes
+struct CompressedHeader {
+  int magic;
+  int depth;
+  int full_layer;
+  int flags;
+  int occupancy_num;
+  int signal_num;
+  int n_point;
+  float signal_step;
+  float point_min[3];
+  float point_step[3];
+};
+const int kCompressedMagic = 0x315A434F;  // "OCZ1"
+// the signal and misc of all the leaves are kept, not only the non-empty ones
+const int kCompressedAllLeaves = 1;
+const int kCompressedMisc = 2;
+
+size_t align4(size_t n) { return (n + 3) & ~size_t(3); }
+
+// the parts of a compressed record, false if it is malformed
+struct CompressedRecord {
+  CompressedHeader header;
+  const uint8* occupancy;
+  const int16* signal;
+  const int* misc;
+  const uint16* points;
+
+  bool parse(const char* record, size_t size) {
+    if (size < sizeof(CompressedHeader)) return false;
+    memcpy(&header, record, sizeof(CompressedHeader));
+    const CompressedHeader& h = header;
+    if (h.magic != kCompressedMagic || h.depth < 1 ||
+        h.depth > kCompressedMaxDepth || h.full_layer < 0 ||
+        h.full_layer > h.depth || h.occupancy_num < 0 || h.signal_num < 0 ||
+        h.n_point < 0) {
+      return false;
+    }
+    size_t offset = sizeof(CompressedHeader);
+    occupancy = reinterpret_cast<const uint8*>(record + offset);
+    offset += align4(h.occupancy_num);
+    signal = reinterpret_cast<const int16*>(record + offset);
+    offset += align4(3 * sizeof(int16) * size_t(h.signal_num));
+    misc = reinterpret_cast<const int*>(record + offset);
+    if (h.flags & kCompressedMisc) offset += sizeof(int) * h.signal_num;
+    points = reinterpret_cast<const uint16*>(record + offset);
+    offset += 3 * sizeof(uint16) * size_t(h.n_point);
+    return align4(offset) == size;
+  }
+};
+
+// the octree whose non-empty nodes have the given occupancy bytes, in the
+// order of the layers and of the nodes, the ones of the complete layers below
+// full_layer - 1 are left out. nullptr if the bytes do not add up, otherwise
+// the signal of the octree
+float* octree_from_occupancy(string* octree, const uint8* occupancy,
+    int occupancy_num, int depth, int full_layer) {
+  std::vector<std::vector<unsigned>> nempty(depth + 1);
+  nempty[0].push_back(0);
+  int k = 0;
+  for (int l = 0; l < depth; ++l) {
+    std::vector<unsigned>& next = nempty[l + 1];
+    next.reserve(8 * nempty[l].size());
+    for (unsigned c : nempty[l]) {
+      unsigned bits = 0xFF;
+      if (l + 1 >= full_layer) {
+        if (k == occupancy_num) return nullptr;
+        bits = occupancy[k++];
+      }
+      for (unsigned j = 0; j < 8; ++j) {
+        if (bits >> j & 1) next.push_back(c << 3 | j);
+      }
     }
   }
+  if (k != occupancy_num) return nullptr;
+  return serialize_octree(octree, nempty, depth, full_layer);
 }
 
-int get_workspace_maxsize() {
-  return 256 * 1024 * 1024;
+}  // namespace
+
+bool encode_octree(string* record, const char* octree, const float* points,
+    int n_point) {
+  OctreeParser parser(octree);
+  CompressedHeader h;
+  memset(&h, 0, sizeof(h));
+  h.magic = kCompressedMagic;
+  h.depth = *parser.depth_;
+  h.full_layer = *parser.full_layer_;
+  h.n_point = n_point;
+  if (h.depth < 1 || h.depth > kCompressedMaxDepth || h.full_layer < 0 ||
+      h.full_layer > h.depth) {
+    return false;
+  }
+
+  // the occupancy bytes, the children of a node give its 8 bits
+  std::vector<uint8> occupancy;
+  for (int l = std::max(h.full_layer - 1, 0); l < h.depth; ++l) {
+    const int* children = parser.children_ + parser.node_num_accu_[l];
+    const int* next = parser.children_ + parser.node_num_accu_[l + 1];
+    for (int i = 0; i < parser.node_num_[l]; ++i) {
+      const int c = children[i];
+      if (c == -1) continue;
+      if (8 * c + 8 > parser.node_num_[l + 1]) return false;
+      uint8 bits = 0;
+      for (int j = 0; j < 8; ++j) bits |= (next[8 * c + j] != -1) << j;
+      occupancy.push_back(bits);
+    }
+  }
+  h.occupancy_num = occupancy.size();
+
+  // the octree is rebuilt from the bytes, and has to be the octree itself
+  string rebuilt;
+  if (octree_from_occupancy(&rebuilt, occupancy.data(), h.occupancy_num,
+                            h.depth, h.full_layer) == nullptr) {
+    return false;
+  }
+  const char* rebuilt_signal = reinterpret_cast<const char*>(
+      OctreeParser(rebuilt.data()).signal_);
+  const size_t structure_size = rebuilt_signal - rebuilt.data();
+  if (memcmp(rebuilt.data(), octree, structure_size) != 0) return false;
+
+  // the leaves to keep, the empty ones have no signal nor misc unless one of
+  // them does
+  const int final_num = *parser.final_node_num_;
+  const int* leaf = parser.children_ + parser.node_num_accu_[h.depth];
+  const float* signal = reinterpret_cast<const float*>(parser.signal_);
+  const int* misc = parser.misc_;
+  for (int i = 0; i < final_num; ++i) {
+    if (misc[i] != 0) h.flags |= kCompressedMisc;
+    if (leaf[i] != -1 || (h.flags & kCompressedAllLeaves)) continue;
+    if (misc[i] != 0 || signal[i] != 0 || signal[final_num + i] != 0 ||
+        signal[2 * final_num + i] != 0) {
+      h.flags |= kCompressedAllLeaves;
+    }
+  }
+  std::vector<int> leaves;
+  for (int i = 0; i < final_num; ++i) {
+    if (leaf[i] != -1 || (h.flags & kCompressedAllLeaves)) leaves.push_back(i);
+  }
+  h.signal_num = leaves.size();
+  float signal_max = 0;
+  for (int c = 0; c < 3; ++c) {
+    for (int i : leaves) {
+      signal_max = std::max(signal_max, std::abs(signal[c * final_num + i]));
+    }
+  }
+  h.signal_step = signal_max > 0 ? signal_max / 32767 : 1.0f;
+
+  // the bounding box of the points, 65536 steps on each axis
+  for (int c = 0; c < 3; ++c) {
+    const float* p = points + c * n_point;
+    float lo = 0, hi = 0;
+    if (n_point > 0) {
+      auto range = std::minmax_element(p, p + n_point);
+      lo = *range.first;
+      hi = *range.second;
+    }
+    h.point_min[c] = lo;
+    h.point_step[c] = (hi - lo) / 65535;
+  }
+
+  const size_t signal_offset = sizeof(h) + align4(h.occupancy_num);
+  const size_t misc_offset = signal_offset +
+      align4(3 * sizeof(int16) * size_t(h.signal_num));
+  const size_t points_offset = misc_offset +
+      ((h.flags & kCompressedMisc) ? sizeof(int) * h.signal_num : 0);
+  record->assign(align4(points_offset + 3 * sizeof(uint16) * size_t(n_point)),
+                 0);
+  char* ptr = &(*record)[0];
+  memcpy(ptr, &h, sizeof(h));
+  memcpy(ptr + sizeof(h), occupancy.data(), h.occupancy_num);
+  int16* des_signal = reinterpret_cast<int16*>(ptr + signal_offset);
+  const float signal_scale = 1.0f / h.signal_step;
+  for (int c = 0; c < 3; ++c) {
+    for (int k = 0; k < h.signal_num; ++k) {
+      const float v = signal[c * final_num + leaves[k]] * signal_scale;
+      des_signal[c * h.signal_num + k] = static_cast<int16>(
+          std::min(std::max(std::lrint(v), -32767L), 32767L));
+    }
+  }
+  if (h.flags & kCompressedMisc) {
+    int* des_misc = reinterpret_cast<int*>(ptr + misc_offset);
+    for (int k = 0; k < h.signal_num; ++k) des_misc[k] = misc[leaves[k]];
+  }
+  uint16* des_points = reinterpret_cast<uint16*>(ptr + points_offset);
+  for (int c = 0; c < 3; ++c) {
+    const float step = h.point_step[c];
+    const float scale = step > 0 ? 1.0f / step : 0.0f;
+    for (int i = 0; i < n_point; ++i) {
+      const float v = (points[c * n_point + i] - h.point_min[c]) * scale;
+      des_points[c * n_point + i] = static_cast<uint16>(
+          std::min(std::max(std::lrint(v), 0L), 65535L));
+    }
+  }
+  return true;
+}
+
+bool is_compressed_octree(const char* record, size_t size) {
+  int magic = 0;
+  if (size >= sizeof(int)) memcpy(&magic, record, sizeof(int));
+  return magic == kCompressedMagic;
+}
+
+bool decode_octree(string* octree, const char* record, size_t size) {
+  CompressedRecord r;
+  if (!r.parse(record, size)) return false;
+  const CompressedHeader& h = r.header;
+  float* signal = octree_from_occupancy(octree, r.occupancy, h.occupancy_num,
+      h.depth, h.full_layer);
+  if (signal == nullptr) return false;
+  OctreeParser parser(octree->data());
+  const int final_num = *parser.final_node_num_;
+  const int* leaf = parser.children_ + parser.node_num_accu_[h.depth];
+  int* misc = reinterpret_cast<int*>(signal + 3 * final_num);
+  const bool all_leaves = (h.flags & kCompressedAllLeaves) != 0;
+  const int leaf_num = all_leaves ? final_num :
+                       parser.node_number_nempty(h.depth);
+  if (h.signal_num != leaf_num) return false;
+
+  // the signal is scaled in a dense pass, then scattered to the leaves
+  std::vector<float> values(3 * size_t(h.signal_num));
+  const float step = h.signal_step;
+  for (size_t k = 0; k < values.size(); ++k) values[k] = r.signal[k] * step;
+  if (all_leaves) {
+    memcpy(signal, values.data(), values.size() * sizeof(float));
+    if (h.flags & kCompressedMisc) {
+      memcpy(misc, r.misc, final_num * sizeof(int));
+    }
+    return true;
+  }
+  for (int i = 0, k = 0; i < final_num; ++i) {
+    if (leaf[i] == -1) continue;
+    for (int c = 0; c < 3; ++c) {
+      signal[c * final_num + i] = values[c * h.signal_num + k];
+    }
+    if (h.flags & kCompressedMisc) misc[i] = r.misc[k];
+    ++k;
+  }
+  return true;
+}
+
+int compressed_point_num(const char* record, size_t size) {
+  CompressedRecord r;
+  return r.parse(record, size) ? r.header.n_point : -1;
+}
+
+bool decode_points(float* points, const char* record, size_t size) {
+  CompressedRecord r;
+  if (!r.parse(record, size)) return false;
+  const int n_point = r.header.n_point;
+  for (int c = 0; c < 3; ++c) {
+    const uint16* src = r.points + c * n_point;
+    float* des = points + c * n_point;
+    const float lo = r.header.point_min[c], step = r.header.point_step[c];
+    for (int i = 0; i < n_point; ++i) des[i] = lo + src[i] * step;
+  }
+  return true;
+}
+
+namespace {
+
+// the axis permutations of octree_augment(), new axis a takes old axis
+// kAxisPerm[p][a]
+const int kAxisPerm[6][3] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 },
+                              { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+
+// the key of a node at a layer of the given bound after the transform, the
+// batch index is kept
+template <typename Key>
+Key augment_key(Key k, const int* perm, int flip, Key bound) {
+  const int axis_bits = KeyTraits<Key>::AXIS_BITS;
+  const Key axis_max = (Key(1) << axis_bits) - 1;
+  Key des = k & ~KeyTraits<Key>::xyz(~Key(0));
+  for (int a = 0; a < 3; ++a) {
+    Key c = (k >> perm[a] * axis_bits) & axis_max;
+    if (flip >> a & 1) c = bound - c;
+    des |= c << a * axis_bits;
+  }
+  return des;
+}
+
+template <typename Key>
+void augment_key(int* des, const int* src, const int* pos, int node_num,
+    const int* perm, int flip, int depth) {
+  typedef KeyTraits<Key> Traits;
+  const Key bound = (Key(1) << depth) - 1;
+  for (int h = 0; h < node_num; ++h) {
+    Traits::store(des, pos[h],
+        augment_key(Traits::load(src, h), perm, flip, bound));
+  }
+}
+
+}  // namespace
+
+void augment_axes(int* axes, int transform) {
+  std::copy_n(kAxisPerm[transform >> 3], 3, axes);
+}
+
+void augment_octree(const CPUDevice& d, int* des_octree, float* des_data,
+    const int* src_octree, const float* src_data, const int* transform) {
+  OctreeBatchParser src, des;
+  src.set_cpu(src_octree);
+  des.set_cpu(des_octree, src.octree_info());
+  const OctreeInfo& info = *src.octree_info();
+  const int depth = info.depth_;
+  const int batch_size = info.batch_size_;
+  CHECK(info.has_children());
+  CHECK_EQ(info.nnum_[0], batch_size);
+
+  // the node range of each octree in each layer, the octrees are laid out
+  // one after another and the children of a range form the next range
+  const int sz = (depth + 1) * batch_size;
+  std::vector<int> node_begin(sz), node_num(sz), rank_begin(sz), nempty(sz);
+  for (int l = 0; l < depth + 1; ++l) {
+    const int* children = src.children_cpu(l);
+    int rank = 0;
+    for (int i = 0; i < batch_size; ++i) {
+      const int p = i * (depth + 1) + l;
+      node_begin[p] = l == 0 ? i : 8 * rank_begin[p - 1];
+      node_num[p] = l == 0 ? 1 : 8 * nempty[p - 1];
+      rank_begin[p] = rank;
+      for (int h = node_begin[p]; h < node_begin[p] + node_num[p]; ++h) {
+        if (children[h] != -1) ++rank;
+      }
+      nempty[p] = rank - rank_begin[p];
+    }
+  }
+
+  // the root layer has no neighbors to permute
+  if (info.has_neigh()) {
+    memcpy(des.mutable_neighbor_cpu(0), src.neighbor_cpu(0),
+        OctreeInfo::AVG_NGH_NUM * batch_size * sizeof(int));
+  }
+
+  // The transform of an octree is a signed permutation of the axes, so the 8
+  // children of a node are permuted the same way at every layer. Top-down,
+  // the new position of a node follows from the new rank of its parent among
+  // the non-empty nodes, and that rank from a scan of the layer in its new
+  // order. Keys, neighbors and the signal are then gathered to their places.
+  const double nnum_per_octree = double(info.total_nnum()) / batch_size;
+  d.parallelFor(batch_size, Eigen::TensorOpCost(12 * nnum_per_octree,
+      (12 + 4 * OctreeInfo::AVG_NGH_NUM) * nnum_per_octree,
+      20 * nnum_per_octree), [&](Eigen::Index begin, Eigen::Index end) {
+    std::vector<int> pos, inv, rank, parent_rank;
+    for (Eigen::Index i = begin; i < end; ++i) {
+      const int flip = transform[i] & 7;
+      const int* perm = kAxisPerm[transform[i] >> 3];
+      // the new child slot and neighbor offset of the old ones
+      int slot[8], offset[64];
+      for (int j = 0; j < 8; ++j) {
+        slot[j] = 0;
+        for (int a = 0; a < 3; ++a) {
+          const int bit = ((j >> (2 - perm[a])) & 1) ^ ((flip >> a) & 1);
+          slot[j] |= bit << (2 - a);
+        }
+      }
+      for (int o = 0; o < 64; ++o) {
+        offset[o] = 0;
+        for (int a = 0; a < 3; ++a) {
+          int c = (o >> (4 - 2 * perm[a])) & 3;
+          if (flip >> a & 1) c = 3 - c;
+          offset[o] |= c << (4 - 2 * a);
+        }
+      }
+
+      for (int l = 0; l < depth + 1; ++l) {
+        const int p = i * (depth + 1) + l;
+        const int n = node_num[p], h0 = node_begin[p];
+        const int* children = src.children_cpu(l) + h0;
+
+        // new positions, relative to the range of the octree
+        pos.resize(n);
+        if (l == 0) {
+          pos[0] = 0;
+        } else {
+          const int* parent = src.children_cpu(l - 1) +
+                              node_begin[p - 1];
+          const int g0 = rank_begin[p - 1];
+          for (int h = 0; h < node_num[p - 1]; ++h) {
+            if (parent[h] == -1) continue;
+            const int g = parent[h] - g0;
+            const int q = 8 * (parent_rank[h] - g0);
+            for (int j = 0; j < 8; ++j) pos[8 * g + j] = q + slot[j];
+          }
+        }
+
+        // the new ranks of the non-empty nodes, in their new order
+        inv.resize(n);
+        rank.resize(n);
+        for (int h = 0; h < n; ++h) inv[pos[h]] = h;
+        int* des_children = des.mutable_children_cpu(l) + h0;
+        int r = rank_begin[p];
+        for (int q = 0; q < n; ++q) {
+          const int h = inv[q];
+          rank[h] = children[h] == -1 ? -1 : r++;
+          des_children[q] = rank[h];
+        }
+
+        if (info.has_key()) {
+          const int key_ints = info.has_key64() ? 2 : 1;
+          int* des_key = des.mutable_key_cpu(l) + key_ints * h0;
+          const int* src_key = src.key_cpu(l) + key_ints * h0;
+          if (info.has_key64()) {
+            augment_key<uint64>(des_key, src_key, pos.data(), n, perm, flip,
+                l);
+          } else {
+            augment_key<unsigned>(des_key, src_key, pos.data(), n, perm,
+                flip, l);
+          }
+        }
+        if (info.has_split()) {
+          const int* src_split = src.split_cpu(l) + h0;
+          int* des_split = des.mutable_split_cpu(l) + h0;
+          for (int h = 0; h < n; ++h) des_split[pos[h]] = src_split[h];
+        }
+        if (info.has_neigh() && l > 0) {
+          // the neighbors of a group are its 4x4x4 neighborhood
+          const int ngh_num = OctreeInfo::AVG_NGH_NUM;
+          const int* src_neigh = src.neighbor_cpu(l) + ngh_num * h0;
+          int* des_neigh = des.mutable_neighbor_cpu(l) + ngh_num * h0;
+          for (int g = 0; g < n / 8; ++g) {
+            const int* ngh0 = src_neigh + 64 * g;
+            int* ngh1 = des_neigh + 64 * (pos[8 * g] >> 3);
+            for (int o = 0; o < 64; ++o) {
+              const int v = ngh0[o];
+              ngh1[offset[o]] = v == -1 ? -1 : pos[v - h0] + h0;
+            }
+          }
+        }
+        if (l == depth) {
+          // the signal is a normal, turned like the axes
+          const int height = info.nnum_[depth];
+          for (int a = 0; a < 3; ++a) {
+            const float* x = src_data + perm[a] * height + h0;
+            float* y = des_data + a * height + h0;
+            const float sign = (flip >> a & 1) ? -1.0f : 1.0f;
+            for (int h = 0; h < n; ++h) y[pos[h]] = sign * x[h];
+          }
+        }
+        parent_rank.swap(rank);
+      }
+    }
+  });
+}
+
+template <typename T>
+void set_zero(const CPUDevice& d, OpKernelContext* ctx, T* Y, const int N) {
+  memset(Y, 0, sizeof(T) * N);
+}
+
+template void set_zero<float>(const CPUDevice& d, OpKernelContext* ctx,
+    float* Y, const int N);
+template void set_zero<int>(const CPUDevice& d, OpKernelContext* ctx,
+    int* Y, const int N);
+
+void copy_device_to_device(const CPUDevice& d, void* dst, const void* src,
+    size_t size) {
+  memcpy(dst, src, size);
+}
+
+void copy_host_to_device(const CPUDevice& d, void* dst, const void* src,
+    size_t size) {
+  memcpy(dst, src, size);
 }
 
 }  // namespace octree
@@ -258,7 +1815,7 @@ OctreeParser::OctreeParser(const void* data) {
   node_num_accu_ = node_num_ + (*depth_) + 1;
 
   key_ = node_num_accu_ + (*depth_) + 2;
-  children_ = key_ + (*total_node_num_);
+  children_ = key_ + (key64() ? 2 : 1) * (*total_node_num_);
 
   signal_ = children_ + (*total_node_num_);
   misc_ = signal_ + 3 * (*final_node_num_);
@@ -274,6 +1831,7 @@ int OctreeParser::node_number_nempty(int depth) const {
       break;
     }
   }
+  return num;
 }
 
 // --- OctreeInfo ---
@@ -294,10 +1852,11 @@ void OctreeInfo::set(int batch_size, int depth, int full_layer,
 void OctreeInfo::update_ptr_dis() {
   CHECK(content_flags_ != 0);
   int dis = sizeof(OctreeInfo) / sizeof(int);
+  const int key_ints = has_key64() ? 2 : 1;
   for (int d = 0; d < depth_ + 1; ++d) {
     if (0 != (content_flags_ & 1)) {
       dis_key_[d] = dis;
-      dis += nnum_[d];
+      dis += key_ints * nnum_[d];
     }
     if (0 != (content_flags_ & 2)) {
       dis_children_[d] = dis;
@@ -317,23 +1876,96 @@ void OctreeInfo::update_ptr_dis() {
 // UNDERSTAND(isunchy): octree_sizeofint
 int OctreeInfo::octree_sizeofint(int total_nnum, int content_flags) {
   int sz = sizeof(OctreeInfo) / sizeof(int);
-  if (0 != (content_flags & 1)) sz += total_nnum;
+  const int key_ints = (content_flags & KEY64) != 0 ? 2 : 1;
+  if (0 != (content_flags & 1)) sz += key_ints * total_nnum;
   if (0 != (content_flags & 2)) sz += total_nnum;
   if (0 != (content_flags & 4)) sz += total_nnum * AVG_NGH_NUM;
   if (0 != (content_flags & 8)) sz += total_nnum;
   return sz;
 }
 
+int OctreeInfo::batch_content_flags(int content_flags, int depth,
+    int batch_size) {
+  if ((content_flags & 1) != 0 &&
+      (depth > OctreeParser::KEY32_MAX_DEPTH || batch_size > 256)) {
+    content_flags |= KEY64;
+  }
+  return content_flags;
+}
+
 // --- OctreeBatch ---
 void OctreeBatch::set_octreebatch(OpKernelContext* context,
+    const Tensor& octree_buffer_tensor, int content_flags, DataCategory dc,
+    bool as_output) {
+  auto allocate = [&](int index, DataType type, const TensorShape& shape,
+                      Tensor* tensor) {
+    if (!as_output) return context->allocate_temp(type, shape, tensor);
+    // the member shares the buffer of the output, so nothing is copied later
+    Tensor* output = nullptr;
+    TF_RETURN_IF_ERROR(context->allocate_output(index, shape, &output));
+    *tensor = *output;
+    return Status::OK();
+  };
+  OP_REQUIRES_OK(context, merge_octrees(context->eigen_device<CPUDevice>(),
+                              allocate, octree_buffer_tensor, content_flags,
+                              dc));
+}
+
+Status OctreeBatch::set_octreebatch(const CPUDevice& d,
     const Tensor& octree_buffer_tensor, int content_flags, DataCategory dc) {
+  auto allocate = [](int index, DataType type, const TensorShape& shape,
+                     Tensor* tensor) {
+    *tensor = Tensor(type, shape);
+    return Status::OK();
+  };
+  return merge_octrees(d, allocate, octree_buffer_tensor, content_flags, dc);
+}
+
+Status OctreeBatch::merge_octrees(const CPUDevice& device,
+    const AllocateFn& allocate, const Tensor& octree_buffer_tensor,
+    int content_flags, DataCategory dc) {
   /// octree parser
   auto octree_buffer = octree_buffer_tensor.flat<string>();
   int batch_size = octree_buffer_tensor.shape().dim_size(0);
     // octree_buffer_tensor.shape().dims() == 1
+
+  // the compressed records are decoded first
+  std::vector<string> decoded(batch_size);
+  std::vector<int> compressed;
+  for (int i = 0; i < batch_size; ++i) {
+    const string& record = octree_buffer(i);
+    if (octree::is_compressed_octree(record.data(), record.size())) {
+      compressed.push_back(i);
+    }
+  }
+  if (!compressed.empty()) {
+    std::atomic<bool> ok(true);
+    // a decoded octree is about 8 times as large as its record
+    const double bytes = octree_buffer(compressed[0]).size();
+    device.parallelFor(compressed.size(),
+        Eigen::TensorOpCost(bytes, 8 * bytes, 16 * bytes),
+        [&](int64 begin, int64 end) {
+      for (int64 k = begin; k < end; ++k) {
+        const string& record = octree_buffer(compressed[k]);
+        if (!octree::decode_octree(&decoded[compressed[k]], record.data(),
+                                   record.size())) {
+          ok = false;
+        }
+      }
+    });
+    if (!ok) {
+      return errors::DataLoss("a compressed octree record is malformed");
+    }
+  }
+
   std::vector<OctreeParser> octree_parsers;
   for (int i = 0; i < batch_size; ++i) {
-    octree_parsers.push_back(OctreeParser(octree_buffer(i).data()));
+    const string& octree = decoded[i].empty() ? octree_buffer(i) : decoded[i];
+    octree_parsers.push_back(OctreeParser(octree.data()));
+  }
+  if (batch_size == 1) {
+    return set_single_octree(device, allocate, octree_parsers[0],
+        content_flags, dc);
   }
 
   /// get node number information
@@ -397,12 +2029,14 @@ void OctreeBatch::set_octreebatch(OpKernelContext* context,
   }
 
   /// init space
-  // octree_
+  // octree_, with 64-bit keys once the batch index or the coordinates do
+  // not fit in a 32-bit key any more
+  content_flags = OctreeInfo::batch_content_flags(content_flags, depth,
+      batch_size);
   int total_nnum = nnum_batch_cum[depth + 1];
   TensorShape octree_shape({ OctreeInfo::octree_sizeofint(total_nnum,
                              content_flags) });
-  OP_REQUIRES_OK(context,
-                 context->allocate_temp(DT_INT32, octree_shape, &octree_));
+  TF_RETURN_IF_ERROR(allocate(1, DT_INT32, octree_shape, &octree_));
   int* octree_ptr = octree_.flat<int32>().data();
   OctreeInfo oct_info;
   oct_info.set(batch_size, depth, full_layer, nnum_batch.data(),
@@ -413,37 +2047,50 @@ void OctreeBatch::set_octreebatch(OpKernelContext* context,
   // data_
   int deepest_nnum = nnum_batch[depth];
   TensorShape data_shape({ 1, 3, deepest_nnum, 1 });
-  OP_REQUIRES_OK(context,
-                 context->allocate_temp(DT_FLOAT, data_shape, &data_));
+  TF_RETURN_IF_ERROR(allocate(0, DT_FLOAT, data_shape, &data_));
   float* data_ptr = data_.flat<float>().data();
 
   // label_
   TensorShape label_shape;
   if (dc == CLASSIFICATION) label_shape = TensorShape({ batch_size });
   if (dc == SEGMENTATION) label_shape = TensorShape({ deepest_nnum });
-  OP_REQUIRES_OK(context,
-                 context->allocate_temp(DT_INT32, label_shape, &label_));
+  TF_RETURN_IF_ERROR(allocate(2, DT_INT32, label_shape, &label_));
   int* label_ptr = label_.flat<int>().data();
 
   /// set data
+  // The prefix sums above give each octree a disjoint range in every layer,
+  // so each (octree, depth) pair is an independent work item. The items are
+  // handed out largest first through a shared counter: a worker which is done
+  // with its item takes the next pending one, so a large octree in the batch
+  // does not leave the other workers idle.
+  struct LayerItem { int octree, depth, nnum; };
+  std::vector<LayerItem> items;
+  items.reserve(batch_size * (depth + 1));
   for (int i = 0; i < batch_size; ++i) {
-    // copy key
     for (int d = 0; d < depth + 1; ++d) {
-      if (!oct_info.has_key()) break;
-      int p = i * (depth + 1) + d;
-      int* des = octbatch_parser.mutable_key_cpu(d) + nnum_cum_layer[p];
-      const int* src = octree_parsers[i].key_ + nnum_cum_octree[p];
-      for (int j = 0; j < nnum[p]; ++j) {
-        des[j] = src[j];
-        unsigned char* ptr = reinterpret_cast<unsigned char*>(des + j);
-        ptr[3] = i;
-      }
+      items.push_back({ i, d, nnum[i * (depth + 1) + d] });
+    }
+  }
+  std::stable_sort(items.begin(), items.end(),
+      [](const LayerItem& a, const LayerItem& b) { return a.nnum > b.nnum; });
+
+  auto set_layer = [&](int i, int d) {
+    int p = i * (depth + 1) + d;
+
+    // copy key
+    const OctreeParser& parser = octree_parsers[i];
+    const int key_ints = parser.key64() ? 2 : 1;
+    const int* src_key = parser.key_ + key_ints * nnum_cum_octree[p];
+    if (oct_info.has_key()) {
+      const int key_dis = oct_info.has_key64() ? 2 : 1;
+      int* des = octbatch_parser.mutable_key_cpu(d) +
+          key_dis * nnum_cum_layer[p];
+      octree::copy_batch_key(des, oct_info.has_key64(), src_key,
+          parser.key64(), nnum[p], i);
     }
 
     // copy children
-    for (int d = 0; d < depth + 1; ++d) {
-      if (!oct_info.has_children()) break;
-      int p = i * (depth + 1) + d;
+    if (oct_info.has_children()) {
       int* des = octbatch_parser.mutable_children_cpu(d) + nnum_cum_layer[p];
       const int* src = octree_parsers[i].children_ + nnum_cum_octree[p];
       for (int j = 0; j < nnum[p]; ++j) {
@@ -451,8 +2098,25 @@ void OctreeBatch::set_octreebatch(OpKernelContext* context,
       }
     }
 
+    // calc and set neighbor info, the root has none
+    if (oct_info.has_neigh()) {
+      int* neigh = octbatch_parser.mutable_neighbor_cpu(d) +
+          OctreeInfo::AVG_NGH_NUM * nnum_cum_layer[p];
+      if (d == 0) {
+        std::fill_n(neigh, OctreeInfo::AVG_NGH_NUM * nnum[p], -1);
+      } else if (parser.key64()) {
+        octree::calc_layer_neighbor64(neigh, src_key, nnum[p], d,
+            nnum_cum_layer[p]);
+      } else {
+        octree::calc_layer_neighbor(neigh,
+            reinterpret_cast<const unsigned*>(src_key), nnum[p], d,
+            nnum_cum_layer[p]);
+      }
+    }
+
+    if (d != depth) return;
+
     // copy data
-    int p = i * (depth + 1) + depth;
     for (int c = 0; c < 3; ++c) {
       float* des = data_ptr + c * nnum_batch[depth] + nnum_cum_layer[p];
       const float* src = reinterpret_cast<const float*>(
@@ -467,19 +2131,101 @@ void OctreeBatch::set_octreebatch(OpKernelContext* context,
         label_ptr[nnum_cum_layer[p] + j] = octree_parsers[i].misc_[j];
       }
     }
+  };
 
-    // calc and set neighbor info
-    for (int d = 1; d < depth + 1; ++d) {
-      if (!oct_info.has_neigh()) break;
-      int p = i * (depth + 1) + d;
-      const unsigned* key =
-          reinterpret_cast<const unsigned*>(octree_parsers[i].key_) +
-          nnum_cum_octree[p];
-      int* neigh = octbatch_parser.mutable_neighbor_cpu(d) +
-          OctreeInfo::AVG_NGH_NUM * nnum_cum_layer[p];
-      octree::calc_neighbor(neigh, key, nnum[p], nnum_cum_layer[p]);
+  const int num_items = items.size();
+  const int num_workers = std::min(num_items, device.numThreads() + 1);
+  std::atomic<int> next_item(0);
+  // per worker: the copies plus the 64 neighbors of each node
+  const double nnum_per_worker = double(total_nnum) / num_workers;
+  device.parallelFor(num_workers, Eigen::TensorOpCost(12 * nnum_per_worker,
+      (12 + 4 * OctreeInfo::AVG_NGH_NUM) * nnum_per_worker,
+      60 * nnum_per_worker), [&](int64 begin, int64 end) {
+    for (int k = next_item++; k < num_items; k = next_item++) {
+      set_layer(items[k].octree, items[k].depth);
     }
+  });
+  return Status::OK();
+}
+
+Status OctreeBatch::set_single_octree(const CPUDevice& device,
+    const AllocateFn& allocate, const OctreeParser& parser,
+    int content_flags, DataCategory dc) {
+  /// the header comes straight from the parser, a batch of one octree has
+  /// the same node numbers and offsets as the octree itself
+  const int depth = *parser.depth_;
+  content_flags = OctreeInfo::batch_content_flags(content_flags, depth, 1);
+  std::vector<int> nnum_nempty(depth + 1);
+  for (int d = 0; d < depth + 1; ++d) {
+    nnum_nempty[d] = parser.node_number_nempty(d);
   }
+  OctreeInfo oct_info;
+  oct_info.set(1, depth, *parser.full_layer_, parser.node_num_,
+      parser.node_num_accu_, nnum_nempty.data(), content_flags);
+
+  /// init space
+  int total_nnum = parser.total_node_number();
+  TensorShape octree_shape({ OctreeInfo::octree_sizeofint(total_nnum,
+                             content_flags) });
+  TF_RETURN_IF_ERROR(allocate(1, DT_INT32, octree_shape, &octree_));
+  OctreeBatchParser octbatch_parser;
+  octbatch_parser.set_cpu(octree_.flat<int32>().data(), &oct_info);
+
+  int deepest_nnum = parser.node_num_[depth];
+  TensorShape data_shape({ 1, 3, deepest_nnum, 1 });
+  TF_RETURN_IF_ERROR(allocate(0, DT_FLOAT, data_shape, &data_));
+
+  TensorShape label_shape;
+  if (dc == CLASSIFICATION) label_shape = TensorShape({ 1 });
+  if (dc == SEGMENTATION) label_shape = TensorShape({ deepest_nnum });
+  TF_RETURN_IF_ERROR(allocate(2, DT_INT32, label_shape, &label_));
+
+  /// set data
+  // keys only lose their batch index, and the children need no offset
+  const int key_ints = parser.key64() ? 2 : 1;
+  for (int d = 0; d < depth + 1; ++d) {
+    const int nnum = parser.node_num_[d];
+    if (oct_info.has_key()) {
+      octree::copy_batch_key(octbatch_parser.mutable_key_cpu(d),
+          oct_info.has_key64(), parser.key_ + key_ints *
+          parser.node_num_accu_[d], parser.key64(), nnum, 0);
+    }
+    if (oct_info.has_children()) {
+      memcpy(octbatch_parser.mutable_children_cpu(d),
+          parser.children_ + parser.node_num_accu_[d], nnum * sizeof(int));
+    }
+  }
+
+  // the signal is already laid out as [3, deepest_nnum]
+  memcpy(data_.flat<float>().data(), parser.signal_,
+      3 * deepest_nnum * sizeof(float));
+  if (dc == SEGMENTATION) {
+    memcpy(label_.flat<int>().data(), parser.misc_,
+        deepest_nnum * sizeof(int));
+  }
+
+  // calc and set neighbor info, one layer per shard; the root has none
+  if (!oct_info.has_neigh()) return Status::OK();
+  std::fill_n(octbatch_parser.mutable_neighbor_cpu(0),
+      OctreeInfo::AVG_NGH_NUM * parser.node_num_[0], -1);
+  if (depth == 0) return Status::OK();
+  const double nnum_per_layer = double(total_nnum) / depth;
+  device.parallelFor(depth, Eigen::TensorOpCost(4 * nnum_per_layer,
+      4 * OctreeInfo::AVG_NGH_NUM * nnum_per_layer, 60 * nnum_per_layer),
+      [&](int64 begin, int64 end) {
+    for (int64 d = begin + 1; d < end + 1; ++d) {
+      const int* key = parser.key_ + key_ints * parser.node_num_accu_[d];
+      int* neigh = octbatch_parser.mutable_neighbor_cpu(d);
+      if (parser.key64()) {
+        octree::calc_layer_neighbor64(neigh, key, parser.node_num_[d], d, 0);
+      } else {
+        octree::calc_layer_neighbor(neigh,
+            reinterpret_cast<const unsigned*>(key), parser.node_num_[d], d,
+            0);
+      }
+    }
+  });
+  return Status::OK();
 }
 
 // --- OctreeBatchParser ---
@@ -531,6 +2277,7 @@ void OctreeBatchParser::set_cpu(const void* ptr) {
   oct_info_ = static_cast<OctreeInfo*>(const_cast<void*>(ptr));
 }
 
+#if GOOGLE_CUDA
 void OctreeBatchParser::set_gpu(const void* ptr, const void* oct_info) {
   const_ptr_ = true;
   // set d_metadata_ address
@@ -548,6 +2295,7 @@ void OctreeBatchParser::set_gpu(const void* ptr, const void* oct_info) {
     oct_info_ = static_cast<OctreeInfo*>(const_cast<void*>(oct_info));
   }
 }
+#endif  // GOOGLE_CUDA
 
 void OctreeBatchParser::set_cpu(void* ptr, const OctreeInfo* oct_info) {
   const_ptr_ = false;
@@ -558,6 +2306,7 @@ void OctreeBatchParser::set_cpu(void* ptr, const OctreeInfo* oct_info) {
   }
 }
 
+#if GOOGLE_CUDA
 void OctreeBatchParser::set_gpu(void* ptr, const OctreeInfo* oct_info) {
   const_ptr_ = false;
   d_metadata_ = static_cast<int*>(ptr);
@@ -572,6 +2321,7 @@ void OctreeBatchParser::set_gpu(void* ptr, const OctreeInfo* oct_info) {
       cudaMemcpyDeviceToHost);
   }
 }
+#endif  // GOOGLE_CUDA
 
 //void OctreeBatchParser::set_gpu(void* data)
 //{
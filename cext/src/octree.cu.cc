@@ -249,6 +249,7 @@ void generate_key_gpu(OpKernelContext* ctx, int* key_split, const int* key,
 
 void generate_key_gpu(OpKernelContext* ctx, int* key, int depth,
     int batch_size) {
+  CHECK_LT(batch_size, 256) << "The 32-bit keys hold the batch index in a byte";
   int n = batch_size * (1 << 3 * depth);
   GPUDevice d = ctx->eigen_device<GPUDevice>();
   CudaLaunchConfig config = GetCudaLaunchConfig(n, d);
@@ -315,6 +316,61 @@ template void tensorflow_gpu_set_zero<float>(OpKernelContext* ctx, float* Y,
 template void tensorflow_gpu_set_zero<int>(OpKernelContext* ctx, int* Y,
     int N);
 
+void pad_forward(const GPUDevice& d, OpKernelContext* ctx, float* Y, int Hy,
+    int Cy, const float* X, int Hx, const int* label) {
+  pad_forward_gpu(ctx, Y, Hy, Cy, X, Hx, label);
+}
+
+void pad_backward(const GPUDevice& d, OpKernelContext* ctx, float* X, int Hx,
+    int Cx, const float* Y, int Hy, const int* label) {
+  pad_backward_gpu(ctx, X, Hx, Cx, Y, Hy, label);
+}
+
+void octree2col(const GPUDevice& d, OpKernelContext* ctx, float* data_col,
+    const float* data_octree, int channel, int height, int kernel_size,
+    int stride, const int* neigh, const int* ni, int height_col, int n) {
+  octree2col_gpu(ctx, data_col, data_octree, channel, height, kernel_size,
+      stride, neigh, ni, height_col, n);
+}
+
+void col2octree(const GPUDevice& d, OpKernelContext* ctx,
+    const float* data_col, float* data_octree, int channel, int height,
+    int kernel_size, int stride, const int* neigh, const int* ni,
+    int height_col, int n) {
+  col2octree_gpu(ctx, data_col, data_octree, channel, height, kernel_size,
+      stride, neigh, ni, height_col, n);
+}
+
+void gemm(const GPUDevice& d, OpKernelContext* ctx, bool transa, bool transb,
+    uint64 m, uint64 n, uint64 k, float alpha, const float* a, const float* b,
+    float beta, float* c) {
+  tensorflow_gpu_gemm(ctx, transa, transb, m, n, k, alpha, a, b, beta, c);
+}
+
+int get_workspace_maxsize(const GPUDevice& d) {
+  return get_workspace_maxsize();
+}
+
+template <typename T>
+void set_zero(const GPUDevice& d, OpKernelContext* ctx, T* Y, const int N) {
+  tensorflow_gpu_set_zero(ctx, Y, N);
+}
+
+template void set_zero<float>(const GPUDevice& d, OpKernelContext* ctx,
+    float* Y, const int N);
+template void set_zero<int>(const GPUDevice& d, OpKernelContext* ctx,
+    int* Y, const int N);
+
+void copy_device_to_device(const GPUDevice& d, void* dst, const void* src,
+    size_t size) {
+  cudaMemcpy(dst, src, size, cudaMemcpyDeviceToDevice);
+}
+
+void copy_host_to_device(const GPUDevice& d, void* dst, const void* src,
+    size_t size) {
+  cudaMemcpy(dst, src, size, cudaMemcpyHostToDevice);
+}
+
 }  // namespace octree
 
 }  // namespace tensorflow
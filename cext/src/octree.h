@@ -2,20 +2,31 @@
 #define TENSORFLOW_USER_OPS_OCTREE_H_
 
 // gpu code file use octree.h should include octree.h first
+#if GOOGLE_CUDA
 #define EIGEN_USE_GPU
+#endif
 
+#include <cstring>
+#include <functional>
 #include <vector>
 
 #include "tensorflow/core/framework/op_kernel.h"
 
 namespace tensorflow  {
 
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+// A serialized octree holds one key per node, x | y << 8 | z << 16, unless it
+// is deeper than KEY32_MAX_DEPTH, then the keys take two ints each,
+// x | y << 16 | z << 32
 class OctreeParser {
  public:
   OctreeParser(const void* data);
 
   int total_node_number() const { return *total_node_num_; }
   int final_node_number() const { return *final_node_num_; }
+  bool key64() const { return *depth_ > KEY32_MAX_DEPTH; }
   // TODO(ps): modify octree format, and remove this function
   int node_number_nempty(int depth) const;
 
@@ -38,6 +49,8 @@ class OctreeParser {
   // octree data
   const int* signal_;
   const int* misc_;
+
+  static const int KEY32_MAX_DEPTH = 8;
 };
 
 class OctreeInfo {
@@ -54,6 +67,12 @@ class OctreeInfo {
   bool has_neigh() const { return (content_flags_ & 4) != 0; }
   // UNDERSTAND: octree info split meaning
   bool has_split() const { return (content_flags_ & 8) != 0; }
+  // the keys are 64-bit, x | y << 16 | z << 32 | batch index << 48
+  bool has_key64() const { return (content_flags_ & KEY64) != 0; }
+  // the content flags of a batch, KEY64 is added to the keys when the depth
+  // or the batch index does not fit in a byte
+  static int batch_content_flags(int content_flags, int depth,
+      int batch_size);
 
   int dis_key(int depth) const {
     CHECK(has_key());
@@ -85,6 +104,8 @@ class OctreeInfo {
 
   // average neighbor number, 2*2*2 nodes share 4*4*4 neighbor nodes
   static const int AVG_NGH_NUM = 8;
+  // content flag of the 64-bit keys
+  static const int KEY64 = 16;
 
  private:
   int dis_key_[16];
@@ -98,11 +119,32 @@ class OctreeBatch {
   enum DataCategory { CLASSIFICATION, SEGMENTATION };
 
  public:
+  // with as_output, data_, octree_ and label_ are allocated as the outputs
+  // 0, 1 and 2 of the op and written in place, otherwise as temporaries
   void set_octreebatch(OpKernelContext* context,
+    const Tensor& octree_buffer_tensor,
+    const int content_flags = 7,
+    const DataCategory dc = CLASSIFICATION,
+    const bool as_output = false);
+  // the same outside of an op, e.g. on the worker threads of a reader, then
+  // data_, octree_ and label_ own their buffers
+  Status set_octreebatch(const CPUDevice& d,
     const Tensor& octree_buffer_tensor,
     const int content_flags = 7,
     const DataCategory dc = CLASSIFICATION);
 
+ private:
+  // allocates data_, octree_ or label_, given the output index 0, 1 or 2
+  typedef std::function<Status(int, DataType, const TensorShape&, Tensor*)>
+      AllocateFn;
+  Status merge_octrees(const CPUDevice& d, const AllocateFn& allocate,
+    const Tensor& octree_buffer_tensor, const int content_flags,
+    const DataCategory dc);
+  // a batch of one octree, whose layers are copied as whole blocks
+  Status set_single_octree(const CPUDevice& d, const AllocateFn& allocate,
+    const OctreeParser& parser, const int content_flags,
+    const DataCategory dc);
+
  public:
   Tensor data_;
   Tensor label_;
@@ -117,6 +159,9 @@ class OctreeBatchParser {
   void set_gpu(const void* prt, const void* oct_info = nullptr);
   void set_cpu(void* ptr, const OctreeInfo* octinfo = nullptr);
   void set_gpu(void* ptr, const OctreeInfo* octinfo = nullptr);
+  // set_cpu() or set_gpu() according to the device holding the octree
+  void set(const CPUDevice& d, const void* ptr) { set_cpu(ptr); }
+  void set(const GPUDevice& d, const void* ptr) { set_gpu(ptr); }
 
   const OctreeInfo* octree_info() { return oct_info_; };
   OctreeInfo* mutable_octree_info() { return oct_info_; };
@@ -180,6 +225,12 @@ class OctreeBatchParser {
     CHECK(d_metadata_ && (const_ptr_ == false));
     return d_metadata_ + oct_info_->dis_children(depth);
   }
+  const int* children(const CPUDevice& d, int depth) {
+    return children_cpu(depth);
+  }
+  const int* children(const GPUDevice& d, int depth) {
+    return children_gpu(depth);
+  }
 
   // pointer to the first key of the specified layer
   const int* key_cpu(int depth) {
@@ -198,7 +249,6 @@ class OctreeBatchParser {
     CHECK(d_metadata_ && (const_ptr_ == false));
     return d_metadata_ + oct_info_->dis_key(depth);
   }
-
   // pointer to the first neighbor of the specified layer
   const int* neighbor_cpu(int depth) {
     CHECK(h_metadata_);
@@ -216,6 +266,12 @@ class OctreeBatchParser {
     CHECK(d_metadata_ && const_ptr_ == false);
     return d_metadata_ + oct_info_->dis_neigh(depth);
   }
+  const int* neighbor(const CPUDevice& d, int depth) {
+    return neighbor_cpu(depth);
+  }
+  const int* neighbor(const GPUDevice& d, int depth) {
+    return neighbor_gpu(depth);
+  }
 
   // pointer to the first split-label of the specified layer
   const int* split_cpu(int depth) {
@@ -246,6 +302,30 @@ class OctreeBatchParser {
   OctreeInfo oct_info_buffer_;
 };
 
+// A packed octree dataset, written by util/pack_dataset.py and mmap-ed by
+// OctreePackedDatabase, is laid out as
+//   OctreePackHeader
+//   int64 offset[num_shape + 1], byte offsets of the records in the file
+//   the records, each one starting at a multiple of ALIGNMENT and holding
+//     int   octree[], a batch of this single shape as built by OctreeBatch,
+//           i.e. the OctreeInfo followed by the layers with their neighbors
+//     float signal[3 * deepest node number]
+//     float points[3 * n_point]
+// The values keep the byte order and OctreeInfo layout of the packer.
+struct OctreePackHeader {
+  char magic[8];        // "OCTPACK"
+  int version;
+  int num_shape;
+  int depth;
+  int full_layer;
+  int content_flags;
+  int n_point;          // point number per shape
+  int reserved[8];
+
+  static const int VERSION = 1;
+  static const int ALIGNMENT = 64;
+};
+
 namespace octree {
 
 void pad_forward_cpu(float* Y, int Hy, int Cy, const float* X, int Hx,
@@ -276,6 +356,8 @@ void generate_key_cpu(int* key_split, const int* key, const int* children,
     int node_num);
 void generate_key_gpu(OpKernelContext* ctx, int* key_split, const int* key,
     const int* children, int node_num);
+// the 32-bit keys of a full layer of batch_size octrees, the batch index goes
+// to the highest byte, so batch_size < 256 like in copy_batch_key()
 void generate_key_cpu(int* key, const int depth, const int batch_size);
 void generate_key_gpu(OpKernelContext* ctx, int* key, int depth,
     int batch_size);
@@ -288,12 +370,62 @@ void calc_neigh_cpu(int* neigh, const int depth, const int batch_size);
 void calc_neigh_gpu(OpKernelContext* ctx, int* neigh, int depth,
     int batch_size);
 
-// calculate neighborhood information with the hash table
+// calculate neighborhood information with an open addressing table of the
+// sibling groups, node_num is a multiple of 8
 void calc_neighbor(int* neigh, const unsigned* key, int node_num,
     int displacement);
-
-inline void compute_key(int& key, const int* pt, int depth);
-inline void compute_pt(int* pt, const int& key, int depth);
+// the same with the 64-bit keys of OctreeInfo::has_key64(), two ints per key
+void calc_neighbor64(int* neigh, const int* key, int node_num,
+    int displacement);
+// calc_neighbor() of the layer at the given depth, a full layer is copied
+// from the cached table of full_layer_neigh() instead
+void calc_layer_neighbor(int* neigh, const unsigned* key, int node_num,
+    int depth, int displacement);
+void calc_layer_neighbor64(int* neigh, const int* key, int node_num,
+    int depth, int displacement);
+// the 64-bit key i of a key array. The keys are stored as pairs of ints, and
+// the key sections of serialized octrees and batches are only 4-byte aligned,
+// so they are never accessed through an uint64 pointer
+inline uint64 load_key64(const int* key, int i) {
+  uint64 k;
+  memcpy(&k, key + 2 * static_cast<int64>(i), sizeof(k));
+  return k;
+}
+inline void store_key64(int* key, int i, uint64 k) {
+  memcpy(key + 2 * static_cast<int64>(i), &k, sizeof(k));
+}
+// copy the keys of the octree batch_id into a batch, adding the batch index.
+// Both sides hold 32-bit or 64-bit keys, the 32-bit ones are widened
+void copy_batch_key(int* des, bool des_key64, const int* src, bool src_key64,
+    int node_num, int batch_id);
+// the key and neighbor tables of a full layer of one octree, built once per
+// process; nullptr for the layers too deep to be cached
+const int* full_layer_key(int depth);
+const int* full_layer_neigh(int depth);
+
+// Morton codec of the octree keys. The code of a node at depth d holds the
+// bit i of x, y and z in the bits 3i + 2, 3i + 1 and 3i, it is the index of
+// the node in a full layer. The xyz form is the key stored in the octree,
+// x | y << 8 | z << 16, whose highest byte is ignored by the encoder. The
+// batch versions use pdep/pext when the CPU has BMI2 and byte lookup tables
+// otherwise, they may run in place
+unsigned morton_encode(unsigned xyz);
+unsigned morton_decode(unsigned code);
+void morton_encode(unsigned* code, const unsigned* xyz, int n);
+void morton_decode(unsigned* xyz, const unsigned* code, int n);
+// the same for the 64-bit keys, x | y << 16 | z << 32, whose highest 16 bits
+// are ignored, and the codes of up to 48 bits
+uint64 morton_encode64(uint64 xyz);
+uint64 morton_decode64(uint64 code);
+void morton_encode64(uint64* code, const uint64* xyz, int n);
+void morton_decode64(uint64* xyz, const uint64* code, int n);
+// whether the batch codec runs on BMI2, which can be turned off to compare
+// against the tables; it stays off on CPUs without BMI2
+bool morton_use_bmi2();
+bool morton_use_bmi2(bool enable);
+
+void compute_key(int& key, const int* pt, int depth);
+void compute_pt(int* pt, const int& key, int depth);
 
 void tensorflow_gpu_gemm(OpKernelContext* ctx, bool transa, bool transb,
     uint64 m, uint64 n, uint64 k, float alpha, const float* a, const float* b,
@@ -304,6 +436,150 @@ void tensorflow_gpu_set_zero(OpKernelContext* ctx, T* Y, const int N);
 
 int get_workspace_maxsize();
 
+// Device overloads used by the op kernels templated on the device. The CPU
+// versions are defined in octree.cc and split the work over the intra-op
+// thread pool, the GPU versions are defined in octree.cu.cc.
+void pad_forward(const CPUDevice& d, OpKernelContext* ctx, float* Y, int Hy,
+    int Cy, const float* X, int Hx, const int* label);
+void pad_forward(const GPUDevice& d, OpKernelContext* ctx, float* Y, int Hy,
+    int Cy, const float* X, int Hx, const int* label);
+
+void pad_backward(const CPUDevice& d, OpKernelContext* ctx, float* X, int Hx,
+    int Cx, const float* Y, int Hy, const int* label);
+void pad_backward(const GPUDevice& d, OpKernelContext* ctx, float* X, int Hx,
+    int Cx, const float* Y, int Hy, const int* label);
+
+void octree2col(const CPUDevice& d, OpKernelContext* ctx, float* data_col,
+    const float* data_octree, int channel, int height, int kernel_size,
+    int stride, const int* neigh, const int* ni, int height_col, int n);
+void octree2col(const GPUDevice& d, OpKernelContext* ctx, float* data_col,
+    const float* data_octree, int channel, int height, int kernel_size,
+    int stride, const int* neigh, const int* ni, int height_col, int n);
+
+void col2octree(const CPUDevice& d, OpKernelContext* ctx,
+    const float* data_col, float* data_octree, int channel, int height,
+    int kernel_size, int stride, const int* neigh, const int* ni,
+    int height_col, int n);
+void col2octree(const GPUDevice& d, OpKernelContext* ctx,
+    const float* data_col, float* data_octree, int channel, int height,
+    int kernel_size, int stride, const int* neigh, const int* ni,
+    int height_col, int n);
+
+// row-major C = alpha * op(A) * op(B) + beta * C, C is m x n
+void gemm(const CPUDevice& d, OpKernelContext* ctx, bool transa, bool transb,
+    uint64 m, uint64 n, uint64 k, float alpha, const float* a, const float* b,
+    float beta, float* c);
+void gemm(const GPUDevice& d, OpKernelContext* ctx, bool transa, bool transb,
+    uint64 m, uint64 n, uint64 k, float alpha, const float* a, const float* b,
+    float beta, float* c);
+
+// the size in floats of one chunk of octree2col() columns, the CPU gives
+// get_workspace_cpu_maxsize() to each thread of the pool
+int get_workspace_maxsize(const CPUDevice& d);
+int get_workspace_maxsize(const GPUDevice& d);
+
+// octree convolution of kernel size 3 and stride 1 on the CPU,
+// Y[num_output, height] = W[num_output, channel * 27] * octree2col(X).
+// It is an implicit GEMM without workspace: for each block of nodes the
+// neighbors of a few channels are gathered through neigh and ni into a panel
+// kept in the L1 cache, and a register-blocked microkernel multiplies it with
+// the filter rows
+void octree_conv(const CPUDevice& d, OpKernelContext* ctx, float* Y,
+    const float* X, const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni);
+// gradients of octree_conv(), grad_W is overwritten. grad_W is summed with a
+// GEMM over tiles of octree2col_cpu() columns sized by
+// get_workspace_cpu_maxsize(), grad_X is an octree_conv() of grad_Y
+void octree_conv_grad(const CPUDevice& d, OpKernelContext* ctx,
+    float* grad_X, float* grad_W, const float* grad_Y, const float* X,
+    const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni);
+// octree_conv() of the nodes with children only, listed in a compacted index
+// list, the outputs of the empty nodes (children == -1) are set to zero
+void octree_conv_sparse(const CPUDevice& d, OpKernelContext* ctx, float* Y,
+    const float* X, const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni, const int* children);
+// gradients of octree_conv_sparse(), the filter gradient is only summed over
+// the nodes with children
+void octree_conv_sparse_grad(const CPUDevice& d, OpKernelContext* ctx,
+    float* grad_X, float* grad_W, const float* grad_Y, const float* X,
+    const float* W, int channel, int num_output, int height,
+    const int* neigh, const int* ni, const int* children);
+// octree_conv() followed by relu, the max pooling of each group of 8
+// siblings and pad_forward() with the children of the parent layer.
+// Only top[num_output, top_h] and the child slot of each maximum,
+// mask[num_output, height / 8], are written, the convolution of a block of
+// nodes never leaves the cache
+void octree_conv_relu_pool(const CPUDevice& d, OpKernelContext* ctx,
+    float* top, int top_h, uint8* mask, const float* X, const float* W,
+    int channel, int num_output, int height, const int* neigh, const int* ni,
+    const int* children);
+// the gradient of the convolution output of octree_conv_relu_pool(),
+// bottom_diff[channel, bottom_h], from its top, mask and top_diff
+void relu_pool_backward(const CPUDevice& d, OpKernelContext* ctx,
+    float* bottom_diff, int bottom_h, const uint8* mask, const float* top,
+    const float* top_diff, int top_h, int channel, const int* children);
+int get_workspace_cpu_maxsize();
+
+// stable sort of the n pairs (code, index) by the low bits of the codes,
+// a parallel LSD radix sort of 8 bits per pass
+void radix_sort_codes(const CPUDevice& d, unsigned* code, int* index, int n,
+    int bits);
+// the serialized octree read by OctreeParser built from n_point points and
+// their normals, both [3, n_point]. The octree fits the cube of the given
+// radius centered at the origin, or the bounding cube of the points if
+// radius <= 0. Levels are built bottom-up from the sorted Morton codes of
+// the points, the layers up to full_layer hold all their nodes, the signal
+// of a leaf is the normalized sum of its normals and misc is zero. Octrees
+// deeper than OctreeParser::KEY32_MAX_DEPTH, up to 10, store 64-bit keys
+void points_to_octree(const CPUDevice& d, string* octree, const float* pts,
+    const float* normals, int n_point, int depth, int full_layer,
+    float radius);
+
+// A compressed record holds a serialized octree and the points [3, n_point]
+// of its shape. The structure is kept as the occupancy bytes of the non-empty
+// nodes, from which the keys and children are rebuilt. The signal is
+// quantized to 16 bits, and the points to 16 bits in their bounding box.
+// The empty leaves keep no signal nor misc when all of theirs are zero.
+// encode_octree() returns false for the octrees it cannot rebuild exactly:
+// deeper than kCompressedMaxDepth, or not laid out like the ones of
+// points_to_octree()
+const int kCompressedMaxDepth = 10;
+bool encode_octree(string* record, const char* octree, const float* points,
+    int n_point);
+bool is_compressed_octree(const char* record, size_t size);
+// the serialized octree of a compressed record, false if it is malformed
+bool decode_octree(string* octree, const char* record, size_t size);
+// the point number of a compressed record, -1 if it is malformed
+int compressed_point_num(const char* record, size_t size);
+bool decode_points(float* points, const char* record, size_t size);
+
+// apply a signed permutation of the axes to each octree of a batch and to
+// its signal [3, H], the normals, about the center of the octree. Bits 0-2
+// of transform[i] flip the new x, y and z axes, and transform[i] >> 3 picks
+// the old axes they come from: xyz, xzy, yxz, yzx, zxy or zyx. The nodes are
+// permuted in place of a rebuild, which needs the children in the batch
+void augment_octree(const CPUDevice& d, int* des_octree, float* des_data,
+    const int* src_octree, const float* src_data, const int* transform);
+// the old axes of the new x, y and z axes of a transform of augment_octree()
+void augment_axes(int* axes, int transform);
+
+template <typename T>
+void set_zero(const CPUDevice& d, OpKernelContext* ctx, T* Y, const int N);
+template <typename T>
+void set_zero(const GPUDevice& d, OpKernelContext* ctx, T* Y, const int N);
+
+// copy between two buffers living on the device
+void copy_device_to_device(const CPUDevice& d, void* dst, const void* src,
+    size_t size);
+void copy_device_to_device(const GPUDevice& d, void* dst, const void* src,
+    size_t size);
+// copy a host buffer to the device
+void copy_host_to_device(const CPUDevice& d, void* dst, const void* src,
+    size_t size);
+void copy_host_to_device(const GPUDevice& d, void* dst, const void* src,
+    size_t size);
+
 }  // namespace octree
 
 }  // namespace tensorflow
@@ -0,0 +1,138 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+#include "tensorflow/core/platform/mutex.h"
+
+#include <random>
+
+#include "octree.h"
+
+namespace tensorflow {
+
+REGISTER_OP("OctreeAugment")
+.Input("in_data: float")
+.Input("in_octree: int32")
+.Input("in_points: float")
+.Attr("flip: bool = true")
+.Attr("permute: bool = true")
+.Attr("seed: int = 0")
+.Output("out_data: float")
+.Output("out_octree: int32")
+.Output("out_points: float")
+.Output("out_transform: int32")
+.SetIsStateful()
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  c->set_output(0, c->input(0));
+  c->set_output(1, c->input(1));
+  c->set_output(2, c->input(2));
+  c->set_output(3, c->MakeShape({ c->UnknownDim() }));
+  return Status::OK();
+})
+.Doc(R"doc(
+Random flips and axis permutations of each shape of an octree batch, the
+outputs of OctreeDatabase and the node positions [4, n] of
+PrimitivePointsSuffixIndex, about the center of the octrees. The octrees are
+permuted node by node instead of rebuilt. With both flip and permute, a shape
+takes one of the 48 symmetries of the cube, out_transform [batch_size] holds
+the flipped axes in bits 0-2 and the axis permutation from bit 3.
+)doc");
+
+class OctreeAugmentOp : public OpKernel {
+ public:
+  explicit OctreeAugmentOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("flip", &this->flip_));
+    OP_REQUIRES_OK(context, context->GetAttr("permute", &this->permute_));
+    int seed;
+    OP_REQUIRES_OK(context, context->GetAttr("seed", &seed));
+    rng_.seed(seed);
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const CPUDevice& d = context->eigen_device<CPUDevice>();
+
+    // in data, the normals [1, 3, H, 1] of the deepest layer
+    const Tensor& in_data = context->input(0);
+    // in octree
+    const Tensor& in_octree = context->input(1);
+    // in points [4, n], the batch index in the last row
+    const Tensor& in_points = context->input(2);
+    OP_REQUIRES(context, in_points.dims() == 2 && in_points.dim_size(0) == 4,
+        errors::InvalidArgument("in_points should be [4, n]"));
+
+    OctreeBatchParser parser;
+    parser.set_cpu(in_octree.flat<int>().data());
+    const int batch_size = parser.batch_size();
+    const int depth = parser.depth();
+    OP_REQUIRES(context, parser.octree_info()->has_children(),
+        errors::InvalidArgument("the octree should have the children"));
+    OP_REQUIRES(context, in_data.dims() == 4 && in_data.dim_size(1) == 3 &&
+        in_data.dim_size(2) == parser.node_num(depth),
+        errors::InvalidArgument("in_data should be [1, 3, H, 1]"));
+
+    // a transform per shape
+    Tensor* out_transform = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_transform",
+                                TensorShape({ batch_size }), &out_transform));
+    int* transform = out_transform->flat<int>().data();
+    {
+      mutex_lock l(mu_);
+      std::uniform_int_distribution<int> flips(0, flip_ ? 7 : 0);
+      std::uniform_int_distribution<int> perms(0, permute_ ? 5 : 0);
+      for (int i = 0; i < batch_size; ++i) {
+        transform[i] = flips(rng_) | perms(rng_) << 3;
+      }
+    }
+
+    Tensor* out_data = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_data",
+                                in_data.shape(), &out_data));
+    Tensor* out_octree = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_octree",
+                                in_octree.shape(), &out_octree));
+    octree::augment_octree(d, out_octree->flat<int>().data(),
+        out_data->flat<float>().data(), in_octree.flat<int>().data(),
+        in_data.flat<float>().data(), transform);
+
+    // the points, turned like the normals
+    Tensor* out_points = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_points",
+                                in_points.shape(), &out_points));
+    const int n = in_points.dim_size(1);
+    const float* src = in_points.flat<float>().data();
+    for (int j = 0; j < n; ++j) {
+      const float b = src[3 * n + j];
+      OP_REQUIRES(context, b >= 0 && b < batch_size,
+          errors::InvalidArgument("the batch index of a point is invalid"));
+    }
+    float* des = out_points->flat<float>().data();
+    std::vector<int> perm(3 * batch_size);
+    for (int i = 0; i < batch_size; ++i) {
+      octree::augment_axes(perm.data() + 3 * i, transform[i]);
+    }
+    d.parallelFor(n, Eigen::TensorOpCost(16, 16, 8),
+        [&](Eigen::Index begin, Eigen::Index end) {
+      for (Eigen::Index j = begin; j < end; ++j) {
+        const int b = static_cast<int>(src[3 * n + j]);
+        for (int a = 0; a < 3; ++a) {
+          const float x = src[perm[3 * b + a] * n + j];
+          des[a * n + j] = (transform[b] >> a & 1) ? -x : x;
+        }
+        des[3 * n + j] = src[3 * n + j];
+      }
+    });
+  }
+
+ private:
+  bool flip_;
+  bool permute_;
+  mutex mu_;
+  std::mt19937 rng_ GUARDED_BY(mu_);
+};
+REGISTER_KERNEL_BUILDER(Name("OctreeAugment").Device(DEVICE_CPU),
+                        OctreeAugmentOp);
+
+}  // namespace tensorflow
@@ -1,14 +1,20 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
-#include "cuda_runtime.h"
 
 #include "octree.h"
+#include "scratch_arena.h"
 
 namespace tensorflow {
 
-void init_neigh_index(OpKernelContext* ctx, Tensor& ni);
+template <typename Device>
+void init_neigh_index(const Device& d, OpKernelContext* ctx, Tensor& ni);
+template <typename Device>
+void zero_empty_nodes(const Device& d, OpKernelContext* ctx, float* data,
+    int channel, int height, int nnum_nempty, const int* children);
 
 REGISTER_OP("OctreeConv")
 .Input("in_data: float")
@@ -18,6 +24,7 @@ REGISTER_OP("OctreeConv")
 .Attr("num_output: int")
 .Attr("kernel_size: int")
 .Attr("stride: int")
+.Attr("sparse: bool = false")
 .Output("out_data: float")
 .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
   int num_output;
@@ -26,9 +33,11 @@ REGISTER_OP("OctreeConv")
   return Status::OK();
 })
 .Doc(R"doc(
-Octree convolution operator.
+Octree convolution operator. With sparse set, only the nodes with children
+are computed and the outputs of the empty nodes are zero.
 )doc");
 
+template <typename Device>
 class OctreeConvOP : public OpKernel {
  public:
   explicit OctreeConvOP(OpKernelConstruction* context) : OpKernel(context) {
@@ -39,9 +48,12 @@ class OctreeConvOP : public OpKernel {
     OP_REQUIRES_OK(context, context->GetAttr("kernel_size",
                                              &this->kernel_size_));
     OP_REQUIRES_OK(context, context->GetAttr("stride", &this->stride_));
+    OP_REQUIRES_OK(context, context->GetAttr("sparse", &this->sparse_));
   }
 
   void Compute(OpKernelContext* context) override {
+    const Device& d = context->eigen_device<Device>();
+
     // in data
     // data format: [1, channels, H, 1]
     const Tensor& in_data = context->input(0);
@@ -64,54 +76,96 @@ class OctreeConvOP : public OpKernel {
     auto in_octree_ptr = in_octree.flat<int>().data();
 
     // parse octree info
-    oct_batch_.set_gpu(in_octree_ptr);
+    oct_batch_.set(d, in_octree_ptr);
     CHECK_EQ(oct_batch_.node_num(curr_depth_), in_data_shape.dim_size(2));
 
-    // get workspace tensor
     kernel_dim_ = in_filter_shape.dim_size(1) * in_filter_shape.dim_size(2);
     workspace_h_ = in_data_shape.dim_size(2);
+    workspace_depth_ = curr_depth_;
+
+    // init neighbor info
+    init_neigh_index(d, context, ni_);
+    auto ni_ptr = ni_.flat<int32>().data();
+
+    // out data
+    Tensor* data_output_tensor = nullptr;
+    TensorShape data_output_shape({ 1, num_output_, workspace_h_, 1 });
+    OP_REQUIRES_OK(context, context->allocate_output("out_data",
+                                data_output_shape, &data_output_tensor));
+    auto data_output_ptr = data_output_tensor->flat<float>().data();
+
+    compute(d, context, in_data_ptr, in_filter_ptr, ni_ptr, data_output_ptr);
+  }
+
+ private:
+  // the CPU runs the implicit GEMM, over the non-empty nodes only if sparse
+  void compute(const CPUDevice& d, OpKernelContext* context,
+      const float* in_data_ptr, const float* in_filter_ptr, const int* ni_ptr,
+      float* data_output_ptr) {
+    if (kernel_size_ != 3 || stride_ != 1) {
+      compute_chunked(d, context, in_data_ptr, in_filter_ptr, ni_ptr,
+          data_output_ptr);
+      return;
+    }
+    if (sparse_) {
+      octree::octree_conv_sparse(d, context, data_output_ptr, in_data_ptr,
+          in_filter_ptr, channels_, num_output_, workspace_h_,
+          oct_batch_.neighbor(d, workspace_depth_), ni_ptr,
+          oct_batch_.children(d, workspace_depth_));
+      return;
+    }
+    octree::octree_conv(d, context, data_output_ptr, in_data_ptr,
+        in_filter_ptr, channels_, num_output_, workspace_h_,
+        oct_batch_.neighbor(d, workspace_depth_), ni_ptr);
+  }
+
+  template <typename D>
+  void compute(const D& d, OpKernelContext* context,
+      const float* in_data_ptr, const float* in_filter_ptr, const int* ni_ptr,
+      float* data_output_ptr) {
+    compute_chunked(d, context, in_data_ptr, in_filter_ptr, ni_ptr,
+        data_output_ptr);
+  }
+
+  // the whole device runs octree2col and the GEMM of one workspace chunk
+  // after another
+  template <typename D>
+  void compute_chunked(const D& d, OpKernelContext* context,
+      const float* in_data_ptr, const float* in_filter_ptr, const int* ni_ptr,
+      float* data_output_ptr) {
+    // get workspace tensor
     workspace_ha_ = workspace_h_;
     workspace_n_ = 1;
-    workspace_depth_ = curr_depth_;
-    const int MAX_SIZE = octree::get_workspace_maxsize();
+    const int MAX_SIZE = octree::get_workspace_maxsize(d);
     int ideal_size = workspace_h_ * kernel_dim_;
     if (ideal_size > MAX_SIZE) {
       workspace_n_ = (ideal_size + MAX_SIZE - 1) / MAX_SIZE;
       workspace_ha_ = (workspace_h_ + workspace_n_ - 1) / workspace_n_;
     }
     const TensorShape workspace_shape({ kernel_dim_, workspace_ha_ });
-    OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, workspace_shape,
+    OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                                workspace_shape,
                                 &workspace_));
     auto workspace_ptr = workspace_.flat<float>().data();
 
     // get result_buffer tensor if needed
     if (workspace_n_ > 1) {
       const TensorShape result_shape({ num_output_, workspace_ha_ });
-      OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, result_shape,
+      OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                                  result_shape,
                                   &result_buffer_));
     }
     auto result_buffer_ptr = result_buffer_.flat<float>().data();
 
-    // init neighbor info
-    init_neigh_index(context, ni_);
-    auto ni_ptr = ni_.flat<int32>().data();
-
-    // out data
-    Tensor* data_output_tensor = nullptr;
-    TensorShape data_output_shape({ 1, num_output_, workspace_h_, 1 });
-    OP_REQUIRES_OK(context, context->allocate_output("out_data",
-                                data_output_shape, &data_output_tensor));
-    auto data_output_ptr = data_output_tensor->flat<float>().data();
-
     float* result_data =
         workspace_n_ == 1 ? data_output_ptr : result_buffer_ptr;
     for (int n = 0; n < workspace_n_; ++n) {
       // set workspace data
-      octree::octree2col_gpu(context, workspace_ptr, in_data_ptr, channels_,
+      octree::octree2col(d, context, workspace_ptr, in_data_ptr, channels_,
           workspace_h_, kernel_size_, stride_,
-          oct_batch_.neighbor_gpu(workspace_depth_), ni_ptr, workspace_ha_, n);
+          oct_batch_.neighbor(d, workspace_depth_), ni_ptr, workspace_ha_, n);
       // gemm
-      octree::tensorflow_gpu_gemm(context, false, false,
+      octree::gemm(d, context, false, false,
           static_cast<uint64>(num_output_), static_cast<uint64>(workspace_ha_),
           static_cast<uint64>(kernel_dim_), static_cast<float>(1),
           in_filter_ptr, workspace_ptr, static_cast<float>(0), result_data);
@@ -119,17 +173,23 @@ class OctreeConvOP : public OpKernel {
       if (workspace_n_ == 1) break;
       int num = std::min(workspace_ha_, workspace_h_ - n * workspace_ha_);
       for (int c = 0; c < num_output_; ++c) {
-        cudaMemcpy(data_output_ptr + c * workspace_h_ + n * workspace_ha_,
-            result_data + c * workspace_ha_, num * sizeof(float),
-            cudaMemcpyDeviceToDevice);
+        octree::copy_device_to_device(d,
+            data_output_ptr + c * workspace_h_ + n * workspace_ha_,
+            result_data + c * workspace_ha_, num * sizeof(float));
       }
     }
+
+    if (sparse_) {
+      zero_empty_nodes(d, context, data_output_ptr, num_output_, workspace_h_,
+          oct_batch_.node_num_nonempty(workspace_depth_),
+          oct_batch_.children(d, workspace_depth_));
+    }
   }
 
- private:
   int kernel_size_;
   int kernel_dim_;
   int stride_;
+  bool sparse_;
 
   int channels_;
   int num_output_;
@@ -155,7 +215,12 @@ class OctreeConvOP : public OpKernel {
 
   Tensor ni_;
 };
-REGISTER_KERNEL_BUILDER(Name("OctreeConv").Device(DEVICE_GPU), OctreeConvOP);
+REGISTER_KERNEL_BUILDER(
+    Name("OctreeConv").Device(DEVICE_CPU), OctreeConvOP<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("OctreeConv").Device(DEVICE_GPU), OctreeConvOP<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("OctreeConvGrad")
@@ -167,6 +232,7 @@ REGISTER_OP("OctreeConvGrad")
 .Attr("num_output: int")
 .Attr("kernel_size: int")
 .Attr("stride: int")
+.Attr("sparse: bool = false")
 .Output("grad_data: float")
 .Output("grad_filter: float")
 .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
@@ -178,6 +244,7 @@ REGISTER_OP("OctreeConvGrad")
 Gradient for octree convolution operator.
 )doc");
 
+template <typename Device>
 class OctreeConvGradOP : public OpKernel {
  public:
   explicit OctreeConvGradOP(OpKernelConstruction* context):OpKernel(context) {
@@ -188,9 +255,12 @@ class OctreeConvGradOP : public OpKernel {
     OP_REQUIRES_OK(context, context->GetAttr("kernel_size",
                                              &this->kernel_size_));
     OP_REQUIRES_OK(context, context->GetAttr("stride", &this->stride_));
+    OP_REQUIRES_OK(context, context->GetAttr("sparse", &this->sparse_));
   }
 
   void Compute(OpKernelContext* context) override {
+    const Device& d = context->eigen_device<Device>();
+
     // in gradients
     const Tensor& gradients = context->input(0);
     auto gradients_ptr = gradients.flat<float>().data();
@@ -232,59 +302,120 @@ class OctreeConvGradOP : public OpKernel {
     OP_REQUIRES_OK(context, context->allocate_output("grad_filter",
                                 grad_filter_shape, &grad_filter_tensor));
     auto grad_filter_ptr = grad_filter_tensor->flat<float>().data();
-    octree::tensorflow_gpu_set_zero(context, grad_filter_ptr,
-        grad_filter_tensor->NumElements());
 
     // parse octree info
-    oct_batch_.set_gpu(in_octree_ptr);
+    oct_batch_.set(d, in_octree_ptr);
     CHECK_EQ(oct_batch_.node_num(curr_depth_), in_data_shape.dim_size(2));
 
-    // get workspace tensor
     kernel_dim_ = in_filter_shape.dim_size(1) * in_filter_shape.dim_size(2);
     workspace_h_ = in_data_shape.dim_size(2);
+    workspace_depth_ = curr_depth_;
+
+    // init neighbor info
+    init_neigh_index(d, context, ni_);
+    auto ni_ptr = ni_.flat<int32>().data();
+
+    compute(d, context, gradients_ptr, in_data_ptr, in_filter_ptr, ni_ptr,
+        grad_data_ptr, grad_filter_ptr);
+  }
+
+ private:
+  // the CPU splits the nodes into cache-sized tiles over the thread pool
+  void compute(const CPUDevice& d, OpKernelContext* context,
+      const float* gradients_ptr, const float* in_data_ptr,
+      const float* in_filter_ptr, const int* ni_ptr, float* grad_data_ptr,
+      float* grad_filter_ptr) {
+    if (kernel_size_ != 3 || stride_ != 1) {
+      compute_chunked(d, context, gradients_ptr, in_data_ptr, in_filter_ptr,
+          ni_ptr, grad_data_ptr, grad_filter_ptr);
+      return;
+    }
+    if (sparse_) {
+      octree::octree_conv_sparse_grad(d, context, grad_data_ptr,
+          grad_filter_ptr, gradients_ptr, in_data_ptr, in_filter_ptr,
+          channels_, num_output_, workspace_h_,
+          oct_batch_.neighbor(d, workspace_depth_), ni_ptr,
+          oct_batch_.children(d, workspace_depth_));
+      return;
+    }
+    octree::octree_conv_grad(d, context, grad_data_ptr, grad_filter_ptr,
+        gradients_ptr, in_data_ptr, in_filter_ptr, channels_, num_output_,
+        workspace_h_, oct_batch_.neighbor(d, workspace_depth_), ni_ptr);
+  }
+
+  template <typename D>
+  void compute(const D& d, OpKernelContext* context,
+      const float* gradients_ptr, const float* in_data_ptr,
+      const float* in_filter_ptr, const int* ni_ptr, float* grad_data_ptr,
+      float* grad_filter_ptr) {
+    compute_chunked(d, context, gradients_ptr, in_data_ptr, in_filter_ptr,
+        ni_ptr, grad_data_ptr, grad_filter_ptr);
+  }
+
+  // the whole device runs the workspace chunks one after another
+  template <typename D>
+  void compute_chunked(const D& d, OpKernelContext* context,
+      const float* gradients_ptr, const float* in_data_ptr,
+      const float* in_filter_ptr, const int* ni_ptr, float* grad_data_ptr,
+      float* grad_filter_ptr) {
+    octree::set_zero(d, context, grad_filter_ptr, num_output_ * kernel_dim_);
+
+    if (sparse_) {
+      // the outputs of the empty nodes are constant, drop their gradients
+      OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                                  TensorShape({ num_output_, workspace_h_ }),
+                                  &gradients_nonempty_));
+      auto gradients_nonempty_ptr = gradients_nonempty_.flat<float>().data();
+      octree::copy_device_to_device(d, gradients_nonempty_ptr, gradients_ptr,
+          num_output_ * workspace_h_ * sizeof(float));
+      zero_empty_nodes(d, context, gradients_nonempty_ptr, num_output_,
+          workspace_h_, oct_batch_.node_num_nonempty(workspace_depth_),
+          oct_batch_.children(d, workspace_depth_));
+      gradients_ptr = gradients_nonempty_ptr;
+    }
+
+    // get workspace tensor
     workspace_ha_ = workspace_h_;
     workspace_n_ = 1;
-    workspace_depth_ = curr_depth_;
-    const int MAX_SIZE = octree::get_workspace_maxsize();
+    const int MAX_SIZE = octree::get_workspace_maxsize(d);
     int ideal_size = workspace_h_ * kernel_dim_;
     if (ideal_size > MAX_SIZE) {
       workspace_n_ = (ideal_size + MAX_SIZE - 1) / MAX_SIZE;
       workspace_ha_ = (workspace_h_ + workspace_n_ - 1) / workspace_n_;
     }
     const TensorShape workspace_shape({ kernel_dim_, workspace_ha_ });
-    OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, workspace_shape,
+    OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                                workspace_shape,
                                 &workspace_));
     auto workspace_ptr = workspace_.flat<float>().data();
 
     // get result_buffer tensor if needed
     if (workspace_n_ > 1) {
       const TensorShape result_shape({ num_output_, workspace_ha_ });
-      OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, result_shape,
+      OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                                  result_shape,
                                   &result_buffer_));
     }
     auto result_buffer_ptr = result_buffer_.flat<float>().data();
 
-    // init neighbor info
-    init_neigh_index(context, ni_);
-    auto ni_ptr = ni_.flat<int32>().data();
-
     /// get weight gradient
     for (int n = 0; n < workspace_n_; ++n) {
       const float* result_buffer = gradients_ptr;
-      octree::octree2col_gpu(context, workspace_ptr, in_data_ptr, channels_,
+      octree::octree2col(d, context, workspace_ptr, in_data_ptr, channels_,
           workspace_h_, kernel_size_, stride_,
-          oct_batch_.neighbor_gpu(workspace_depth_), ni_ptr, workspace_ha_, n);
+          oct_batch_.neighbor(d, workspace_depth_), ni_ptr, workspace_ha_, n);
       int num = std::min(workspace_ha_, workspace_h_ - n * workspace_ha_);
       if (workspace_n_ > 1) {
         for (int c = 0; c < num_output_; ++c) {
-          cudaMemcpy(result_buffer_ptr + c * workspace_ha_,
+          octree::copy_device_to_device(d,
+              result_buffer_ptr + c * workspace_ha_,
               gradients_ptr + c * workspace_h_ + n * workspace_ha_,
-              num * sizeof(float), cudaMemcpyDeviceToDevice);
+              num * sizeof(float));
         }
         result_buffer = result_buffer_ptr;
       }
       // C = alpha * A * B + beta * C
-      octree::tensorflow_gpu_gemm(context, false, true,
+      octree::gemm(d, context, false, true,
           static_cast<int64>(num_output_), static_cast<int64>(kernel_dim_),
           static_cast<int64>(workspace_ha_), static_cast<float>(1),
           result_buffer, workspace_ptr, static_cast<float>(1),
@@ -297,29 +428,30 @@ class OctreeConvGradOP : public OpKernel {
       if (workspace_n_ > 1) {
         int num = std::min(workspace_ha_, workspace_h_ - n * workspace_ha_);
         for (int c = 0; c < num_output_; ++c) {
-          cudaMemcpy(result_buffer_ptr + c * workspace_ha_,
-              gradients_ptr + c * workspace_h_ - n * workspace_ha_,
-              num * sizeof(float), cudaMemcpyDeviceToDevice);
+          octree::copy_device_to_device(d,
+              result_buffer_ptr + c * workspace_ha_,
+              gradients_ptr + c * workspace_h_ + n * workspace_ha_,
+              num * sizeof(float));
         }
         result_buffer = result_buffer_ptr;
       }
 
       // gemm
-      octree::tensorflow_gpu_gemm(context, true, false,
+      octree::gemm(d, context, true, false,
           static_cast<uint64>(kernel_dim_), static_cast<uint64>(workspace_ha_),
           static_cast<uint64>(num_output_), static_cast<float>(1),
           in_filter_ptr, result_buffer, static_cast<float>(0), workspace_ptr);
       // col2octree
-      octree::col2octree_gpu(context, workspace_ptr, grad_data_ptr, channels_,
+      octree::col2octree(d, context, workspace_ptr, grad_data_ptr, channels_,
           workspace_h_, kernel_size_, stride_,
-          oct_batch_.neighbor_gpu(workspace_depth_), ni_ptr, workspace_ha_, n);
+          oct_batch_.neighbor(d, workspace_depth_), ni_ptr, workspace_ha_, n);
     }
   }
 
- private:
   int kernel_size_;
   int kernel_dim_;
   int stride_;
+  bool sparse_;
 
   int channels_;
   int num_output_;
@@ -333,14 +465,35 @@ class OctreeConvGradOP : public OpKernel {
   int workspace_depth_;
   Tensor workspace_;
   Tensor result_buffer_;
+  Tensor gradients_nonempty_;
 
   Tensor ni_;
 };
 REGISTER_KERNEL_BUILDER(
-    Name("OctreeConvGrad").Device(DEVICE_GPU), OctreeConvGradOP);
-
+    Name("OctreeConvGrad").Device(DEVICE_CPU), OctreeConvGradOP<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("OctreeConvGrad").Device(DEVICE_GPU), OctreeConvGradOP<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+
+template <typename Device>
+void zero_empty_nodes(const Device& d, OpKernelContext* ctx, float* data,
+    int channel, int height, int nnum_nempty, const int* children) {
+  // the non-empty nodes are packed by pad_backward() and put back by
+  // pad_forward(), which writes zero to the empty ones
+  Tensor packed;
+  OP_REQUIRES_OK(ctx, allocate_scratch(d, ctx, DT_FLOAT,
+                          TensorShape({ channel, nnum_nempty }), &packed));
+  auto packed_ptr = packed.flat<float>().data();
+  octree::pad_backward(d, ctx, packed_ptr, nnum_nempty, channel, data, height,
+      children);
+  octree::pad_forward(d, ctx, data, height, channel, packed_ptr, nnum_nempty,
+      children);
+}
 
-void init_neigh_index(OpKernelContext* ctx, Tensor& ni) {
+template <typename Device>
+void init_neigh_index(const Device& d, OpKernelContext* ctx, Tensor& ni) {
   const TensorShape shape({ 216 });
   OP_REQUIRES_OK(ctx, ctx->allocate_temp(DT_INT32, shape, &ni));
   auto ni_ptr = ni.flat<int32>().data();
@@ -361,8 +514,8 @@ void init_neigh_index(OpKernelContext* ctx, Tensor& ni) {
       }
     }
   }
-  cudaMemcpy(ni_ptr, ni_temp.data(), ni.NumElements() * sizeof(int32),
-      cudaMemcpyHostToDevice);
+  octree::copy_host_to_device(d, ni_ptr, ni_temp.data(),
+      ni.NumElements() * sizeof(int32));
 }
 
 }  // namespace tensorflow
@@ -0,0 +1,221 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+
+#include "octree.h"
+#include "scratch_arena.h"
+
+namespace tensorflow {
+
+template <typename Device>
+void init_neigh_index(const Device& d, OpKernelContext* ctx, Tensor& ni);
+
+REGISTER_OP("OctreeConvReluPool")
+.Input("in_data: float")
+.Input("in_filter: float")
+.Input("in_octree: int32")
+.Attr("curr_depth: int")
+.Attr("num_output: int")
+.Output("out_data: float")
+.Output("out_mask: uint8")
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  int num_output;
+  TF_RETURN_IF_ERROR(c->GetAttr("num_output", &num_output));
+  c->set_output(0, c->MakeShape({ 1, num_output, c->UnknownDim(), 1 }));
+  c->set_output(1, c->MakeShape({ 1, num_output, c->UnknownDim(), 1 }));
+  return Status::OK();
+})
+.Doc(R"doc(
+Fused octree convolution of kernel size 3 and stride 1, relu and octree
+pooling, the same as OctreeConv, tf.nn.relu and OctreePooling in a row.
+out_mask holds the child slot 0-7 of the maximum after the relu in each group
+of siblings, the first one on ties.
+)doc");
+
+class OctreeConvReluPoolOp : public OpKernel {
+ public:
+  explicit OctreeConvReluPoolOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("curr_depth",
+                                             &this->curr_depth_));
+    OP_REQUIRES_OK(context, context->GetAttr("num_output",
+                                             &this->num_output_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const CPUDevice& d = context->eigen_device<CPUDevice>();
+
+    // in data
+    // data format: [1, channels, H, 1]
+    const Tensor& in_data = context->input(0);
+    const TensorShape& in_data_shape = in_data.shape();
+    auto in_data_ptr = in_data.flat<float>().data();
+    const int channels = in_data_shape.dim_size(1);
+    const int height = in_data_shape.dim_size(2);
+
+    // in filter
+    // filter format: [out_channels, in_channels, 27]
+    const Tensor& in_filter = context->input(1);
+    const TensorShape& in_filter_shape = in_filter.shape();
+    auto in_filter_ptr = in_filter.flat<float>().data();
+    CHECK_EQ(in_filter_shape.dim_size(0), num_output_);
+    CHECK_EQ(in_filter_shape.dim_size(1), channels);
+    CHECK_EQ(in_filter_shape.dim_size(2), 27);
+
+    // in octree
+    const Tensor& in_octree = context->input(2);
+    auto in_octree_ptr = in_octree.flat<int>().data();
+
+    // parse octree info
+    oct_batch_.set(d, in_octree_ptr);
+    CHECK_EQ(oct_batch_.node_num(curr_depth_), height);
+    const int top_h = oct_batch_.node_num(curr_depth_ - 1);
+
+    // init neighbor info
+    init_neigh_index(d, context, ni_);
+    auto ni_ptr = ni_.flat<int32>().data();
+
+    // out data
+    Tensor* data_output_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_data",
+                                TensorShape({ 1, num_output_, top_h, 1 }),
+                                &data_output_tensor));
+    auto data_output_ptr = data_output_tensor->flat<float>().data();
+
+    // out mask
+    Tensor* mask_output_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_mask",
+                                TensorShape({ 1, num_output_, height >> 3, 1 }),
+                                &mask_output_tensor));
+    auto mask_output_ptr = mask_output_tensor->flat<uint8>().data();
+
+    octree::octree_conv_relu_pool(d, context, data_output_ptr, top_h,
+        mask_output_ptr, in_data_ptr, in_filter_ptr, channels, num_output_,
+        height, oct_batch_.neighbor(d, curr_depth_), ni_ptr,
+        oct_batch_.children(d, curr_depth_ - 1));
+  }
+
+ private:
+  int curr_depth_;
+  int num_output_;
+  OctreeBatchParser oct_batch_;
+  Tensor ni_;
+};
+REGISTER_KERNEL_BUILDER(Name("OctreeConvReluPool").Device(DEVICE_CPU),
+                        OctreeConvReluPoolOp);
+
+
+REGISTER_OP("OctreeConvReluPoolGrad")
+.Input("gradients: float")
+.Input("in_data: float")
+.Input("in_filter: float")
+.Input("in_octree: int32")
+.Input("out_data: float")
+.Input("out_mask: uint8")
+.Attr("curr_depth: int")
+.Attr("num_output: int")
+.Output("grad_data: float")
+.Output("grad_filter: float")
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  c->set_output(0, c->input(1));
+  c->set_output(1, c->input(2));
+  return Status::OK();
+})
+.Doc(R"doc(
+Gradient for the fused octree convolution, relu and pooling operator.
+)doc");
+
+class OctreeConvReluPoolGradOp : public OpKernel {
+ public:
+  explicit OctreeConvReluPoolGradOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("curr_depth",
+                                             &this->curr_depth_));
+    OP_REQUIRES_OK(context, context->GetAttr("num_output",
+                                             &this->num_output_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const CPUDevice& d = context->eigen_device<CPUDevice>();
+
+    // in gradients
+    const Tensor& gradients = context->input(0);
+    auto gradients_ptr = gradients.flat<float>().data();
+    CHECK_EQ(gradients.dim_size(1), num_output_);
+
+    // in data
+    const Tensor& in_data = context->input(1);
+    auto in_data_ptr = in_data.flat<float>().data();
+    const TensorShape& in_data_shape = in_data.shape();
+    const int channels = in_data_shape.dim_size(1);
+    const int height = in_data_shape.dim_size(2);
+
+    // in filter
+    const Tensor& in_filter = context->input(2);
+    auto in_filter_ptr = in_filter.flat<float>().data();
+    const TensorShape& in_filter_shape = in_filter.shape();
+    CHECK_EQ(in_filter_shape.dim_size(0), num_output_);
+    CHECK_EQ(in_filter_shape.dim_size(1), channels);
+    CHECK_EQ(in_filter_shape.dim_size(2), 27);
+
+    // in octree
+    const Tensor& in_octree = context->input(3);
+    auto in_octree_ptr = in_octree.flat<int>().data();
+
+    // the outputs of the forward pass
+    const Tensor& out_data = context->input(4);
+    auto out_data_ptr = out_data.flat<float>().data();
+    const Tensor& out_mask = context->input(5);
+    auto out_mask_ptr = out_mask.flat<uint8>().data();
+    CHECK_EQ(out_mask.dim_size(2), height >> 3);
+
+    // parse octree info
+    oct_batch_.set(d, in_octree_ptr);
+    CHECK_EQ(oct_batch_.node_num(curr_depth_), height);
+    const int top_h = oct_batch_.node_num(curr_depth_ - 1);
+    CHECK_EQ(gradients.dim_size(2), top_h);
+
+    // out grad data
+    Tensor* grad_data_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("grad_data",
+                                in_data_shape, &grad_data_tensor));
+    auto grad_data_ptr = grad_data_tensor->flat<float>().data();
+
+    // out grad filter
+    Tensor* grad_filter_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("grad_filter",
+                                in_filter_shape, &grad_filter_tensor));
+    auto grad_filter_ptr = grad_filter_tensor->flat<float>().data();
+
+    // init neighbor info
+    init_neigh_index(d, context, ni_);
+    auto ni_ptr = ni_.flat<int32>().data();
+
+    // the gradient of the convolution output, non-zero at the maxima only
+    OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                                TensorShape({ num_output_, height }),
+                                &conv_diff_));
+    auto conv_diff_ptr = conv_diff_.flat<float>().data();
+    octree::relu_pool_backward(d, context, conv_diff_ptr, height,
+        out_mask_ptr, out_data_ptr, gradients_ptr, top_h, num_output_,
+        oct_batch_.children(d, curr_depth_ - 1));
+
+    octree::octree_conv_grad(d, context, grad_data_ptr, grad_filter_ptr,
+        conv_diff_ptr, in_data_ptr, in_filter_ptr, channels, num_output_,
+        height, oct_batch_.neighbor(d, curr_depth_), ni_ptr);
+  }
+
+ private:
+  int curr_depth_;
+  int num_output_;
+  OctreeBatchParser oct_batch_;
+  Tensor ni_;
+  Tensor conv_diff_;
+};
+REGISTER_KERNEL_BUILDER(Name("OctreeConvReluPoolGrad").Device(DEVICE_CPU),
+                        OctreeConvReluPoolGradOp);
+
+}  // namespace tensorflow
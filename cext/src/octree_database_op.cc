@@ -22,7 +22,8 @@ REGISTER_OP("OctreeDatabase")
   return Status::OK();
 })
 .Doc(R"doc(
-Decode octree batch info.
+Decode octree batch info. The octrees may be the compressed records of
+OctreeEncode.
 )doc");
 
 class OctreeDatabaseOp : public OpKernel {
@@ -39,37 +40,11 @@ class OctreeDatabaseOp : public OpKernel {
     // in data
     const Tensor& in_data = context->input(0);
 
-    // parse octree batch
+    // parse octree batch, written straight into the outputs
     OctreeBatch oct_batch;
     auto dc = OctreeBatch::CLASSIFICATION;
     if (segmentation_) dc = OctreeBatch::SEGMENTATION;
-    oct_batch.set_octreebatch(context, in_data, content_flags_, dc);
-
-    // out data
-    Tensor* data_output_tensor = nullptr;
-    TensorShape data_output_shape = oct_batch.data_.shape();
-    OP_REQUIRES_OK(context, context->allocate_output("out_data",
-                                data_output_shape, &data_output_tensor));
-    CHECK((*data_output_tensor).CopyFrom(oct_batch.data_, data_output_shape));
-
-    // out octree
-    Tensor* octree_output_tensor = nullptr;
-    TensorShape octree_output_shape = oct_batch.octree_.shape();
-    OP_REQUIRES_OK(context, context->allocate_output("out_octree",
-                                octree_output_shape, &octree_output_tensor));
-    CHECK((*octree_output_tensor).CopyFrom(oct_batch.octree_,
-                                           octree_output_shape));
-
-    // out label
-    Tensor* seglabel_output_tensor = nullptr;
-    TensorShape seglabel_output_shape = oct_batch.label_.shape();
-    OP_REQUIRES_OK(context, context->allocate_output("out_seglabel",
-                                seglabel_output_shape,
-                                &seglabel_output_tensor));
-    if (dc = OctreeBatch::SEGMENTATION) {
-      CHECK((*seglabel_output_tensor).CopyFrom(oct_batch.label_,
-                                               seglabel_output_shape));
-    }
+    oct_batch.set_octreebatch(context, in_data, content_flags_, dc, true);
   }
 
  private:
@@ -0,0 +1,133 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+
+#include <atomic>
+
+#include "octree.h"
+
+namespace tensorflow {
+
+REGISTER_OP("OctreeEncode")
+.Input("in_octree: string")
+.Input("in_points: float")
+.Output("out_record: string")
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  c->set_output(0, c->input(0));
+  return Status::OK();
+})
+.Doc(R"doc(
+Compress each serialized octree with the points of its shape
+[n_shape, 3 * n_point]. OctreeDatabase and OctreePack read the records like
+the octrees, and OctreeDecodePoints gets the points back. The signal and the
+points are quantized to 16 bits.
+)doc");
+
+class OctreeEncodeOp : public OpKernel {
+ public:
+  explicit OctreeEncodeOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    const CPUDevice& d = context->eigen_device<CPUDevice>();
+
+    // in octree
+    const Tensor& in_octree = context->input(0);
+    OP_REQUIRES(context, in_octree.dims() == 1,
+        errors::InvalidArgument("in_octree should be a vector"));
+    const int n_shape = in_octree.dim_size(0);
+    auto octree = in_octree.flat<string>();
+
+    // in points
+    const Tensor& in_points = context->input(1);
+    OP_REQUIRES(context, in_points.dims() == 2 &&
+        in_points.dim_size(0) == n_shape && in_points.dim_size(1) % 3 == 0,
+        errors::InvalidArgument("in_points should be [n_shape, 3 * n_point]"));
+    const int n_point = in_points.dim_size(1) / 3;
+    const float* points = in_points.flat<float>().data();
+
+    Tensor* out_record = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_record",
+                                in_octree.shape(), &out_record));
+    auto record = out_record->flat<string>();
+
+    std::atomic<int> failed(-1);
+    const double bytes = n_shape > 0 ? octree(0).size() : 0;
+    d.parallelFor(n_shape, Eigen::TensorOpCost(2 * bytes, bytes / 4,
+        16 * bytes),
+        [&](Eigen::Index begin, Eigen::Index end) {
+      for (Eigen::Index i = begin; i < end; ++i) {
+        if (!octree::encode_octree(&record(i), octree(i).data(),
+                                   points + 3 * n_point * i, n_point)) {
+          failed = i;
+        }
+      }
+    });
+    OP_REQUIRES(context, failed == -1, errors::InvalidArgument(
+        "octree ", failed.load(), " can not be compressed"));
+  }
+};
+REGISTER_KERNEL_BUILDER(Name("OctreeEncode").Device(DEVICE_CPU),
+                        OctreeEncodeOp);
+
+
+REGISTER_OP("OctreeDecodePoints")
+.Input("in_record: string")
+.Output("out_points: float")
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  c->set_output(0, c->MakeShape({ c->Dim(c->input(0), 0),
+                                   c->UnknownDim() }));
+  return Status::OK();
+})
+.Doc(R"doc(
+The points [n_shape, 3 * n_point] of the records of OctreeEncode, all the
+records hold the same number of points.
+)doc");
+
+class OctreeDecodePointsOp : public OpKernel {
+ public:
+  explicit OctreeDecodePointsOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    const CPUDevice& d = context->eigen_device<CPUDevice>();
+
+    // in record
+    const Tensor& in_record = context->input(0);
+    OP_REQUIRES(context, in_record.dims() == 1,
+        errors::InvalidArgument("in_record should be a vector"));
+    const int n_shape = in_record.dim_size(0);
+    auto record = in_record.flat<string>();
+    int n_point = 0;
+    for (int i = 0; i < n_shape; ++i) {
+      const int n = octree::compressed_point_num(record(i).data(),
+                                                 record(i).size());
+      OP_REQUIRES(context, n >= 0,
+          errors::DataLoss("a compressed octree record is malformed"));
+      if (i == 0) n_point = n;
+      OP_REQUIRES(context, n == n_point, errors::InvalidArgument(
+          "the records should hold the same number of points"));
+    }
+
+    Tensor* out_points = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_points",
+                                TensorShape({ n_shape, 3 * n_point }),
+                                &out_points));
+    float* points = out_points->flat<float>().data();
+    d.parallelFor(n_shape, Eigen::TensorOpCost(6.0 * n_point,
+        12.0 * n_point, 6.0 * n_point),
+        [&](Eigen::Index begin, Eigen::Index end) {
+      for (Eigen::Index i = begin; i < end; ++i) {
+        octree::decode_points(points + 3 * n_point * i, record(i).data(),
+                              record(i).size());
+      }
+    });
+  }
+};
+REGISTER_KERNEL_BUILDER(Name("OctreeDecodePoints").Device(DEVICE_CPU),
+                        OctreeDecodePointsOp);
+
+}  // namespace tensorflow
@@ -0,0 +1,84 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+
+#include "octree.h"
+
+namespace tensorflow {
+
+REGISTER_OP("OctreePack")
+.Input("in_octree: string")
+.Input("in_points: float")
+.Attr("content_flags: int = 7")
+.Output("out_record: string")
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  c->set_output(0, c->input(0));
+  return Status::OK();
+})
+.Doc(R"doc(
+Pack each octree and its points [n_shape, 3 * n_point] into one record of the
+packed dataset read by OctreePackedDatabase, with the batch header, the
+non-empty node numbers and the neighbors computed in advance.
+)doc");
+
+class OctreePackOp : public OpKernel {
+ public:
+  explicit OctreePackOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("content_flags",
+                                             &this->content_flags_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& in_octree = context->input(0);
+    const Tensor& in_points = context->input(1);
+    OP_REQUIRES(context, in_octree.dims() == 1,
+        errors::InvalidArgument("in_octree should be a vector"));
+    const int n_shape = in_octree.dim_size(0);
+    OP_REQUIRES(context, in_points.dims() == 2 &&
+        in_points.dim_size(0) == n_shape && in_points.dim_size(1) % 3 == 0,
+        errors::InvalidArgument("in_points should be [n_shape, 3 * n_point]"));
+    const int64 points_size = in_points.dim_size(1);
+    const float* points = in_points.flat<float>().data();
+
+    Tensor* out_record = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_record",
+                                in_octree.shape(), &out_record));
+    auto record = out_record->flat<string>();
+
+    for (int i = 0; i < n_shape; ++i) {
+      // a batch of this shape alone carries everything the reader needs
+      OctreeBatch oct_batch;
+      oct_batch.set_octreebatch(context, in_octree.Slice(i, i + 1),
+                                content_flags_);
+      if (!context->status().ok()) return;
+
+      const size_t octree_bytes = oct_batch.octree_.TotalBytes();
+      const size_t data_bytes = oct_batch.data_.TotalBytes();
+      const size_t points_bytes = points_size * sizeof(float);
+      const size_t align = OctreePackHeader::ALIGNMENT;
+      size_t bytes = octree_bytes + data_bytes + points_bytes;
+      bytes = (bytes + align - 1) / align * align;
+
+      // the padding is zero filled by resize()
+      string& rec = record(i);
+      rec.clear();
+      rec.resize(bytes);
+      char* ptr = &rec[0];
+      memcpy(ptr, oct_batch.octree_.flat<int>().data(), octree_bytes);
+      memcpy(ptr + octree_bytes, oct_batch.data_.flat<float>().data(),
+          data_bytes);
+      memcpy(ptr + octree_bytes + data_bytes, points + i * points_size,
+          points_bytes);
+    }
+  }
+
+ private:
+  int content_flags_;
+};
+REGISTER_KERNEL_BUILDER(Name("OctreePack").Device(DEVICE_CPU), OctreePackOp);
+
+}  // namespace tensorflow
@@ -0,0 +1,301 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/mutex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <random>
+
+#include "octree.h"
+
+namespace tensorflow {
+
+REGISTER_OP("OctreePackedDatabase")
+.Attr("filename: string")
+.Attr("batch_size: int")
+.Attr("shuffle: bool = true")
+.Attr("seed: int = 0")
+.Output("out_data: float")
+.Output("out_octree: int32")
+.Output("out_points: float")
+.SetIsStateful()
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  int batch_size;
+  TF_RETURN_IF_ERROR(c->GetAttr("batch_size", &batch_size));
+  c->set_output(0, c->MakeShape({ 1, 3, c->UnknownDim(), 1 }));
+  c->set_output(1, c->UnknownShapeOfRank(1));
+  c->set_output(2, c->MakeShape({ batch_size, c->UnknownDim() }));
+  return Status::OK();
+})
+.Doc(R"doc(
+Read the next batch of a packed octree dataset written by
+util/pack_dataset.py. The file is memory mapped and the batch is merged from
+the precomputed records, the outputs match the ones of OctreeDatabase plus the
+points of each shape [batch_size, 3 * n_point].
+)doc");
+
+class OctreePackedDatabaseOp : public OpKernel {
+ public:
+  explicit OctreePackedDatabaseOp(OpKernelConstruction* context)
+      : OpKernel(context), cursor_(0) {
+    string filename;
+    OP_REQUIRES_OK(context, context->GetAttr("filename", &filename));
+    OP_REQUIRES_OK(context, context->GetAttr("batch_size",
+                                             &this->batch_size_));
+    OP_REQUIRES_OK(context, context->GetAttr("shuffle", &this->shuffle_));
+    int seed;
+    OP_REQUIRES_OK(context, context->GetAttr("seed", &seed));
+    OP_REQUIRES(context, batch_size_ > 0,
+        errors::InvalidArgument("batch_size should be positive"));
+
+    // the records are paged in by the OS on first access
+    OP_REQUIRES_OK(context, Env::Default()->NewReadOnlyMemoryRegionFromFile(
+                                filename, &file_));
+    const char* base = static_cast<const char*>(file_->data());
+    const uint64 length = file_->length();
+    OP_REQUIRES(context, length >= sizeof(OctreePackHeader),
+        errors::DataLoss("truncated octree pack: ", filename));
+    header_ = reinterpret_cast<const OctreePackHeader*>(base);
+    OP_REQUIRES(context, strncmp(header_->magic, "OCTPACK", 8) == 0 &&
+        header_->version == OctreePackHeader::VERSION,
+        errors::DataLoss("not an octree pack of version ",
+                         OctreePackHeader::VERSION, ": ", filename));
+    OP_REQUIRES(context, header_->num_shape > 0,
+        errors::DataLoss("empty octree pack: ", filename));
+    const int depth = header_->depth;
+    OP_REQUIRES(context, depth > 0 && depth + 1 < 16 && header_->n_point >= 0,
+        errors::DataLoss("bad octree pack header: ", filename));
+
+    offset_ = reinterpret_cast<const int64*>(base + sizeof(OctreePackHeader));
+    const int num_shape = header_->num_shape;
+    const uint64 table_end = sizeof(OctreePackHeader) +
+        (num_shape + 1) * sizeof(int64);
+    OP_REQUIRES(context, table_end <= length &&
+        offset_[0] >= static_cast<int64>(table_end) &&
+        offset_[num_shape] <= static_cast<int64>(length),
+        errors::DataLoss("truncated octree pack: ", filename));
+    for (int i = 0; i < num_shape; ++i) {
+      OP_REQUIRES(context, offset_[i] % OctreePackHeader::ALIGNMENT == 0 &&
+          offset_[i] < offset_[i + 1],
+          errors::DataLoss("bad record offset ", i, " in ", filename));
+      OP_REQUIRES_OK(context, check_record(i, offset_[i + 1] - offset_[i]));
+    }
+
+    order_.resize(num_shape);
+    std::iota(order_.begin(), order_.end(), 0);
+    rng_.seed(seed);
+    if (shuffle_) std::shuffle(order_.begin(), order_.end(), rng_);
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const char* base = static_cast<const char*>(file_->data());
+    const int depth = header_->depth;
+    const int n_point = header_->n_point;
+
+    /// pick the records and parse their headers
+    std::vector<OctreeBatchParser> parsers(batch_size_);
+    std::vector<const float*> signals(batch_size_), points(batch_size_);
+    {
+      mutex_lock l(mu_);
+      for (int i = 0; i < batch_size_; ++i) {
+        if (cursor_ == header_->num_shape) {
+          // a new epoch
+          cursor_ = 0;
+          if (shuffle_) std::shuffle(order_.begin(), order_.end(), rng_);
+        }
+        const char* record = base + offset_[order_[cursor_++]];
+        parsers[i].set_cpu(static_cast<const void*>(record));
+      }
+    }
+    for (int i = 0; i < batch_size_; ++i) {
+      const OctreeInfo* info = parsers[i].octree_info();
+      const int* octree = reinterpret_cast<const int*>(info);
+      signals[i] = reinterpret_cast<const float*>(octree +
+          OctreeInfo::octree_sizeofint(info->total_nnum(),
+                                       info->content_flags_));
+      points[i] = signals[i] + 3 * info->nnum_[depth];
+    }
+
+    /// node numbers, the same prefix sums as OctreeBatch::set_octreebatch()
+    // cumulative node and non-empty node number in each layer
+    const int sz = (depth + 1) * (batch_size_ + 1);
+    std::vector<int> nnum_cum_layer(sz), nnum_cum_nempty_layer(sz);
+    for (int d = 0; d < depth + 1; ++d) {
+      nnum_cum_layer[d] = 0;
+      nnum_cum_nempty_layer[d] = 0;
+      for (int i = 0; i < batch_size_; ++i) {
+        const OctreeInfo* info = parsers[i].octree_info();
+        int p = i * (depth + 1) + d;
+        int q = p + depth + 1;
+        nnum_cum_layer[q] = info->nnum_[d] + nnum_cum_layer[p];
+        nnum_cum_nempty_layer[q] = info->nnum_nempty_[d] +
+                                   nnum_cum_nempty_layer[p];
+      }
+    }
+
+    // node number, non-empty node number and their cumulation of the batch
+    std::vector<int> nnum_batch(depth + 1), nnum_batch_nempty(depth + 1);
+    std::vector<int> nnum_batch_cum(depth + 2);
+    nnum_batch_cum[0] = 0;
+    for (int d = 0; d < depth + 1; ++d) {
+      int p = batch_size_ * (depth + 1) + d;
+      nnum_batch[d] = nnum_cum_layer[p];
+      nnum_batch_nempty[d] = nnum_cum_nempty_layer[p];
+      nnum_batch_cum[d + 1] = nnum_batch_cum[d] + nnum_batch[d];
+    }
+
+    /// init space
+    const int content_flags = OctreeInfo::batch_content_flags(
+        header_->content_flags, depth, batch_size_);
+    OctreeInfo oct_info;
+    oct_info.set(batch_size_, depth, header_->full_layer, nnum_batch.data(),
+        nnum_batch_cum.data(), nnum_batch_nempty.data(), content_flags);
+    const int total_nnum = nnum_batch_cum[depth + 1];
+    Tensor* out_octree = nullptr;
+    TensorShape octree_shape({ OctreeInfo::octree_sizeofint(total_nnum,
+                               content_flags) });
+    OP_REQUIRES_OK(context, context->allocate_output("out_octree",
+                                octree_shape, &out_octree));
+    OctreeBatchParser octbatch_parser;
+    octbatch_parser.set_cpu(out_octree->flat<int>().data(), &oct_info);
+
+    const int deepest_nnum = nnum_batch[depth];
+    Tensor* out_data = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_data",
+                                TensorShape({ 1, 3, deepest_nnum, 1 }),
+                                &out_data));
+    float* data_ptr = out_data->flat<float>().data();
+
+    Tensor* out_points = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_points",
+                                TensorShape({ batch_size_, 3 * n_point }),
+                                &out_points));
+    float* points_ptr = out_points->flat<float>().data();
+
+    /// set data, only offsets are added to the precomputed records
+    auto merge_shape = [&](int i) {
+      OctreeBatchParser& src = parsers[i];
+      for (int d = 0; d < depth + 1; ++d) {
+        const int p = i * (depth + 1) + d;
+        const int nnum = src.node_num(d);
+        if (oct_info.has_key()) {
+          const int key_dis = oct_info.has_key64() ? 2 : 1;
+          int* des = octbatch_parser.mutable_key_cpu(d) +
+                     key_dis * nnum_cum_layer[p];
+          octree::copy_batch_key(des, oct_info.has_key64(), src.key_cpu(d),
+              src.octree_info()->has_key64(), nnum, i);
+        }
+        if (oct_info.has_children()) {
+          int* des = octbatch_parser.mutable_children_cpu(d) +
+                     nnum_cum_layer[p];
+          const int* children = src.children_cpu(d);
+          const int dis = nnum_cum_nempty_layer[p];
+          for (int j = 0; j < nnum; ++j) {
+            des[j] = -1 == children[j] ? -1 : children[j] + dis;
+          }
+        }
+        if (oct_info.has_neigh()) {
+          const int n = nnum * OctreeInfo::AVG_NGH_NUM;
+          int* des = octbatch_parser.mutable_neighbor_cpu(d) +
+                     OctreeInfo::AVG_NGH_NUM * nnum_cum_layer[p];
+          if (d == 0) {
+            // the root has no neighbors, whatever the record holds
+            std::fill_n(des, n, -1);
+          } else {
+            const int* neigh = src.neighbor_cpu(d);
+            const int dis = nnum_cum_layer[p];
+            for (int j = 0; j < n; ++j) {
+              des[j] = -1 == neigh[j] ? -1 : neigh[j] + dis;
+            }
+          }
+        }
+      }
+
+      const int p = i * (depth + 1) + depth;
+      const int nnum = src.node_num(depth);
+      for (int c = 0; c < 3; ++c) {
+        memcpy(data_ptr + c * deepest_nnum + nnum_cum_layer[p],
+            signals[i] + c * nnum, nnum * sizeof(float));
+      }
+      memcpy(points_ptr + 3 * n_point * i, points[i],
+          3 * n_point * sizeof(float));
+    };
+
+    // one shape per shard, the copies are bounded by the memory bandwidth
+    const double nnum_per_shape = double(total_nnum) / batch_size_;
+    const int words_per_node = 2 + OctreeInfo::AVG_NGH_NUM;
+    context->eigen_device<CPUDevice>().parallelFor(batch_size_,
+        Eigen::TensorOpCost(4 * words_per_node * nnum_per_shape,
+                            4 * words_per_node * nnum_per_shape,
+                            words_per_node * nnum_per_shape),
+        [&](int64 begin, int64 end) {
+      for (int64 i = begin; i < end; ++i) merge_shape(i);
+    });
+  }
+
+ private:
+  // the record i must hold an octree of the pack layout with its signal and
+  // points, all inside its slot of size bytes
+  Status check_record(const int i, const int64 size) const {
+    const char* base = static_cast<const char*>(file_->data());
+    const int depth = header_->depth;
+    if (size < static_cast<int64>(sizeof(OctreeInfo))) {
+      return errors::DataLoss("truncated record ", i);
+    }
+    const OctreeInfo* info =
+        reinterpret_cast<const OctreeInfo*>(base + offset_[i]);
+    // the records of deep octrees carry 64-bit keys the header omits
+    if (info->depth_ != depth || (info->content_flags_ & ~OctreeInfo::KEY64) !=
+        (header_->content_flags & ~OctreeInfo::KEY64)) {
+      return errors::DataLoss("record ", i,
+                              " does not match the octree pack header");
+    }
+    if (info->nnum_cum_[0] != 0) {
+      return errors::DataLoss("bad node numbers in record ", i);
+    }
+    for (int d = 0; d < depth + 1; ++d) {
+      if (info->nnum_[d] < 0 || info->nnum_nempty_[d] < 0 ||
+          info->nnum_nempty_[d] > info->nnum_[d] ||
+          info->nnum_cum_[d + 1] !=
+          static_cast<int64>(info->nnum_cum_[d]) + info->nnum_[d] ||
+          info->nnum_cum_[d + 1] > size / static_cast<int64>(sizeof(int))) {
+        return errors::DataLoss("bad node numbers in record ", i);
+      }
+    }
+    // octree_sizeofint() in 64 bits, the header plus the ints of every node
+    const int flags = info->content_flags_;
+    const int64 node_ints = OctreeInfo::octree_sizeofint(1, flags) -
+                            OctreeInfo::octree_sizeofint(0, flags);
+    const int64 record_size = sizeof(int) * (
+        OctreeInfo::octree_sizeofint(0, flags) +
+        node_ints * info->total_nnum() +
+        3 * static_cast<int64>(info->nnum_[depth]) +
+        3 * static_cast<int64>(header_->n_point));
+    if (record_size > size) {
+      return errors::DataLoss("record ", i, " of ", record_size,
+                              " bytes overflows its slot of ", size, " bytes");
+    }
+    return Status::OK();
+  }
+
+  int batch_size_;
+  bool shuffle_;
+  std::unique_ptr<ReadOnlyMemoryRegion> file_;
+  const OctreePackHeader* header_;
+  const int64* offset_;
+
+  mutex mu_;
+  std::vector<int> order_ GUARDED_BY(mu_);
+  int cursor_ GUARDED_BY(mu_);
+  std::mt19937 rng_ GUARDED_BY(mu_);
+};
+REGISTER_KERNEL_BUILDER(Name("OctreePackedDatabase").Device(DEVICE_CPU),
+                        OctreePackedDatabaseOp);
+
+}  // namespace tensorflow
@@ -1,20 +1,31 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
-#include "cuda_runtime.h"
+
+#include <cstring>
 
 #include "octree.h"
+#include "scratch_arena.h"
 
 namespace tensorflow {
 
 namespace octree {
 
-void max_pooling_forward(OpKernelContext* ctx, float* top_data, int top_h,
-    int* bottom_mask, const float* bottom_data, int bottom_h, int nthreads);
-void max_pooling_backward(OpKernelContext* ctx, float* bottom_diff,
-    int bottom_h, const int* bottom_mask, const float* top_diff, int top_h,
-    int nthreads);
+void max_pooling_pad_forward(const CPUDevice& d, OpKernelContext* ctx,
+    float* top_data, int top_h, uint8* bottom_mask, const float* bottom_data,
+    int bottom_h, int channel, const int* children);
+void max_pooling_forward(const GPUDevice& d, OpKernelContext* ctx,
+    float* top_data, int top_h, uint8* bottom_mask, const float* bottom_data,
+    int bottom_h, int nthreads);
+void max_pooling_pad_backward(const CPUDevice& d, OpKernelContext* ctx,
+    float* bottom_diff, int bottom_h, const uint8* bottom_mask,
+    const float* top_diff, int top_h, int channel, const int* children);
+void max_pooling_backward(const GPUDevice& d, OpKernelContext* ctx,
+    float* bottom_diff, int bottom_h, const uint8* bottom_mask,
+    const float* top_diff, int top_h, int nthreads);
 
 } // namespace octree
 
@@ -23,7 +34,7 @@ REGISTER_OP("OctreePooling")
 .Input("in_octree: int32")
 .Attr("curr_depth: int")
 .Output("out_data: float")
-.Output("out_mask: int32")
+.Output("out_mask: uint8")
 .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
   ::tensorflow::shape_inference::ShapeHandle output_shape = c->input(0);
   TF_RETURN_IF_ERROR(
@@ -33,9 +44,11 @@ REGISTER_OP("OctreePooling")
   return Status::OK();
 })
 .Doc(R"doc(
-Octree pooling operator.
+Octree pooling operator. out_mask holds the child slot 0-7 of the maximum in
+each group of siblings.
 )doc");
 
+template <typename Device>
 class OctreePoolingOp : public OpKernel {
  public:
   explicit OctreePoolingOp(OpKernelConstruction* context) : OpKernel(context) {
@@ -44,6 +57,8 @@ class OctreePoolingOp : public OpKernel {
   }
 
   void Compute(OpKernelContext* context) override {
+    const Device& d = context->eigen_device<Device>();
+
     // in data
     const Tensor& in_data = context->input(0);
     const TensorShape& in_data_shape = in_data.shape();
@@ -54,16 +69,9 @@ class OctreePoolingOp : public OpKernel {
     auto in_octree_ptr = in_octree.flat<int>().data();
 
     // parse octree info
-    this->oct_batch_.set_gpu(in_octree_ptr);
+    this->oct_batch_.set(d, in_octree_ptr);
     CHECK_EQ(oct_batch_.node_num(curr_depth_), in_data_shape.dim_size(2));
 
-    // get top_buffer_ tensor
-    TensorShape top_buffer_shape = in_data_shape;
-    top_buffer_shape.set_dim(2, in_data_shape.dim_size(2) >> 3);
-    OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, top_buffer_shape,
-                                &top_buffer_));
-    auto top_buffer_ptr = top_buffer_.flat<float>().data();
-
     // out data
     Tensor* data_output_tensor = nullptr;
     TensorShape data_output_shape = in_data_shape;
@@ -78,35 +86,62 @@ class OctreePoolingOp : public OpKernel {
     mask_output_shape.set_dim(2, in_data_shape.dim_size(2) >> 3);
     OP_REQUIRES_OK(context, context->allocate_output("out_mask",
                                 mask_output_shape, &mask_output_tensor));
-    auto mask_output_ptr = mask_output_tensor->flat<int>().data();
+    auto mask_output_ptr = mask_output_tensor->flat<uint8>().data();
 
-    // fill in mask
-    int channel = in_data_shape.dim_size(1);
-    int bottom_h = in_data_shape.dim_size(2);
-    int top_h = bottom_h / 8;
-    int nthreads = top_h * channel;
-    octree::max_pooling_forward(context, top_buffer_ptr, top_h,
-        mask_output_ptr, in_data_ptr, bottom_h, nthreads);
-
-    octree::pad_forward_gpu(context, data_output_ptr,
-        data_output_shape.dim_size(2), data_output_shape.dim_size(1),
-        top_buffer_ptr, top_buffer_shape.dim_size(2),
-        oct_batch_.children_gpu(curr_depth_ - 1));
+    channel_ = in_data_shape.dim_size(1);
+    bottom_h_ = in_data_shape.dim_size(2);
+    top_h_ = data_output_shape.dim_size(2);
+    compute(d, context, data_output_ptr, mask_output_ptr, in_data_ptr);
   }
 
  private:
+  // the CPU pools the siblings straight into their parents
+  void compute(const CPUDevice& d, OpKernelContext* context,
+      float* data_output_ptr, uint8* mask_output_ptr,
+      const float* in_data_ptr) {
+    octree::max_pooling_pad_forward(d, context, data_output_ptr, top_h_,
+        mask_output_ptr, in_data_ptr, bottom_h_, channel_,
+        oct_batch_.children(d, curr_depth_ - 1));
+  }
+
+  template <typename D>
+  void compute(const D& d, OpKernelContext* context, float* data_output_ptr,
+      uint8* mask_output_ptr, const float* in_data_ptr) {
+    // get top_buffer_ tensor
+    int top_buffer_h = bottom_h_ / 8;
+    OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                                TensorShape({ 1, channel_, top_buffer_h, 1 }),
+                                &top_buffer_));
+    auto top_buffer_ptr = top_buffer_.flat<float>().data();
+
+    // fill in mask
+    int nthreads = top_buffer_h * channel_;
+    octree::max_pooling_forward(d, context, top_buffer_ptr, top_buffer_h,
+        mask_output_ptr, in_data_ptr, bottom_h_, nthreads);
+
+    octree::pad_forward(d, context, data_output_ptr, top_h_, channel_,
+        top_buffer_ptr, top_buffer_h, oct_batch_.children(d, curr_depth_ - 1));
+  }
+
+  int channel_;
+  int bottom_h_;
+  int top_h_;
   int curr_depth_;
   OctreeBatchParser oct_batch_;
   Tensor top_buffer_;
 };
 REGISTER_KERNEL_BUILDER(
-    Name("OctreePooling").Device(DEVICE_GPU), OctreePoolingOp);
+    Name("OctreePooling").Device(DEVICE_CPU), OctreePoolingOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("OctreePooling").Device(DEVICE_GPU), OctreePoolingOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("OctreePoolingGrad")
 .Input("gradients: float")
 .Input("in_data: float")
-.Input("in_mask: int32")
+.Input("in_mask: uint8")
 .Input("in_octree: int32")
 .Attr("curr_depth: int")
 .Output("grad_data: float")
@@ -118,6 +153,7 @@ REGISTER_OP("OctreePoolingGrad")
 Gradient for octree pooling operator.
 )doc");
 
+template <typename Device>
 class OctreePoolingGradOP : public OpKernel {
  public:
   explicit OctreePoolingGradOP(OpKernelConstruction* context)
@@ -127,6 +163,8 @@ class OctreePoolingGradOP : public OpKernel {
   }
 
   void Compute(OpKernelContext* context) override {
+    const Device& d = context->eigen_device<Device>();
+
     // in gradients
     const Tensor& gradients = context->input(0);
     const TensorShape& gradients_shape = gradients.shape();
@@ -139,7 +177,7 @@ class OctreePoolingGradOP : public OpKernel {
     // in mask
     const Tensor& in_mask = context->input(2);
     const TensorShape& in_mask_shape = in_mask.shape();
-    auto in_mask_ptr = in_mask.flat<int>().data();
+    auto in_mask_ptr = in_mask.flat<uint8>().data();
     CHECK_EQ(in_mask_shape.dim_size(2), in_data_shape.dim_size(2) >> 3);
 
     // in octree
@@ -154,37 +192,113 @@ class OctreePoolingGradOP : public OpKernel {
     auto grad_data_ptr = grad_data_tensor->flat<float>().data();
 
     // parse octree info
-    this->oct_batch_.set_gpu(in_octree_ptr);
+    this->oct_batch_.set(d, in_octree_ptr);
     CHECK_EQ(oct_batch_.node_num(curr_depth_), in_data_shape.dim_size(2));
 
+    channel_ = grad_data_shape.dim_size(1);
+    bottom_h_ = grad_data_shape.dim_size(2);
+    top_h_ = gradients_shape.dim_size(2);
+    compute(d, context, grad_data_ptr, in_mask_ptr, gradients_ptr);
+  }
+
+ private:
+  // the CPU scatters the gradients of the parents to their maxima
+  void compute(const CPUDevice& d, OpKernelContext* context,
+      float* grad_data_ptr, const uint8* in_mask_ptr,
+      const float* gradients_ptr) {
+    octree::max_pooling_pad_backward(d, context, grad_data_ptr, bottom_h_,
+        in_mask_ptr, gradients_ptr, top_h_, channel_,
+        oct_batch_.children(d, curr_depth_ - 1));
+  }
+
+  template <typename D>
+  void compute(const D& d, OpKernelContext* context, float* grad_data_ptr,
+      const uint8* in_mask_ptr, const float* gradients_ptr) {
     // get top_buffer_ tensor
-    TensorShape top_buffer_shape = in_data_shape;
-    top_buffer_shape.set_dim(2, in_data_shape.dim_size(2) >> 3);
-    OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, top_buffer_shape,
+    int top_buffer_h = bottom_h_ / 8;
+    OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                                TensorShape({ 1, channel_, top_buffer_h, 1 }),
                                 &top_buffer_));
     auto top_buffer_ptr = top_buffer_.flat<float>().data();
 
-    octree::pad_backward_gpu(context, top_buffer_ptr,
-        top_buffer_shape.dim_size(2), top_buffer_shape.dim_size(1),
-        gradients_ptr, gradients_shape.dim_size(2),
-        oct_batch_.children_gpu(curr_depth_ - 1));
-
-    int channel = grad_data_shape.dim_size(1);
-    int bottom_h = grad_data_shape.dim_size(2);
-    int top_h = bottom_h / 8;
-    octree::tensorflow_gpu_set_zero(context, grad_data_ptr,
-                                    grad_data_shape.num_elements());
-    int nthreads = top_h * channel;
-    octree::max_pooling_backward(context, grad_data_ptr, bottom_h, in_mask_ptr,
-      top_buffer_ptr, top_h, nthreads);
+    octree::pad_backward(d, context, top_buffer_ptr, top_buffer_h, channel_,
+        gradients_ptr, top_h_, oct_batch_.children(d, curr_depth_ - 1));
+
+    octree::set_zero(d, context, grad_data_ptr, channel_ * bottom_h_);
+    int nthreads = top_buffer_h * channel_;
+    octree::max_pooling_backward(d, context, grad_data_ptr, bottom_h_,
+        in_mask_ptr, top_buffer_ptr, top_buffer_h, nthreads);
   }
 
- private:
+  int channel_;
+  int bottom_h_;
+  int top_h_;
   int curr_depth_;
   OctreeBatchParser oct_batch_;
   Tensor top_buffer_;
 };
-REGISTER_KERNEL_BUILDER(
-    Name("OctreePoolingGrad").Device(DEVICE_GPU), OctreePoolingGradOP);
+REGISTER_KERNEL_BUILDER(Name("OctreePoolingGrad").Device(DEVICE_CPU),
+                        OctreePoolingGradOP<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(Name("OctreePoolingGrad").Device(DEVICE_GPU),
+                        OctreePoolingGradOP<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+
+namespace octree {
+
+void max_pooling_pad_forward(const CPUDevice& d, OpKernelContext* ctx,
+    float* top_data, int top_h, uint8* bottom_mask, const float* bottom_data,
+    int bottom_h, int channel, const int* children) {
+  // max_pooling_forward() and pad_forward() in one pass, the maximum of the
+  // children is written to their parent, the empty parents get zero
+  const int group_num = bottom_h / 8;
+  d.parallelFor(channel * top_h, Eigen::TensorOpCost(32, 5, 8),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index i = begin; i < end; ++i) {
+          int c = i / top_h;
+          int g = children[i % top_h];
+          if (g == -1) {
+            top_data[i] = float(0);
+            continue;
+          }
+          const float* bottom_tmp = bottom_data + c * bottom_h + 8 * g;
+          int max_idx = 0;
+          float max_val = bottom_tmp[0];
+          for (int idx = 1; idx < 8; ++idx) {
+            float value = bottom_tmp[idx];
+            if (value > max_val) {
+              max_idx = idx;
+              max_val = value;
+            }
+          }
+          top_data[i] = max_val;
+          bottom_mask[c * group_num + g] = static_cast<uint8>(max_idx);
+        }
+      });
+}
+
+void max_pooling_pad_backward(const CPUDevice& d, OpKernelContext* ctx,
+    float* bottom_diff, int bottom_h, const uint8* bottom_mask,
+    const float* top_diff, int top_h, int channel, const int* children) {
+  // each channel clears its row and scatters the gradients of the parents,
+  // the rows of the channels do not overlap
+  const int group_num = bottom_h / 8;
+  d.parallelFor(channel, Eigen::TensorOpCost(9.0 * top_h, 4.0 * bottom_h,
+      2.0 * top_h + bottom_h), [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index c = begin; c < end; ++c) {
+          float* diff = bottom_diff + c * bottom_h;
+          memset(diff, 0, bottom_h * sizeof(float));
+          for (int h = 0; h < top_h; ++h) {
+            int g = children[h];
+            if (g == -1) continue;
+            diff[8 * g + bottom_mask[c * group_num + g]] =
+                top_diff[c * top_h + h];
+          }
+        }
+      });
+}
+
+}  // namespace octree
 
 }  // namespace tensorflow
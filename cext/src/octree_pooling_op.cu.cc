@@ -14,7 +14,7 @@ typedef Eigen::GpuDevice GPUDevice;
 namespace octree {
 
 __global__ void max_pooling_forward_kernel(float* top_data, int top_h,
-    int* bottom_mask, const float* bottom_data, int bottom_h, int nthreads) {
+    uint8* bottom_mask, const float* bottom_data, int bottom_h, int nthreads) {
   CUDA_1D_KERNEL_LOOP(i, nthreads) {
     int h = i % top_h;
     int c = i / top_h;
@@ -31,31 +31,32 @@ __global__ void max_pooling_forward_kernel(float* top_data, int top_h,
       }
     }
     top_data[i] = max_val;
-    bottom_mask[i] = max_idx;
+    // the child slot of the maximum
+    bottom_mask[i] = static_cast<uint8>(max_idx - hb);
   }
 }
 
 __global__ void max_pooling_backward_kernel(float* bottom_diff, int bottom_h,
-    const int* bottom_mask, const float* top_diff, int top_h, int nthreads) {
+    const uint8* bottom_mask, const float* top_diff, int top_h, int nthreads) {
   CUDA_1D_KERNEL_LOOP(i, nthreads) {
+    int h = i % top_h;
     int c = i / top_h;
-    bottom_diff[c * bottom_h + bottom_mask[i]] = top_diff[i];
+    bottom_diff[c * bottom_h + 8 * h + bottom_mask[i]] = top_diff[i];
   }
 }
 
-void max_pooling_forward(OpKernelContext* ctx, float* top_data, int top_h,
-    int* bottom_mask, const float* bottom_data, int bottom_h, int nthreads) {
-  GPUDevice d = ctx->eigen_device<GPUDevice>();
+void max_pooling_forward(const GPUDevice& d, OpKernelContext* ctx,
+    float* top_data, int top_h, uint8* bottom_mask, const float* bottom_data,
+    int bottom_h, int nthreads) {
   CudaLaunchConfig config = GetCudaLaunchConfig(nthreads, d);
   max_pooling_forward_kernel
       <<<config.block_count, config.thread_per_block, 0, d.stream()>>>(
           top_data, top_h, bottom_mask, bottom_data, bottom_h, nthreads);
 }
 
-void max_pooling_backward(OpKernelContext* ctx, float* bottom_diff,
-    int bottom_h, const int* bottom_mask, const float* top_diff, int top_h,
-    int nthreads) {
-  GPUDevice d = ctx->eigen_device<GPUDevice>();
+void max_pooling_backward(const GPUDevice& d, OpKernelContext* ctx,
+    float* bottom_diff, int bottom_h, const uint8* bottom_mask,
+    const float* top_diff, int top_h, int nthreads) {
   CudaLaunchConfig config = GetCudaLaunchConfig(nthreads, d);
   max_pooling_backward_kernel
       <<<config.block_count, config.thread_per_block, 0, d.stream()>>>(
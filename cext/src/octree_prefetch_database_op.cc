@@ -0,0 +1,335 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+#include "tensorflow/core/example/example.pb.h"
+#include "tensorflow/core/lib/io/record_reader.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/mutex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <random>
+
+#include "octree.h"
+
+namespace tensorflow {
+
+void suffix_index_to_points(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_point, const float* in_points,
+    float* out_pos);
+
+REGISTER_OP("OctreePrefetchDatabase")
+.Attr("filenames: list(string)")
+.Attr("batch_size: int")
+.Attr("n_point: int = 5000")
+.Attr("shuffle: bool = true")
+.Attr("shuffle_buffer: int = 1000")
+.Attr("seed: int = 0")
+.Attr("prefetch: int = 8")
+.Attr("num_threads: int = 4")
+.Attr("content_flags: int = 7")
+.Output("out_data: float")
+.Output("out_octree: int32")
+.Output("out_node_position: float")
+.Output("out_stall: float")
+.SetIsStateful()
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  int batch_size, n_point;
+  TF_RETURN_IF_ERROR(c->GetAttr("batch_size", &batch_size));
+  TF_RETURN_IF_ERROR(c->GetAttr("n_point", &n_point));
+  c->set_output(0, c->MakeShape({ 1, 3, c->UnknownDim(), 1 }));
+  c->set_output(1, c->UnknownShapeOfRank(1));
+  c->set_output(2, c->MakeShape({ 4, batch_size * n_point }));
+  c->set_output(3, c->Scalar());
+  return Status::OK();
+})
+.Doc(R"doc(
+Read the batches of TFRecord octree datasets ahead of the steps. The records
+are tf.train.Examples with an 'octree' and, unless the octree is a compressed
+record of OctreeEncode, 'points' [3 * n_point]. num_threads workers read,
+decode, shuffle and merge up to prefetch batches in the background, the files
+are read over and over. The outputs match OctreeDatabase plus the points with
+their index in the batch like PrimitivePointsSuffixIndex. out_stall is the
+time in seconds the call waited for its batch, zero if the workers keep up.
+)doc");
+
+namespace {
+
+// the records of a list of TFRecord files, read over and over, and shuffled
+// through a buffer of buffer_size records if requested
+class RecordSource {
+ public:
+  RecordSource(const std::vector<string>& filenames, bool shuffle,
+      int buffer_size, int seed)
+      : filenames_(filenames), file_index_(0), shuffle_(shuffle),
+        buffer_size_(buffer_size), rng_(seed) {
+    if (shuffle_) std::shuffle(filenames_.begin(), filenames_.end(), rng_);
+  }
+
+  Status Next(string* record) {
+    if (!shuffle_) return Read(record);
+    while (buffer_.size() < buffer_size_) {
+      buffer_.emplace_back();
+      Status s = Read(&buffer_.back());
+      if (!s.ok()) {
+        buffer_.pop_back();
+        return s;
+      }
+    }
+    std::uniform_int_distribution<int> pick(0, buffer_.size() - 1);
+    std::swap(buffer_[pick(rng_)], buffer_.back());
+    record->swap(buffer_.back());
+    buffer_.pop_back();
+    return Status::OK();
+  }
+
+ private:
+  Status Read(string* record) {
+    // at most one pass over the files without a record
+    for (size_t empty = 0; empty <= filenames_.size(); ) {
+      if (!reader_) {
+        if (file_index_ == filenames_.size()) {
+          // a new epoch
+          file_index_ = 0;
+          if (shuffle_) {
+            std::shuffle(filenames_.begin(), filenames_.end(), rng_);
+          }
+        }
+        TF_RETURN_IF_ERROR(Env::Default()->NewRandomAccessFile(
+            filenames_[file_index_++], &file_));
+        reader_.reset(new io::SequentialRecordReader(file_.get()));
+      }
+      Status s = reader_->ReadRecord(record);
+      if (!errors::IsOutOfRange(s)) return s;
+      reader_.reset();
+      file_.reset();
+      ++empty;
+    }
+    return errors::DataLoss("no records in the octree datasets");
+  }
+
+  std::vector<string> filenames_;
+  size_t file_index_;
+  std::unique_ptr<RandomAccessFile> file_;
+  std::unique_ptr<io::SequentialRecordReader> reader_;
+
+  bool shuffle_;
+  size_t buffer_size_;
+  std::vector<string> buffer_;
+  std::mt19937 rng_;
+};
+
+}  // namespace
+
+class OctreePrefetchDatabaseOp : public OpKernel {
+ public:
+  explicit OctreePrefetchDatabaseOp(OpKernelConstruction* context)
+      : OpKernel(context), cancelled_(false), consume_ticket_(0),
+        produce_ticket_(0) {
+    std::vector<string> filenames;
+    OP_REQUIRES_OK(context, context->GetAttr("filenames", &filenames));
+    OP_REQUIRES_OK(context, context->GetAttr("batch_size",
+                                             &this->batch_size_));
+    OP_REQUIRES_OK(context, context->GetAttr("n_point", &this->n_point_));
+    bool shuffle;
+    OP_REQUIRES_OK(context, context->GetAttr("shuffle", &shuffle));
+    int shuffle_buffer, seed, num_threads;
+    OP_REQUIRES_OK(context, context->GetAttr("shuffle_buffer",
+                                             &shuffle_buffer));
+    OP_REQUIRES_OK(context, context->GetAttr("seed", &seed));
+    OP_REQUIRES_OK(context, context->GetAttr("prefetch", &this->prefetch_));
+    OP_REQUIRES_OK(context, context->GetAttr("num_threads", &num_threads));
+    OP_REQUIRES_OK(context, context->GetAttr("content_flags",
+                                             &this->content_flags_));
+    OP_REQUIRES(context, !filenames.empty(),
+        errors::InvalidArgument("filenames should not be empty"));
+    OP_REQUIRES(context, batch_size_ > 0 && n_point_ > 0,
+        errors::InvalidArgument("batch_size and n_point should be positive"));
+    OP_REQUIRES(context, shuffle_buffer > 0 && prefetch_ > 0 &&
+        num_threads > 0, errors::InvalidArgument(
+        "shuffle_buffer, prefetch and num_threads should be positive"));
+
+    source_.reset(new RecordSource(filenames, shuffle, shuffle_buffer, seed));
+    // slot i holds the batches of the tickets i, i + prefetch, ...: it is
+    // free for ticket t once its sequence is t, and full once it is t + 1
+    ring_.reset(new Slot[prefetch_]);
+    for (int i = 0; i < prefetch_; ++i) ring_[i].seq = i;
+
+    // the workers merge their batches on a thread pool of the same size
+    pool_.reset(new Eigen::ThreadPool(num_threads));
+    device_.reset(new CPUDevice(pool_.get(), num_threads));
+    for (int i = 0; i < num_threads; ++i) {
+      workers_.emplace_back(Env::Default()->StartThread(ThreadOptions(),
+          "octree_prefetch", [this]() { WorkerLoop(); }));
+    }
+  }
+
+  ~OctreePrefetchDatabaseOp() override {
+    {
+      mutex_lock l(ring_mu_);
+      cancelled_ = true;
+      if (ring_) {
+        for (int i = 0; i < prefetch_; ++i) ring_[i].cv.notify_all();
+      }
+    }
+    workers_.clear();
+  }
+
+  void Compute(OpKernelContext* context) override {
+    // the batches come out in the order their records were read, so they
+    // keep the order of the files when nothing is shuffled
+    const int64 ticket = consume_ticket_++;
+    Slot& slot = ring_[ticket % prefetch_];
+    const uint64 start = Env::Default()->NowMicros();
+    OP_REQUIRES(context, Wait(slot, ticket + 1),
+        errors::Cancelled("the octree reader is closed"));
+    const float stall = (Env::Default()->NowMicros() - start) * 1.0e-6f;
+
+    Batch batch = std::move(slot.batch);
+    slot.batch = Batch();
+    Advance(&slot, ticket + prefetch_);
+
+    OP_REQUIRES_OK(context, batch.status);
+    context->set_output(0, batch.data);
+    context->set_output(1, batch.octree);
+    context->set_output(2, batch.node_position);
+    Tensor* out_stall = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_stall",
+                                TensorShape({}), &out_stall));
+    out_stall->scalar<float>()() = stall;
+  }
+
+ private:
+  struct Batch {
+    Status status;
+    Tensor data;
+    Tensor octree;
+    Tensor node_position;
+  };
+
+  struct Slot {
+    int64 seq;               // guarded by ring_mu_
+    condition_variable cv;   // signalled when seq advances
+    Batch batch;
+  };
+
+  // blocks until the sequence of the slot is seq, false once the op is
+  // destroyed
+  bool Wait(Slot& slot, int64 seq) {
+    mutex_lock l(ring_mu_);
+    while (slot.seq != seq) {
+      if (cancelled_) return false;
+      slot.cv.wait(l);
+    }
+    return true;
+  }
+
+  // hands the slot over to the thread waiting for seq
+  void Advance(Slot* slot, int64 seq) {
+    mutex_lock l(ring_mu_);
+    slot->seq = seq;
+    slot->cv.notify_all();
+  }
+
+  void WorkerLoop() {
+    std::vector<string> records(batch_size_);
+    while (!cancelled_) {
+      // only reading the records is serialized, in the order of the tickets
+      int64 ticket;
+      Status status;
+      {
+        mutex_lock l(mu_);
+        ticket = produce_ticket_++;
+        for (int i = 0; i < batch_size_ && status.ok(); ++i) {
+          status = source_->Next(&records[i]);
+        }
+      }
+
+      Batch batch;
+      batch.status = status.ok() ? Assemble(records, &batch) : status;
+      Slot& slot = ring_[ticket % prefetch_];
+      if (!Wait(slot, ticket)) return;
+      slot.batch = std::move(batch);
+      Advance(&slot, ticket + 1);
+    }
+  }
+
+  Status Assemble(const std::vector<string>& records, Batch* batch) {
+    Tensor octrees(DT_STRING, TensorShape({ batch_size_ }));
+    Tensor points(DT_FLOAT, TensorShape({ batch_size_, 3 * n_point_ }));
+    auto octree = octrees.flat<string>();
+    float* points_ptr = points.flat<float>().data();
+    for (int i = 0; i < batch_size_; ++i) {
+      Example example;
+      if (!example.ParseFromString(records[i])) {
+        return errors::DataLoss("a record is not a tf.train.Example");
+      }
+      const auto& feature = example.features().feature();
+      auto it = feature.find("octree");
+      if (it == feature.end() || it->second.bytes_list().value_size() != 1) {
+        return errors::DataLoss("a record has no octree");
+      }
+      octree(i) = it->second.bytes_list().value(0);
+
+      // the points, unless the compressed octree carries them
+      float* pts = points_ptr + 3 * n_point_ * i;
+      it = feature.find("points");
+      if (it != feature.end()) {
+        const auto& value = it->second.float_list().value();
+        if (value.size() != 3 * n_point_) {
+          return errors::DataLoss("a record has ", value.size() / 3,
+                                  " points instead of ", n_point_);
+        }
+        memcpy(pts, value.data(), 3 * n_point_ * sizeof(float));
+      } else {
+        const string& record = octree(i);
+        if (octree::compressed_point_num(record.data(), record.size()) !=
+            n_point_ || !octree::decode_points(pts, record.data(),
+                                               record.size())) {
+          return errors::DataLoss("a record does not hold ", n_point_,
+                                  " points");
+        }
+      }
+    }
+
+    OctreeBatch octree_batch;
+    TF_RETURN_IF_ERROR(octree_batch.set_octreebatch(*device_, octrees,
+                                                    content_flags_));
+    batch->data = octree_batch.data_;
+    batch->octree = octree_batch.octree_;
+    batch->node_position = Tensor(DT_FLOAT,
+        TensorShape({ 4, batch_size_ * n_point_ }));
+    suffix_index_to_points(*device_, nullptr, batch_size_, n_point_,
+        points_ptr, batch->node_position.flat<float>().data());
+    return Status::OK();
+  }
+
+  int batch_size_;
+  int n_point_;
+  int prefetch_;
+  int content_flags_;
+
+  std::unique_ptr<Eigen::ThreadPool> pool_;
+  std::unique_ptr<CPUDevice> device_;
+  std::vector<std::unique_ptr<Thread>> workers_;
+  std::atomic<bool> cancelled_;
+
+  // the bounded ring of the prefetched batches: the producers and the
+  // consumers hand the slots over through their sequence numbers, and only
+  // hold ring_mu_ to update or wait for them
+  mutex ring_mu_;
+  std::unique_ptr<Slot[]> ring_;
+  std::atomic<int64> consume_ticket_;
+
+  mutex mu_;
+  std::unique_ptr<RecordSource> source_ GUARDED_BY(mu_);
+  int64 produce_ticket_ GUARDED_BY(mu_);
+};
+REGISTER_KERNEL_BUILDER(Name("OctreePrefetchDatabase").Device(DEVICE_CPU),
+                        OctreePrefetchDatabaseOp);
+
+}  // namespace tensorflow
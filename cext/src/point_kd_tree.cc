@@ -0,0 +1,126 @@
+#define EIGEN_USE_THREADS
+
+#include "point_kd_tree.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "primitive_util.h"
+
+namespace tensorflow {
+
+namespace primitive {
+
+Status PointKdTree::build(const Eigen::ThreadPoolDevice& d,
+    const float* in_pos, const int n_point, const int batch_size) {
+  std::vector<int> point_index;
+  TF_RETURN_IF_ERROR(group_points_by_batch(in_pos, n_point, batch_size,
+                                           &batch_begin_, &point_index));
+  nodes_.resize(n_point);
+  axis_.assign(n_point, 0);
+
+  const int avg_point = n_point / std::max(batch_size, 1);
+  const int depth = static_cast<int>(std::log2(avg_point + 1)) + 1;
+  d.parallelFor(batch_size,
+      Eigen::TensorOpCost(16 * avg_point, 16 * avg_point,
+                          20 * avg_point * depth),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index b = begin; b < end; ++b) {
+          float lower[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+          float upper[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+          for (int j = batch_begin_[b]; j < batch_begin_[b + 1]; ++j) {
+            int i = point_index[j];
+            Node& node = nodes_[j];
+            for (int a = 0; a < 3; ++a) {
+              node.p[a] = in_pos[a * n_point + i];
+              lower[a] = std::min(lower[a], node.p[a]);
+              upper[a] = std::max(upper[a], node.p[a]);
+            }
+            node.index = i;
+          }
+          build_range(batch_begin_[b], batch_begin_[b + 1], lower, upper);
+        }
+      });
+  return Status::OK();
+}
+
+void PointKdTree::build_range(const int begin, const int end,
+    const float* lower, const float* upper) {
+  if (end - begin <= kLeafSize) return;
+
+  // split the cell along the axis of its largest extent
+  int axis = 0;
+  for (int a = 1; a < 3; ++a) {
+    if (upper[a] - lower[a] > upper[axis] - lower[axis]) axis = a;
+  }
+
+  const int mid = begin + (end - begin) / 2;
+  std::nth_element(nodes_.begin() + begin, nodes_.begin() + mid,
+      nodes_.begin() + end, [axis](const Node& x, const Node& y) {
+        return x.p[axis] < y.p[axis];
+      });
+  axis_[mid] = static_cast<uint8_t>(axis);
+  float split_lower[3] = { lower[0], lower[1], lower[2] };
+  float split_upper[3] = { upper[0], upper[1], upper[2] };
+  split_lower[axis] = split_upper[axis] = nodes_[mid].p[axis];
+  build_range(begin, mid, lower, split_upper);
+  build_range(mid + 1, end, split_lower, upper);
+}
+
+int PointKdTree::nearest(const int batch_index, const float* p,
+    float* distance) const {
+  float min_distance = FLT_MAX;
+  int min_index = -1;
+  float offset[3] = { 0, 0, 0 };
+  search(batch_begin_[batch_index], batch_begin_[batch_index + 1], p, offset,
+      &min_distance, &min_index);
+  *distance = min_distance;
+  return min_index;
+}
+
+void PointKdTree::search(const int begin, const int end, const float* p,
+    float* offset, float* min_distance, int* min_index) const {
+  auto visit = [&](const Node& node) {
+    float dx = p[0] - node.p[0];
+    float dy = p[1] - node.p[1];
+    float dz = p[2] - node.p[2];
+    float distance = dx * dx + dy * dy + dz * dz;
+    if (distance < *min_distance ||
+        (distance == *min_distance && node.index < *min_index)) {
+      *min_distance = distance;
+      *min_index = node.index;
+    }
+  };
+  if (end - begin <= kLeafSize) {
+    for (int j = begin; j < end; ++j) visit(nodes_[j]);
+    return;
+  }
+
+  // the near side first, then the far side if its cell is not farther than
+  // the nearest point so far. The offset of each axis never exceeds the
+  // coordinate difference to a point of the cell, and it is squared and
+  // summed in the same order as the point distance, so the rounded cell
+  // distance never exceeds the rounded point distance either
+  const int mid = begin + (end - begin) / 2;
+  visit(nodes_[mid]);
+  const int axis = axis_[mid];
+  const float diff = p[axis] - nodes_[mid].p[axis];
+  const int near_begin = diff < 0 ? begin : mid + 1;
+  const int near_end = diff < 0 ? mid : end;
+  const int far_begin = diff < 0 ? mid + 1 : begin;
+  const int far_end = diff < 0 ? end : mid;
+  search(near_begin, near_end, p, offset, min_distance, min_index);
+  const float old_offset = offset[axis];
+  offset[axis] = std::abs(diff);
+  float cell_distance = offset[0] * offset[0] + offset[1] * offset[1] +
+      offset[2] * offset[2];
+  if (cell_distance <= *min_distance) {
+    search(far_begin, far_end, p, offset, min_distance, min_index);
+  }
+  offset[axis] = old_offset;
+}
+
+}  // namespace primitive
+
+}  // namespace tensorflow
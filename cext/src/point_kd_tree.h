@@ -0,0 +1,62 @@
+#ifndef TENSORFLOW_USER_OPS_POINT_KD_TREE_H_
+#define TENSORFLOW_USER_OPS_POINT_KD_TREE_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "tensorflow/core/framework/op_kernel.h"
+
+namespace tensorflow {
+
+namespace primitive {
+
+// A KD-tree over the points of each shape of a batch, for the nearest object
+// point queries of the consistency losses. The points of a shape are reordered
+// into an implicit balanced tree: the median of a range splits its cell along
+// the axis of the largest extent, the points before it are not above it on
+// that axis and the ones after it not below, and ranges of at most kLeafSize
+// points are scanned linearly. A query only enters a range if the squared
+// distance to its cell is not above the nearest distance found so far; both
+// are rounded the same way, so the result is exactly the one of a linear scan.
+class PointKdTree {
+ public:
+  // in_pos is [4, n_point], row 3 holds the batch index of each point; the
+  // shapes are built in parallel; fails on an invalid batch index
+  Status build(const Eigen::ThreadPoolDevice& d, const float* in_pos,
+      const int n_point, const int batch_size);
+
+  int num_points(const int batch_index) const {
+    return batch_begin_[batch_index + 1] - batch_begin_[batch_index];
+  }
+
+  // the index in in_pos of the nearest point of shape batch_index to p, and
+  // its squared distance; on ties the smallest index wins, the same as a
+  // linear scan of the points in their original order. -1 if the shape has
+  // no point
+  int nearest(const int batch_index, const float* p, float* distance) const;
+
+ private:
+  static const int kLeafSize = 16;
+
+  struct Node {
+    float p[3];
+    int index;  // the index of the point in in_pos
+  };
+
+  // lower and upper bound the cell of [begin, end)
+  void build_range(const int begin, const int end, const float* lower,
+      const float* upper);
+  // offset is the distance from p to the cell of [begin, end) on each axis
+  void search(const int begin, const int end, const float* p, float* offset,
+      float* min_distance, int* min_index) const;
+
+  std::vector<int> batch_begin_;  // the nodes of shape b, [batch_size + 1]
+  std::vector<Node> nodes_;
+  std::vector<uint8_t> axis_;     // the split axis of each median node
+};
+
+}  // namespace primitive
+
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_USER_OPS_POINT_KD_TREE_H_
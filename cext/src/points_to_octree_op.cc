@@ -0,0 +1,82 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+
+#include "octree.h"
+
+namespace tensorflow {
+
+REGISTER_OP("PointsToOctree")
+.Input("in_points: float")
+.Input("in_normals: float")
+.Attr("depth: int")
+.Attr("full_layer: int = 2")
+.Attr("radius: float = 0.5")
+.Output("out_octree: string")
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  c->set_output(0, c->MakeShape({ c->Dim(c->input(0), 0) }));
+  return Status::OK();
+})
+.Doc(R"doc(
+Build the octree of each shape from its points and normals
+[n_shape, 3 * n_point], laid out like the points feature, and serialize it
+for OctreeDatabase. The octree fits the cube of the given radius centered at
+the origin, or the bounding cube of the points if radius <= 0. Octrees
+deeper than 8 store 64-bit keys.
+)doc");
+
+class PointsToOctreeOp : public OpKernel {
+ public:
+  explicit PointsToOctreeOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("depth", &this->depth_));
+    OP_REQUIRES_OK(context, context->GetAttr("full_layer",
+                                             &this->full_layer_));
+    OP_REQUIRES_OK(context, context->GetAttr("radius", &this->radius_));
+    // the Morton codes of the leaves take 3 * depth <= 30 bits, the octrees
+    // deeper than OctreeParser::KEY32_MAX_DEPTH store 64-bit keys
+    OP_REQUIRES(context, depth_ > 0 && depth_ <= 10,
+        errors::InvalidArgument("depth should be in [1, 10]"));
+    OP_REQUIRES(context, full_layer_ > 0 && full_layer_ <= depth_,
+        errors::InvalidArgument("full_layer should be in [1, depth]"));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const CPUDevice& d = context->eigen_device<CPUDevice>();
+    const Tensor& in_points = context->input(0);
+    const Tensor& in_normals = context->input(1);
+    OP_REQUIRES(context, in_points.dims() == 2 &&
+        in_points.dim_size(1) % 3 == 0,
+        errors::InvalidArgument("in_points should be [n_shape, 3 * n_point]"));
+    OP_REQUIRES(context, in_normals.shape() == in_points.shape(),
+        errors::InvalidArgument("in_normals should be shaped as in_points"));
+    const int n_shape = in_points.dim_size(0);
+    const int n_point = in_points.dim_size(1) / 3;
+    const float* points = in_points.flat<float>().data();
+    const float* normals = in_normals.flat<float>().data();
+
+    Tensor* out_octree = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_octree",
+                                TensorShape({ n_shape }), &out_octree));
+    auto octree = out_octree->flat<string>();
+
+    // the shapes one by one, each of them sorts its points over the pool
+    for (int i = 0; i < n_shape; ++i) {
+      const int64 offset = static_cast<int64>(i) * 3 * n_point;
+      octree::points_to_octree(d, &octree(i), points + offset,
+          normals + offset, n_point, depth_, full_layer_, radius_);
+    }
+  }
+
+ private:
+  int depth_;
+  int full_layer_;
+  float radius_;
+};
+REGISTER_KERNEL_BUILDER(Name("PointsToOctree").Device(DEVICE_CPU),
+                        PointsToOctreeOp);
+
+}  // namespace tensorflow
@@ -1,17 +1,30 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+
 namespace tensorflow {
 
-void compute_aligning_loss(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float* in_q, const float* in_dir,
-    float* loss_ptr);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+void compute_aligning_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* in_q,
+    const float* in_dir, float* loss_ptr);
+void compute_aligning_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* in_q,
+    const float* in_dir, float* loss_ptr);
 
-void compute_aligning_loss_grad(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float* loss, const float* in_q,
-    const float* in_dir, float* grad_q);
+void compute_aligning_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* loss,
+    const float* in_q, const float* in_dir, float* grad_q);
+void compute_aligning_loss_grad(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* loss,
+    const float* in_q, const float* in_dir, float* grad_q);
 
 REGISTER_OP("PrimitiveAligningLoss")
 .Input("in_q: float")
@@ -27,6 +40,7 @@ direction according to the input quaternion. The input direction should be a
 unit direction.
 )doc");
 
+template <typename Device>
 class PrimitiveAligningLossOp : public OpKernel {
  public:
   explicit PrimitiveAligningLossOp(OpKernelConstruction* context)
@@ -52,16 +66,20 @@ class PrimitiveAligningLossOp : public OpKernel {
     auto out_loss_ptr = out_loss->flat<float>().data();
 
     // compute aligning loss
-    compute_aligning_loss(context, n_cube_, batch_size_, in_q_ptr,
-        in_dir_ptr, out_loss_ptr);
+    compute_aligning_loss(context->eigen_device<Device>(), context, n_cube_,
+        batch_size_, in_q_ptr, in_dir_ptr, out_loss_ptr);
   }
 
  private:
   int n_cube_;
   int batch_size_;
 };
+REGISTER_KERNEL_BUILDER(Name("PrimitiveAligningLoss").Device(DEVICE_CPU),
+    PrimitiveAligningLossOp<CPUDevice>);
+#if GOOGLE_CUDA
 REGISTER_KERNEL_BUILDER(Name("PrimitiveAligningLoss").Device(DEVICE_GPU),
-    PrimitiveAligningLossOp);
+    PrimitiveAligningLossOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 REGISTER_OP("PrimitiveAligningLossGrad")
 .Input("gradient: float")
@@ -76,6 +94,7 @@ REGISTER_OP("PrimitiveAligningLossGrad")
 Gradient for the primitive aligning loss;
 )doc");
 
+template <typename Device>
 class PrimitiveAligningLossGradOp : public OpKernel {
  public:
   explicit PrimitiveAligningLossGradOp(OpKernelConstruction* context)
@@ -105,15 +124,60 @@ class PrimitiveAligningLossGradOp : public OpKernel {
     auto grad_q_ptr = grad_q->flat<float>().data();
 
     // compute aligning loss gradient
-    compute_aligning_loss_grad(context, n_cube_, batch_size_, gradients_ptr,
-        in_q_ptr, in_dir_ptr, grad_q_ptr);
+    compute_aligning_loss_grad(context->eigen_device<Device>(), context,
+        n_cube_, batch_size_, gradients_ptr, in_q_ptr, in_dir_ptr, grad_q_ptr);
   }
 
  private:
   int n_cube_;
   int batch_size_;
 };
+REGISTER_KERNEL_BUILDER(Name("PrimitiveAligningLossGrad").Device(DEVICE_CPU),
+    PrimitiveAligningLossGradOp<CPUDevice>);
+#if GOOGLE_CUDA
 REGISTER_KERNEL_BUILDER(Name("PrimitiveAligningLossGrad").Device(DEVICE_GPU),
-    PrimitiveAligningLossGradOp);
+    PrimitiveAligningLossGradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+void compute_aligning_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* in_q,
+    const float* in_dir, float* loss_ptr) {
+  // check in_dir is normalized
+  float norm = in_dir[0] + in_dir[1] + in_dir[2];
+  CHECK(norm - 1.0f < 1e-6);
+
+  // get aligning loss
+  float loss = 0;
+  for (int i = 0; i < batch_size * n_cube; ++i) {
+    float px = in_dir[0], py = in_dir[1], pz = in_dir[2];
+    const float* q = in_q + i * 4;
+    float rotation_matrix[9];
+    primitive::as_rotation_matrix(q[0], q[1], q[2], q[3], rotation_matrix);
+    primitive::matvec(rotation_matrix, &px, &py, &pz);
+    float distance = 1 - (px * in_dir[0] + py * in_dir[1] + pz * in_dir[2]);
+    loss += distance / (batch_size * n_cube);
+  }
+  *loss_ptr = loss;
+}
+
+void compute_aligning_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* loss,
+    const float* in_q, const float* in_dir, float* grad_q) {
+  // gradient w.r.t. q
+  float grad_distance = (*loss) / (batch_size * n_cube);
+  for (int i = 0; i < batch_size * n_cube; ++i) {
+    const float* q = in_q + i * 4;
+    float grad_rotation_matrix[9];
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) {
+        grad_rotation_matrix[r * 3 + c] = -grad_distance * in_dir[r] *
+            in_dir[c];
+      }
+    }
+    float* gq = grad_q + i * 4;
+    primitive::grad_rotation_matrix_to_quaternion(grad_rotation_matrix, q[0],
+        q[1], q[2], q[3], gq + 0, gq + 1, gq + 2, gq + 3);
+  }
+}
 
 }  // namespace tensorflow
@@ -1,26 +1,50 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+#include "scratch_arena.h"
+
 namespace tensorflow {
 
-void compute_consistency_loss(OpKernelContext* context, const int n_cube,
-    const int n_point, const int batch_size, const float num_sample,
-    const float scale, const float* in_z, const float* in_q, const float* in_t,
-    const float* in_pos, float* loss_ptr);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
 
-void compute_consistency_loss_grad(OpKernelContext* context, const int n_cube,
-    const int n_point, const int batch_size, const float num_sample,
-    const float scale, const float* loss, const float* in_z, const float* in_q,
-    const float* in_t, const float* in_pos, float* grad_z, float* grad_q,
-    float* grad_t);
+void compute_consistency_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr);
+void compute_consistency_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr);
+
+void compute_consistency_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
+void compute_consistency_loss_grad(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
 
 REGISTER_OP("PrimitiveConsistencyLoss")
 .Input("in_z: float")
 .Input("in_q: float")
 .Input("in_t: float")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Attr("scale: float = 0.9")
 .Attr("num_sample: int = 26")
 .Output("out_loss: float")
@@ -33,6 +57,7 @@ Compute the distance of the point sampled on the cube with their nearest point
 in the point cloud.
 )doc");
 
+template <typename Device>
 class PrimitiveConsistencyLossOp : public OpKernel {
  public:
   explicit PrimitiveConsistencyLossOp(OpKernelConstruction* context)
@@ -66,6 +91,11 @@ class PrimitiveConsistencyLossOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(4),
+                                batch_size_ * n_cube_, &transforms));
+
     // out loss
     Tensor* out_loss = nullptr;
     TensorShape out_loss_shape({1});
@@ -76,9 +106,9 @@ class PrimitiveConsistencyLossOp : public OpKernel {
     CHECK(num_sample_ == 8 || num_sample_ == 26 || num_sample_ == 96);
 
     // compute consistency loss
-    compute_consistency_loss(context, n_cube_, n_point_, batch_size_,
-        num_sample_, scale_, in_z_ptr, in_q_ptr, in_t_ptr, in_pos_ptr,
-        out_loss_ptr);
+    compute_consistency_loss(context->eigen_device<Device>(), context, n_cube_,
+        n_point_, batch_size_, num_sample_, scale_, in_z_ptr, in_q_ptr,
+        in_t_ptr, transforms, in_pos_ptr, out_loss_ptr);
   }
 
  private:
@@ -88,8 +118,14 @@ class PrimitiveConsistencyLossOp : public OpKernel {
   int num_sample_;
   float scale_;  // scale of sampled points inside cube
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveConsistencyLoss").Device(DEVICE_GPU),
-    PrimitiveConsistencyLossOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveConsistencyLoss").Device(DEVICE_CPU),
+    PrimitiveConsistencyLossOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveConsistencyLoss").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveConsistencyLossOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("PrimitiveConsistencyLossGrad")
@@ -98,6 +134,7 @@ REGISTER_OP("PrimitiveConsistencyLossGrad")
 .Input("in_q: float")
 .Input("in_t: float")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Attr("scale: float")
 .Attr("num_sample: int")
 .Output("grad_z: float")
@@ -113,6 +150,7 @@ REGISTER_OP("PrimitiveConsistencyLossGrad")
 Gradient for the primitive consistency loss.
 )doc");
 
+template <typename Device>
 class PrimitiveConsistencyLossGradOp : public OpKernel {
  public:
   explicit PrimitiveConsistencyLossGradOp(OpKernelConstruction* context)
@@ -150,6 +188,11 @@ class PrimitiveConsistencyLossGradOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(5),
+                                batch_size_ * n_cube_, &transforms));
+
     CHECK(num_sample_ == 8 || num_sample_ == 26 || num_sample_ == 96);
 
     // grad_z
@@ -174,9 +217,10 @@ class PrimitiveConsistencyLossGradOp : public OpKernel {
     auto grad_t_ptr = grad_t->flat<float>().data();
 
     // compute consistency loss gradient
-    compute_consistency_loss_grad(context, n_cube_, n_point_, batch_size_,
-        num_sample_, scale_, gradients_ptr, in_z_ptr, in_q_ptr, in_t_ptr,
-        in_pos_ptr, grad_z_ptr, grad_q_ptr, grad_t_ptr);    
+    compute_consistency_loss_grad(context->eigen_device<Device>(), context,
+        n_cube_, n_point_, batch_size_, num_sample_, scale_, gradients_ptr,
+        in_z_ptr, in_q_ptr, in_t_ptr, transforms, in_pos_ptr, grad_z_ptr,
+        grad_q_ptr, grad_t_ptr);    
   }
 
  private:
@@ -186,7 +230,117 @@ class PrimitiveConsistencyLossGradOp : public OpKernel {
   int num_sample_;
   float scale_;  // scale of sampled points inside cube
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveConsistencyLossGrad").Device(DEVICE_GPU),
-    PrimitiveConsistencyLossGradOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveConsistencyLossGrad").Device(DEVICE_CPU),
+    PrimitiveConsistencyLossGradOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveConsistencyLossGrad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveConsistencyLossGradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+void compute_consistency_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr) {
+  // sample points on cube surface
+  std::vector<float> cube_surface_points;
+  OP_REQUIRES(context, primitive::cube_surface_samples(num_sample, scale,
+                           &cube_surface_points),
+              errors::InvalidArgument(
+                  "num_sample error in consistency loss layer"));
+  const int n_sample_point = cube_surface_points.size() / 3;
+
+  // get min distance and corresponding point index
+  Tensor sample_point_min_distance;
+  Tensor sample_point_min_distance_index;
+  const TensorShape sample_point_min_distance_shape({
+      n_cube * n_sample_point * batch_size});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              sample_point_min_distance_shape,
+                              &sample_point_min_distance));
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              sample_point_min_distance_shape,
+                              &sample_point_min_distance_index));
+  auto sample_point_min_distance_ptr =
+      sample_point_min_distance.flat<float>().data();
+  auto sample_point_min_distance_index_ptr =
+      sample_point_min_distance_index.flat<int>().data();
+  OP_REQUIRES_OK(context, primitive::sample_point_nearest_object_point(d,
+                              n_cube, n_point, batch_size, n_sample_point,
+                              cube_surface_points.data(), transforms, in_pos,
+                              sample_point_min_distance_ptr,
+                              sample_point_min_distance_index_ptr));
+
+  // get consistency loss
+  const int n_min_distance = n_cube * n_sample_point * batch_size;
+  float loss = 0;
+  for (int i = 0; i < n_min_distance; ++i) {
+    loss += sample_point_min_distance_ptr[i];
+  }
+  *loss_ptr = loss / n_min_distance;
+}
+
+void compute_consistency_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t) {
+  /// -- prepare forward medial data for gradient computation --
+  // sample points on cube surface
+  std::vector<float> cube_surface_points;
+  OP_REQUIRES(context, primitive::cube_surface_samples(num_sample, scale,
+                           &cube_surface_points),
+              errors::InvalidArgument(
+                  "num_sample error in consistency loss layer"));
+  const int n_sample_point = cube_surface_points.size() / 3;
+
+  // get min distance and corresponding point index
+  Tensor sample_point_min_distance;
+  Tensor sample_point_min_distance_index;
+  const TensorShape sample_point_min_distance_shape({
+      n_cube * n_sample_point * batch_size});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              sample_point_min_distance_shape,
+                              &sample_point_min_distance));
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              sample_point_min_distance_shape,
+                              &sample_point_min_distance_index));
+  auto sample_point_min_distance_ptr =
+      sample_point_min_distance.flat<float>().data();
+  auto sample_point_min_distance_index_ptr =
+      sample_point_min_distance_index.flat<int>().data();
+  OP_REQUIRES_OK(context, primitive::sample_point_nearest_object_point(d,
+                              n_cube, n_point, batch_size, n_sample_point,
+                              cube_surface_points.data(), transforms, in_pos,
+                              sample_point_min_distance_ptr,
+                              sample_point_min_distance_index_ptr));
+  /// ----------------------------------------------------------
+
+  // splash gradient to the nearest distance of each sample point
+  const int n_min_distance = n_cube * n_sample_point * batch_size;
+  Tensor grad_sample_point_min_distance;
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              sample_point_min_distance_shape,
+                              &grad_sample_point_min_distance));
+  auto gspmd_ptr = grad_sample_point_min_distance.flat<float>().data();
+  for (int i = 0; i < n_min_distance; ++i) {
+    gspmd_ptr[i] = (*loss) / n_min_distance;
+  }
+
+  // init zero gradient
+  memset(grad_z, 0, sizeof(float) * batch_size * n_cube * 3);
+  memset(grad_q, 0, sizeof(float) * batch_size * n_cube * 4);
+  memset(grad_t, 0, sizeof(float) * batch_size * n_cube * 3);
+
+  // gradient w.r.t. (z, q, t)
+  primitive::grad_sample_point_nearest_object_point(d, n_cube, n_point,
+      batch_size, n_sample_point, cube_surface_points.data(), transforms,
+      in_q, in_pos, sample_point_min_distance_index_ptr, gspmd_ptr, grad_z,
+      grad_q, grad_t);
+}
 
 }  // namespace tensorflow
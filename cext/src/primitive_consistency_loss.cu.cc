@@ -169,14 +169,15 @@ static __global__ void fill_sample_point_object_point_distance(
   }
 }
 
-static __global__ void fill_grad_sample_point_object_point_distance(
+// the gradient w.r.t. the sampled point to object point distance matrix has
+// one non-zero per reduced key, at its nearest object point, so only its value
+// is stored for each key
+static __global__ void fill_grad_sample_point_min_distance(
     const int nthreads, const int n_cube, const int n_sample_point,
     const int batch_size, const float* loss,
-    const int* sample_point_min_distance_index,
-    float* grad_sample_point_object_point_distance) {
+    float* grad_sample_point_min_distance) {
   CUDA_1D_KERNEL_LOOP(index, nthreads) {
-    grad_sample_point_object_point_distance[
-        sample_point_min_distance_index[index]] =
+    grad_sample_point_min_distance[index] =
         (*loss) / (n_cube * n_sample_point * batch_size);
   }
 }
@@ -184,13 +185,16 @@ static __global__ void fill_grad_sample_point_object_point_distance(
 static __global__ void fill_grad_wrt_zqt(const int nthreads, const int n_cube,
     const int n_sample_point, const int n_point, const float* in_z,
     const float* in_q, const float* in_t, const float* in_pos,
-    const float* in_sample_points,
-    const float* grad_sample_point_object_point_distance, float* grad_z,
+    const float* in_sample_points, const int* sample_point_min_distance_index,
+    const float* grad_sample_point_min_distance, float* grad_z,
     float* grad_q, float* grad_t) {
   CUDA_1D_KERNEL_LOOP(index, nthreads) {
-    int cube_index = index / (n_sample_point * n_point);
-    int sample_point_index = (index / n_point) % n_sample_point;
-    int point_index = index % n_point;
+    // the nearest object point of each sampled point, as the flat index of
+    // the [n_cube * n_sample_point, n_point] distance matrix
+    int element_index = sample_point_min_distance_index[index];
+    int cube_index = element_index / (n_sample_point * n_point);
+    int sample_point_index = (element_index / n_point) % n_sample_point;
+    int point_index = element_index % n_point;
     float px = in_pos[0 * n_point + point_index];
     float py = in_pos[1 * n_point + point_index];
     float pz = in_pos[2 * n_point + point_index];
@@ -217,9 +221,7 @@ static __global__ void fill_grad_wrt_zqt(const int nthreads, const int n_cube,
     float* gz = grad_z + (batch_index * n_cube + cube_index) * 3;
     float* gq = grad_q + (batch_index * n_cube + cube_index) * 4;
     float* gt = grad_t + (batch_index * n_cube + cube_index) * 3;
-    float grad_distance =
-        grad_sample_point_object_point_distance[(cube_index * n_sample_point +
-            sample_point_index) * n_point + point_index];
+    float grad_distance = grad_sample_point_min_distance[index];
     float gdx = grad_distance * 2 * dx;
     float gdy = grad_distance * 2 * dy;
     float gdz = grad_distance * 2 * dz;
@@ -281,12 +283,12 @@ static std::vector<float> cube_surface_points_host_96 {
 //   -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, -0.8, -0.4, 0.0, 0.4, 0.8, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0,
 // };
 
-void compute_consistency_loss(OpKernelContext* context, const int n_cube,
-    const int n_point, const int batch_size, const float num_sample,
-    const float scale, const float* in_z, const float* in_q, const float* in_t,
-    const float* in_pos, float* loss_ptr) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_consistency_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -406,13 +408,12 @@ void compute_consistency_loss(OpKernelContext* context, const int n_cube,
   cudaMemcpy(loss_ptr, &loss, sizeof(float), cudaMemcpyHostToDevice);
 }
 
-void compute_consistency_loss_grad(OpKernelContext* context, const int n_cube,
-    const int n_point, const int batch_size, const float num_sample,
-    const float scale, const float* loss, const float* in_z, const float* in_q,
-    const float* in_t, const float* in_pos, float* grad_z, float* grad_q,
-    float* grad_t) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_consistency_loss_grad(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float num_sample, const float scale, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -526,33 +527,33 @@ void compute_consistency_loss_grad(OpKernelContext* context, const int n_cube,
       n_cube * n_sample_point * batch_size);
   /// ----------------------------------------------------------
 
-  // splash gradient to sampled point to object point distance
-  Tensor grad_sample_point_object_point_distance;
-  const TensorShape gspopd_shape({n_cube * n_sample_point, n_point});
-  OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, gspopd_shape,
-                              &grad_sample_point_object_point_distance));
-  auto gspopd_ptr = grad_sample_point_object_point_distance.flat<float>().data();
-  primitive::gpu_set_zero(context, gspopd_ptr,
-      n_cube * n_sample_point * n_point);
+  // splash gradient to the nearest object point of each sampled point,
+  // [n_cube * n_sample_point * batch_size]
+  Tensor grad_sample_point_min_distance;
+  const TensorShape gspmd_shape({n_cube * n_sample_point * batch_size});
+  OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, gspmd_shape,
+                              &grad_sample_point_min_distance));
+  auto gspmd_ptr = grad_sample_point_min_distance.flat<float>().data();
   nthreads = n_cube * n_sample_point * batch_size;
   config = GetCudaLaunchConfig(nthreads, d);
-  fill_grad_sample_point_object_point_distance
+  fill_grad_sample_point_min_distance
       <<<config.block_count, config.thread_per_block, 0, d.stream()>>>(
           nthreads, n_cube, n_sample_point, batch_size, loss,
-          sample_point_min_distance_index_ptr, gspopd_ptr);
+          gspmd_ptr);
 
   // init zero gradient
   primitive::gpu_set_zero(context, grad_z, batch_size * n_cube * 3);
   primitive::gpu_set_zero(context, grad_q, batch_size * n_cube * 4);
   primitive::gpu_set_zero(context, grad_t, batch_size * n_cube * 3);
 
-  // gradient w.r.t. (z, q, t)
-  nthreads = n_cube * n_sample_point * n_point;
+  // gradient w.r.t. (z, q, t), one thread per sampled point and shape
+  nthreads = n_cube * n_sample_point * batch_size;
   config = GetCudaLaunchConfig(nthreads, d);
   fill_grad_wrt_zqt
       <<<config.block_count, config.thread_per_block, 0, d.stream()>>>(
           nthreads, n_cube, n_sample_point, n_point, in_z, in_q, in_t, in_pos,
-          cube_surface_points_ptr, gspopd_ptr, grad_z, grad_q, grad_t);
+          cube_surface_points_ptr, sample_point_min_distance_index_ptr,
+          gspmd_ptr, grad_z, grad_q, grad_t);
 }
 
 }  // namespace tensorflow
\ No newline at end of file
@@ -0,0 +1,450 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+
+#include "primitive_util.h"
+#include "scratch_arena.h"
+
+namespace tensorflow {
+
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+/// The coverage losses on the nearest cubes given by
+/// PrimitivePointCubeAssignment, in_index [n_point] holds the nearest cube of
+/// each point accumulated with the batch index. Only the distance of a point to
+/// its own cube is computed, so the forward and the backward are O(n_point).
+/// With split == false the loss is the mean distance of all the points, as
+/// PrimitiveCoverageLoss, otherwise it is the sum of the distances of each
+/// cube, as PrimitiveCoverageSplitLoss.
+void compute_coverage_assigned_loss(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const bool split, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* in_index, float* loss_ptr);
+void compute_coverage_assigned_loss(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const bool split, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* in_index, float* loss_ptr);
+
+void compute_coverage_assigned_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const bool split, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* in_index, float* grad_z, float* grad_q, float* grad_t);
+void compute_coverage_assigned_loss_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const bool split, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* in_index, float* grad_z, float* grad_q, float* grad_t);
+
+REGISTER_OP("PrimitiveCoverageAssignedLoss")
+.Input("in_z: float")
+.Input("in_q: float")
+.Input("in_t: float")
+.Input("in_pos: float")
+.Input("in_index: int32")
+.Input("in_transforms: float")
+.Output("out_loss: float")
+.SetShapeFn([](shape_inference::InferenceContext* c) {
+  c->set_output(0, c->MakeShape({1}));
+  return Status::OK();
+})
+.Doc(R"doc(
+PrimitiveCoverageLoss on the nearest cubes in_index of the points, the
+out_index of PrimitivePointCubeAssignment.
+)doc");
+
+REGISTER_OP("PrimitiveCoverageSplitAssignedLoss")
+.Input("in_z: float")
+.Input("in_q: float")
+.Input("in_t: float")
+.Input("in_pos: float")
+.Input("in_index: int32")
+.Input("in_transforms: float")
+.Output("out_loss: float")
+.SetShapeFn([](shape_inference::InferenceContext* c) {
+  c->set_output(0, c->MakeShape({c->Dim(c->input(0), 0), c->UnknownDim()}));
+  return Status::OK();
+})
+.Doc(R"doc(
+PrimitiveCoverageSplitLoss on the nearest cubes in_index of the points, the
+out_index of PrimitivePointCubeAssignment. The number of points of each cube is
+the out_count of PrimitivePointCubeAssignment.
+)doc");
+
+template <typename Device, bool split>
+class PrimitiveCoverageAssignedLossOp : public OpKernel {
+ public:
+  explicit PrimitiveCoverageAssignedLossOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    // in_z [bs, n_cube * 3]
+    const Tensor& in_z = context->input(0);
+    auto in_z_ptr = in_z.flat<float>().data();
+    batch_size_ = in_z.dim_size(0);
+    n_cube_ = in_z.dim_size(1) / 3;
+
+    // in_q [bs, n_cube * 4]
+    const Tensor& in_q = context->input(1);
+    auto in_q_ptr = in_q.flat<float>().data();
+    CHECK_EQ(in_q.dim_size(0), batch_size_);
+    CHECK_EQ(in_q.dim_size(1), n_cube_ * 4);
+
+    // in_t [bs, n_cube * 3]
+    const Tensor& in_t = context->input(2);
+    auto in_t_ptr = in_t.flat<float>().data();
+    CHECK_EQ(in_t.dim_size(0), batch_size_);
+    CHECK_EQ(in_t.dim_size(1), n_cube_ * 3);
+
+    // in_pos [4, n_point]
+    const Tensor& in_pos = context->input(3);
+    auto in_pos_ptr = in_pos.flat<float>().data();
+    CHECK_EQ(in_pos.dim_size(0), 4);
+    n_point_ = in_pos.dim_size(1);
+
+    // in_index [n_point]
+    const Tensor& in_index = context->input(4);
+    auto in_index_ptr = in_index.flat<int>().data();
+    OP_REQUIRES(context, in_index.NumElements() == n_point_,
+        errors::InvalidArgument("in_index should be [n_point]"));
+
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(5),
+                                batch_size_ * n_cube_, &transforms));
+
+    // out loss, [1] or [bs, n_cube]
+    Tensor* out_loss = nullptr;
+    TensorShape out_loss_shape = split ?
+        TensorShape({batch_size_, n_cube_}) : TensorShape({1});
+    OP_REQUIRES_OK(context, context->allocate_output("out_loss",
+                                out_loss_shape, &out_loss));
+    auto out_loss_ptr = out_loss->flat<float>().data();
+
+    compute_coverage_assigned_loss(context->eigen_device<Device>(), context,
+        n_cube_, n_point_, batch_size_, split, in_z_ptr, in_q_ptr, in_t_ptr,
+        transforms, in_pos_ptr, in_index_ptr, out_loss_ptr);
+  }
+
+ private:
+  int n_cube_;
+  int n_point_;
+  int batch_size_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageAssignedLoss").Device(DEVICE_CPU),
+    PrimitiveCoverageAssignedLossOp<CPUDevice, false>);
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSplitAssignedLoss").Device(DEVICE_CPU),
+    PrimitiveCoverageAssignedLossOp<CPUDevice, true>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageAssignedLoss").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageAssignedLossOp<GPUDevice, false>);
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSplitAssignedLoss").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageAssignedLossOp<GPUDevice, true>);
+#endif  // GOOGLE_CUDA
+
+
+REGISTER_OP("PrimitiveCoverageAssignedLossGrad")
+.Input("gradient: float")
+.Input("in_z: float")
+.Input("in_q: float")
+.Input("in_t: float")
+.Input("in_pos: float")
+.Input("in_index: int32")
+.Input("in_transforms: float")
+.Output("grad_z: float")
+.Output("grad_q: float")
+.Output("grad_t: float")
+.SetShapeFn([](shape_inference::InferenceContext* c) {
+  c->set_output(0, c->input(1));
+  c->set_output(1, c->input(2));
+  c->set_output(2, c->input(3));
+  return Status::OK();
+})
+.Doc(R"doc(
+Gradient for the assigned coverage loss.
+)doc");
+
+REGISTER_OP("PrimitiveCoverageSplitAssignedLossGrad")
+.Input("gradient: float")
+.Input("in_z: float")
+.Input("in_q: float")
+.Input("in_t: float")
+.Input("in_pos: float")
+.Input("in_index: int32")
+.Input("in_transforms: float")
+.Output("grad_z: float")
+.Output("grad_q: float")
+.Output("grad_t: float")
+.SetShapeFn([](shape_inference::InferenceContext* c) {
+  c->set_output(0, c->input(1));
+  c->set_output(1, c->input(2));
+  c->set_output(2, c->input(3));
+  return Status::OK();
+})
+.Doc(R"doc(
+Gradient for the assigned coverage split loss.
+)doc");
+
+template <typename Device, bool split>
+class PrimitiveCoverageAssignedLossGradOp : public OpKernel {
+ public:
+  explicit PrimitiveCoverageAssignedLossGradOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    // in gradients, [1] or [bs, n_cube]
+    const Tensor& gradients = context->input(0);
+    auto gradients_ptr = gradients.flat<float>().data();
+
+    // in_z [bs, n_cube * 3]
+    const Tensor& in_z = context->input(1);
+    auto in_z_ptr = in_z.flat<float>().data();
+    batch_size_ = in_z.dim_size(0);
+    n_cube_ = in_z.dim_size(1) / 3;
+    OP_REQUIRES(context, gradients.NumElements() ==
+        (split ? batch_size_ * n_cube_ : 1),
+        errors::InvalidArgument("gradient does not match the loss"));
+
+    // in_q [bs, n_cube * 4]
+    const Tensor& in_q = context->input(2);
+    auto in_q_ptr = in_q.flat<float>().data();
+    CHECK_EQ(in_q.dim_size(0), batch_size_);
+    CHECK_EQ(in_q.dim_size(1), n_cube_ * 4);
+
+    // in_t [bs, n_cube * 3]
+    const Tensor& in_t = context->input(3);
+    auto in_t_ptr = in_t.flat<float>().data();
+    CHECK_EQ(in_t.dim_size(0), batch_size_);
+    CHECK_EQ(in_t.dim_size(1), n_cube_ * 3);
+
+    // in_pos [4, n_point]
+    const Tensor& in_pos = context->input(4);
+    auto in_pos_ptr = in_pos.flat<float>().data();
+    CHECK_EQ(in_pos.dim_size(0), 4);
+    n_point_ = in_pos.dim_size(1);
+
+    // in_index [n_point]
+    const Tensor& in_index = context->input(5);
+    auto in_index_ptr = in_index.flat<int>().data();
+    OP_REQUIRES(context, in_index.NumElements() == n_point_,
+        errors::InvalidArgument("in_index should be [n_point]"));
+
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(6),
+                                batch_size_ * n_cube_, &transforms));
+
+    // grad_z
+    Tensor* grad_z = nullptr;
+    TensorShape grad_z_shape = in_z.shape();
+    OP_REQUIRES_OK(context, context->allocate_output("grad_z",
+                                grad_z_shape, &grad_z));
+    auto grad_z_ptr = grad_z->flat<float>().data();
+
+    // grad_q
+    Tensor* grad_q = nullptr;
+    TensorShape grad_q_shape = in_q.shape();
+    OP_REQUIRES_OK(context, context->allocate_output("grad_q",
+                                grad_q_shape, &grad_q));
+    auto grad_q_ptr = grad_q->flat<float>().data();
+
+    // grad_t
+    Tensor* grad_t = nullptr;
+    TensorShape grad_t_shape = in_t.shape();
+    OP_REQUIRES_OK(context, context->allocate_output("grad_t",
+                                grad_t_shape, &grad_t));
+    auto grad_t_ptr = grad_t->flat<float>().data();
+
+    compute_coverage_assigned_loss_grad(context->eigen_device<Device>(),
+        context, n_cube_, n_point_, batch_size_, split, gradients_ptr, in_z_ptr,
+        in_q_ptr, in_t_ptr, transforms, in_pos_ptr, in_index_ptr, grad_z_ptr,
+        grad_q_ptr, grad_t_ptr);
+  }
+
+ private:
+  int n_cube_;
+  int n_point_;
+  int batch_size_;
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageAssignedLossGrad").Device(DEVICE_CPU),
+    PrimitiveCoverageAssignedLossGradOp<CPUDevice, false>);
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSplitAssignedLossGrad").Device(DEVICE_CPU),
+    PrimitiveCoverageAssignedLossGradOp<CPUDevice, true>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageAssignedLossGrad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageAssignedLossGradOp<GPUDevice, false>);
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSplitAssignedLossGrad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageAssignedLossGradOp<GPUDevice, true>);
+#endif  // GOOGLE_CUDA
+
+static const int kAssignedPointBlock = 1024;
+
+// in_index comes from the graph, make sure it points to a cube of the shape of
+// each point before it is used as an offset
+static Status check_assigned_index(const int n_cube, const int n_point,
+    const float* in_pos, const int* in_index) {
+  for (int i = 0; i < n_point; ++i) {
+    const int batch_index = static_cast<int>(in_pos[3 * n_point + i]);
+    if (in_index[i] < batch_index * n_cube ||
+        in_index[i] >= (batch_index + 1) * n_cube) {
+      return errors::InvalidArgument("in_index[", i, "] = ", in_index[i],
+          " is not a cube of shape ", batch_index);
+    }
+  }
+  return Status::OK();
+}
+
+void compute_coverage_assigned_loss(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const bool split, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* in_index, float* loss_ptr) {
+  const int cube_num = batch_size * n_cube;
+  memset(loss_ptr, 0, sizeof(float) * (split ? cube_num : 1));
+  if (n_point == 0) return;
+  OP_REQUIRES_OK(context, check_assigned_index(n_cube, n_point, in_pos,
+                              in_index));
+
+  // sum the distances of the points up per cube, one slot per thread
+  const int slot_num = d.numThreads() + 1;
+  std::vector<double> loss_slots(static_cast<size_t>(slot_num) * cube_num, 0.0);
+  const int block_num = (n_point + kAssignedPointBlock - 1) /
+                        kAssignedPointBlock;
+  const int block_point = std::min(n_point, kAssignedPointBlock);
+  d.parallelFor(block_num, Eigen::TensorOpCost(20.0 * block_point, 0,
+      100.0 * block_point),
+      [&](Eigen::Index b0, Eigen::Index b1) {
+        double* slot = loss_slots.data() +
+            static_cast<size_t>(d.currentThreadId() + 1) * cube_num;
+        for (Eigen::Index b = b0; b < b1; ++b) {
+          const int end = std::min<int>((b + 1) * kAssignedPointBlock,
+                                        n_point);
+          for (int i = b * kAssignedPointBlock; i < end; ++i) {
+            float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                           in_pos[2 * n_point + i] };
+            const int k = in_index[i];
+            slot[k] += primitive::point_cube_distance(p, transforms, k);
+          }
+        }
+      });
+
+  double total = 0;
+  for (int k = 0; k < cube_num; ++k) {
+    double sum = 0;
+    for (int s = 0; s < slot_num; ++s) {
+      sum += loss_slots[static_cast<size_t>(s) * cube_num + k];
+    }
+    if (split) loss_ptr[k] = static_cast<float>(sum);
+    total += sum;
+  }
+  if (!split) *loss_ptr = static_cast<float>(total / n_point);
+}
+
+void compute_coverage_assigned_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const bool split, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* in_index, float* grad_z, float* grad_q, float* grad_t) {
+  // init zero gradient
+  const int cube_num = batch_size * n_cube;
+  memset(grad_z, 0, sizeof(float) * cube_num * 3);
+  memset(grad_q, 0, sizeof(float) * cube_num * 4);
+  memset(grad_t, 0, sizeof(float) * cube_num * 3);
+  if (n_point == 0) return;
+  OP_REQUIRES_OK(context, check_assigned_index(n_cube, n_point, in_pos,
+                              in_index));
+
+  // the gradient of the distance of a point to cube k
+  std::vector<float> grad_distance(cube_num);
+  for (int k = 0; k < cube_num; ++k) {
+    grad_distance[k] = split ? loss[k] : (*loss) / n_point;
+  }
+
+  // the gradients of all the cubes, one slot per thread, each slot holds
+  // grad_z, grad_q and grad_t one after another
+  const int slot_num = d.numThreads() + 1;
+  const int64 slot_size = static_cast<int64>(cube_num) * 10;
+  Tensor grad_slots;
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              TensorShape({ slot_num, slot_size }),
+                              &grad_slots));
+  float* grad_slots_ptr = grad_slots.flat<float>().data();
+  // a slot is only touched by the thread owning it
+  std::vector<char> slot_used(slot_num, 0);
+
+  const int block_num = (n_point + kAssignedPointBlock - 1) /
+                        kAssignedPointBlock;
+  const int block_point = std::min(n_point, kAssignedPointBlock);
+  d.parallelFor(block_num, Eigen::TensorOpCost(20.0 * block_point, 0,
+      300.0 * block_point),
+      [&](Eigen::Index b0, Eigen::Index b1) {
+        const int slot = d.currentThreadId() + 1;
+        float* slot_z = grad_slots_ptr + slot * slot_size;
+        float* slot_q = slot_z + cube_num * 3;
+        float* slot_t = slot_q + cube_num * 4;
+        if (!slot_used[slot]) {
+          memset(slot_z, 0, sizeof(float) * slot_size);
+          slot_used[slot] = 1;
+        }
+        for (Eigen::Index b = b0; b < b1; ++b) {
+          const int end = std::min<int>((b + 1) * kAssignedPointBlock,
+                                        n_point);
+          for (int i = b * kAssignedPointBlock; i < end; ++i) {
+            const int k = in_index[i];
+            if (grad_distance[k] == 0) continue;
+            float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                           in_pos[2 * n_point + i] };
+            primitive::grad_point_cube_distance(p, transforms, k,
+                in_q + k * 4, grad_distance[k], slot_z + k * 3,
+                slot_q + k * 4, slot_t + k * 3, nullptr);
+          }
+        }
+      });
+
+  // sum the slots up
+  d.parallelFor(slot_size, Eigen::TensorOpCost(4.0 * slot_num, 4,
+      slot_num),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index j = begin; j < end; ++j) {
+          float sum = 0;
+          for (int s = 0; s < slot_num; ++s) {
+            if (slot_used[s]) sum += grad_slots_ptr[s * slot_size + j];
+          }
+          if (j < cube_num * 3) {
+            grad_z[j] = sum;
+          } else if (j < cube_num * 7) {
+            grad_q[j - cube_num * 3] = sum;
+          } else {
+            grad_t[j - cube_num * 7] = sum;
+          }
+        }
+      });
+}
+
+}  // namespace tensorflow
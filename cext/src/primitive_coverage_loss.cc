@@ -1,24 +1,44 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+#include "scratch_arena.h"
+
 namespace tensorflow {
 
-void compute_coverage_loss(OpKernelContext* context, const int n_cube,
-    const int n_point, const float* in_z, const float* in_q, const float* in_t,
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+void compute_coverage_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, float* loss_ptr);
+void compute_coverage_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
     const float* in_pos, float* loss_ptr);
 
-void compute_coverage_loss_grad(OpKernelContext* context, const int n_cube,
-    const int n_point, const int batch_size, const float* loss,
-    const float* in_z, const float* in_q, const float* in_t,
-    const float* in_pos, float* grad_z, float* grad_q, float* grad_t);
+void compute_coverage_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
+void compute_coverage_loss_grad(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
 
 REGISTER_OP("PrimitiveCoverageLoss")
 .Input("in_z: float")
 .Input("in_q: float")
 .Input("in_t: float")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Output("out_loss: float")
 .SetShapeFn([](shape_inference::InferenceContext* c) {
   c->set_output(0, c->MakeShape({1}));
@@ -29,6 +49,7 @@ Compute the distance of every point that located outside all cubes with its
 nearest cube.
 )doc");
 
+template <typename Device>
 class PrimitiveCoverageLossOp : public OpKernel {
  public:
   explicit PrimitiveCoverageLossOp(OpKernelConstruction* context)
@@ -59,6 +80,11 @@ class PrimitiveCoverageLossOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(4),
+                                batch_size_ * n_cube_, &transforms));
+
     // out loss
     Tensor* out_loss = nullptr;
     TensorShape out_loss_shape({1});
@@ -67,8 +93,9 @@ class PrimitiveCoverageLossOp : public OpKernel {
     auto out_loss_ptr = out_loss->flat<float>().data();
 
     // compute coverage loss
-    compute_coverage_loss(context, n_cube_, n_point_, in_z_ptr, in_q_ptr,
-        in_t_ptr, in_pos_ptr, out_loss_ptr);
+    compute_coverage_loss(context->eigen_device<Device>(), context, n_cube_,
+        n_point_, in_z_ptr, in_q_ptr, in_t_ptr, transforms, in_pos_ptr,
+        out_loss_ptr);
   }
 
  private:
@@ -76,8 +103,14 @@ class PrimitiveCoverageLossOp : public OpKernel {
   int n_point_;  // the sum of batch size point clouds' points
   int batch_size_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageLoss").Device(DEVICE_GPU),
-    PrimitiveCoverageLossOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageLoss").Device(DEVICE_CPU),
+    PrimitiveCoverageLossOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageLoss").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageLossOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("PrimitiveCoverageLossGrad")
@@ -86,6 +119,7 @@ REGISTER_OP("PrimitiveCoverageLossGrad")
 .Input("in_q: float")
 .Input("in_t: float")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Output("grad_z: float")
 .Output("grad_q: float")
 .Output("grad_t: float")
@@ -99,6 +133,7 @@ REGISTER_OP("PrimitiveCoverageLossGrad")
 Gradient for the coverage loss.
 )doc");
 
+template <typename Device>
 class PrimitiveCoverageLossGradOp : public OpKernel {
  public:
   explicit PrimitiveCoverageLossGradOp(OpKernelConstruction* context)
@@ -133,6 +168,11 @@ class PrimitiveCoverageLossGradOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(5),
+                                batch_size_ * n_cube_, &transforms));
+
     // grad_z
     Tensor* grad_z = nullptr;
     TensorShape grad_z_shape = in_z.shape();
@@ -155,9 +195,9 @@ class PrimitiveCoverageLossGradOp : public OpKernel {
     auto grad_t_ptr = grad_t->flat<float>().data();
 
     // compute coverage loss gradient
-    compute_coverage_loss_grad(context, n_cube_, n_point_, batch_size_,
-        gradients_ptr, in_z_ptr, in_q_ptr, in_t_ptr, in_pos_ptr, grad_z_ptr,
-        grad_q_ptr, grad_t_ptr);
+    compute_coverage_loss_grad(context->eigen_device<Device>(), context,
+        n_cube_, n_point_, batch_size_, gradients_ptr, in_z_ptr, in_q_ptr,
+        in_t_ptr, transforms, in_pos_ptr, grad_z_ptr, grad_q_ptr, grad_t_ptr);
   }
 
  private:
@@ -165,7 +205,153 @@ class PrimitiveCoverageLossGradOp : public OpKernel {
   int n_point_;
   int batch_size_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageLossGrad").Device(DEVICE_GPU),
-    PrimitiveCoverageLossGradOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageLossGrad").Device(DEVICE_CPU),
+    PrimitiveCoverageLossGradOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageLossGrad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageLossGradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+// The CPU versions stream the points in blocks and keep the distances of a
+// point to its cubes in registers. Each thread reduces its blocks into its own
+// slot, the loss and the gradients of all the cubes, and the slots are summed
+// at the end, so the memory is O(n_cube * threads) instead of O(n_point *
+// n_cube) and millions of points fit.
+static const int kCoveragePointBlock = 1024;
+
+// the squared distance of point i to its nearest cube, the first one on ties
+static inline float nearest_cube_distance(const int n_cube, const int n_point,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int i, float* p, int* nearest_cube) {
+  p[0] = in_pos[0 * n_point + i];
+  p[1] = in_pos[1 * n_point + i];
+  p[2] = in_pos[2 * n_point + i];
+  const int first = static_cast<int>(in_pos[3 * n_point + i]) * n_cube;
+  float min_distance = primitive::point_cube_distance(p, transforms, first);
+  *nearest_cube = first;
+  for (int k = first + 1; k < first + n_cube; ++k) {
+    float distance = primitive::point_cube_distance(p, transforms, k);
+    if (distance < min_distance) {
+      min_distance = distance;
+      *nearest_cube = k;
+    }
+  }
+  return min_distance;
+}
+
+void compute_coverage_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, float* loss_ptr) {
+  *loss_ptr = 0;
+  if (n_point == 0 || n_cube == 0) return;
+
+  // sum the distance of every point to its nearest cube, one slot per thread
+  const int slot_num = d.numThreads() + 1;
+  std::vector<double> loss_slots(slot_num, 0.0);
+  const int block_num =
+      (n_point + kCoveragePointBlock - 1) / kCoveragePointBlock;
+  const int block_point = std::min(n_point, kCoveragePointBlock);
+  d.parallelFor(block_num, Eigen::TensorOpCost(16.0 * block_point,
+      0, 100.0 * n_cube * block_point),
+      [&](Eigen::Index b0, Eigen::Index b1) {
+        const int slot = d.currentThreadId() + 1;
+        double loss = 0;
+        float p[3];
+        int nearest_cube;
+        for (Eigen::Index b = b0; b < b1; ++b) {
+          const int end = std::min<int>((b + 1) * kCoveragePointBlock,
+                                        n_point);
+          for (int i = b * kCoveragePointBlock; i < end; ++i) {
+            loss += nearest_cube_distance(n_cube, n_point, transforms, in_pos,
+                i, p, &nearest_cube);
+          }
+        }
+        loss_slots[slot] += loss;
+      });
+
+  double loss = 0;
+  for (int s = 0; s < slot_num; ++s) loss += loss_slots[s];
+  *loss_ptr = static_cast<float>(loss / n_point);
+}
+
+void compute_coverage_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int batch_size,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t) {
+  // init zero gradient
+  const int cube_num = batch_size * n_cube;
+  memset(grad_z, 0, sizeof(float) * cube_num * 3);
+  memset(grad_q, 0, sizeof(float) * cube_num * 4);
+  memset(grad_t, 0, sizeof(float) * cube_num * 3);
+  if (n_point == 0 || n_cube == 0) return;
+  const float grad_distance = (*loss) / n_point;
+  if (grad_distance == 0) return;
+
+  // the gradients of all the cubes, one slot per thread, each slot holds
+  // grad_z, grad_q and grad_t one after another
+  const int slot_num = d.numThreads() + 1;
+  const int64 slot_size = static_cast<int64>(cube_num) * 10;
+  Tensor grad_slots;
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              TensorShape({ slot_num, slot_size }),
+                              &grad_slots));
+  float* grad_slots_ptr = grad_slots.flat<float>().data();
+  // a slot is only touched by the thread owning it
+  std::vector<char> slot_used(slot_num, 0);
+
+  // find the nearest cube of every point and splash the gradient of its
+  // distance to that cube right away
+  const int block_num =
+      (n_point + kCoveragePointBlock - 1) / kCoveragePointBlock;
+  const int block_point = std::min(n_point, kCoveragePointBlock);
+  d.parallelFor(block_num, Eigen::TensorOpCost(16.0 * block_point,
+      0, (100.0 * n_cube + 200.0) * block_point),
+      [&](Eigen::Index b0, Eigen::Index b1) {
+        const int slot = d.currentThreadId() + 1;
+        float* slot_z = grad_slots_ptr + slot * slot_size;
+        float* slot_q = slot_z + cube_num * 3;
+        float* slot_t = slot_q + cube_num * 4;
+        if (!slot_used[slot]) {
+          memset(slot_z, 0, sizeof(float) * slot_size);
+          slot_used[slot] = 1;
+        }
+        float p[3];
+        int k;
+        for (Eigen::Index b = b0; b < b1; ++b) {
+          const int end = std::min<int>((b + 1) * kCoveragePointBlock,
+                                        n_point);
+          for (int i = b * kCoveragePointBlock; i < end; ++i) {
+            nearest_cube_distance(n_cube, n_point, transforms, in_pos, i, p,
+                &k);
+            primitive::grad_point_cube_distance(p, transforms, k,
+                in_q + k * 4, grad_distance, slot_z + k * 3, slot_q + k * 4,
+                slot_t + k * 3, nullptr);
+          }
+        }
+      });
+
+  // sum the slots up
+  d.parallelFor(slot_size, Eigen::TensorOpCost(4.0 * slot_num, 4,
+      slot_num),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index j = begin; j < end; ++j) {
+          float sum = 0;
+          for (int s = 0; s < slot_num; ++s) {
+            if (slot_used[s]) sum += grad_slots_ptr[s * slot_size + j];
+          }
+          if (j < cube_num * 3) {
+            grad_z[j] = sum;
+          } else if (j < cube_num * 7) {
+            grad_q[j - cube_num * 3] = sum;
+          } else {
+            grad_t[j - cube_num * 7] = sum;
+          }
+        }
+      });
+}
 
 }  // namespace tensorflow
@@ -1,19 +1,39 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+#include "scratch_arena.h"
+
 namespace tensorflow {
 
-void compute_coverage_select_loss(OpKernelContext* context, const int n_cube,
-    const int n_point, const float* in_z, const float* in_q, const float* in_t,
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+void compute_coverage_select_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const int* in_mask, const float* in_pos, float* loss_ptr);
+void compute_coverage_select_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
     const int* in_mask, const float* in_pos, float* loss_ptr);
 
-void compute_coverage_select_loss_grad(OpKernelContext* context,
-    const int n_cube, const int n_point, const int batch_size,
-    const float* loss, const float* in_z, const float* in_q, const float* in_t,
-    const int* in_mask, const float* in_pos, float* grad_z, float* grad_q,
-    float* grad_t);
+void compute_coverage_select_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const float* loss, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const int* in_mask,
+    const float* in_pos, float* grad_z, float* grad_q, float* grad_t);
+void compute_coverage_select_loss_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const float* loss, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const int* in_mask,
+    const float* in_pos, float* grad_z, float* grad_q, float* grad_t);
 
 REGISTER_OP("PrimitiveCoverageSelectLoss")
 .Input("in_z: float")
@@ -21,6 +41,7 @@ REGISTER_OP("PrimitiveCoverageSelectLoss")
 .Input("in_t: float")
 .Input("in_mask: int32")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Output("out_loss: float")
 .SetShapeFn([](shape_inference::InferenceContext* c) {
   c->set_output(0, c->MakeShape({1}));
@@ -31,6 +52,7 @@ Compute the distance of every point that located outside all selected
 cubes (mask as 1) with its nearest selected cube.
 )doc");
 
+template <typename Device>
 class PrimitiveCoverageSelectLossOp : public OpKernel {
  public:
   explicit PrimitiveCoverageSelectLossOp(OpKernelConstruction* context)
@@ -67,6 +89,11 @@ class PrimitiveCoverageSelectLossOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(5),
+                                batch_size_ * n_cube_, &transforms));
+
     // out loss
     Tensor* out_loss = nullptr;
     TensorShape out_loss_shape({1});
@@ -75,8 +102,9 @@ class PrimitiveCoverageSelectLossOp : public OpKernel {
     auto out_loss_ptr = out_loss->flat<float>().data();
 
     // compute coverage loss
-    compute_coverage_select_loss(context, n_cube_, n_point_, in_z_ptr, in_q_ptr,
-        in_t_ptr, in_mask_ptr, in_pos_ptr, out_loss_ptr);
+    compute_coverage_select_loss(context->eigen_device<Device>(), context,
+        n_cube_, n_point_, in_z_ptr, in_q_ptr, in_t_ptr, transforms,
+        in_mask_ptr, in_pos_ptr, out_loss_ptr);
   }
 
  private:
@@ -84,8 +112,14 @@ class PrimitiveCoverageSelectLossOp : public OpKernel {
   int n_point_;  // the sum of batch size point clouds' points
   int batch_size_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageSelectLoss").Device(DEVICE_GPU),
-    PrimitiveCoverageSelectLossOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageSelectLoss").Device(DEVICE_CPU),
+    PrimitiveCoverageSelectLossOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSelectLoss").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageSelectLossOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("PrimitiveCoverageSelectLossGrad")
@@ -95,6 +129,7 @@ REGISTER_OP("PrimitiveCoverageSelectLossGrad")
 .Input("in_t: float")
 .Input("in_mask: int32")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Output("grad_z: float")
 .Output("grad_q: float")
 .Output("grad_t: float")
@@ -108,6 +143,7 @@ REGISTER_OP("PrimitiveCoverageSelectLossGrad")
 Gradient for coverage loss.
 )doc");
 
+template <typename Device>
 class PrimitiveCoverageSelectLossGradOp : public OpKernel {
  public:
   explicit PrimitiveCoverageSelectLossGradOp(OpKernelConstruction* context)
@@ -148,6 +184,11 @@ class PrimitiveCoverageSelectLossGradOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(6),
+                                batch_size_ * n_cube_, &transforms));
+
     // grad_z
     Tensor* grad_z = nullptr;
     TensorShape grad_z_shape = in_z.shape();
@@ -170,9 +211,10 @@ class PrimitiveCoverageSelectLossGradOp : public OpKernel {
     auto grad_t_ptr = grad_t->flat<float>().data();
 
     // compute coverage loss gradient
-    compute_coverage_select_loss_grad(context, n_cube_, n_point_, batch_size_,
-        gradients_ptr, in_z_ptr, in_q_ptr, in_t_ptr, in_mask_ptr, in_pos_ptr,
-        grad_z_ptr, grad_q_ptr, grad_t_ptr);
+    compute_coverage_select_loss_grad(context->eigen_device<Device>(), context,
+        n_cube_, n_point_, batch_size_, gradients_ptr, in_z_ptr, in_q_ptr,
+        in_t_ptr, transforms, in_mask_ptr, in_pos_ptr, grad_z_ptr, grad_q_ptr,
+        grad_t_ptr);
   }
 
  private:
@@ -180,7 +222,133 @@ class PrimitiveCoverageSelectLossGradOp : public OpKernel {
   int n_point_;
   int batch_size_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageSelectLossGrad").Device(DEVICE_GPU),
-    PrimitiveCoverageSelectLossGradOp);
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSelectLossGrad").Device(DEVICE_CPU),
+    PrimitiveCoverageSelectLossGradOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSelectLossGrad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageSelectLossGradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+static void get_min_distance_cube_index_cpu(const CPUDevice& d,
+    const int n_cube, const int n_point,
+    const primitive::CubeTransforms& transforms, const int* in_mask,
+    const float* in_pos, float* min_distance, int* min_distance_cube_index) {
+  // get the nearest cube of each point and its distance, the cubes with
+  // mask != 1 are never selected
+  d.parallelFor(n_point,
+      Eigen::TensorOpCost(16 + 8 * n_cube, 8, 100 * n_cube),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index i = begin; i < end; ++i) {
+          float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                         in_pos[2 * n_point + i] };
+          int batch_index = static_cast<int>(in_pos[3 * n_point + i]);
+          float min_dis = 0;
+          int min_idx = 0;
+          for (int j = 0; j < n_cube; ++j) {
+            int k = batch_index * n_cube + j;
+            float distance = FLT_MAX;
+            if (in_mask[k] == 1) {
+              distance = primitive::point_cube_distance(p, transforms, k);
+            }
+            if (j == 0 || distance < min_dis) {
+              min_dis = distance;
+              min_idx = j;
+            }
+          }
+          min_distance[i] = min_dis;
+          min_distance_cube_index[i] = min_idx;
+        }
+      });
+}
+
+void compute_coverage_select_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const int* in_mask, const float* in_pos, float* loss_ptr) {
+  // distance from each point to its nearest cube, [n_point]
+  Tensor min_distance;
+  const TensorShape min_distance_shape({n_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              min_distance_shape, &min_distance));
+  auto min_distance_ptr = min_distance.flat<float>().data();
+
+  // get min distance cube index
+  Tensor min_distance_cube_index;
+  const TensorShape min_distance_cube_index_shape({n_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              min_distance_cube_index_shape,
+                              &min_distance_cube_index));
+  auto min_distance_cube_index_ptr = min_distance_cube_index.flat<int>().data();
+  get_min_distance_cube_index_cpu(d, n_cube, n_point, transforms, in_mask,
+      in_pos, min_distance_ptr, min_distance_cube_index_ptr);
+
+  // get coverage loss
+  float loss = 0;
+  for (int i = 0; i < n_point; ++i) {
+    loss += min_distance_ptr[i] / n_point;
+  }
+  *loss_ptr = loss;
+}
+
+void compute_coverage_select_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const float* loss, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const int* in_mask,
+    const float* in_pos, float* grad_z, float* grad_q, float* grad_t) {
+  /// -- prepare forward medial data for gradient computation --
+  // distance from each point to its nearest cube, [n_point]
+  Tensor min_distance;
+  const TensorShape min_distance_shape({n_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              min_distance_shape, &min_distance));
+  auto min_distance_ptr = min_distance.flat<float>().data();
+
+  // get min distance cube index
+  Tensor min_distance_cube_index;
+  const TensorShape min_distance_cube_index_shape({n_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              min_distance_cube_index_shape,
+                              &min_distance_cube_index));
+  auto min_distance_cube_index_ptr = min_distance_cube_index.flat<int>().data();
+  get_min_distance_cube_index_cpu(d, n_cube, n_point, transforms, in_mask,
+      in_pos, min_distance_ptr, min_distance_cube_index_ptr);
+  /// ----------------------------------------------------------
+
+  // the gradient splashed to the nearest cube of each point
+  const float grad_distance = (*loss) / n_point;
+
+  // init zero gradient
+  memset(grad_z, 0, sizeof(float) * batch_size * n_cube * 3);
+  memset(grad_q, 0, sizeof(float) * batch_size * n_cube * 4);
+  memset(grad_t, 0, sizeof(float) * batch_size * n_cube * 3);
+  if (grad_distance == 0) return;
+
+  // gradient w.r.t. (z, q, t), each cube only visits the points it is the
+  // nearest cube of, so the shards never write to the same cube
+  std::vector<int> cube_begin, point_index;
+  OP_REQUIRES_OK(context, primitive::group_points_by_cube(in_pos, n_point,
+                              batch_size, n_cube, min_distance_cube_index_ptr,
+                              &cube_begin, &point_index));
+  const int avg_point = n_point / std::max(batch_size * n_cube, 1);
+  d.parallelFor(batch_size * n_cube,
+      Eigen::TensorOpCost(8 * avg_point, 40, 80 * avg_point),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index k = begin; k < end; ++k) {
+          if (in_mask[k] != 1) continue;
+          for (int j = cube_begin[k]; j < cube_begin[k + 1]; ++j) {
+            int i = point_index[j];
+            float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                           in_pos[2 * n_point + i] };
+            primitive::grad_point_cube_distance(p, transforms, k,
+                in_q + k * 4, grad_distance, grad_z + k * 3, grad_q + k * 4,
+                grad_t + k * 3, nullptr);
+          }
+        }
+      });
+}
 
 }  // namespace tensorflow
@@ -211,23 +211,23 @@ static __global__ void get_coverage_loss(const int nthreads, const int n_cube,
   }
 }
 
-static __global__ void fill_grad_point_cube_distance(const int nthreads,
-    const int n_cube, const int n_point, const float* loss,
-    const int* min_distance_cube_index, float* grad_point_cube_distance) {
+// the gradient w.r.t. the point to cube distance matrix has one non-zero per
+// row, at the nearest cube, so only its value is stored for each point
+static __global__ void fill_grad_point_distance(const int nthreads,
+    const int n_point, const float* loss, float* grad_point_distance) {
   CUDA_1D_KERNEL_LOOP(index, nthreads) {
-    grad_point_cube_distance[index * n_cube + min_distance_cube_index[index]] =
-        (*loss) / n_point;
+    grad_point_distance[index] = (*loss) / n_point;
   }
 }
 
 static __global__ void fill_grad_wrt_zqt(const int nthreads, const int n_cube,
     const int n_point, const float* in_z, const float* in_q, const float* in_t,
     const int* in_mask, const float* in_pos,
-    const float* grad_point_cube_distance, float* grad_z,
-    float* grad_q, float* grad_t) {
+    const int* min_distance_cube_index, const float* grad_point_distance,
+    float* grad_z, float* grad_q, float* grad_t) {
   CUDA_1D_KERNEL_LOOP(index, nthreads) {
-    int point_index = index / n_cube;
-    int cube_index = index % n_cube;
+    int point_index = index;
+    int cube_index = min_distance_cube_index[point_index];
     int batch_index = static_cast<int>(in_pos[3 * n_point + point_index]);
     int cube_mask = in_mask[batch_index * n_cube + cube_index];
     if (cube_mask == 1) {
@@ -252,8 +252,7 @@ static __global__ void fill_grad_wrt_zqt(const int nthreads, const int n_cube,
       float* gz = grad_z + (batch_index * n_cube + cube_index) * 3;
       float* gq = grad_q + (batch_index * n_cube + cube_index) * 4;
       float* gt = grad_t + (batch_index * n_cube + cube_index) * 3;
-      float grad_distance = grad_point_cube_distance[point_index * n_cube +
-          cube_index];
+      float grad_distance = grad_point_distance[point_index];
       float gdx = grad_distance * 2 * dx;
       float gdy = grad_distance * 2 * dy;
       float gdz = grad_distance * 2 * dz;
@@ -311,11 +310,10 @@ static __global__ void fill_grad_wrt_zqt(const int nthreads, const int n_cube,
   }
 }
 
-void compute_coverage_select_loss(OpKernelContext* context, const int n_cube,
-    const int n_point, const float* in_z, const float* in_q, const float* in_t,
+void compute_coverage_select_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
     const int* in_mask, const float* in_pos, float* loss_ptr) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
   CudaLaunchConfig config;
   int nthreads;
 
@@ -357,13 +355,12 @@ void compute_coverage_select_loss(OpKernelContext* context, const int n_cube,
           min_distance_cube_index_ptr, loss_ptr);
 }
 
-void compute_coverage_select_loss_grad(OpKernelContext* context,
-    const int n_cube, const int n_point, const int batch_size,
-    const float* loss, const float* in_z, const float* in_q, const float* in_t,
-    const int* in_mask, const float* in_pos, float* grad_z, float* grad_q,
-    float* grad_t) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_coverage_select_loss_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const float* loss, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const int* in_mask,
+    const float* in_pos, float* grad_z, float* grad_q, float* grad_t) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -397,32 +394,30 @@ void compute_coverage_select_loss_grad(OpKernelContext* context,
           min_distance_cube_index_ptr);
   /// ----------------------------------------------------------
 
-  // splash gradient to point cube distance
-  Tensor grad_point_cube_distance;
-  const TensorShape gpcd_shape({n_point, n_cube});
-  OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, gpcd_shape,
-                              &grad_point_cube_distance));
-  auto gpcd_ptr = grad_point_cube_distance.flat<float>().data();
-  primitive::gpu_set_zero(context, gpcd_ptr, n_point * n_cube);
+  // splash gradient to the nearest cube of each point, [n_point]
+  Tensor grad_point_distance;
+  const TensorShape gpd_shape({n_point});
+  OP_REQUIRES_OK(context, context->allocate_temp(DT_FLOAT, gpd_shape,
+                              &grad_point_distance));
+  auto gpd_ptr = grad_point_distance.flat<float>().data();
   nthreads = n_point;
   config = GetCudaLaunchConfig(nthreads, d);
-  fill_grad_point_cube_distance
+  fill_grad_point_distance
       <<<config.block_count, config.thread_per_block, 0, d.stream()>>>(
-          nthreads, n_cube, n_point, loss, min_distance_cube_index_ptr,
-          gpcd_ptr);
+          nthreads, n_point, loss, gpd_ptr);
 
   // init zero gradient
   primitive::gpu_set_zero(context, grad_z, batch_size * n_cube * 3);
   primitive::gpu_set_zero(context, grad_q, batch_size * n_cube * 4);
   primitive::gpu_set_zero(context, grad_t, batch_size * n_cube * 3);
 
-  // gradient w.r.t. (z, q, t)
-  nthreads = n_point * n_cube;
+  // gradient w.r.t. (z, q, t), one thread per point
+  nthreads = n_point;
   config = GetCudaLaunchConfig(nthreads, d);
   fill_grad_wrt_zqt
       <<<config.block_count, config.thread_per_block, 0, d.stream()>>>(
           nthreads, n_cube, n_point, in_z, in_q, in_t, in_mask, in_pos,
-          gpcd_ptr, grad_z, grad_q, grad_t);
+          min_distance_cube_index_ptr, gpd_ptr, grad_z, grad_q, grad_t);
 }
 
 }  // namespace tensorflow
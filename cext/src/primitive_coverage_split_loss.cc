@@ -1,24 +1,48 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+#include "scratch_arena.h"
+
 namespace tensorflow {
 
-void compute_coverage_split_loss(OpKernelContext* context, const int batch_size,
-    const int n_cube, const int n_point, const float* in_z, const float* in_q,
-    const float* in_t, const float* in_pos, float* loss_ptr, int* count_ptr);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
 
-void compute_coverage_split_loss_grad(OpKernelContext* context,
-    const int n_cube, const int n_point, const int batch_size,
-    const float* loss, const float* in_z, const float* in_q, const float* in_t,
-    const float* in_pos, float* grad_z, float* grad_q, float* grad_t);
+void compute_coverage_split_loss(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_cube, const int n_point,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr, int* count_ptr);
+void compute_coverage_split_loss(const GPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_cube, const int n_point,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr, int* count_ptr);
+
+void compute_coverage_split_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const float* loss, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
+void compute_coverage_split_loss_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const float* loss, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t);
 
 REGISTER_OP("PrimitiveCoverageSplitLoss")
 .Input("in_z: float")
 .Input("in_q: float")
 .Input("in_t: float")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Output("out_loss: float")
 .Output("out_count: int32")
 .SetShapeFn([](shape_inference::InferenceContext* c) {
@@ -31,6 +55,7 @@ Output the summation of coverage distance for each cube, and note that each cube
 may contain different number of points.
 )doc");
 
+template <typename Device>
 class PrimitiveCoverageSplitLossOp : public OpKernel {
  public:
   explicit PrimitiveCoverageSplitLossOp(OpKernelConstruction* context)
@@ -61,6 +86,11 @@ class PrimitiveCoverageSplitLossOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(4),
+                                batch_size_ * n_cube_, &transforms));
+
     // out split loss [bs, n_cube]
     Tensor* out_loss = nullptr;
     TensorShape out_loss_shape({batch_size_, n_cube_});
@@ -76,8 +106,9 @@ class PrimitiveCoverageSplitLossOp : public OpKernel {
     auto out_count_ptr = out_count->flat<int>().data();
 
     // compute coverage loss
-    compute_coverage_split_loss(context, batch_size_, n_cube_, n_point_,
-        in_z_ptr, in_q_ptr, in_t_ptr, in_pos_ptr, out_loss_ptr, out_count_ptr);
+    compute_coverage_split_loss(context->eigen_device<Device>(), context,
+        batch_size_, n_cube_, n_point_, in_z_ptr, in_q_ptr, in_t_ptr,
+        transforms, in_pos_ptr, out_loss_ptr, out_count_ptr);
   }
 
  private:
@@ -85,8 +116,14 @@ class PrimitiveCoverageSplitLossOp : public OpKernel {
   int n_point_;  // the sum of batch size point clouds' points
   int batch_size_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageSplitLoss").Device(DEVICE_GPU),
-    PrimitiveCoverageSplitLossOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCoverageSplitLoss").Device(DEVICE_CPU),
+    PrimitiveCoverageSplitLossOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSplitLoss").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageSplitLossOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("PrimitiveCoverageSplitLossGrad")
@@ -95,6 +132,7 @@ REGISTER_OP("PrimitiveCoverageSplitLossGrad")
 .Input("in_q: float")
 .Input("in_t: float")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Output("grad_z: float")
 .Output("grad_q: float")
 .Output("grad_t: float")
@@ -108,6 +146,7 @@ REGISTER_OP("PrimitiveCoverageSplitLossGrad")
 Gradient for the coverage split loss.
 )doc");
 
+template <typename Device>
 class PrimitiveCoverageSplitLossGradOp : public OpKernel {
  public:
   explicit PrimitiveCoverageSplitLossGradOp(OpKernelConstruction* context)
@@ -144,6 +183,11 @@ class PrimitiveCoverageSplitLossGradOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(5),
+                                batch_size_ * n_cube_, &transforms));
+
     // grad_z
     Tensor* grad_z = nullptr;
     TensorShape grad_z_shape = in_z.shape();
@@ -166,9 +210,9 @@ class PrimitiveCoverageSplitLossGradOp : public OpKernel {
     auto grad_t_ptr = grad_t->flat<float>().data();
 
     // compute coverage loss gradient
-    compute_coverage_split_loss_grad(context, n_cube_, n_point_, batch_size_,
-        gradients_ptr, in_z_ptr, in_q_ptr, in_t_ptr, in_pos_ptr, grad_z_ptr,
-        grad_q_ptr, grad_t_ptr);
+    compute_coverage_split_loss_grad(context->eigen_device<Device>(), context,
+        n_cube_, n_point_, batch_size_, gradients_ptr, in_z_ptr, in_q_ptr,
+        in_t_ptr, transforms, in_pos_ptr, grad_z_ptr, grad_q_ptr, grad_t_ptr);
   }
 
  private:
@@ -177,7 +221,131 @@ class PrimitiveCoverageSplitLossGradOp : public OpKernel {
   int batch_size_;
 };
 REGISTER_KERNEL_BUILDER(
-    Name("PrimitiveCoverageSplitLossGrad").Device(DEVICE_GPU),
-    PrimitiveCoverageSplitLossGradOp);
+    Name("PrimitiveCoverageSplitLossGrad").Device(DEVICE_CPU),
+    PrimitiveCoverageSplitLossGradOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCoverageSplitLossGrad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCoverageSplitLossGradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+static void get_min_distance_cube_index_cpu(const CPUDevice& d,
+    const int n_cube, const int n_point,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* min_distance, int* min_distance_cube_index) {
+  // get the nearest cube of each point and its distance
+  d.parallelFor(n_point,
+      Eigen::TensorOpCost(16 + 4 * n_cube, 8, 100 * n_cube),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index i = begin; i < end; ++i) {
+          float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                         in_pos[2 * n_point + i] };
+          int batch_index = static_cast<int>(in_pos[3 * n_point + i]);
+          float min_dis = 0;
+          int min_idx = 0;
+          for (int j = 0; j < n_cube; ++j) {
+            int k = batch_index * n_cube + j;
+            float distance = primitive::point_cube_distance(p, transforms, k);
+            if (j == 0 || distance < min_dis) {
+              min_dis = distance;
+              min_idx = j;
+            }
+          }
+          min_distance[i] = min_dis;
+          min_distance_cube_index[i] = min_idx;
+        }
+      });
+}
+
+void compute_coverage_split_loss(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_cube, const int n_point,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* loss_ptr, int* count_ptr) {
+  // distance from each point to its nearest cube, [n_point]
+  Tensor min_distance;
+  const TensorShape min_distance_shape({n_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              min_distance_shape, &min_distance));
+  auto min_distance_ptr = min_distance.flat<float>().data();
+
+  // get min distance cube index
+  Tensor min_distance_cube_index;
+  const TensorShape min_distance_cube_index_shape({n_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              min_distance_cube_index_shape,
+                              &min_distance_cube_index));
+  auto min_distance_cube_index_ptr = min_distance_cube_index.flat<int>().data();
+  get_min_distance_cube_index_cpu(d, n_cube, n_point, transforms, in_pos,
+      min_distance_ptr, min_distance_cube_index_ptr);
+
+  // get each cube coverage loss and the number of points it covers
+  memset(loss_ptr, 0, sizeof(float) * batch_size * n_cube);
+  memset(count_ptr, 0, sizeof(int) * batch_size * n_cube);
+  for (int i = 0; i < n_point; ++i) {
+    int batch_index = static_cast<int>(in_pos[3 * n_point + i]);
+    int min_idx = min_distance_cube_index_ptr[i];
+    int cube_index = batch_index * n_cube + min_idx;
+    loss_ptr[cube_index] += min_distance_ptr[i];
+    count_ptr[cube_index] += 1;
+  }
+}
+
+void compute_coverage_split_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int batch_size, const float* loss, const float* in_z,
+    const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    float* grad_z, float* grad_q, float* grad_t) {
+  /// -- prepare forward medial data for gradient computation --
+  // distance from each point to its nearest cube, [n_point]
+  Tensor min_distance;
+  const TensorShape min_distance_shape({n_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              min_distance_shape, &min_distance));
+  auto min_distance_ptr = min_distance.flat<float>().data();
+
+  // get min distance cube index
+  Tensor min_distance_cube_index;
+  const TensorShape min_distance_cube_index_shape({n_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              min_distance_cube_index_shape,
+                              &min_distance_cube_index));
+  auto min_distance_cube_index_ptr = min_distance_cube_index.flat<int>().data();
+  get_min_distance_cube_index_cpu(d, n_cube, n_point, transforms, in_pos,
+      min_distance_ptr, min_distance_cube_index_ptr);
+  /// ----------------------------------------------------------
+
+  // init zero gradient
+  memset(grad_z, 0, sizeof(float) * batch_size * n_cube * 3);
+  memset(grad_q, 0, sizeof(float) * batch_size * n_cube * 4);
+  memset(grad_t, 0, sizeof(float) * batch_size * n_cube * 3);
+
+  // gradient w.r.t. (z, q, t), each cube only visits the points it is the
+  // nearest cube of, so the shards never write to the same cube
+  std::vector<int> cube_begin, point_index;
+  OP_REQUIRES_OK(context, primitive::group_points_by_cube(in_pos, n_point,
+                              batch_size, n_cube, min_distance_cube_index_ptr,
+                              &cube_begin, &point_index));
+  const int avg_point = n_point / std::max(batch_size * n_cube, 1);
+  d.parallelFor(batch_size * n_cube,
+      Eigen::TensorOpCost(8 * avg_point, 40, 80 * avg_point),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index k = begin; k < end; ++k) {
+          // the gradient splashed to the nearest cube of each point
+          float grad_distance = loss[k];
+          if (grad_distance == 0) continue;
+          for (int j = cube_begin[k]; j < cube_begin[k + 1]; ++j) {
+            int i = point_index[j];
+            float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                           in_pos[2 * n_point + i] };
+            primitive::grad_point_cube_distance(p, transforms, k,
+                in_q + k * 4, grad_distance, grad_z + k * 3, grad_q + k * 4,
+                grad_t + k * 3, nullptr);
+          }
+        }
+      });
+}
 
 }  // namespace tensorflow
@@ -1,17 +1,30 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+
 namespace tensorflow {
 
-void compute_cube_area_average_loss(OpKernelContext* context,
-    const int n_cube, const int batch_size, const float* in_z,
-    float* loss_ptr);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
 
-void compute_cube_area_average_loss_grad(OpKernelContext* context,
-    const int n_cube, const int batch_size, const float* loss,
-    const float* in_z, float* grad_z);
+void compute_cube_area_average_loss(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float* in_z, float* loss_ptr);
+void compute_cube_area_average_loss(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float* in_z, float* loss_ptr);
+
+void compute_cube_area_average_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float* loss, const float* in_z, float* grad_z);
+void compute_cube_area_average_loss_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float* loss, const float* in_z, float* grad_z);
 
 REGISTER_OP("PrimitiveCubeAreaAverageLoss")
 .Input("in_z: float")
@@ -25,6 +38,7 @@ Get the all cubes surface area. Compute the total difference of each cube'
 surface area with the mean area.
 )doc");
 
+template <typename Device>
 class PrimitiveCubeAreaAverageLossOp : public OpKernel {
  public:
   explicit PrimitiveCubeAreaAverageLossOp(OpKernelConstruction* context)
@@ -45,17 +59,20 @@ class PrimitiveCubeAreaAverageLossOp : public OpKernel {
     auto out_loss_ptr = out_loss->flat<float>().data();
 
     // compute cube area
-    compute_cube_area_average_loss(context, n_cube_, batch_size_, in_z_ptr,
-        out_loss_ptr);
+    compute_cube_area_average_loss(context->eigen_device<Device>(), context,
+        n_cube_, batch_size_, in_z_ptr, out_loss_ptr);
   }
 
  private:
   int n_cube_;
   int batch_size_;
 };
-REGISTER_KERNEL_BUILDER(
-    Name("PrimitiveCubeAreaAverageLoss").Device(DEVICE_GPU),
-    PrimitiveCubeAreaAverageLossOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCubeAreaAverageLoss").Device(DEVICE_CPU),
+    PrimitiveCubeAreaAverageLossOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCubeAreaAverageLoss").Device(DEVICE_GPU),
+    PrimitiveCubeAreaAverageLossOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("PrimitiveCubeAreaAverageLossGrad")
@@ -70,6 +87,7 @@ REGISTER_OP("PrimitiveCubeAreaAverageLossGrad")
 Gradient for cube area average loss.
 )doc");
 
+template <typename Device>
 class PrimitiveCubeAreaAverageLossGradOp : public OpKernel {
  public:
   explicit PrimitiveCubeAreaAverageLossGradOp(OpKernelConstruction* context)
@@ -94,16 +112,124 @@ class PrimitiveCubeAreaAverageLossGradOp : public OpKernel {
     auto grad_z_ptr = grad_z->flat<float>().data();
 
     // compute coverage loss gradient
-    compute_cube_area_average_loss_grad(context, n_cube_, batch_size_,
-        gradients_ptr, in_z_ptr, grad_z_ptr);
+    compute_cube_area_average_loss_grad(context->eigen_device<Device>(),
+        context, n_cube_, batch_size_, gradients_ptr, in_z_ptr, grad_z_ptr);
   }
 
  private:
   int n_cube_;
   int batch_size_;
 };
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCubeAreaAverageLossGrad").Device(DEVICE_CPU),
+    PrimitiveCubeAreaAverageLossGradOp<CPUDevice>);
+#if GOOGLE_CUDA
 REGISTER_KERNEL_BUILDER(
     Name("PrimitiveCubeAreaAverageLossGrad").Device(DEVICE_GPU),
-    PrimitiveCubeAreaAverageLossGradOp);
+    PrimitiveCubeAreaAverageLossGradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+static float smooth_l1_cpu(float x) {
+  if (std::abs(x) < 1) {
+    return 0.5f*x*x;
+  }
+  else {
+    return std::abs(x) - 0.5f;
+  }
+}
+
+static float smooth_l1_grad_cpu(float x) {
+  if (x <= -1.0f) {
+    return -1.0f;
+  }
+  else if (x <= 1.0f) {
+    return x;
+  }
+  else {
+    return 1.0f;
+  }
+}
+
+static void get_cube_surface_mean_area_cpu(const int n_cube,
+    const int batch_size, const float* in_z, float* cube_surface_mean_area) {
+  for (int b = 0; b < batch_size; ++b) {
+    float area = 0;
+    for (int i = b * n_cube; i < (b + 1) * n_cube; ++i) {
+      float x = in_z[i * 3 + 0] * 2;
+      float y = in_z[i * 3 + 1] * 2;
+      float z = in_z[i * 3 + 2] * 2;
+      area += (x * y + x * z + y * z) / (3 * n_cube);
+    }
+    cube_surface_mean_area[b] = area;
+  }
+}
+
+void compute_cube_area_average_loss(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float* in_z, float* loss_ptr) {
+  // get cube surface mean area, regrad each surface as an instance, which
+  // means each cube have three surface area
+  std::vector<float> cube_surface_mean_area(batch_size);
+  get_cube_surface_mean_area_cpu(n_cube, batch_size, in_z,
+      cube_surface_mean_area.data());
+
+  // get cube area loss
+  float loss = 0;
+  for (int i = 0; i < batch_size * n_cube; ++i) {
+    float mean_area = cube_surface_mean_area[i / n_cube];
+    float x = in_z[i * 3 + 0] * 2;
+    float y = in_z[i * 3 + 1] * 2;
+    float z = in_z[i * 3 + 2] * 2;
+    float d_xy = smooth_l1_cpu(x * y - mean_area);
+    float d_xz = smooth_l1_cpu(x * z - mean_area);
+    float d_yz = smooth_l1_cpu(y * z - mean_area);
+    loss += (d_xy + d_xz + d_yz) / (3 * batch_size * n_cube);
+  }
+  *loss_ptr = loss;
+}
+
+void compute_cube_area_average_loss_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float* loss, const float* in_z, float* grad_z) {
+  /// -- prepare forward medial data for gradient computation --
+  std::vector<float> cube_surface_mean_area(batch_size);
+  get_cube_surface_mean_area_cpu(n_cube, batch_size, in_z,
+      cube_surface_mean_area.data());
+  /// ----------------------------------------------------------
+
+  // init zero gradient
+  memset(grad_z, 0, sizeof(float) * batch_size * n_cube * 3);
+
+  // gradient w.r.t. z, the mean area is shared by all cubes of a shape
+  for (int b = 0; b < batch_size; ++b) {
+    float grad_mean_area = 0;
+    for (int i = b * n_cube; i < (b + 1) * n_cube; ++i) {
+      float x = in_z[i * 3 + 0] * 2;
+      float y = in_z[i * 3 + 1] * 2;
+      float z = in_z[i * 3 + 2] * 2;
+      float grad_d = *loss / (3 * batch_size * n_cube);
+      float grad_d_xy = grad_d * smooth_l1_grad_cpu(
+          x * y - cube_surface_mean_area[b]);
+      float grad_d_xz = grad_d * smooth_l1_grad_cpu(
+          x * z - cube_surface_mean_area[b]);
+      float grad_d_yz = grad_d * smooth_l1_grad_cpu(
+          y * z - cube_surface_mean_area[b]);
+      float* gz = grad_z + i * 3;
+      gz[0] += (grad_d_xy * y + grad_d_xz * z) * 2;
+      gz[1] += (grad_d_xy * x + grad_d_yz * z) * 2;
+      gz[2] += (grad_d_xz * x + grad_d_yz * y) * 2;
+      grad_mean_area += -(grad_d_xy + grad_d_xz + grad_d_yz) / (3 * n_cube);
+    }
+    for (int i = b * n_cube; i < (b + 1) * n_cube; ++i) {
+      float sx = in_z[i * 3 + 0] * 2;
+      float sy = in_z[i * 3 + 1] * 2;
+      float sz = in_z[i * 3 + 2] * 2;
+      float* gsz = grad_z + i * 3;
+      gsz[0] += grad_mean_area * (sy + sz) * 2;
+      gsz[1] += grad_mean_area * (sx + sz) * 2;
+      gsz[2] += grad_mean_area * (sx + sy) * 2;
+    }
+  }
+}
 
 }  // namespace tensorflow
@@ -103,11 +103,9 @@ static __global__ void fill_grad_wrt_z(const int nthreads, const int n_cube,
   }  
 }
 
-void compute_cube_area_average_loss(OpKernelContext* context,
-    const int n_cube, const int batch_size, const float* in_z,
-    float* loss_ptr) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_cube_area_average_loss(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float* in_z, float* loss_ptr) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -137,11 +135,9 @@ void compute_cube_area_average_loss(OpKernelContext* context,
           loss_ptr);  
 }
 
-void compute_cube_area_average_loss_grad(OpKernelContext* context,
-    const int n_cube, const int batch_size, const float* loss,
-    const float* in_z, float* grad_z) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_cube_area_average_loss_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float* loss, const float* in_z, float* grad_z) {
   CudaLaunchConfig config;
   int nthreads;
 
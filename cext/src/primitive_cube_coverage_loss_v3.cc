@@ -1,19 +1,40 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+#include "scratch_arena.h"
+
 namespace tensorflow {
 
-void compute_cube_coverage_loss_v3(OpKernelContext* context, const int n_cube,
-    const int n_point, const int n_src_cube, const int batch_size,
-    const float* in_z, const float* in_q, const float* in_t,
-    const float* in_pos, const int* point_group_index, float* loss_ptr);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
 
-void compute_cube_coverage_loss_v3_grad(OpKernelContext* context,
+void compute_cube_coverage_loss_v3(const CPUDevice& d, OpKernelContext* context,
     const int n_cube, const int n_point, const int n_src_cube,
-    const int batch_size, const float* loss, const float* in_z,
-    const float* in_q, const float* in_t, const float* in_pos,
+    const int batch_size, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, const int* point_group_index, float* loss_ptr);
+void compute_cube_coverage_loss_v3(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int n_src_cube,
+    const int batch_size, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, const int* point_group_index, float* loss_ptr);
+
+void compute_cube_coverage_loss_v3_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int n_src_cube, const int batch_size, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* point_group_index, float* grad_z, float* grad_q, float* grad_t);
+void compute_cube_coverage_loss_v3_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int n_src_cube, const int batch_size, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
     const int* point_group_index, float* grad_z, float* grad_q, float* grad_t);
 
 REGISTER_OP("PrimitiveCubeCoverageLossV3")
@@ -22,6 +43,7 @@ REGISTER_OP("PrimitiveCubeCoverageLossV3")
 .Input("in_t: float")
 .Input("in_pos: float")
 .Input("in_point_index: int32")
+.Input("in_transforms: float")
 .Attr("n_src_cube: int")
 .Output("out_loss: float")
 .SetShapeFn([](shape_inference::InferenceContext* c) {
@@ -34,6 +56,7 @@ should cover one or more group of points.
 )doc");
 
 
+template <typename Device>
 class PrimitiveCubeCoverageLossV3Op : public OpKernel {
  public:
   explicit PrimitiveCubeCoverageLossV3Op(OpKernelConstruction* context)
@@ -76,6 +99,11 @@ class PrimitiveCubeCoverageLossV3Op : public OpKernel {
     CHECK_EQ(in_point_index.dim_size(0), n_point_);
     auto in_point_index_ptr = in_point_index.flat<int>().data();
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(5),
+                                batch_size_ * n_cube_, &transforms));
+
     // out loss
     Tensor* out_loss = nullptr;
     TensorShape out_loss_shape({1});
@@ -84,9 +112,9 @@ class PrimitiveCubeCoverageLossV3Op : public OpKernel {
     auto out_loss_ptr = out_loss->flat<float>().data();
 
     // compute cube coverage loss
-    compute_cube_coverage_loss_v3(context, n_cube_, n_point_, n_src_cube_,
-        batch_size_, in_z_ptr, in_q_ptr, in_t_ptr, in_pos_ptr,
-        in_point_index_ptr, out_loss_ptr);
+    compute_cube_coverage_loss_v3(context->eigen_device<Device>(), context,
+        n_cube_, n_point_, n_src_cube_, batch_size_, in_z_ptr, in_q_ptr,
+        in_t_ptr, transforms, in_pos_ptr, in_point_index_ptr, out_loss_ptr);
   }
 
  private:
@@ -95,8 +123,14 @@ class PrimitiveCubeCoverageLossV3Op : public OpKernel {
   int n_src_cube_;
   int batch_size_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveCubeCoverageLossV3").Device(DEVICE_GPU),
-    PrimitiveCubeCoverageLossV3Op);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCubeCoverageLossV3").Device(DEVICE_CPU),
+    PrimitiveCubeCoverageLossV3Op<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCubeCoverageLossV3").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCubeCoverageLossV3Op<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("PrimitiveCubeCoverageLossV3Grad")
@@ -106,6 +140,7 @@ REGISTER_OP("PrimitiveCubeCoverageLossV3Grad")
 .Input("in_t: float")
 .Input("in_pos: float")
 .Input("in_point_index: int32")
+.Input("in_transforms: float")
 .Attr("n_src_cube: int")
 .Output("grad_z: float")
 .Output("grad_q: float")
@@ -120,6 +155,7 @@ REGISTER_OP("PrimitiveCubeCoverageLossV3Grad")
 Gradient for cube coverage loss.
 )doc");
 
+template <typename Device>
 class PrimitiveCubeCoverageLossV3GradOp : public OpKernel {
  public:
   explicit PrimitiveCubeCoverageLossV3GradOp(OpKernelConstruction* context)
@@ -161,6 +197,11 @@ class PrimitiveCubeCoverageLossV3GradOp : public OpKernel {
     CHECK_EQ(in_point_index.dim_size(0), n_point_);
     auto in_point_index_ptr = in_point_index.flat<int>().data();
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(6),
+                                batch_size_ * n_cube_, &transforms));
+
     // grad_z
     Tensor* grad_z = nullptr;
     TensorShape grad_z_shape = in_z.shape();
@@ -183,9 +224,10 @@ class PrimitiveCubeCoverageLossV3GradOp : public OpKernel {
     auto grad_t_ptr = grad_t->flat<float>().data();
 
     // compute cube coverage loss gradient
-    compute_cube_coverage_loss_v3_grad(context, n_cube_, n_point_, n_src_cube_,
-        batch_size_, gradients_ptr, in_z_ptr, in_q_ptr, in_t_ptr, in_pos_ptr,
-        in_point_index_ptr, grad_z_ptr, grad_q_ptr, grad_t_ptr);
+    compute_cube_coverage_loss_v3_grad(context->eigen_device<Device>(), context,
+        n_cube_, n_point_, n_src_cube_, batch_size_, gradients_ptr, in_z_ptr,
+        in_q_ptr, in_t_ptr, transforms, in_pos_ptr, in_point_index_ptr,
+        grad_z_ptr, grad_q_ptr, grad_t_ptr);
   }
 
  private:
@@ -195,7 +237,200 @@ class PrimitiveCubeCoverageLossV3GradOp : public OpKernel {
   int batch_size_;
 };
 REGISTER_KERNEL_BUILDER(
-    Name("PrimitiveCubeCoverageLossV3Grad").Device(DEVICE_GPU),
-    PrimitiveCubeCoverageLossV3GradOp);
+    Name("PrimitiveCubeCoverageLossV3Grad").Device(DEVICE_CPU),
+    PrimitiveCubeCoverageLossV3GradOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveCubeCoverageLossV3Grad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveCubeCoverageLossV3GradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+static void get_group_cube_distance_cpu(const CPUDevice& d,
+    const int n_cube, const int n_point, const int n_group,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* point_group_index, float* point_cube_distance,
+    float* group_cube_distance, int* group_point_count,
+    int* min_distance_cube_index) {
+  // fill point to cube distance matrix, [n_point, n_cube]
+  d.parallelFor(n_point,
+      Eigen::TensorOpCost(16 + 40 * n_cube, 4 * n_cube, 100 * n_cube),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index i = begin; i < end; ++i) {
+          float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                         in_pos[2 * n_point + i] };
+          int batch_index = static_cast<int>(in_pos[3 * n_point + i]);
+          for (int j = 0; j < n_cube; ++j) {
+            int k = batch_index * n_cube + j;
+            point_cube_distance[i * n_cube + j] =
+                primitive::point_cube_distance(p, transforms, k);
+          }
+        }
+      });
+
+  // mean distance between each point group and each cube
+  memset(group_cube_distance, 0, sizeof(float) * n_group * n_cube);
+  memset(group_point_count, 0, sizeof(int) * n_group);
+  for (int i = 0; i < n_point; ++i) {
+    int group_index = point_group_index[i];
+    float* distance = group_cube_distance + group_index * n_cube;
+    for (int j = 0; j < n_cube; ++j) {
+      distance[j] += point_cube_distance[i * n_cube + j];
+    }
+    group_point_count[group_index] += 1;
+  }
+  for (int i = 0; i < n_group; ++i) {
+    float* distance = group_cube_distance + i * n_cube;
+    if (group_point_count[i] != 0) {
+      for (int j = 0; j < n_cube; ++j) {
+        distance[j] /= group_point_count[i];
+      }
+    }
+    int min_idx = 0;
+    for (int j = 1; j < n_cube; ++j) {
+      if (distance[j] < distance[min_idx]) min_idx = j;
+    }
+    min_distance_cube_index[i] = min_idx;
+  }
+}
+
+void compute_cube_coverage_loss_v3(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int n_src_cube,
+    const int batch_size, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, const int* point_group_index, float* loss_ptr) {
+  // fill point to cube distance matrix, [n_point, n_cube]
+  Tensor point_cube_distance;
+  const TensorShape point_cube_distance_shape({n_point, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              point_cube_distance_shape,
+                              &point_cube_distance));
+  auto point_cube_distance_ptr = point_cube_distance.flat<float>().data();
+
+  // fill group to cube distance matrix, [batch_size, n_src_cube, n_cube]
+  Tensor group_cube_distance;
+  const TensorShape group_cube_distance_shape({
+      batch_size, n_src_cube, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              group_cube_distance_shape,
+                              &group_cube_distance));
+  auto group_cube_distance_ptr = group_cube_distance.flat<float>().data();
+  Tensor group_point_count;
+  const TensorShape group_point_count_shape({batch_size, n_src_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              group_point_count_shape, &group_point_count));
+  auto group_point_count_ptr = group_point_count.flat<int>().data();
+
+  // get min distance cube index
+  Tensor min_distance_cube_index;
+  const TensorShape min_distance_cube_index_shape({batch_size, n_src_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              min_distance_cube_index_shape,
+                              &min_distance_cube_index));
+  auto min_distance_cube_index_ptr = min_distance_cube_index.flat<int>().data();
+  get_group_cube_distance_cpu(d, n_cube, n_point, batch_size * n_src_cube,
+      transforms, in_pos, point_group_index, point_cube_distance_ptr,
+      group_cube_distance_ptr, group_point_count_ptr,
+      min_distance_cube_index_ptr);
+
+  // get cube coverage loss
+  float loss = 0;
+  for (int i = 0; i < batch_size * n_src_cube; ++i) {
+    loss += group_cube_distance_ptr[i * n_cube +
+        min_distance_cube_index_ptr[i]] / (batch_size * n_src_cube);
+  }
+  *loss_ptr = loss;
+}
+
+void compute_cube_coverage_loss_v3_grad(const CPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int n_src_cube, const int batch_size, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* point_group_index, float* grad_z, float* grad_q, float* grad_t) {
+  /// -- prepare forward medial data for gradient computation --
+  // fill point to cube distance matrix, [n_point, n_cube]
+  Tensor point_cube_distance;
+  const TensorShape point_cube_distance_shape({n_point, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              point_cube_distance_shape,
+                              &point_cube_distance));
+  auto point_cube_distance_ptr = point_cube_distance.flat<float>().data();
+
+  // fill group to cube distance matrix, [batch_size, n_src_cube, n_cube]
+  Tensor group_cube_distance;
+  const TensorShape group_cube_distance_shape({
+      batch_size, n_src_cube, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              group_cube_distance_shape,
+                              &group_cube_distance));
+  auto group_cube_distance_ptr = group_cube_distance.flat<float>().data();
+  Tensor group_point_count;
+  const TensorShape group_point_count_shape({batch_size, n_src_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              group_point_count_shape, &group_point_count));
+  auto group_point_count_ptr = group_point_count.flat<int>().data();
+
+  // get min distance cube index
+  Tensor min_distance_cube_index;
+  const TensorShape min_distance_cube_index_shape({batch_size, n_src_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              min_distance_cube_index_shape,
+                              &min_distance_cube_index));
+  auto min_distance_cube_index_ptr = min_distance_cube_index.flat<int>().data();
+  get_group_cube_distance_cpu(d, n_cube, n_point, batch_size * n_src_cube,
+      transforms, in_pos, point_group_index, point_cube_distance_ptr,
+      group_cube_distance_ptr, group_point_count_ptr,
+      min_distance_cube_index_ptr);
+  /// ----------------------------------------------------------
+
+  // splash gradient to point cube distance, only the nearest cube of each
+  // group receives gradient
+  Tensor grad_point_cube_distance;
+  const TensorShape gpcd_shape({n_point, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT, gpcd_shape,
+                              &grad_point_cube_distance));
+  auto gpcd_ptr = grad_point_cube_distance.flat<float>().data();
+  memset(gpcd_ptr, 0, sizeof(float) * n_point * n_cube);
+  for (int i = 0; i < n_point; ++i) {
+    int group_index = point_group_index[i];
+    int point_count = group_point_count_ptr[group_index];
+    if (point_count != 0) {
+      gpcd_ptr[i * n_cube + min_distance_cube_index_ptr[group_index]] =
+          (*loss) / (batch_size * n_src_cube) / point_count;
+    }
+  }
+
+  // init zero gradient
+  memset(grad_z, 0, sizeof(float) * batch_size * n_cube * 3);
+  memset(grad_q, 0, sizeof(float) * batch_size * n_cube * 4);
+  memset(grad_t, 0, sizeof(float) * batch_size * n_cube * 3);
+
+  // gradient w.r.t. (z, q, t), each cube only visits the points of its own
+  // shape, so the shards never write to the same cube
+  std::vector<int> batch_begin, point_index;
+  OP_REQUIRES_OK(context, primitive::group_points_by_batch(in_pos, n_point,
+                              batch_size, &batch_begin, &point_index));
+  const int avg_point = n_point / std::max(batch_size, 1);
+  d.parallelFor(batch_size * n_cube,
+      Eigen::TensorOpCost(8 * avg_point, 40, 4 * avg_point),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index k = begin; k < end; ++k) {
+          int batch_index = k / n_cube;
+          int cube_index = k % n_cube;
+          for (int j = batch_begin[batch_index];
+               j < batch_begin[batch_index + 1]; ++j) {
+            int i = point_index[j];
+            float grad_distance = gpcd_ptr[i * n_cube + cube_index];
+            if (grad_distance == 0) continue;
+            float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                           in_pos[2 * n_point + i] };
+            primitive::grad_point_cube_distance(p, transforms, k,
+                in_q + k * 4, grad_distance, grad_z + k * 3, grad_q + k * 4,
+                grad_t + k * 3, nullptr);
+          }
+        }
+      });
+}
 
 }  // namespace tensorflow
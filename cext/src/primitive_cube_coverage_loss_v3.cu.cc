@@ -310,12 +310,11 @@ static __global__ void fill_grad_wrt_zqt(const int nthreads, const int n_cube,
   }
 }
 
-void compute_cube_coverage_loss_v3(OpKernelContext* context, const int n_cube,
-    const int n_point, const int n_src_cube, const int batch_size,
-    const float* in_z, const float* in_q, const float* in_t,
+void compute_cube_coverage_loss_v3(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int n_point, const int n_src_cube,
+    const int batch_size, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
     const float* in_pos, const int* point_group_index, float* loss_ptr) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
   CudaLaunchConfig config;
   int nthreads;
 
@@ -388,14 +387,12 @@ void compute_cube_coverage_loss_v3(OpKernelContext* context, const int n_cube,
           min_distance_cube_index_ptr, loss_ptr);
 }
 
-void compute_cube_coverage_loss_v3_grad(OpKernelContext* context,
-    const int n_cube, const int n_point, const int n_src_cube,
-    const int batch_size, const float* loss, const float* in_z,
-    const float* in_q, const float* in_t, const float* in_pos,
-    const int* point_group_index, float* grad_z, float* grad_q,
-    float* grad_t) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_cube_coverage_loss_v3_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int n_point,
+    const int n_src_cube, const int batch_size, const float* loss,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    const int* point_group_index, float* grad_z, float* grad_q, float* grad_t) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -0,0 +1,78 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+
+#include "primitive_util.h"
+
+namespace tensorflow {
+
+typedef Eigen::ThreadPoolDevice CPUDevice;
+
+REGISTER_OP("PrimitiveCubeTransforms")
+.Input("in_z: float")
+.Input("in_q: float")
+.Input("in_t: float")
+.Output("out_transforms: float")
+.SetShapeFn([](shape_inference::InferenceContext* c) {
+  c->set_output(0, c->MakeShape({ primitive::kCubeTransformRows,
+                                  c->UnknownDim() }));
+  return Status::OK();
+})
+.Doc(R"doc(
+Compute the transforms of the cubes (z, q, t) once, in the packed layout the
+CPU losses use. Column k holds cube k = batch_index * n_cube + cube_index,
+rows 0-8 are the rotation R(q) of the normalized q in row-major order, rows
+9-17 its transpose, rows 18-20 the inverse translation -R^T * t, rows 21-23
+the half extents z and rows 24-26 the translation t. The number of columns
+is batch_size * n_cube rounded up to a multiple of 16, the padding columns
+are zero.
+)doc");
+
+class PrimitiveCubeTransformsOp : public OpKernel {
+ public:
+  explicit PrimitiveCubeTransformsOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    // in_z [bs, n_cube * 3]
+    const Tensor& in_z = context->input(0);
+    auto in_z_ptr = in_z.flat<float>().data();
+    const int batch_size = in_z.dim_size(0);
+    const int n_cube = in_z.dim_size(1) / 3;
+
+    // in_q [bs, n_cube * 4]
+    const Tensor& in_q = context->input(1);
+    auto in_q_ptr = in_q.flat<float>().data();
+    OP_REQUIRES(context, in_q.dim_size(0) == batch_size &&
+        in_q.dim_size(1) == n_cube * 4,
+        errors::InvalidArgument("in_q should be [batch_size, n_cube * 4]"));
+
+    // in_t [bs, n_cube * 3]
+    const Tensor& in_t = context->input(2);
+    auto in_t_ptr = in_t.flat<float>().data();
+    OP_REQUIRES(context, in_t.dim_size(0) == batch_size &&
+        in_t.dim_size(1) == n_cube * 3,
+        errors::InvalidArgument("in_t should be [batch_size, n_cube * 3]"));
+
+    // out transforms
+    const int n = batch_size * n_cube;
+    const int stride = primitive::cube_transform_stride(n);
+    Tensor* out_transforms = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_transforms",
+                                TensorShape({ primitive::kCubeTransformRows,
+                                              stride }),
+                                &out_transforms));
+    auto out_ptr = out_transforms->flat<float>().data();
+    memset(out_ptr, 0, sizeof(float) * primitive::kCubeTransformRows * stride);
+
+    primitive::cube_transforms(context->eigen_device<CPUDevice>(), n,
+        in_z_ptr, in_q_ptr, in_t_ptr, stride, out_ptr);
+  }
+};
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCubeTransforms").Device(DEVICE_CPU),
+    PrimitiveCubeTransformsOp);
+
+}  // namespace tensorflow
@@ -1,12 +1,23 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+
 namespace tensorflow {
 
-void compute_cube_volume(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float* in_z, float* out_volume);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+void compute_cube_volume(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* in_z,
+    float* out_volume);
+void compute_cube_volume(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* in_z,
+    float* out_volume);
 
 REGISTER_OP("PrimitiveCubeVolume")
 .Input("in_z: float")
@@ -19,6 +30,7 @@ REGISTER_OP("PrimitiveCubeVolume")
 Compute the primitive cube volume.
 )doc");
 
+template <typename Device>
 class PrimitiveCubeVolumeOp : public OpKernel {
 public:
   explicit PrimitiveCubeVolumeOp(OpKernelConstruction* context)
@@ -39,15 +51,33 @@ public:
     auto out_volume_ptr = out_volume->flat<float>().data();
 
     // compute cube volume
-    compute_cube_volume(context, n_cube_, batch_size_, in_z_ptr,
-        out_volume_ptr);
+    compute_cube_volume(context->eigen_device<Device>(), context, n_cube_,
+        batch_size_, in_z_ptr, out_volume_ptr);
   }
 
  private:
   int n_cube_;
   int batch_size_;
 };
+REGISTER_KERNEL_BUILDER(Name("PrimitiveCubeVolume").Device(DEVICE_CPU),
+    PrimitiveCubeVolumeOp<CPUDevice>);
+#if GOOGLE_CUDA
 REGISTER_KERNEL_BUILDER(Name("PrimitiveCubeVolume").Device(DEVICE_GPU),
-    PrimitiveCubeVolumeOp);
+    PrimitiveCubeVolumeOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+void compute_cube_volume(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* in_z,
+    float* out_volume) {
+  // get cube volume
+  float volume = 0;
+  for (int i = 0; i < batch_size * n_cube; ++i) {
+    float x = in_z[i * 3 + 0] * 2;
+    float y = in_z[i * 3 + 1] * 2;
+    float z = in_z[i * 3 + 2] * 2;
+    volume += x * y * z / batch_size;
+  }
+  *out_volume = volume;
+}
 
 }  // namespace tensorflow
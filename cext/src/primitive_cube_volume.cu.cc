@@ -22,10 +22,9 @@ static __global__ void get_cube_volume(const int nthreads,
   }
 }
 
-void compute_cube_volume(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float* in_z, float* out_volume) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_cube_volume(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float* in_z,
+    float* out_volume) {
   CudaLaunchConfig config;
   int nthreads;
 
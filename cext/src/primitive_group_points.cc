@@ -1,12 +1,24 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+
 namespace tensorflow {
 
-void group_points(OpKernelContext* context, const int n_point, const int n_cube,
-    const float* in_z, const float* in_q, const float* in_t,
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+void group_points(const CPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, int* index);
+void group_points(const GPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
     const float* in_pos, int* index);
 
 REGISTER_OP("PrimitiveGroupPoints")
@@ -14,6 +26,7 @@ REGISTER_OP("PrimitiveGroupPoints")
 .Input("in_q: float")
 .Input("in_t: float")
 .Input("in_pos: float")
+.Input("in_transforms: float")
 .Output("out_index: int32")
 .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
   c->set_output(0, c->MakeShape({c->Dim(c->input(3), 1)}));
@@ -23,6 +36,7 @@ REGISTER_OP("PrimitiveGroupPoints")
 Group points by the nearest cube.
 )doc");
 
+template <typename Device>
 class PrimitiveGroupPointsOp : public OpKernel {
  public:
   explicit PrimitiveGroupPointsOp(OpKernelConstruction* context)
@@ -53,6 +67,11 @@ class PrimitiveGroupPointsOp : public OpKernel {
     CHECK_EQ(in_pos.dim_size(0), 4);
     n_point_ = in_pos.dim_size(1);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(4),
+                                batch_size_ * n_cube_, &transforms));
+
     // out index
     /// point group index is accumulated with batch size
     /// [0, 1, ..., n_cube - 1, n_cube, n_cube + 1, ..., 2*n_cube - 1, ...,
@@ -64,8 +83,8 @@ class PrimitiveGroupPointsOp : public OpKernel {
     auto index_output_ptr = index_output_tensor->flat<int>().data();
 
     // split points to group
-    group_points(context, n_point_, n_cube_, in_z_ptr, in_q_ptr, in_t_ptr,
-        in_pos_ptr, index_output_ptr);
+    group_points(context->eigen_device<Device>(), context, n_point_, n_cube_,
+        in_z_ptr, in_q_ptr, in_t_ptr, transforms, in_pos_ptr, index_output_ptr);
   }
 
  private:
@@ -73,7 +92,41 @@ class PrimitiveGroupPointsOp : public OpKernel {
   int n_point_;
   int batch_size_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveGroupPoints").Device(DEVICE_GPU),
-    PrimitiveGroupPointsOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveGroupPoints").Device(DEVICE_CPU),
+    PrimitiveGroupPointsOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveGroupPoints").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveGroupPointsOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+void group_points(const CPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const float* in_pos, int* index) {
+
+  // assign every point to its nearest cube, no distance matrix is needed
+  d.parallelFor(n_point, Eigen::TensorOpCost(16, 4, 64 * n_cube),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index i = begin; i < end; ++i) {
+          float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                         in_pos[2 * n_point + i] };
+          int batch_index = static_cast<int>(in_pos[3 * n_point + i]);
+          int offset = batch_index * n_cube;
+          float min_val = FLT_MAX;
+          int min_idx = 0;
+          for (int c = 0; c < n_cube; ++c) {
+            float distance = primitive::point_cube_distance(p, transforms,
+                offset + c);
+            if (distance < min_val) {
+              min_idx = c;
+              min_val = distance;
+            }
+          }
+          index[i] = offset + min_idx;
+        }
+      });
+}
 
 }  // namespace tensorflow
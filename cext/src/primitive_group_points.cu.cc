@@ -1,6 +1,8 @@
 #define EIGEN_USE_THREADS
 #define EIGEN_USE_GPU
 
+#include "primitive_util.h"
+
 #include "cuda.h"
 #include "device_launch_parameters.h"
 #include "tensorflow/core/util/cuda_kernel_helper.h"
@@ -95,11 +97,10 @@ static __global__ void get_min_distance_cube_index(const int nthreads,
   }
 }
 
-void group_points(OpKernelContext* context, const int n_point, const int n_cube,
-    const float* in_z, const float* in_q, const float* in_t,
+void group_points(const GPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
     const float* in_pos, int* index) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
   CudaLaunchConfig config;
   int nthreads;
 
@@ -1,23 +1,43 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+#include "scratch_arena.h"
+
 namespace tensorflow {
 
-void compute_mutex_loss(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float scale, const float* in_z,
-    const float* in_q, const float* in_t, float* loss_ptr);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
 
-void compute_mutex_loss_grad(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float scale, const float* loss,
-    const float* in_z, const float* in_q, const float* in_t, float* grad_z,
-    float* grad_q, float* grad_t);
+void compute_mutex_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr);
+void compute_mutex_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr);
+
+void compute_mutex_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t);
+void compute_mutex_loss_grad(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t);
 
 REGISTER_OP("PrimitiveMutexLoss")
 .Input("in_z: float")
 .Input("in_q: float")
 .Input("in_t: float")
+.Input("in_transforms: float")
 .Attr("scale: float = 0.9")
 .Output("out_loss: float")
 .SetShapeFn([](shape_inference::InferenceContext* c) {
@@ -29,6 +49,7 @@ Sample points in the cube volume, and compute the distance of each point invades
 the other cubes.
 )doc");
 
+template <typename Device>
 class PrimitiveMutexLossOp : public OpKernel {
  public:
   explicit PrimitiveMutexLossOp(OpKernelConstruction* context)
@@ -55,6 +76,11 @@ class PrimitiveMutexLossOp : public OpKernel {
     CHECK_EQ(in_t.dim_size(0), batch_size_);
     CHECK_EQ(in_t.dim_size(1), n_cube_ * 3);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(3),
+                                batch_size_ * n_cube_, &transforms));
+
     // out loss
     Tensor* out_loss = nullptr;
     TensorShape out_loss_shape({1});
@@ -63,8 +89,9 @@ class PrimitiveMutexLossOp : public OpKernel {
     auto out_loss_ptr = out_loss->flat<float>().data();
     
     // compute mutex loss
-    compute_mutex_loss(context, n_cube_, batch_size_, scale_, in_z_ptr,
-        in_q_ptr, in_t_ptr, out_loss_ptr);
+    compute_mutex_loss(context->eigen_device<Device>(), context, n_cube_,
+        batch_size_, scale_, in_z_ptr, in_q_ptr, in_t_ptr, transforms,
+        out_loss_ptr);
   }
 
  private:
@@ -72,8 +99,14 @@ class PrimitiveMutexLossOp : public OpKernel {
   int batch_size_;
   float scale_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveMutexLoss").Device(DEVICE_GPU),
-    PrimitiveMutexLossOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveMutexLoss").Device(DEVICE_CPU),
+    PrimitiveMutexLossOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveMutexLoss").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveMutexLossOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("PrimitiveMutexLossGrad")
@@ -81,6 +114,7 @@ REGISTER_OP("PrimitiveMutexLossGrad")
 .Input("in_z: float")
 .Input("in_q: float")
 .Input("in_t: float")
+.Input("in_transforms: float")
 .Attr("scale: float")
 .Output("grad_z: float")
 .Output("grad_q: float")
@@ -95,6 +129,7 @@ REGISTER_OP("PrimitiveMutexLossGrad")
 Gradient for the primitive mutex loss.
 )doc");
 
+template <typename Device>
 class PrimitiveMutexLossGradOp : public OpKernel {
  public:
   explicit PrimitiveMutexLossGradOp(OpKernelConstruction* context)
@@ -125,6 +160,11 @@ class PrimitiveMutexLossGradOp : public OpKernel {
     CHECK_EQ(in_t.dim_size(0), batch_size_);
     CHECK_EQ(in_t.dim_size(1), n_cube_ * 3);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(4),
+                                batch_size_ * n_cube_, &transforms));
+
     // grad_z
     Tensor* grad_z = nullptr;
     TensorShape grad_z_shape = in_z.shape();
@@ -147,9 +187,9 @@ class PrimitiveMutexLossGradOp : public OpKernel {
     auto grad_t_ptr = grad_t->flat<float>().data();
 
     // compute mutex loss gradient
-    compute_mutex_loss_grad(context, n_cube_, batch_size_, scale_,
-        gradients_ptr, in_z_ptr, in_q_ptr, in_t_ptr, grad_z_ptr, grad_q_ptr,
-        grad_t_ptr);
+    compute_mutex_loss_grad(context->eigen_device<Device>(), context, n_cube_,
+        batch_size_, scale_, gradients_ptr, in_z_ptr, in_q_ptr, in_t_ptr,
+        transforms, grad_z_ptr, grad_q_ptr, grad_t_ptr);
   }
 
  private:
@@ -157,7 +197,176 @@ class PrimitiveMutexLossGradOp : public OpKernel {
   int batch_size_;
   float scale_;
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveMutexLossGrad").Device(DEVICE_GPU),
-    PrimitiveMutexLossGradOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveMutexLossGrad").Device(DEVICE_CPU),
+    PrimitiveMutexLossGradOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveMutexLossGrad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveMutexLossGradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+static void get_max_mutex_distance_cpu(const CPUDevice& d, const int n_cube,
+    const int batch_size, const int n_sample_point, const float* sample_points,
+    const float* in_z, const primitive::CubeTransforms& transforms,
+    float* max_mutex_distance, int* max_mutex_distance_cube_index) {
+  // for each sample point of each cube, find the other cube it penetrates
+  // deepest into, the mutex distance is the min axis distance to its faces
+  d.parallelFor(batch_size * n_cube,
+      Eigen::TensorOpCost(40 * n_cube, 8 * n_sample_point,
+                          120 * n_cube * n_sample_point),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index k = begin; k < end; ++k) {
+          int batch_index = k / n_cube;
+          int s_cube_index = k % n_cube;
+          for (int j = 0; j < n_sample_point; ++j) {
+            float s[3] = { sample_points[0 * n_sample_point + j],
+                           sample_points[1 * n_sample_point + j],
+                           sample_points[2 * n_sample_point + j] };
+            float p[3];
+            primitive::transform_sample_point(s, transforms, k, p);
+            float max_val = -1.0f;
+            int max_idx = 0;
+            for (int i = 0; i < n_cube; ++i) {
+              if (i == s_cube_index) continue;
+              int kt = batch_index * n_cube + i;
+              float distance = 0;
+              {
+                const float* z = in_z + kt * 3;
+                float local[3];
+                primitive::to_cube_frame(p, transforms, kt, local);
+                distance = std::max(z[0] - std::abs(local[0]), 0.0f);
+                distance = std::min(distance,
+                    std::max(z[1] - std::abs(local[1]), 0.0f));
+                distance = std::min(distance,
+                    std::max(z[2] - std::abs(local[2]), 0.0f));
+              }
+              if (distance > max_val) {
+                max_val = distance;
+                max_idx = i;
+              }
+            }
+            max_mutex_distance[k * n_sample_point + j] =
+                std::max(max_val, 0.0f);
+            max_mutex_distance_cube_index[k * n_sample_point + j] = max_idx;
+          }
+        }
+      });
+}
+
+void compute_mutex_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr) {
+  // sample points in cube volume
+  std::vector<float> cube_volume_points;
+  primitive::cube_volume_samples(scale, &cube_volume_points);
+  int n_sample_point = cube_volume_points.size() / 3;
+
+  // get max mutex distance and the corresponding cube of each sample point
+  Tensor max_mutex_distance;
+  Tensor max_mutex_distance_cube_index;
+  const TensorShape mmdci_shape({batch_size, n_cube, n_sample_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT, mmdci_shape,
+                              &max_mutex_distance));
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32, mmdci_shape,
+                              &max_mutex_distance_cube_index));
+  auto mmd_ptr = max_mutex_distance.flat<float>().data();
+  auto mmdci_ptr = max_mutex_distance_cube_index.flat<int>().data();
+  get_max_mutex_distance_cpu(d, n_cube, batch_size, n_sample_point,
+      cube_volume_points.data(), in_z, transforms, mmd_ptr, mmdci_ptr);
+
+  // get mutex loss
+  float loss = 0;
+  for (int i = 0; i < batch_size * n_cube * n_sample_point; ++i) {
+    loss += mmd_ptr[i] / (batch_size * n_cube * n_sample_point);
+  }
+  *loss_ptr = loss;
+}
+
+void compute_mutex_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t) {
+  /// -- prepare forward medial data for gradient computation --
+  // sample points in cube volume
+  std::vector<float> cube_volume_points;
+  primitive::cube_volume_samples(scale, &cube_volume_points);
+  int n_sample_point = cube_volume_points.size() / 3;
+
+  // get max mutex distance and the corresponding cube of each sample point
+  Tensor max_mutex_distance;
+  Tensor max_mutex_distance_cube_index;
+  const TensorShape mmdci_shape({batch_size, n_cube, n_sample_point});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT, mmdci_shape,
+                              &max_mutex_distance));
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32, mmdci_shape,
+                              &max_mutex_distance_cube_index));
+  auto mmd_ptr = max_mutex_distance.flat<float>().data();
+  auto mmdci_ptr = max_mutex_distance_cube_index.flat<int>().data();
+  get_max_mutex_distance_cpu(d, n_cube, batch_size, n_sample_point,
+      cube_volume_points.data(), in_z, transforms, mmd_ptr, mmdci_ptr);
+  /// ----------------------------------------------------------
+
+  // init zero gradient
+  memset(grad_z, 0, sizeof(float) * batch_size * n_cube * 3);
+  memset(grad_q, 0, sizeof(float) * batch_size * n_cube * 4);
+  memset(grad_t, 0, sizeof(float) * batch_size * n_cube * 3);
+
+  // gradient w.r.t. (z, q, t), a sample point moves both its own cube and the
+  // cube it penetrates, so the shards are split by shape
+  d.parallelFor(batch_size,
+      Eigen::TensorOpCost(40 * n_cube * n_sample_point, 40 * n_cube,
+                          400 * n_cube * n_sample_point),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index batch_index = begin; batch_index < end;
+             ++batch_index) {
+          float grad_distance = (*loss) /
+              (batch_size * n_cube * n_sample_point);
+          for (int s_cube_index = 0; s_cube_index < n_cube; ++s_cube_index) {
+            int k = batch_index * n_cube + s_cube_index;
+            for (int j = 0; j < n_sample_point; ++j) {
+              int t_cube_index = mmdci_ptr[k * n_sample_point + j];
+              int kt = batch_index * n_cube + t_cube_index;
+              if (t_cube_index == s_cube_index) continue;
+              float s[3] = { cube_volume_points[0 * n_sample_point + j],
+                             cube_volume_points[1 * n_sample_point + j],
+                             cube_volume_points[2 * n_sample_point + j] };
+              float p[3], local[3];
+              primitive::transform_sample_point(s, transforms, k, p);
+              primitive::to_cube_frame(p, transforms, kt, local);
+
+              // only the nearest face receives gradient
+              const float* z = in_z + kt * 3;
+              float axis_distance[3];
+              for (int a = 0; a < 3; ++a) {
+                axis_distance[a] = std::max(z[a] - std::abs(local[a]), 0.0f);
+              }
+              int min_axis_index = 0;
+              if (axis_distance[1] < axis_distance[min_axis_index]) {
+                min_axis_index = 1;
+              }
+              if (axis_distance[2] < axis_distance[min_axis_index]) {
+                min_axis_index = 2;
+              }
+              float grad_local[3] = { 0.0f, 0.0f, 0.0f };
+              int a = min_axis_index;
+              if (z[a] - std::abs(local[a]) > 0) {
+                grad_z[kt * 3 + a] += grad_distance;
+                grad_local[a] = local[a] >= 0 ? -grad_distance : grad_distance;
+              }
+
+              float grad_p[3] = { 0.0f, 0.0f, 0.0f };
+              primitive::grad_to_cube_frame(p, transforms, kt, in_q + kt * 4,
+                  grad_local, grad_q + kt * 4, grad_t + kt * 3, grad_p);
+              primitive::grad_transform_sample_point(s, transforms, k,
+                  in_q + k * 4, grad_p, grad_z + k * 3, grad_q + k * 4,
+                  grad_t + k * 3);
+            }
+          }
+        }
+      });
+}
 
 }  //namespace tensorflow
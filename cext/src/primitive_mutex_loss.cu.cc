@@ -445,11 +445,10 @@ static std::vector<float> cube_volume_points_host {
   -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0,
 };
 
-void compute_mutex_loss(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float scale, const float* in_z,
-    const float* in_q, const float* in_t, float* loss_ptr) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_mutex_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -532,12 +531,11 @@ void compute_mutex_loss(OpKernelContext* context, const int n_cube,
 }
 
 
-void compute_mutex_loss_grad(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float scale, const float* loss,
-    const float* in_z, const float* in_q, const float* in_t, float* grad_z,
-    float* grad_q, float* grad_t) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_mutex_loss_grad(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -472,11 +472,11 @@ static std::vector<float> cube_volume_points_host {
   -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0,
 };
 
-void compute_mutex_select_loss(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float scale, const float* in_z,
-    const float* in_q, const float* in_t, const int* in_mask, float* loss_ptr) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_mutex_select_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const int* in_mask,
+    float* loss_ptr) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -573,12 +573,11 @@ void compute_mutex_select_loss(OpKernelContext* context, const int n_cube,
 }
 
 
-void compute_mutex_select_loss_grad(OpKernelContext* context, const int n_cube,
-    const int batch_size, const float scale, const float* loss,
-    const float* in_z, const float* in_q, const float* in_t, const int* in_mask,
-    float* grad_z, float* grad_q, float* grad_t) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void compute_mutex_select_loss_grad(const GPUDevice& d,
+    OpKernelContext* context, const int n_cube, const int batch_size,
+    const float scale, const float* loss, const float* in_z, const float* in_q,
+    const float* in_t, const primitive::CubeTransforms& transforms,
+    const int* in_mask, float* grad_z, float* grad_q, float* grad_t) {
   CudaLaunchConfig config;
   int nthreads;
 
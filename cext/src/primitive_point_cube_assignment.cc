@@ -0,0 +1,164 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+
+#include "primitive_util.h"
+
+namespace tensorflow {
+
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+void assign_points_to_cubes(const CPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const int batch_size,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    int* index, float* distance, int* count);
+void assign_points_to_cubes(const GPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const int batch_size,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    int* index, float* distance, int* count);
+
+REGISTER_OP("PrimitivePointCubeAssignment")
+.Input("in_z: float")
+.Input("in_q: float")
+.Input("in_t: float")
+.Input("in_pos: float")
+.Input("in_transforms: float")
+.Output("out_index: int32")
+.Output("out_distance: float")
+.Output("out_count: int32")
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  c->set_output(0, c->MakeShape({c->Dim(c->input(3), 1)}));
+  c->set_output(1, c->MakeShape({c->Dim(c->input(3), 1)}));
+  c->set_output(2, c->MakeShape({c->Dim(c->input(0), 0), c->UnknownDim()}));
+  return Status::OK();
+})
+.Doc(R"doc(
+Assign every point to its nearest cube, once for all the ops that need it.
+out_index [n_point] is the nearest cube accumulated with the batch index, the
+same as the output of PrimitiveGroupPoints, out_distance [n_point] the squared
+distance to that cube and out_count [bs, n_cube] the number of points of each
+cube. The index can be fed to PrimitiveCubeCoverageLoss, and to
+PrimitiveCoverageAssignedLoss and PrimitiveCoverageSplitAssignedLoss in place
+of PrimitiveCoverageLoss and PrimitiveCoverageSplitLoss.
+)doc");
+
+template <typename Device>
+class PrimitivePointCubeAssignmentOp : public OpKernel {
+ public:
+  explicit PrimitivePointCubeAssignmentOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    // in_z [bs, n_cube * 3]
+    const Tensor& in_z = context->input(0);
+    auto in_z_ptr = in_z.flat<float>().data();
+    batch_size_ = in_z.dim_size(0);
+    n_cube_ = in_z.dim_size(1) / 3;
+
+    // in_q [bs, n_cube * 4]
+    const Tensor& in_q = context->input(1);
+    auto in_q_ptr = in_q.flat<float>().data();
+    CHECK_EQ(in_q.dim_size(0), batch_size_);
+    CHECK_EQ(in_q.dim_size(1), n_cube_ * 4);
+
+    // in_t [bs, n_cube * 3]
+    const Tensor& in_t = context->input(2);
+    auto in_t_ptr = in_t.flat<float>().data();
+    CHECK_EQ(in_t.dim_size(0), batch_size_);
+    CHECK_EQ(in_t.dim_size(1), n_cube_ * 3);
+
+    // in_pos [4, n_point]
+    const Tensor& in_pos = context->input(3);
+    auto in_pos_ptr = in_pos.flat<float>().data();
+    CHECK_EQ(in_pos.dim_size(0), 4);
+    n_point_ = in_pos.dim_size(1);
+
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(4),
+                                batch_size_ * n_cube_, &transforms));
+
+    // out index [n_point]
+    Tensor* index_output_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_index",
+                                TensorShape({n_point_}),
+                                &index_output_tensor));
+    auto index_output_ptr = index_output_tensor->flat<int>().data();
+
+    // out distance [n_point]
+    Tensor* distance_output_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_distance",
+                                TensorShape({n_point_}),
+                                &distance_output_tensor));
+    auto distance_output_ptr = distance_output_tensor->flat<float>().data();
+
+    // out count [bs, n_cube]
+    Tensor* count_output_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_count",
+                                TensorShape({batch_size_, n_cube_}),
+                                &count_output_tensor));
+    auto count_output_ptr = count_output_tensor->flat<int>().data();
+
+    assign_points_to_cubes(context->eigen_device<Device>(), context, n_point_,
+        n_cube_, batch_size_, in_z_ptr, in_q_ptr, in_t_ptr, transforms,
+        in_pos_ptr, index_output_ptr, distance_output_ptr, count_output_ptr);
+  }
+
+ private:
+  int n_cube_;
+  int n_point_;
+  int batch_size_;
+};
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitivePointCubeAssignment").Device(DEVICE_CPU),
+    PrimitivePointCubeAssignmentOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitivePointCubeAssignment").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitivePointCubeAssignmentOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+void assign_points_to_cubes(const CPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const int batch_size,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    int* index, float* distance, int* count) {
+  memset(count, 0, sizeof(int) * batch_size * n_cube);
+  if (n_cube == 0) return;
+
+  // the nearest cube of every point, the first one on ties
+  d.parallelFor(n_point, Eigen::TensorOpCost(16, 8, 64 * n_cube),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index i = begin; i < end; ++i) {
+          float p[3] = { in_pos[0 * n_point + i], in_pos[1 * n_point + i],
+                         in_pos[2 * n_point + i] };
+          int batch_index = static_cast<int>(in_pos[3 * n_point + i]);
+          int offset = batch_index * n_cube;
+          float min_val = FLT_MAX;
+          int min_idx = 0;
+          for (int c = 0; c < n_cube; ++c) {
+            float dist = primitive::point_cube_distance(p, transforms,
+                offset + c);
+            if (dist < min_val) {
+              min_idx = c;
+              min_val = dist;
+            }
+          }
+          index[i] = offset + min_idx;
+          distance[i] = min_val;
+        }
+      });
+
+  for (int i = 0; i < n_point; ++i) {
+    count[index[i]] += 1;
+  }
+}
+
+}  // namespace tensorflow
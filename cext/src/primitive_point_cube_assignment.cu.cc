@@ -0,0 +1,103 @@
+#define EIGEN_USE_THREADS
+
+#include "primitive_util.h"
+
+#include "cuda.h"
+#include "device_launch_parameters.h"
+#include "tensorflow/core/util/cuda_kernel_helper.h"
+#include "tensorflow/core/platform/stream_executor.h"
+
+namespace tensorflow {
+
+typedef Eigen::GpuDevice GPUDevice;
+
+static __device__ void matvec_kernel(const float* m, float* x, float* y,
+    float* z) {
+  float tx = m[0] * (*x) + m[1] * (*y) + m[2] * (*z);
+  float ty = m[3] * (*x) + m[4] * (*y) + m[5] * (*z);
+  float tz = m[6] * (*x) + m[7] * (*y) + m[8] * (*z);
+  *x = tx; *y = ty; *z = tz;
+}
+
+static __device__ float diag(const float a, const float b) {
+  return 1 - 2 * a * a - 2 * b * b;
+}
+
+static __device__ float tr_add(const float a, const float b, const float c,
+    const float d) {
+  return 2 * a * b + 2 * c * d;
+}
+
+static __device__ float tr_sub(const float a, const float b, const float c,
+    const float d) {
+  return 2 * a * b - 2 * c * d;
+}
+
+static __device__ void normalize(float* w, float* x, float* y, float* z) {
+  float norm = sqrt((*w)*(*w) + (*x)*(*x) + (*y)*(*y) + (*z)*(*z));
+  *w /= norm;  *x /= norm;  *y /= norm;  *z /= norm;
+}
+
+static __device__ void as_rotation_matrix(float w, float x, float y, float z,
+    float* m) {
+  normalize(&w, &x, &y, &z);
+  m[0] = diag(y, z);  m[1] = tr_sub(x, y, z, w);  m[2] = tr_add(x, z, y, w);
+  m[3] = tr_add(x, y, z, w);  m[4] = diag(x, z);  m[5] = tr_sub(y, z, x, w);
+  m[6] = tr_sub(x, z, y, w);  m[7] = tr_add(y, z, x, w);  m[8] = diag(x, y);
+}
+
+static __device__ void conjugate(float* w, float* x, float* y, float* z) {
+  (*x) = -(*x);  (*y) = -(*y);  (*z) = -(*z);
+}
+
+// one thread per point, the distances to the cubes stay in registers
+static __global__ void assign_nearest_cube(const int nthreads,
+    const int n_cube, const float* in_z, const float* in_q, const float* in_t,
+    const float* in_pos, int* index, float* distance, int* count) {
+  CUDA_1D_KERNEL_LOOP(i, nthreads) {
+    int batch_index = static_cast<int>(in_pos[3 * nthreads + i]);
+    int offset = batch_index * n_cube;
+    float min_val = 0;
+    int min_idx = 0;
+    for (int c = 0; c < n_cube; ++c) {
+      const float* z = in_z + (offset + c) * 3;
+      const float* q = in_q + (offset + c) * 4;
+      const float* t = in_t + (offset + c) * 3;
+      float px = in_pos[0 * nthreads + i] - t[0];
+      float py = in_pos[1 * nthreads + i] - t[1];
+      float pz = in_pos[2 * nthreads + i] - t[2];
+      float qw = q[0], qx = q[1], qy = q[2], qz = q[3];
+      float rotation_matrix[9];
+      conjugate(&qw, &qx, &qy, &qz);
+      as_rotation_matrix(qw, qx, qy, qz, rotation_matrix);
+      matvec_kernel(rotation_matrix, &px, &py, &pz);
+      float dx = MAX(abs(px) - z[0], 0);
+      float dy = MAX(abs(py) - z[1], 0);
+      float dz = MAX(abs(pz) - z[2], 0);
+      float d = dx * dx + dy * dy + dz * dz;
+      if (c == 0 || d < min_val) {
+        min_val = d;
+        min_idx = c;
+      }
+    }
+    index[i] = offset + min_idx;
+    distance[i] = min_val;
+    CudaAtomicAdd(count + offset + min_idx, 1);
+  }
+}
+
+void assign_points_to_cubes(const GPUDevice& d, OpKernelContext* context,
+    const int n_point, const int n_cube, const int batch_size,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, const float* in_pos,
+    int* index, float* distance, int* count) {
+  primitive::gpu_set_zero(context, count, batch_size * n_cube);
+  if (n_point == 0 || n_cube == 0) return;
+
+  CudaLaunchConfig config = GetCudaLaunchConfig(n_point, d);
+  assign_nearest_cube
+      <<<config.block_count, config.thread_per_block, 0, d.stream()>>>(
+          n_point, n_cube, in_z, in_q, in_t, in_pos, index, distance, count);
+}
+
+}  // namespace tensorflow
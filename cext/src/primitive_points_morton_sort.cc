@@ -0,0 +1,170 @@
+#define EIGEN_USE_THREADS
+
+#include "tensorflow/core/framework/op.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/common_shape_fns.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <utility>
+
+#include "octree.h"
+
+namespace tensorflow {
+
+void morton_sort_points(const CPUDevice& d, OpKernelContext* context,
+    const int n_point, const int depth, const float* in_pos, float* out_pos,
+    int* out_index);
+
+REGISTER_OP("PrimitivePointsMortonSort")
+.Input("in_pos: float")
+.Attr("depth: int = 10")
+.Output("out_pos: float")
+.Output("out_index: int32")
+.SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
+  c->set_output(0, c->input(0));
+  c->set_output(1, c->MakeShape({ c->Dim(c->input(0), 1) }));
+  return Status::OK();
+})
+.Doc(R"doc(
+Sort the points [4, n_point] of each shape along a Morton curve, so that the
+loss kernels see spatially coherent runs of points. The bounding cube of each
+shape is split into 2^depth cells per axis, depth <= 16, and the shapes keep
+their order. out_pos[:, i] = in_pos[:, out_index[i]], the per-point results
+computed on out_pos go back to the original order by gathering them with
+tf.invert_permutation(out_index).
+)doc");
+
+class PrimitivePointsMortonSortOp : public OpKernel {
+ public:
+  explicit PrimitivePointsMortonSortOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("depth", &this->depth_));
+    OP_REQUIRES(context, depth_ >= 1 && depth_ <= 16,
+        errors::InvalidArgument("depth should be in [1, 16]"));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    // in_pos [4, n_point]
+    const Tensor& in_pos = context->input(0);
+    OP_REQUIRES(context, in_pos.dims() == 2 && in_pos.dim_size(0) == 4,
+        errors::InvalidArgument("in_pos should be [4, n_point]"));
+    auto in_pos_ptr = in_pos.flat<float>().data();
+    const int n_point = in_pos.dim_size(1);
+    for (int i = 0; i < n_point; ++i) {
+      OP_REQUIRES(context, in_pos_ptr[3 * n_point + i] >= 0,
+          errors::InvalidArgument("the batch index should not be negative"));
+    }
+
+    // out pos
+    Tensor* pos_output_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_pos",
+                                in_pos.shape(), &pos_output_tensor));
+    auto pos_output_ptr = pos_output_tensor->flat<float>().data();
+
+    // out index
+    Tensor* index_output_tensor = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output("out_index",
+                                TensorShape({ n_point }),
+                                &index_output_tensor));
+    auto index_output_ptr = index_output_tensor->flat<int>().data();
+
+    morton_sort_points(context->eigen_device<CPUDevice>(), context, n_point,
+        depth_, in_pos_ptr, pos_output_ptr, index_output_ptr);
+  }
+
+ private:
+  int depth_;
+};
+REGISTER_KERNEL_BUILDER(Name("PrimitivePointsMortonSort").Device(DEVICE_CPU),
+    PrimitivePointsMortonSortOp);
+
+void morton_sort_points(const CPUDevice& d, OpKernelContext* context,
+    const int n_point, const int depth, const float* in_pos, float* out_pos,
+    int* out_index) {
+  const float* batch_index = in_pos + 3 * n_point;
+
+  // the runs of points with the same batch index, sorted one by one when the
+  // shapes are contiguous, otherwise all the points are sorted at once by
+  // the batch index and the code
+  std::vector<int> run = { 0 };
+  bool contiguous = true;
+  for (int i = 1; i < n_point; ++i) {
+    if (batch_index[i] == batch_index[i - 1]) continue;
+    contiguous &= batch_index[i] > batch_index[i - 1];
+    run.push_back(i);
+  }
+  run.push_back(n_point);
+  if (!contiguous) run = { 0, n_point };
+  const int n_run = run.size() - 1;
+
+  // the bounding box of each shape
+  int batch_size = 0;
+  for (int i = 0; i < n_point; ++i) {
+    batch_size = std::max(batch_size, static_cast<int>(batch_index[i]) + 1);
+  }
+  std::vector<float> bbox_min(3 * batch_size, FLT_MAX);
+  std::vector<float> bbox_max(3 * batch_size, -FLT_MAX);
+  for (int i = 0; i < n_point; ++i) {
+    const int b = static_cast<int>(batch_index[i]);
+    for (int c = 0; c < 3; ++c) {
+      const float p = in_pos[c * n_point + i];
+      bbox_min[3 * b + c] = std::min(bbox_min[3 * b + c], p);
+      bbox_max[3 * b + c] = std::max(bbox_max[3 * b + c], p);
+    }
+  }
+
+  // the codes of the points in the cells of the bounding cube, with the
+  // batch index above the 48 bits of the code and the point index as the
+  // tie break, so the order does not depend on the sort
+  std::vector<std::pair<uint64, int>> entries(n_point);
+  const float n_cell = static_cast<float>(1 << depth);
+  d.parallelFor(n_run, Eigen::TensorOpCost(16.0 * n_point / n_run,
+      16.0 * n_point / n_run, 300.0 * n_point / n_run),
+      [&](Eigen::Index begin, Eigen::Index end) {
+    std::vector<uint64> xyz;
+    for (Eigen::Index r = begin; r < end; ++r) {
+      const int first = run[r], num = run[r + 1] - run[r];
+      xyz.resize(num);
+      for (int j = 0; j < num; ++j) {
+        const int i = first + j;
+        const int b = static_cast<int>(batch_index[i]);
+        const float* lo = bbox_min.data() + 3 * b;
+        const float* hi = bbox_max.data() + 3 * b;
+        const float extent = std::max(std::max(hi[0] - lo[0], hi[1] - lo[1]),
+                                      hi[2] - lo[2]);
+        const float scale = extent > 0 ? n_cell / extent : 0;
+        uint64 key = 0;
+        for (int c = 0; c < 3; ++c) {
+          const float x = (in_pos[c * n_point + i] - lo[c]) * scale;
+          const uint64 cell = std::min(static_cast<uint64>(x),
+                                       static_cast<uint64>(n_cell - 1));
+          key |= cell << 16 * c;
+        }
+        xyz[j] = key;
+      }
+      octree::morton_encode64(xyz.data(), xyz.data(), num);
+      for (int j = 0; j < num; ++j) {
+        const int i = first + j;
+        const uint64 b = static_cast<uint64>(batch_index[i]);
+        entries[i] = std::make_pair(b << 48 | xyz[j], i);
+      }
+      std::sort(entries.begin() + first, entries.begin() + first + num);
+    }
+  });
+
+  // gather the points in the sorted order
+  d.parallelFor(n_point, Eigen::TensorOpCost(16, 20, 4),
+      [&](Eigen::Index begin, Eigen::Index end) {
+    for (Eigen::Index i = begin; i < end; ++i) {
+      const int k = entries[i].second;
+      out_index[i] = k;
+      for (int c = 0; c < 4; ++c) {
+        out_pos[c * n_point + i] = in_pos[c * n_point + k];
+      }
+    }
+  });
+}
+
+}  // namespace tensorflow
@@ -1,12 +1,23 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+
 namespace tensorflow {
 
-void suffix_index_to_points(OpKernelContext* context, const int batch_size,
-    const int n_point, const float* in_points, float* out_pos);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+void suffix_index_to_points(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_point, const float* in_points,
+    float* out_pos);
+void suffix_index_to_points(const GPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_point, const float* in_points,
+    float* out_pos);
 
 
 REGISTER_OP("PrimitivePointsSuffixIndex")
@@ -20,6 +31,7 @@ REGISTER_OP("PrimitivePointsSuffixIndex")
 Add batch inner index to each points as the 4th dimension.
 )doc");
 
+template <typename Device>
 class PrimitivePointsSuffixIndexOp : public OpKernel {
  public:
   explicit PrimitivePointsSuffixIndexOp(OpKernelConstruction* context)
@@ -40,15 +52,33 @@ class PrimitivePointsSuffixIndexOp : public OpKernel {
     auto pos_output_ptr = pos_output_tensor->flat<float>().data();
 
     // add index to position
-    suffix_index_to_points(context, batch_size_, n_point_, in_points_ptr,
-        pos_output_ptr);
+    suffix_index_to_points(context->eigen_device<Device>(), context,
+        batch_size_, n_point_, in_points_ptr, pos_output_ptr);
   }
 
  private:
   int batch_size_;
   int n_point_;
 };
+REGISTER_KERNEL_BUILDER(Name("PrimitivePointsSuffixIndex").Device(DEVICE_CPU),
+    PrimitivePointsSuffixIndexOp<CPUDevice>);
+#if GOOGLE_CUDA
 REGISTER_KERNEL_BUILDER(Name("PrimitivePointsSuffixIndex").Device(DEVICE_GPU),
-    PrimitivePointsSuffixIndexOp);
+    PrimitivePointsSuffixIndexOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+void suffix_index_to_points(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_point, const float* in_points,
+    float* out_pos) {
+  int n = batch_size * n_point;
+  for (int b = 0; b < batch_size; ++b) {
+    for (int k = 0; k < 3; ++k) {
+      memcpy(out_pos + k * n + b * n_point,
+             in_points + (b * 3 + k) * n_point, n_point * sizeof(float));
+    }
+    std::fill_n(out_pos + 3 * n + b * n_point, n_point,
+                static_cast<float>(b));
+  }
+}
 
 }  // namespace tensorflow
@@ -23,10 +23,9 @@ static __global__ void suffix_index_to_points_kernel(const int nthreads,
   }
 }
 
-void suffix_index_to_points(OpKernelContext* context, const int batch_size,
-    const int n_point, const float* in_points, float* out_pos) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void suffix_index_to_points(const GPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_point, const float* in_points,
+    float* out_pos) {
   int nthreads = batch_size * n_point;
   CudaLaunchConfig config = GetCudaLaunchConfig(nthreads, d);
   suffix_index_to_points_kernel
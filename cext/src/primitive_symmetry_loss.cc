@@ -1,23 +1,43 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+#include "scratch_arena.h"
+
 namespace tensorflow {
 
-void compute_symmetry_loss(OpKernelContext* context, const int n_cube,
-    const int batch_size, const int depth, const float scale,
-    const float* in_z, const float* in_q, const float* in_t, float* loss_ptr);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+void compute_symmetry_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const int depth, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr);
+void compute_symmetry_loss(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const int depth, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr);
 
-void compute_symmetry_loss_grad(OpKernelContext* context, const int n_cube,
-    const int batch_size, const int depth, const float scale,
+void compute_symmetry_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const int depth, const float scale,
     const float* loss, const float* in_z, const float* in_q, const float* in_t,
-    float* grad_z, float* grad_q, float* grad_t);
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t);
+void compute_symmetry_loss_grad(const GPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const int depth, const float scale,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t);
 
 REGISTER_OP("PrimitiveSymmetryLoss")
 .Input("in_z: float")
 .Input("in_q: float")
 .Input("in_t: float")
+.Input("in_transforms: float")
 .Attr("scale: float = 0.9")
 .Attr("depth: int = 5")
 .Output("out_loss: float")
@@ -30,6 +50,7 @@ Sample points in cube volume, flip them along symmetry plane. The group of
 point cloud sampled on one cube should be covered by one cube (maybe itself).
 )doc");
 
+template <typename Device>
 class PrimitiveSymmetryLossOp : public OpKernel {
  public:
   explicit PrimitiveSymmetryLossOp(OpKernelConstruction* context)
@@ -57,6 +78,11 @@ class PrimitiveSymmetryLossOp : public OpKernel {
     CHECK_EQ(in_t.dim_size(0), batch_size_);
     CHECK_EQ(in_t.dim_size(1), n_cube_ * 3);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(3),
+                                batch_size_ * n_cube_, &transforms));
+
     // out loss
     Tensor* out_loss = nullptr;
     TensorShape out_loss_shape({1});
@@ -65,8 +91,9 @@ class PrimitiveSymmetryLossOp : public OpKernel {
     auto out_loss_ptr = out_loss->flat<float>().data();
   
     // compute symmetry loss
-    compute_symmetry_loss(context, n_cube_, batch_size_, depth_, scale_,
-        in_z_ptr, in_q_ptr, in_t_ptr, out_loss_ptr);
+    compute_symmetry_loss(context->eigen_device<Device>(), context, n_cube_,
+        batch_size_, depth_, scale_, in_z_ptr, in_q_ptr, in_t_ptr, transforms,
+        out_loss_ptr);
   }
 
  private:
@@ -75,8 +102,14 @@ class PrimitiveSymmetryLossOp : public OpKernel {
   int depth_;  // octree node depth, for computing symmetry plane location
   float scale_;  // scale of sampled points inside cube
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveSymmetryLoss").Device(DEVICE_GPU),
-    PrimitiveSymmetryLossOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveSymmetryLoss").Device(DEVICE_CPU),
+    PrimitiveSymmetryLossOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveSymmetryLoss").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveSymmetryLossOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
 
 
 REGISTER_OP("PrimitiveSymmetryLossGrad")
@@ -84,6 +117,7 @@ REGISTER_OP("PrimitiveSymmetryLossGrad")
 .Input("in_z: float")
 .Input("in_q: float")
 .Input("in_t: float")
+.Input("in_transforms: float")
 .Attr("scale: float")
 .Attr("depth: int")
 .Output("grad_z: float")
@@ -99,6 +133,7 @@ REGISTER_OP("PrimitiveSymmetryLossGrad")
 Gradient for the primitive symmetry loss;
 )doc");
 
+template <typename Device>
 class PrimitiveSymmetryLossGradOp : public OpKernel {
  public:
   explicit PrimitiveSymmetryLossGradOp(OpKernelConstruction* context)
@@ -130,6 +165,11 @@ class PrimitiveSymmetryLossGradOp : public OpKernel {
     CHECK_EQ(in_t.dim_size(0), batch_size_);
     CHECK_EQ(in_t.dim_size(1), n_cube_ * 3);
 
+    // in_transforms [27, stride], the transforms of (in_z, in_q, in_t)
+    primitive::CubeTransforms transforms;
+    OP_REQUIRES_OK(context, primitive::get_cube_transforms(context->input(4),
+                                batch_size_ * n_cube_, &transforms));
+
 
     // grad_z
     Tensor* grad_z = nullptr;
@@ -153,9 +193,9 @@ class PrimitiveSymmetryLossGradOp : public OpKernel {
     auto grad_t_ptr = grad_t->flat<float>().data();
 
     // compute symmetry loss gradient
-    compute_symmetry_loss_grad(context, n_cube_, batch_size_, depth_,
-        scale_, gradients_ptr, in_z_ptr, in_q_ptr, in_t_ptr, grad_z_ptr,
-        grad_q_ptr, grad_t_ptr);
+    compute_symmetry_loss_grad(context->eigen_device<Device>(), context,
+        n_cube_, batch_size_, depth_, scale_, gradients_ptr, in_z_ptr, in_q_ptr,
+        in_t_ptr, transforms, grad_z_ptr, grad_q_ptr, grad_t_ptr);
   }
 
  private:
@@ -164,7 +204,167 @@ class PrimitiveSymmetryLossGradOp : public OpKernel {
   int depth_;
   float scale_;  // scale of sampled points inside cube
 };
-REGISTER_KERNEL_BUILDER(Name("PrimitiveSymmetryLossGrad").Device(DEVICE_GPU),
-    PrimitiveSymmetryLossGradOp);
+REGISTER_KERNEL_BUILDER(Name("PrimitiveSymmetryLossGrad").Device(DEVICE_CPU),
+    PrimitiveSymmetryLossGradOp<CPUDevice>);
+#if GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("PrimitiveSymmetryLossGrad").Device(DEVICE_GPU)
+        .HostMemory("in_transforms"),
+    PrimitiveSymmetryLossGradOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+static void get_symmetry_group_distance_cpu(const CPUDevice& d,
+    const int n_cube, const int batch_size, const int n_sample_point,
+    const float symmetry_plane, const float* sample_points,
+    const primitive::CubeTransforms& transforms, float* group_cube_distance,
+    int* min_distance_cube_index) {
+  // mean distance between the flipped sample points of each cube and every
+  // cube of the same shape, and the nearest one of them
+  d.parallelFor(batch_size * n_cube,
+      Eigen::TensorOpCost(40 * n_cube, 4 * n_cube,
+                          140 * n_cube * n_sample_point),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index k = begin; k < end; ++k) {
+          int batch_index = k / n_cube;
+          float* distance = group_cube_distance + k * n_cube;
+          for (int i = 0; i < n_cube; ++i) distance[i] = 0;
+          for (int j = 0; j < n_sample_point; ++j) {
+            float s[3] = { sample_points[0 * n_sample_point + j],
+                           sample_points[1 * n_sample_point + j],
+                           sample_points[2 * n_sample_point + j] };
+            float p[3];
+            primitive::transform_sample_point(s, transforms, k, p);
+            p[2] = symmetry_plane - (p[2] - symmetry_plane);
+            for (int i = 0; i < n_cube; ++i) {
+              int kd = batch_index * n_cube + i;
+              distance[i] += primitive::point_cube_distance(p, transforms, kd) /
+                  n_sample_point;
+            }
+          }
+          int min_idx = 0;
+          for (int i = 1; i < n_cube; ++i) {
+            if (distance[i] < distance[min_idx]) min_idx = i;
+          }
+          min_distance_cube_index[k] = min_idx;
+        }
+      });
+}
+
+void compute_symmetry_loss(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const int depth, const float scale,
+    const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* loss_ptr) {
+  // sample points in cube volume
+  std::vector<float> cube_volume_points;
+  primitive::cube_volume_samples(scale, &cube_volume_points);
+  int n_sample_point = cube_volume_points.size() / 3;
+
+  // flip points along z = 0.5 - 0.5/(2**depth) plane
+  float symmetry_plane = static_cast<float>(0.5 * (1.0 - 1.0 / pow(2, depth)));
+
+  // aggregate group points distance, [batch_size, n_cube, n_cube]
+  Tensor group_cube_distance;
+  const TensorShape group_cube_distance_shape({batch_size, n_cube, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              group_cube_distance_shape,
+                              &group_cube_distance));
+  auto group_cube_distance_ptr = group_cube_distance.flat<float>().data();
+
+  // get min distance cube index
+  Tensor min_distance_cube_index;
+  const TensorShape min_distance_cube_index_shape({batch_size, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              min_distance_cube_index_shape,
+                              &min_distance_cube_index));
+  auto min_distance_cube_index_ptr =
+      min_distance_cube_index.flat<int>().data();
+  get_symmetry_group_distance_cpu(d, n_cube, batch_size, n_sample_point,
+      symmetry_plane, cube_volume_points.data(), transforms,
+      group_cube_distance_ptr, min_distance_cube_index_ptr);
+
+  // get symmetry loss
+  float loss = 0;
+  for (int i = 0; i < batch_size * n_cube; ++i) {
+    loss += group_cube_distance_ptr[i * n_cube +
+        min_distance_cube_index_ptr[i]] / (batch_size * n_cube);
+  }
+  *loss_ptr = loss;
+}
+
+void compute_symmetry_loss_grad(const CPUDevice& d, OpKernelContext* context,
+    const int n_cube, const int batch_size, const int depth, const float scale,
+    const float* loss, const float* in_z, const float* in_q, const float* in_t,
+    const primitive::CubeTransforms& transforms, float* grad_z, float* grad_q,
+    float* grad_t) {
+  /// -- prepare forward medial data for gradient computation --
+  // sample points in cube volume
+  std::vector<float> cube_volume_points;
+  primitive::cube_volume_samples(scale, &cube_volume_points);
+  int n_sample_point = cube_volume_points.size() / 3;
+
+  // flip points along z = 0.5 - 0.5/(2**depth) plane
+  float symmetry_plane = static_cast<float>(0.5 * (1.0 - 1.0 / pow(2, depth)));
+
+  // aggregate group points distance, [batch_size, n_cube, n_cube]
+  Tensor group_cube_distance;
+  const TensorShape group_cube_distance_shape({batch_size, n_cube, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_FLOAT,
+                              group_cube_distance_shape,
+                              &group_cube_distance));
+  auto group_cube_distance_ptr = group_cube_distance.flat<float>().data();
+
+  // get min distance cube index
+  Tensor min_distance_cube_index;
+  const TensorShape min_distance_cube_index_shape({batch_size, n_cube});
+  OP_REQUIRES_OK(context, allocate_scratch(d, context, DT_INT32,
+                              min_distance_cube_index_shape,
+                              &min_distance_cube_index));
+  auto min_distance_cube_index_ptr =
+      min_distance_cube_index.flat<int>().data();
+  get_symmetry_group_distance_cpu(d, n_cube, batch_size, n_sample_point,
+      symmetry_plane, cube_volume_points.data(), transforms,
+      group_cube_distance_ptr, min_distance_cube_index_ptr);
+  /// ----------------------------------------------------------
+
+  // init zero gradient
+  memset(grad_z, 0, sizeof(float) * batch_size * n_cube * 3);
+  memset(grad_q, 0, sizeof(float) * batch_size * n_cube * 4);
+  memset(grad_t, 0, sizeof(float) * batch_size * n_cube * 3);
+
+  // gradient w.r.t. (z, q, t), through the nearest cube of each flipped cube
+  // and then through the flipped sample points, split by shape since both
+  // cubes belong to the same shape
+  const float grad_distance = (*loss) / (batch_size * n_cube) /
+      n_sample_point;
+  d.parallelFor(batch_size,
+      Eigen::TensorOpCost(40 * n_cube, 40 * n_cube,
+                          400 * n_cube * n_sample_point),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index batch_index = begin; batch_index < end;
+             ++batch_index) {
+          for (int c = 0; c < n_cube; ++c) {
+            int k = batch_index * n_cube + c;
+            int kd = batch_index * n_cube + min_distance_cube_index_ptr[k];
+            for (int j = 0; j < n_sample_point; ++j) {
+              float s[3] = { cube_volume_points[0 * n_sample_point + j],
+                             cube_volume_points[1 * n_sample_point + j],
+                             cube_volume_points[2 * n_sample_point + j] };
+              float p[3];
+              primitive::transform_sample_point(s, transforms, k, p);
+              p[2] = symmetry_plane - (p[2] - symmetry_plane);
+              float grad_p[3] = { 0.0f, 0.0f, 0.0f };
+              primitive::grad_point_cube_distance(p, transforms, kd,
+                  in_q + kd * 4, grad_distance, grad_z + kd * 3,
+                  grad_q + kd * 4, grad_t + kd * 3, grad_p);
+              // flip gradient for z axis
+              grad_p[2] *= -1.0f;
+              primitive::grad_transform_sample_point(s, transforms, k,
+                  in_q + k * 4, grad_p, grad_z + k * 3, grad_q + k * 4,
+                  grad_t + k * 3);
+            }
+          }
+        }
+      });
+}
 
 }  // namespace tensorflow
@@ -1,19 +1,34 @@
+#define EIGEN_USE_THREADS
+
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/framework/common_shape_fns.h"
 
+#include "primitive_util.h"
+
 namespace tensorflow {
 
-void correct_tree_mask(OpKernelContext* context, const int batch_size,
-    const int n_part_1, const int n_part_2, const int n_part_3,
-    const int* in_relation_1, const int* in_relation_2, const int* in_mask,
-    int* mask);
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
 
-void lift_up_tree_mask(OpKernelContext* context, const int batch_size,
-    const int n_part_1, const int n_part_2, const int n_part_3,
-    const int* in_relation_1, const int* in_relation_2, const int* tree_mask_1,
-    int* tree_mask_2, int* tree_mask_3);
+void correct_tree_mask(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_part_1, const int n_part_2,
+    const int n_part_3, const int* in_relation_1, const int* in_relation_2,
+    const int* in_mask, int* mask);
+void correct_tree_mask(const GPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_part_1, const int n_part_2,
+    const int n_part_3, const int* in_relation_1, const int* in_relation_2,
+    const int* in_mask, int* mask);
+
+void lift_up_tree_mask(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_part_1, const int n_part_2,
+    const int n_part_3, const int* in_relation_1, const int* in_relation_2,
+    const int* tree_mask_1, int* tree_mask_2, int* tree_mask_3);
+void lift_up_tree_mask(const GPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_part_1, const int n_part_2,
+    const int n_part_3, const int* in_relation_1, const int* in_relation_2,
+    const int* tree_mask_1, int* tree_mask_2, int* tree_mask_3);
 
 REGISTER_OP("PrimitiveTreeGeneration")
 .Input("in_mask: int32")
@@ -37,6 +52,7 @@ Output three level selected trees.
 )doc");
 
 
+template <typename Device>
 class PrimitiveTreeGenerationOp : public OpKernel {
  public:
   explicit PrimitiveTreeGenerationOp(OpKernelConstruction* context)
@@ -82,13 +98,14 @@ class PrimitiveTreeGenerationOp : public OpKernel {
     auto out_tree_mask_3_ptr = out_tree_mask_3->flat<int>().data();
 
     // correct input tree mask, get the tree_mask_1
-    correct_tree_mask(context, batch_size_, n_part_1_, n_part_2_, n_part_3_,
-        in_relation_1_ptr, in_relation_2_ptr, in_mask_ptr, out_tree_mask_1_ptr);
+    correct_tree_mask(context->eigen_device<Device>(), context, batch_size_,
+        n_part_1_, n_part_2_, n_part_3_, in_relation_1_ptr, in_relation_2_ptr,
+        in_mask_ptr, out_tree_mask_1_ptr);
 
     // lift up tree mask to get tree_mask_2 and tree_mask_3
-    lift_up_tree_mask(context, batch_size_, n_part_1_, n_part_2_, n_part_3_,
-        in_relation_1_ptr, in_relation_2_ptr, out_tree_mask_1_ptr,
-        out_tree_mask_2_ptr, out_tree_mask_3_ptr);
+    lift_up_tree_mask(context->eigen_device<Device>(), context, batch_size_,
+        n_part_1_, n_part_2_, n_part_3_, in_relation_1_ptr, in_relation_2_ptr,
+        out_tree_mask_1_ptr, out_tree_mask_2_ptr, out_tree_mask_3_ptr);
   }
 
  private:
@@ -98,7 +115,227 @@ class PrimitiveTreeGenerationOp : public OpKernel {
   int n_part_sum_;
   int batch_size_;
 };
+REGISTER_KERNEL_BUILDER(Name("PrimitiveTreeGeneration").Device(DEVICE_CPU),
+    PrimitiveTreeGenerationOp<CPUDevice>);
+#if GOOGLE_CUDA
 REGISTER_KERNEL_BUILDER(Name("PrimitiveTreeGeneration").Device(DEVICE_GPU),
-    PrimitiveTreeGenerationOp);
+    PrimitiveTreeGenerationOp<GPUDevice>);
+#endif  // GOOGLE_CUDA
+
+// host version of correct_tree_mask_kernal, for a single tree
+static void correct_single_tree_mask(const int n_part_1,
+    const int n_part_2, const int n_part_3, const int* in_relation_1,
+    const int* in_relation_2, int* mask) {
+  int* mask_ptr = mask;
+  int* mask_1_ptr = mask_ptr;
+  int* mask_2_ptr = mask_ptr + n_part_1;
+  int* mask_3_ptr = mask_ptr + n_part_1 + n_part_2;
+  const int* relation_1_ptr = in_relation_1;
+  const int* relation_2_ptr = in_relation_2;
+  int i, j, k;
+  // when level 3 is 1, if it has no children in level 2, or its children has
+  // no children in level 1, set level 3 as 0
+  for (i = 0; i < n_part_3; ++i) {
+    if (mask_3_ptr[i] == 1) {
+      mask_3_ptr[i] = 0;
+      for (j = 0; j < n_part_2; ++j) {
+        if (relation_2_ptr[j] == i) {
+          for (k = 0; k < n_part_1; ++k) {
+            if (relation_1_ptr[k] == j) {
+              mask_3_ptr[i] = 1;
+              break;
+            }
+          }
+          if (mask_3_ptr[i] == 1) {
+            break;
+          }
+        }
+      }
+    }
+  }
+  // when level 2 is 1, if it has no children in level 1, set level 2 as 0
+  for (i = 0; i < n_part_2; ++i) {
+    if (mask_2_ptr[i] == 1) {
+      mask_2_ptr[i] = 0;
+      for (j = 0; j < n_part_1; ++j) {
+        if (relation_1_ptr[j] == i) {
+          mask_2_ptr[i] = 1;
+          break;
+        }
+      }
+    }
+  }
+  // when level 3 is 1, set its next two level children as 0
+  for (i = 0; i < n_part_3; ++i) {
+    if (mask_3_ptr[i] == 1) {
+      for (j = 0; j < n_part_2; ++j) {
+        if (relation_2_ptr[j] == i) {
+          mask_2_ptr[j] = 0;
+          for (k = 0; k < n_part_1; ++k) {
+            if (relation_1_ptr[k] == j) {
+              mask_1_ptr[k] = 0;
+            }
+          }
+        }
+      }
+    }
+  }
+  // when level 2 is 1, set his children as 0
+  for (i = 0; i < n_part_2; ++i) {
+    if (mask_2_ptr[i] == 1) {
+      for (j = 0; j < n_part_1; ++j) {
+        if (relation_1_ptr[j] == i) {
+          mask_1_ptr[j] = 0;
+        }
+      }
+    }
+  }
+  // complete tree
+  for (i = 0; i < n_part_1; ++i) {
+    // the cube index of the path from leaf to root w.r.t. the ith cube in level 1
+    int level_1_index = i;
+    int level_2_index = relation_1_ptr[i];
+    int level_3_index = relation_2_ptr[level_2_index];
+    int fill_level = 0;
+    if (mask_1_ptr[level_1_index] + mask_2_ptr[level_2_index] +
+        mask_3_ptr[level_3_index] == 0) {
+      fill_level = 2;
+      // scan level 1 to find if other sibling cube is picked
+      for (j = 0; j < n_part_1; ++j) {
+        if (j != level_1_index && relation_1_ptr[j] == level_2_index) {
+          if (mask_1_ptr[j] == 1) {
+            fill_level = 1;
+            break;
+          }
+        }
+      }
+    }
+    // if no sibling cube is picked in level 1, check level 2
+    if (fill_level == 2) {
+      fill_level = 3;
+      for (j = 0; j < n_part_2; ++j) {
+        if (j != level_2_index && relation_2_ptr[j] == level_3_index) {
+          if (mask_2_ptr[j] == 1) {
+            fill_level = 2;
+            break;
+          }
+          for (k = 0; k < n_part_1; ++k) {
+            if (relation_1_ptr[k] == j) {
+              if (mask_1_ptr[k] == 1) {
+                fill_level = 2;
+                break;
+              }
+            }
+          }
+        }
+      }
+    }
+    if (fill_level != 0) {
+      switch(fill_level) {
+        case 1: mask_1_ptr[level_1_index] = 1; break;
+        case 2: mask_2_ptr[level_2_index] = 1; break;
+        case 3: mask_3_ptr[level_3_index] = 1; break;
+      }
+    }
+  }
+
+  // if the path from bottom to top is a one cube branch, set the top level
+  // as 1 and its all children to 0
+  for (i = 0; i < n_part_1; ++i) {
+    // the cube index of the path from leaf to root w.r.t. the ith cube in level 1
+    int level_1_index = i;
+    int level_2_index = relation_1_ptr[i];
+    int level_3_index = relation_2_ptr[level_2_index];
+    int level_1_cube_number = 0;
+    int level_2_cube_number = 0;
+    // count level 2 co-parent cube number
+    for (j = 0; j < n_part_2; ++j) {
+      if (relation_2_ptr[j] == level_3_index) {
+        level_2_cube_number++;
+      }
+    }
+    // count level 1 co-parent cube number
+    for (j = 0; j < n_part_1; ++j) {
+      if (relation_1_ptr[j] == level_2_index) {
+        level_1_cube_number++;
+      }
+    }
+    // if level 3 has one children and level 2 has one children
+    if (level_2_cube_number == 1 && level_1_cube_number == 1) {
+      if (mask_1_ptr[level_1_index] == 1 || mask_2_ptr[level_2_index] == 1 ||
+        mask_3_ptr[level_3_index] == 1) {
+        mask_3_ptr[level_3_index] = 1;
+        mask_1_ptr[level_1_index] = 0;
+        mask_2_ptr[level_2_index] = 0;
+      }
+    }
+    // if level 3 has one children
+    if (level_2_cube_number == 1 && level_1_cube_number > 1) {
+      if (mask_2_ptr[level_2_index] == 1 || mask_3_ptr[level_3_index] == 1) {
+        mask_3_ptr[level_3_index] = 1;
+        mask_2_ptr[level_2_index] = 0;
+      }
+    }
+    // if level 2 has one children
+    if (level_2_cube_number > 1 && level_1_cube_number == 1) {
+      if (mask_1_ptr[level_1_index] == 1 || mask_2_ptr[level_2_index] == 1) {
+        mask_2_ptr[level_2_index] = 1;
+        mask_1_ptr[level_1_index] = 0;
+      }
+    }
+  }
+}
+
+void correct_tree_mask(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_part_1, const int n_part_2,
+    const int n_part_3, const int* in_relation_1, const int* in_relation_2,
+    const int* in_mask, int* mask) {
+  // copy mask
+  int n_part_sum = n_part_1 + n_part_2 + n_part_3;
+  memcpy(mask, in_mask, sizeof(int)*batch_size*n_part_sum);
+  // correct each tree in batch
+  int cost = n_part_1 * (n_part_1 + n_part_2) * 4;
+  d.parallelFor(batch_size, Eigen::TensorOpCost(4 * n_part_sum,
+      4 * n_part_sum, cost), [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index i = begin; i < end; ++i) {
+          correct_single_tree_mask(n_part_1, n_part_2, n_part_3,
+              in_relation_1 + i*n_part_1, in_relation_2 + i*n_part_2,
+              mask + i*n_part_sum);
+        }
+      });
+}
+
+void lift_up_tree_mask(const CPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_part_1, const int n_part_2,
+    const int n_part_3, const int* in_relation_1, const int* in_relation_2,
+    const int* tree_mask_1, int* tree_mask_2, int* tree_mask_3) {
+  int n_part_sum = n_part_1 + n_part_2 + n_part_3;
+  // lift up tree to level 2
+  memcpy(tree_mask_2, tree_mask_1, sizeof(int)*batch_size*n_part_sum);
+  for (int b = 0; b < batch_size; ++b) {
+    int* mask_1_ptr = tree_mask_2 + b*n_part_sum;
+    int* mask_2_ptr = mask_1_ptr + n_part_1;
+    const int* relation_1_ptr = in_relation_1 + b*n_part_1;
+    for (int i = 0; i < n_part_1; ++i) {
+      if (mask_1_ptr[i] == 1) {
+        mask_1_ptr[i] = 0;
+        mask_2_ptr[relation_1_ptr[i]] = 1;
+      }
+    }
+  }
+  // lift up tree to level 3
+  memcpy(tree_mask_3, tree_mask_2, sizeof(int)*batch_size*n_part_sum);
+  for (int b = 0; b < batch_size; ++b) {
+    int* mask_2_ptr = tree_mask_3 + b*n_part_sum + n_part_1;
+    int* mask_3_ptr = mask_2_ptr + n_part_2;
+    const int* relation_2_ptr = in_relation_2 + b*n_part_2;
+    for (int i = 0; i < n_part_2; ++i) {
+      if (mask_2_ptr[i] == 1) {
+        mask_2_ptr[i] = 0;
+        mask_3_ptr[relation_2_ptr[i]] = 1;
+      }
+    }
+  }
+}
 
 }  // namespace tensorflow
@@ -213,12 +213,10 @@ static __global__ void lift_up_tree_mask_level_3(const int nthreads,
   }
 }
 
-void correct_tree_mask(OpKernelContext* context, const int batch_size,
-    const int n_part_1, const int n_part_2, const int n_part_3,
-    const int* in_relation_1, const int* in_relation_2, const int* in_mask,
-    int* mask) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void correct_tree_mask(const GPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_part_1, const int n_part_2,
+    const int n_part_3, const int* in_relation_1, const int* in_relation_2,
+    const int* in_mask, int* mask) {
   CudaLaunchConfig config;
   int nthreads;
 
@@ -236,12 +234,10 @@ void correct_tree_mask(OpKernelContext* context, const int batch_size,
           mask);
 }
 
-void lift_up_tree_mask(OpKernelContext* context, const int batch_size,
-    const int n_part_1, const int n_part_2, const int n_part_3,
-    const int* in_relation_1, const int* in_relation_2, const int* tree_mask_1,
-    int* tree_mask_2, int* tree_mask_3) {
-  // get GPU device
-  GPUDevice d = context->eigen_device<GPUDevice>();
+void lift_up_tree_mask(const GPUDevice& d, OpKernelContext* context,
+    const int batch_size, const int n_part_1, const int n_part_2,
+    const int n_part_3, const int* in_relation_1, const int* in_relation_2,
+    const int* tree_mask_1, int* tree_mask_2, int* tree_mask_3) {
   int nthreads= batch_size;
   CudaLaunchConfig config = GetCudaLaunchConfig(nthreads, d);
 
@@ -0,0 +1,392 @@
+#define EIGEN_USE_THREADS
+
+#include "primitive_util.h"
+
+#include <algorithm>
+
+#include "point_kd_tree.h"
+
+namespace tensorflow {
+
+namespace primitive {
+
+#define SIGN(a) (((a)>=0)?(1):(-1))
+
+static float diag(const float a, const float b) {
+  return 1 - 2 * a * a - 2 * b * b;
+}
+
+static float tr_add(const float a, const float b, const float c,
+    const float d) {
+  return 2 * a * b + 2 * c * d;
+}
+
+static float tr_sub(const float a, const float b, const float c,
+    const float d) {
+  return 2 * a * b - 2 * c * d;
+}
+
+void as_rotation_matrix(float w, float x, float y, float z, float* m) {
+  normalize(&w, &x, &y, &z);
+  m[0] = diag(y, z);  m[1] = tr_sub(x, y, z, w);  m[2] = tr_add(x, z, y, w);
+  m[3] = tr_add(x, y, z, w);  m[4] = diag(x, z);  m[5] = tr_sub(y, z, x, w);
+  m[6] = tr_sub(x, z, y, w);  m[7] = tr_add(y, z, x, w);  m[8] = diag(x, y);
+}
+
+void grad_rotation_matrix_to_quaternion(const float* grad_rotation_matrix,
+    const float qw, const float qx, const float qy, const float qz, float* gqw,
+    float* gqx, float* gqy, float* gqz) {
+  const float* m = grad_rotation_matrix;
+  float w = qw, x = qx, y = qy, z = qz;
+  float w2 = w*w, x2 = x*x, y2 = y*y, z2 = z*z;
+  float wx = w*x, wy = w*y, wz = w*z, xy = x*y, xz = x*z, yz = y*z;
+  float s = 1.0 / (w2 + x2 + y2 + z2);  // devide -> multiple
+  float s2 = s*s;
+  *gqw =
+      m[0] * (4 * w*(y2 + z2)*s2) +
+      m[1] * (4 * w*(wz - xy)*s2 - 2 * z*s) +
+      m[2] * (2 * y*s - 4 * w*(wy + xz)*s2) +
+      m[3] * (2 * z*s - 4 * w*(wz + xy)*s2) +
+      m[4] * (4 * w*(x2 + z2)*s2) +
+      m[5] * (4 * w*(wx - yz)*s2 - 2 * x*s) +
+      m[6] * (4 * w*(wy - xz)*s2 - 2 * y*s) +
+      m[7] * (2 * x*s - 4 * w*(wx + yz)*s2) +
+      m[8] * (4 * w*(x2 + y2)*s2);
+  *gqx =
+      m[0] * (4 * x*(y2 + z2)*s2) +
+      m[1] * (4 * x*(wz - xy)*s2 + 2 * y*s) +
+      m[2] * (2 * z*s - 4 * x*(wy + xz)*s2) +
+      m[3] * (2 * y*s - 4 * x*(wz + xy)*s2) +
+      m[4] * (4 * x*(x2 + z2)*s2 - 4 * x*s) +
+      m[5] * (4 * x*(wx - yz)*s2 - 2 * w*s) +
+      m[6] * (4 * x*(wy - xz)*s2 + 2 * z*s) +
+      m[7] * (2 * w*s - 4 * x*(wx + yz)*s2) +
+      m[8] * (4 * x*(x2 + y2)*s2 - 4 * x*s);
+  *gqy =
+      m[0] * (4 * y*(y2 + z2)*s2 - 4 * y*s) +
+      m[1] * (4 * y*(wz - xy)*s2 + 2 * x*s) +
+      m[2] * (2 * w*s - 4 * y*(wy + xz)*s2) +
+      m[3] * (2 * x*s - 4 * y*(wz + xy)*s2) +
+      m[4] * (4 * y*(x2 + z2)*s2) +
+      m[5] * (4 * y*(wx - yz)*s2 + 2 * z*s) +
+      m[6] * (4 * y*(wy - xz)*s2 - 2 * w*s) +
+      m[7] * (2 * z*s - 4 * y*(wx + yz)*s2) +
+      m[8] * (4 * y*(x2 + y2)*s2 - 4 * y*s);
+  *gqz =
+      m[0] * (4 * z*(y2 + z2)*s2 - 4 * z*s) +
+      m[1] * (4 * z*(wz - xy)*s2 - 2 * w*s) +
+      m[2] * (2 * x*s - 4 * z*(wy + xz)*s2) +
+      m[3] * (2 * w*s - 4 * z*(wz + xy)*s2) +
+      m[4] * (4 * z*(x2 + z2)*s2 - 4 * z*s) +
+      m[5] * (4 * z*(wx - yz)*s2 + 2 * y*s) +
+      m[6] * (4 * z*(wy - xz)*s2 + 2 * x*s) +
+      m[7] * (2 * y*s - 4 * z*(wx + yz)*s2) +
+      m[8] * (4 * z*(x2 + y2)*s2);
+}
+
+void cube_transforms(const Eigen::ThreadPoolDevice& d, const int n_cube,
+    const float* in_z, const float* in_q, const float* in_t, const int stride,
+    float* transforms) {
+  d.parallelFor(n_cube, Eigen::TensorOpCost(40, 4 * kCubeTransformRows, 120),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index k = begin; k < end; ++k) {
+          float* out = transforms + k;
+          float m[9];
+          as_rotation_matrix(in_q[k * 4 + 0], in_q[k * 4 + 1],
+              in_q[k * 4 + 2], in_q[k * 4 + 3], m);
+          for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+              out[(kCubeRotation + 3 * i + j) * stride] = m[3 * i + j];
+              out[(kCubeRotationT + 3 * i + j) * stride] = m[3 * j + i];
+            }
+          }
+          const float* t = in_t + k * 3;
+          for (int i = 0; i < 3; ++i) {
+            out[(kCubeInvTranslation + i) * stride] =
+                -(m[i] * t[0] + m[3 + i] * t[1] + m[6 + i] * t[2]);
+            out[(kCubeHalfExtent + i) * stride] = in_z[k * 3 + i];
+            out[(kCubeTranslation + i) * stride] = t[i];
+          }
+        }
+      });
+}
+
+Status get_cube_transforms(const Tensor& tensor, const int n_cube,
+    CubeTransforms* transforms) {
+  const int stride = cube_transform_stride(n_cube);
+  if (tensor.dims() != 2 || tensor.dim_size(0) != kCubeTransformRows ||
+      tensor.dim_size(1) != stride) {
+    return errors::InvalidArgument("in_transforms should be [",
+        kCubeTransformRows, ", ", stride, "] for ", n_cube, " cubes");
+  }
+  transforms->data = tensor.flat<float>().data();
+  transforms->stride = stride;
+  return Status::OK();
+}
+
+void grad_to_cube_frame(const float* p, const CubeTransforms& c, const int k,
+    const float* q, const float* grad_local, float* gq, float* gt,
+    float* gp) {
+  float px = p[0] - c.at(kCubeTranslation + 0, k);
+  float py = p[1] - c.at(kCubeTranslation + 1, k);
+  float pz = p[2] - c.at(kCubeTranslation + 2, k);
+  float gdx = grad_local[0], gdy = grad_local[1], gdz = grad_local[2];
+  // gradient w.r.t. q, through R(conj(q))
+  {
+    float grad_rotation_matrix[9] = {
+        gdx * px, gdx * py, gdx * pz,
+        gdy * px, gdy * py, gdy * pz,
+        gdz * px, gdz * py, gdz * pz };
+    float gqw, gqx, gqy, gqz;
+    grad_rotation_matrix_to_quaternion(grad_rotation_matrix, q[0], -q[1],
+        -q[2], -q[3], &gqw, &gqx, &gqy, &gqz);
+    conjugate(&gqw, &gqx, &gqy, &gqz);
+    gq[0] += gqw;  gq[1] += gqx;  gq[2] += gqy;  gq[3] += gqz;
+  }
+  // R(conj(q))^T = R(q)
+  float g[3];
+  for (int i = 0; i < 3; ++i) {
+    g[i] = c.at(kCubeRotation + 3 * i + 0, k) * gdx +
+           c.at(kCubeRotation + 3 * i + 1, k) * gdy +
+           c.at(kCubeRotation + 3 * i + 2, k) * gdz;
+  }
+  // gradient w.r.t. t and p
+  gt[0] -= g[0];  gt[1] -= g[1];  gt[2] -= g[2];
+  if (gp != nullptr) {
+    gp[0] += g[0];  gp[1] += g[1];  gp[2] += g[2];
+  }
+}
+
+void grad_point_cube_distance(const float* p, const CubeTransforms& c,
+    const int k, const float* q, const float grad_distance, float* gz,
+    float* gq, float* gt, float* gp) {
+  float local[3], grad_local[3];
+  to_cube_frame(p, c, k, local);
+  for (int i = 0; i < 3; ++i) {
+    float d = std::abs(local[i]) - c.at(kCubeHalfExtent + i, k);
+    if (d > 0) {
+      grad_local[i] = grad_distance * 2 * d;
+      gz[i] -= grad_local[i];
+      grad_local[i] *= SIGN(local[i]);
+    }
+    else {
+      grad_local[i] = 0.0f;
+    }
+  }
+  grad_to_cube_frame(p, c, k, q, grad_local, gq, gt, gp);
+}
+
+void grad_transform_sample_point(const float* s, const CubeTransforms& c,
+    const int k, const float* q, const float* grad_p, float* gz, float* gq,
+    float* gt) {
+  float spx = s[0] * c.at(kCubeHalfExtent + 0, k);
+  float spy = s[1] * c.at(kCubeHalfExtent + 1, k);
+  float spz = s[2] * c.at(kCubeHalfExtent + 2, k);
+  float gdx = grad_p[0], gdy = grad_p[1], gdz = grad_p[2];
+  // gradient w.r.t. t
+  gt[0] += gdx;  gt[1] += gdy;  gt[2] += gdz;
+  // gradient w.r.t. q
+  {
+    float grad_rotation_matrix[9] = {
+        gdx * spx, gdx * spy, gdx * spz,
+        gdy * spx, gdy * spy, gdy * spz,
+        gdz * spx, gdz * spy, gdz * spz };
+    float gqw, gqx, gqy, gqz;
+    grad_rotation_matrix_to_quaternion(grad_rotation_matrix, q[0], q[1], q[2],
+        q[3], &gqw, &gqx, &gqy, &gqz);
+    gq[0] += gqw;  gq[1] += gqx;  gq[2] += gqy;  gq[3] += gqz;
+  }
+  // gradient w.r.t. z, through R^T
+  float g[3];
+  for (int i = 0; i < 3; ++i) {
+    g[i] = c.at(kCubeRotationT + 3 * i + 0, k) * gdx +
+           c.at(kCubeRotationT + 3 * i + 1, k) * gdy +
+           c.at(kCubeRotationT + 3 * i + 2, k) * gdz;
+  }
+  gz[0] += g[0] * s[0];  gz[1] += g[1] * s[1];  gz[2] += g[2] * s[2];
+}
+
+static const float cube_surface_points_8[] = {
+ -1.0, -1.0, -1.0, -1.0,  1.0,  1.0,  1.0,  1.0,
+ -1.0, -1.0,  1.0,  1.0, -1.0, -1.0,  1.0,  1.0,
+ -1.0,  1.0, -1.0,  1.0, -1.0,  1.0, -1.0,  1.0,
+};
+static const float cube_surface_points_26[] = {
+  -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0,  0.0,  0.0,  0.0,  0.0,  0.0,  0.0,  0.0,  0.0,  1.0,  1.0,  1.0,  1.0,  1.0,  1.0,  1.0,  1.0,  1.0,
+  -1.0, -1.0, -1.0,  0.0,  0.0,  0.0,  1.0,  1.0,  1.0, -1.0, -1.0, -1.0,  0.0,  0.0,  1.0,  1.0,  1.0, -1.0, -1.0, -1.0,  0.0,  0.0,  0.0,  1.0,  1.0,  1.0,
+  -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0,
+};
+static const float cube_surface_points_96[] = {
+  -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, -0.75, -0.75, -0.75, -0.75, -0.25, -0.25, -0.25, -0.25, 0.25, 0.25, 0.25, 0.25, 0.75, 0.75, 0.75, 0.75, -0.75, -0.75, -0.75, -0.75, -0.25, -0.25, -0.25, -0.25, 0.25, 0.25, 0.25, 0.25, 0.75, 0.75, 0.75, 0.75, -0.75, -0.75, -0.75, -0.75, -0.25, -0.25, -0.25, -0.25, 0.25, 0.25, 0.25, 0.25, 0.75, 0.75, 0.75, 0.75, -0.75, -0.75, -0.75, -0.75, -0.25, -0.25, -0.25, -0.25, 0.25, 0.25, 0.25, 0.25, 0.75, 0.75, 0.75, 0.75,
+  -0.75, -0.75, -0.75, -0.75, -0.25, -0.25, -0.25, -0.25, 0.25, 0.25, 0.25, 0.25, 0.75, 0.75, 0.75, 0.75, -0.75, -0.75, -0.75, -0.75, -0.25, -0.25, -0.25, -0.25, 0.25, 0.25, 0.25, 0.25, 0.75, 0.75, 0.75, 0.75, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75,
+  -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -0.75, -0.25, 0.25, 0.75, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0,
+};
+static const float cube_volume_points_27[] = {
+  -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0, -1.0,  0.0,  0.0,  0.0,  0.0,  0.0,  0.0,  0.0,  0.0,  0.0,  1.0,  1.0,  1.0,  1.0,  1.0,  1.0,  1.0,  1.0,  1.0,
+  -1.0, -1.0, -1.0,  0.0,  0.0,  0.0,  1.0,  1.0,  1.0, -1.0, -1.0, -1.0,  0.0,  0.0,  0.0,  1.0,  1.0,  1.0, -1.0, -1.0, -1.0,  0.0,  0.0,  0.0,  1.0,  1.0,  1.0,
+  -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0, -1.0,  0.0,  1.0,
+};
+
+bool cube_surface_samples(const int num_sample, const float scale,
+    std::vector<float>* samples) {
+  const float* points = nullptr;
+  if (num_sample == 8) {
+    points = cube_surface_points_8;
+  }
+  else if (num_sample == 26) {
+    points = cube_surface_points_26;
+  }
+  else if (num_sample == 96) {
+    points = cube_surface_points_96;
+  }
+  else {
+    return false;
+  }
+  samples->resize(3 * num_sample);
+  for (int i = 0; i < 3 * num_sample; ++i) {
+    (*samples)[i] = points[i] * scale;
+  }
+  return true;
+}
+
+void cube_volume_samples(const float scale, std::vector<float>* samples) {
+  samples->resize(3 * 27);
+  for (int i = 0; i < 3 * 27; ++i) {
+    (*samples)[i] = cube_volume_points_27[i] * scale;
+  }
+}
+
+Status group_points_by_batch(const float* in_pos, const int n_point,
+    const int batch_size, std::vector<int>* batch_begin,
+    std::vector<int>* point_index) {
+  // counting sort, keeps the original order inside each batch
+  const float* batch_index = in_pos + 3 * n_point;
+  batch_begin->assign(batch_size + 1, 0);
+  for (int i = 0; i < n_point; ++i) {
+    int b = static_cast<int>(batch_index[i]);
+    if (b < 0 || b >= batch_size) {
+      return errors::InvalidArgument("Invalid batch index ", b, " of point ",
+                                     i, ", the batch size is ", batch_size);
+    }
+    (*batch_begin)[b + 1] += 1;
+  }
+  for (int b = 0; b < batch_size; ++b) {
+    (*batch_begin)[b + 1] += (*batch_begin)[b];
+  }
+  std::vector<int> offset(batch_begin->begin(), batch_begin->end() - 1);
+  point_index->resize(n_point);
+  for (int i = 0; i < n_point; ++i) {
+    int b = static_cast<int>(batch_index[i]);
+    (*point_index)[offset[b]++] = i;
+  }
+  return Status::OK();
+}
+
+Status group_points_by_cube(const float* in_pos, const int n_point,
+    const int batch_size, const int n_cube, const int* cube_index,
+    std::vector<int>* cube_begin, std::vector<int>* point_index) {
+  // counting sort on b * n_cube + cube_index, stable as above
+  const float* batch_index = in_pos + 3 * n_point;
+  const int n_bucket = batch_size * n_cube;
+  cube_begin->assign(n_bucket + 1, 0);
+  for (int i = 0; i < n_point; ++i) {
+    int b = static_cast<int>(batch_index[i]);
+    if (b < 0 || b >= batch_size) {
+      return errors::InvalidArgument("Invalid batch index ", b, " of point ",
+                                     i, ", the batch size is ", batch_size);
+    }
+    (*cube_begin)[b * n_cube + cube_index[i] + 1] += 1;
+  }
+  for (int k = 0; k < n_bucket; ++k) {
+    (*cube_begin)[k + 1] += (*cube_begin)[k];
+  }
+  std::vector<int> offset(cube_begin->begin(), cube_begin->end() - 1);
+  point_index->resize(n_point);
+  for (int i = 0; i < n_point; ++i) {
+    int k = static_cast<int>(batch_index[i]) * n_cube + cube_index[i];
+    (*point_index)[offset[k]++] = i;
+  }
+  return Status::OK();
+}
+
+Status sample_point_nearest_object_point(const Eigen::ThreadPoolDevice& d,
+    const int n_cube, const int n_point, const int batch_size,
+    const int n_sample, const float* samples,
+    const CubeTransforms& transforms, const float* in_pos, float* min_distance,
+    int* min_distance_index) {
+  // a KD-tree over the points of each shape, the samples of a cube only
+  // query the tree of its own shape
+  PointKdTree tree;
+  TF_RETURN_IF_ERROR(tree.build(d, in_pos, n_point, batch_size));
+  for (int b = 0; b < batch_size; ++b) {
+    if (tree.num_points(b) == 0) {
+      return errors::InvalidArgument("Shape ", b, " has no point");
+    }
+  }
+
+  const int avg_point = n_point / std::max(batch_size, 1);
+  const int depth = static_cast<int>(std::log2(avg_point + 1)) + 1;
+  d.parallelFor(batch_size * n_cube,
+      Eigen::TensorOpCost(64 * depth * n_sample, 8 * n_sample,
+                          60 * depth * n_sample),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index k = begin; k < end; ++k) {
+          int batch_index = k / n_cube;
+          int cube_index = k % n_cube;
+          for (int s = 0; s < n_sample; ++s) {
+            float sp[3];
+            float raw_sp[3] = { samples[0 * n_sample + s],
+                                samples[1 * n_sample + s],
+                                samples[2 * n_sample + s] };
+            transform_sample_point(raw_sp, transforms, k, sp);
+            float min_val;
+            int min_idx = tree.nearest(batch_index, sp, &min_val);
+            int index = (cube_index * n_sample + s) * batch_size +
+                batch_index;
+            min_distance[index] = min_val;
+            min_distance_index[index] = min_idx;
+          }
+        }
+      });
+  return Status::OK();
+}
+
+void grad_sample_point_nearest_object_point(const Eigen::ThreadPoolDevice& d,
+    const int n_cube, const int n_point, const int batch_size,
+    const int n_sample, const float* samples,
+    const CubeTransforms& transforms, const float* in_q, const float* in_pos,
+    const int* min_distance_index, const float* grad_min_distance,
+    float* grad_z, float* grad_q, float* grad_t) {
+  // only the nearest point of each sample receives gradient
+  d.parallelFor(batch_size * n_cube,
+      Eigen::TensorOpCost(32 * n_sample, 40, 200 * n_sample),
+      [&](Eigen::Index begin, Eigen::Index end) {
+        for (Eigen::Index k = begin; k < end; ++k) {
+          int batch_index = k / n_cube;
+          int cube_index = k % n_cube;
+          for (int s = 0; s < n_sample; ++s) {
+            int index = (cube_index * n_sample + s) * batch_size +
+                batch_index;
+            float grad_distance = grad_min_distance[index];
+            if (grad_distance == 0) continue;
+            int i = min_distance_index[index];
+            float sp[3];
+            float raw_sp[3] = { samples[0 * n_sample + s],
+                                samples[1 * n_sample + s],
+                                samples[2 * n_sample + s] };
+            transform_sample_point(raw_sp, transforms, k, sp);
+            float grad_sp[3];
+            for (int a = 0; a < 3; ++a) {
+              grad_sp[a] = grad_distance * 2 *
+                  (sp[a] - in_pos[a * n_point + i]);
+            }
+            grad_transform_sample_point(raw_sp, transforms, k, in_q + k * 4,
+                grad_sp, grad_z + k * 3, grad_q + k * 4, grad_t + k * 3);
+          }
+        }
+      });
+}
+
+}  // namespace primitive
+
+}  // namespace tensorflow
@@ -1,7 +1,15 @@
 #ifndef TENSORFLOW_USER_OPS_PRIMITIVE_UTIL_H_
 #define TENSORFLOW_USER_OPS_PRIMITIVE_UTIL_H_
 
+#if GOOGLE_CUDA
 #define EIGEN_USE_GPU
+#endif
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <vector>
 
 #include "tensorflow/core/framework/op_kernel.h"
 
@@ -12,6 +20,162 @@ namespace primitive {
 template <typename T>
 void gpu_set_zero(OpKernelContext* ctx, T* Y, const int N);
 
+// Host helpers used by the CPU kernels. The quaternion math mirrors the
+// __device__ helpers of the *.cu.cc files, so both devices agree.
+inline void matvec(const float* m, float* x, float* y, float* z) {
+  float tx = m[0] * (*x) + m[1] * (*y) + m[2] * (*z);
+  float ty = m[3] * (*x) + m[4] * (*y) + m[5] * (*z);
+  float tz = m[6] * (*x) + m[7] * (*y) + m[8] * (*z);
+  *x = tx; *y = ty; *z = tz;
+}
+
+inline void t_matvec(const float* m, float* x, float* y, float* z) {
+  float tx = m[0] * (*x) + m[3] * (*y) + m[6] * (*z);
+  float ty = m[1] * (*x) + m[4] * (*y) + m[7] * (*z);
+  float tz = m[2] * (*x) + m[5] * (*y) + m[8] * (*z);
+  *x = tx; *y = ty; *z = tz;
+}
+
+inline void conjugate(float* w, float* x, float* y, float* z) {
+  (*x) = -(*x);  (*y) = -(*y);  (*z) = -(*z);
+}
+
+inline void normalize(float* w, float* x, float* y, float* z) {
+  float norm = std::sqrt((*w)*(*w) + (*x)*(*x) + (*y)*(*y) + (*z)*(*z));
+  *w /= norm;  *x /= norm;  *y /= norm;  *z /= norm;
+}
+
+void as_rotation_matrix(float w, float x, float y, float z, float* m);
+
+void grad_rotation_matrix_to_quaternion(const float* grad_rotation_matrix,
+    const float qw, const float qx, const float qy, const float qz, float* gqw,
+    float* gqx, float* gqy, float* gqz);
+
+// The per-cube transforms computed once by PrimitiveCubeTransforms and shared
+// by the CPU losses, so the kernels do not rebuild the rotation matrix for
+// every point. They are the rows of a [kCubeTransformRows, stride] matrix,
+// one column per cube, and the stride pads the rows to 64 bytes
+enum CubeTransformRow {
+  kCubeRotation = 0,         // R(q) of the normalized q, row-major
+  kCubeRotationT = 9,        // its transpose, R(conj(q))
+  kCubeInvTranslation = 18,  // -R^T * t
+  kCubeHalfExtent = 21,      // z
+  kCubeTranslation = 24,     // t
+  kCubeTransformRows = 27
+};
+
+inline int cube_transform_stride(const int n_cube) {
+  return (n_cube + 15) / 16 * 16;
+}
+
+struct CubeTransforms {
+  const float* data;
+  int stride;
+  float at(const int row, const int k) const { return data[row * stride + k]; }
+};
+
+// fill the transforms of the n_cube cubes (z, q, t), in the layout above
+void cube_transforms(const Eigen::ThreadPoolDevice& d, const int n_cube,
+    const float* in_z, const float* in_q, const float* in_t, const int stride,
+    float* transforms);
+// view the output of PrimitiveCubeTransforms as the transforms of n_cube
+// cubes, fails if its shape does not match
+Status get_cube_transforms(const Tensor& tensor, const int n_cube,
+    CubeTransforms* transforms);
+
+// The helpers below work on cube k = (z, q, t) of the transforms c, the
+// gradients also need its raw quaternion q.
+
+// point p moved into the frame of cube k: R(conj(q)) * (p - t)
+inline void to_cube_frame(const float* p, const CubeTransforms& c,
+    const int k, float* local) {
+  for (int i = 0; i < 3; ++i) {
+    local[i] = c.at(kCubeRotationT + 3 * i + 0, k) * p[0] +
+               c.at(kCubeRotationT + 3 * i + 1, k) * p[1] +
+               c.at(kCubeRotationT + 3 * i + 2, k) * p[2] +
+               c.at(kCubeInvTranslation + i, k);
+  }
+}
+// backward of to_cube_frame(), grad_local is the gradient w.r.t. the local
+// coordinates; it is accumulated into gq and gt, and into gp if not null
+void grad_to_cube_frame(const float* p, const CubeTransforms& c, const int k,
+    const float* q, const float* grad_local, float* gq, float* gt, float* gp);
+
+// squared distance between point p and cube k, 0 inside the cube
+inline float point_cube_distance(const float* p, const CubeTransforms& c,
+    const int k) {
+  float local[3];
+  to_cube_frame(p, c, k, local);
+  float distance = 0;
+  for (int i = 0; i < 3; ++i) {
+    float d = std::max(std::abs(local[i]) - c.at(kCubeHalfExtent + i, k),
+                       0.0f);
+    distance += d * d;
+  }
+  return distance;
+}
+// accumulate grad_distance times the gradient of point_cube_distance() into
+// gz, gq, gt, and into gp w.r.t. the point if gp is not null
+void grad_point_cube_distance(const float* p, const CubeTransforms& c,
+    const int k, const float* q, const float grad_distance, float* gz,
+    float* gq, float* gt, float* gp);
+
+// canonical sample s moved onto cube k: R(q) * (s * z) + t
+inline void transform_sample_point(const float* s, const CubeTransforms& c,
+    const int k, float* p) {
+  float sp[3];
+  for (int i = 0; i < 3; ++i) sp[i] = s[i] * c.at(kCubeHalfExtent + i, k);
+  for (int i = 0; i < 3; ++i) {
+    p[i] = c.at(kCubeRotation + 3 * i + 0, k) * sp[0] +
+           c.at(kCubeRotation + 3 * i + 1, k) * sp[1] +
+           c.at(kCubeRotation + 3 * i + 2, k) * sp[2] +
+           c.at(kCubeTranslation + i, k);
+  }
+}
+// accumulate the gradient of transform_sample_point() into gz, gq and gt,
+// grad_p is the gradient w.r.t. the transformed point
+void grad_transform_sample_point(const float* s, const CubeTransforms& c,
+    const int k, const float* q, const float* grad_p, float* gz, float* gq,
+    float* gt);
+
+// samples of the canonical cube [-1, 1]^3 in [3, n_sample] layout, multiplied
+// by scale; the surface supports num_sample = 8, 26 and 96, the volume has 27
+bool cube_surface_samples(const int num_sample, const float scale,
+    std::vector<float>* samples);
+void cube_volume_samples(const float scale, std::vector<float>* samples);
+
+// group the point indices by the batch index stored in row 3 of in_pos,
+// the points of shape b are point_index[batch_begin[b], batch_begin[b + 1]);
+// fails if a batch index is not in [0, batch_size)
+Status group_points_by_batch(const float* in_pos, const int n_point,
+    const int batch_size, std::vector<int>* batch_begin,
+    std::vector<int>* point_index);
+// group the point indices by their nearest cube, cube_index[i] is the cube of
+// point i inside its own shape; the points of cube k = b * n_cube + c are
+// point_index[cube_begin[k], cube_begin[k + 1]), in their original order
+Status group_points_by_cube(const float* in_pos, const int n_point,
+    const int batch_size, const int n_cube, const int* cube_index,
+    std::vector<int>* cube_begin, std::vector<int>* point_index);
+
+// for every cube c of shape b and every cube sample s, find the nearest point
+// of shape b to the transformed sample, through a KD-tree over the points of
+// each shape; the results are indexed by (c * n_sample + s) * batch_size + b,
+// the same as the reduced keys of the consistency losses on the GPU; fails if
+// a shape has no point
+Status sample_point_nearest_object_point(const Eigen::ThreadPoolDevice& d,
+    const int n_cube, const int n_point, const int batch_size,
+    const int n_sample, const float* samples,
+    const CubeTransforms& transforms, const float* in_pos, float* min_distance,
+    int* min_distance_index);
+// accumulate the gradient of the nearest distances above into the cubes,
+// grad_min_distance has the same layout as min_distance
+void grad_sample_point_nearest_object_point(const Eigen::ThreadPoolDevice& d,
+    const int n_cube, const int n_point, const int batch_size,
+    const int n_sample, const float* samples,
+    const CubeTransforms& transforms, const float* in_q, const float* in_pos,
+    const int* min_distance_index, const float* grad_min_distance,
+    float* grad_z, float* grad_q, float* grad_t);
+
 }  // namespace primitive
 
 }  // namespace tensorflow
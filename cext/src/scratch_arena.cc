@@ -0,0 +1,112 @@
+#include "scratch_arena.h"
+
+#include <algorithm>
+
+#include "tensorflow/core/platform/mem.h"
+#include "tensorflow/core/util/env_var.h"
+
+namespace tensorflow {
+
+namespace {
+// the alignment of all the blocks, so any cached block fits any request
+const size_t kArenaAlignment = 64;
+const size_t kMinBlockSize = 256;
+}  // namespace
+
+ScratchArena::~ScratchArena() {
+  mutex_lock l(mu_);
+  release_cache();
+}
+
+ScratchArena* ScratchArena::cpu() {
+  static ScratchArena* arena = [] {
+    int64 limit_mb;
+    Status s = ReadInt64FromEnvVar("SCRATCH_ARENA_LIMIT_MB", 1024, &limit_mb);
+    if (!s.ok() || limit_mb < 0) limit_mb = 1024;
+    return new ScratchArena(limit_mb << 20);
+  }();
+  return arena;
+}
+
+size_t ScratchArena::round_up(size_t num_bytes) {
+  if (num_bytes <= kMinBlockSize) return kMinBlockSize;
+  // 4 classes between two powers of two
+  size_t step = 1;
+  while (step <= num_bytes / 8) step <<= 1;
+  return (num_bytes + step - 1) / step * step;
+}
+
+void* ScratchArena::AllocateRaw(size_t alignment, size_t num_bytes) {
+  CHECK_LE(alignment, kArenaAlignment);
+  const int64 size = round_up(num_bytes);
+  mutex_lock l(mu_);
+  void* ptr = nullptr;
+  auto it = free_.find(size);
+  if (it != free_.end() && !it->second.empty()) {
+    ptr = it->second.back();
+    it->second.pop_back();
+    stats_.bytes_cached -= size;
+    stats_.num_reuses++;
+  } else {
+    if (stats_.bytes_in_use + stats_.bytes_cached + size > limit_) {
+      release_cache();
+    }
+    ptr = port::AlignedMalloc(size, kArenaAlignment);
+    if (ptr == nullptr && stats_.bytes_cached > 0) {
+      release_cache();
+      ptr = port::AlignedMalloc(size, kArenaAlignment);
+    }
+    if (ptr == nullptr) return nullptr;
+    stats_.num_allocs++;
+  }
+  in_use_[ptr] = size;
+  stats_.bytes_in_use += size;
+  stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.bytes_in_use);
+  return ptr;
+}
+
+void ScratchArena::DeallocateRaw(void* ptr) {
+  if (ptr == nullptr) return;
+  mutex_lock l(mu_);
+  auto it = in_use_.find(ptr);
+  CHECK(it != in_use_.end()) << "the block is not from the scratch arena";
+  const int64 size = it->second;
+  in_use_.erase(it);
+  stats_.bytes_in_use -= size;
+  if (stats_.bytes_in_use + stats_.bytes_cached + size <= limit_) {
+    free_[size].push_back(ptr);
+    stats_.bytes_cached += size;
+  } else {
+    port::AlignedFree(ptr);
+  }
+}
+
+ScratchArena::Stats ScratchArena::stats() {
+  mutex_lock l(mu_);
+  return stats_;
+}
+
+void ScratchArena::Trim() {
+  mutex_lock l(mu_);
+  release_cache();
+}
+
+void ScratchArena::release_cache() {
+  for (auto& blocks : free_) {
+    for (void* ptr : blocks.second) port::AlignedFree(ptr);
+  }
+  free_.clear();
+  stats_.bytes_cached = 0;
+}
+
+Status allocate_scratch(const CPUDevice& d, OpKernelContext* context,
+    DataType type, const TensorShape& shape, Tensor* tensor) {
+  *tensor = Tensor(ScratchArena::cpu(), type, shape);
+  if (!tensor->IsInitialized() && shape.num_elements() > 0) {
+    return errors::ResourceExhausted("out of memory allocating a scratch ",
+        "tensor of shape ", shape.DebugString());
+  }
+  return Status::OK();
+}
+
+}  // namespace tensorflow
@@ -0,0 +1,77 @@
+#ifndef TENSORFLOW_USER_OPS_SCRATCH_ARENA_H_
+#define TENSORFLOW_USER_OPS_SCRATCH_ARENA_H_
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/platform/mutex.h"
+
+namespace tensorflow {
+
+typedef Eigen::ThreadPoolDevice CPUDevice;
+typedef Eigen::GpuDevice GPUDevice;
+
+// A caching allocator for the scratch tensors the CPU kernels need during one
+// call, e.g. the [n_point, n_cube] distance matrices of the losses or the
+// workspace of the octree convolution. The blocks are rounded up to a size
+// class and go back to a free list when the tensor dies, so the next op or
+// step of the same shape takes them again without touching the system
+// allocator, and their pages stay mapped.
+// The arena keeps at most limit bytes, blocks in use plus cached ones. A
+// block released over the limit is freed, and an allocation that would push
+// the arena over the limit drops the cache first.
+class ScratchArena : public Allocator {
+ public:
+  struct Stats {
+    int64 num_allocs = 0;    // blocks taken from the system
+    int64 num_reuses = 0;    // blocks taken from the cache
+    int64 bytes_in_use = 0;
+    int64 bytes_cached = 0;
+    int64 peak_bytes = 0;    // high-water mark of bytes_in_use
+  };
+
+  explicit ScratchArena(int64 limit) : limit_(limit) {}
+  ~ScratchArena() override;
+
+  // The arena of the CPU kernels, SCRATCH_ARENA_LIMIT_MB (1024 by default)
+  // sets its limit, 0 turns the caching off
+  static ScratchArena* cpu();
+
+  std::string Name() override { return "scratch_arena"; }
+  void* AllocateRaw(size_t alignment, size_t num_bytes) override;
+  void DeallocateRaw(void* ptr) override;
+
+  Stats stats();
+  // free all the cached blocks
+  void Trim();
+
+  // the size class of num_bytes, at most 1/4 of it is wasted
+  static size_t round_up(size_t num_bytes);
+
+ private:
+  void release_cache();  // requires mu_
+
+  const int64 limit_;
+  mutex mu_;
+  std::map<size_t, std::vector<void*>> free_ GUARDED_BY(mu_);
+  std::unordered_map<void*, size_t> in_use_ GUARDED_BY(mu_);
+  Stats stats_ GUARDED_BY(mu_);
+};
+
+// Allocate a scratch tensor that only lives during the call of an op. On the
+// CPU it comes from ScratchArena::cpu(), on the GPU the device allocator of
+// TensorFlow already caches its blocks, so it is a plain allocate_temp.
+Status allocate_scratch(const CPUDevice& d, OpKernelContext* context,
+    DataType type, const TensorShape& shape, Tensor* tensor);
+inline Status allocate_scratch(const GPUDevice& d, OpKernelContext* context,
+    DataType type, const TensorShape& shape, Tensor* tensor) {
+  return context->allocate_temp(type, shape, tensor);
+}
+
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_USER_OPS_SCRATCH_ARENA_H_
@@ -0,0 +1,86 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import octree_augment
+from cext import octree_database
+from cext import points_to_octree
+from cext import primitive_points_suffix_index
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+# the old axes of the new x, y and z axes of each permutation
+AXIS_PERM = [[0, 1, 2], [0, 2, 1], [1, 0, 2], [1, 2, 0], [2, 0, 1], [2, 1, 0]]
+
+
+def _transform(x, transform):
+  # x [n_shape, 3, n_point]
+  y = np.empty_like(x)
+  for i, t in enumerate(transform):
+    y[i] = x[i, AXIS_PERM[t >> 3]]
+    for a in range(3):
+      if t >> a & 1: y[i, a] = -y[i, a]
+  return y
+
+
+class OctreeAugmentTest(test.TestCase):
+
+  def _VerifyValuesNew(self, n_shape, n_point, depth, flip, permute, seed):
+    rng = np.random.RandomState(seed)
+    # the points lie at the centers of the cells of depth 10, so the octree of
+    # the transformed points is the transformed octree exactly
+    in_points = rng.uniform(-0.4, 0.4, [n_shape, 3, n_point])
+    in_points = ((np.floor((in_points + 0.5) * 1024) + 0.5) / 1024 - 0.5)
+    in_points = in_points.astype(np.float32)
+    in_normals = rng.randn(n_shape, 3, n_point).astype(np.float32)
+
+    def build(points, normals):
+      octree = points_to_octree(points.reshape(n_shape, -1),
+                                normals.reshape(n_shape, -1), depth=depth)
+      data, octree, _ = octree_database(octree)
+      position = primitive_points_suffix_index(points.reshape(n_shape, -1))
+      return data, octree, position
+
+    with self.test_session() as sess:
+      data, octree, position = build(in_points, in_normals)
+      outputs = sess.run(octree_augment(data, octree, position, flip=flip,
+                                        permute=permute, seed=seed))
+      out_data, out_octree, out_points, transform = outputs
+      self.assertEqual(n_shape, len(transform))
+      self.assertTrue(np.all(transform >= 0) and np.all(transform < 48))
+      if not flip: self.assertAllEqual(np.zeros(n_shape), transform & 7)
+      if not permute: self.assertAllEqual(np.zeros(n_shape), transform >> 3)
+
+      points = _transform(in_points, transform)
+      normals = _transform(in_normals, transform)
+      expected = sess.run(build(points, normals))
+
+    self.assertAllClose(expected[0], out_data, rtol=1e-5, atol=1e-6)
+    self.assertAllEqual(expected[1], out_octree)
+    self.assertAllEqual(expected[2], out_points)
+
+  def testForward_0(self):
+    self._VerifyValuesNew(1, 500, 4, True, True, 0)
+
+  def testForward_1(self):
+    # a batch, each shape with its own transform
+    self._VerifyValuesNew(4, 2000, 5, True, True, 1)
+
+  def testForward_2(self):
+    self._VerifyValuesNew(3, 1000, 4, True, False, 2)
+
+  def testForward_3(self):
+    self._VerifyValuesNew(3, 1000, 4, False, True, 3)
+
+  def testForward_4(self):
+    # the 64-bit keys
+    self._VerifyValuesNew(2, 1000, 9, True, True, 4)
+
+
+if __name__ == '__main__':
+  test.main()
@@ -0,0 +1,118 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.framework import constant_op
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import octree_database
+from cext import octree_conv
+from octree_test_util import make_octree
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+class OctreeConvTest(test.TestCase):
+
+  def _VerifyValuesNew(self, nonempty, channel, num_output, kernel_size, seed):
+    # the sparse convolution of depth 1 against the dense one with the outputs
+    # of the empty nodes masked out
+    rng = np.random.RandomState(seed)
+    octrees = [make_octree(o, i) for i, o in enumerate(nonempty)]
+    height = 8 * len(nonempty)
+    mask = np.concatenate(nonempty).astype(np.float32).reshape(1, 1, -1, 1)
+    in_data = rng.randn(1, channel, height, 1).astype(np.float32)
+    in_filter = rng.randn(num_output, channel,
+                          kernel_size ** 3).astype(np.float32)
+    in_grad = rng.randn(1, num_output, height, 1).astype(np.float32)
+
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        _, octree, _ = sess.run(octree_database(octrees))
+        data = constant_op.constant(in_data)
+        kernel = constant_op.constant(in_filter)
+        grad_ys = constant_op.constant(in_grad)
+        dense = octree_conv(data, kernel, octree, 1, num_output, kernel_size,
+                            1) * mask
+        sparse = octree_conv(data, kernel, octree, 1, num_output, kernel_size,
+                             1, sparse=True)
+        expected = sess.run([dense] + tf.gradients(dense, [data, kernel],
+                                                   grad_ys=grad_ys))
+        actual = sess.run([sparse] + tf.gradients(sparse, [data, kernel],
+                                                  grad_ys=grad_ys))
+      for e, a in zip(expected, actual):
+        self.assertAllClose(e, a, rtol=1e-5, atol=1e-5)
+
+  def _VerifyReference(self, n_shape, channel, num_output, seed):
+    # the convolution of kernel size 3 and stride 1 at depth 1 against numpy,
+    # built from the coordinates of the 2 x 2 x 2 nodes of each shape
+    rng = np.random.RandomState(seed)
+    octrees = [make_octree([1, 0, 0, 0, 0, 0, 0, 1], i)
+               for i in range(n_shape)]
+    height = 8 * n_shape
+    in_data = rng.randn(1, channel, height, 1).astype(np.float32)
+    in_filter = rng.randn(num_output, channel, 27).astype(np.float32)
+    in_grad = rng.randn(1, num_output, height, 1).astype(np.float32)
+
+    # the columns [channel, 27, height], the kernel offsets are x-major
+    xyz = [(j >> 2 & 1, j >> 1 & 1, j & 1) for j in range(8)]
+    neighbors = []
+    for h in range(height):
+      x, y, z = xyz[h % 8]
+      for k in range(27):
+        nx, ny, nz = x + k // 9 - 1, y + k // 3 % 3 - 1, z + k % 3 - 1
+        if 0 <= nx < 2 and 0 <= ny < 2 and 0 <= nz < 2:
+          neighbors.append((k, h, h - h % 8 + (nx << 2 | ny << 1 | nz)))
+    data = in_data.reshape(channel, height).astype(np.float64)
+    col = np.zeros([channel, 27, height])
+    for k, h, p in neighbors:
+      col[:, k, h] = data[:, p]
+    col = col.reshape(channel * 27, height)
+    weight = in_filter.reshape(num_output, channel * 27).astype(np.float64)
+    grad = in_grad.reshape(num_output, height).astype(np.float64)
+    grad_col = weight.T.dot(grad).reshape(channel, 27, height)
+    grad_data = np.zeros([channel, height])
+    for k, h, p in neighbors:
+      grad_data[:, p] += grad_col[:, k, h]
+    expected = [weight.dot(col).reshape(1, num_output, height, 1),
+                grad_data.reshape(in_data.shape),
+                grad.dot(col.T).reshape(in_filter.shape)]
+
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        _, octree, _ = sess.run(octree_database(octrees))
+        data = constant_op.constant(in_data)
+        kernel = constant_op.constant(in_filter)
+        conv = octree_conv(data, kernel, octree, 1, num_output, 3, 1)
+        actual = sess.run([conv] + tf.gradients(conv, [data, kernel],
+            grad_ys=constant_op.constant(in_grad)))
+      for e, a in zip(expected, actual):
+        self.assertAllClose(e, a, rtol=1e-4, atol=1e-4)
+
+  def testReference_0(self):
+    # one shape, fewer channels than a block of the CPU kernel
+    self._VerifyReference(1, 3, 2, 3)
+
+  def testReference_1(self):
+    # three shapes, the channels and outputs leave partial blocks
+    self._VerifyReference(3, 17, 13, 4)
+
+  def testForward_0(self):
+    # a batch of two sparse octrees
+    self._VerifyValuesNew([[1, 0, 0, 1, 0, 1, 0, 0], [0, 1, 1, 0, 0, 0, 0, 1]],
+                          3, 5, 3, 0)
+
+  def testForward_1(self):
+    # one full octree, nothing is skipped
+    self._VerifyValuesNew([[1, 1, 1, 1, 1, 1, 1, 1]], 4, 2, 3, 1)
+
+  def testForward_2(self):
+    # the kernel size 1 runs octree2col on the CPU as well
+    self._VerifyValuesNew([[0, 0, 1, 0, 0, 1, 1, 0]], 6, 3, 1, 2)
+
+
+if __name__ == '__main__':
+  test.main()
@@ -0,0 +1,75 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.framework import constant_op
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import octree_conv
+from cext import octree_conv_relu_pool
+from cext import octree_database
+from cext import octree_pooling
+from octree_test_util import make_octree
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+class OctreeConvReluPoolTest(test.TestCase):
+
+  def _VerifyValuesNew(self, nonempty, channel, num_output, seed,
+                       negative=False):
+    # the fused op against octree_conv, relu and octree_pooling at depth 2,
+    # with negative the convolution is nowhere positive
+    rng = np.random.RandomState(seed)
+    octrees = [make_octree(o, i) for i, o in enumerate(nonempty)]
+    with self.test_session(use_gpu=False) as sess:
+      _, octree, _ = sess.run(octree_database(octrees))
+      height = sum(8 * np.count_nonzero(o) for o in nonempty)
+      in_data = rng.randn(1, channel, height, 1).astype(np.float32)
+      in_filter = rng.randn(num_output, channel, 27).astype(np.float32)
+      if negative:
+        in_data = np.abs(in_data)
+        in_filter = -np.abs(in_filter)
+      data = constant_op.constant(in_data)
+      kernel = constant_op.constant(in_filter)
+
+      fused, mask = octree_conv_relu_pool(data, kernel, octree, curr_depth=2,
+                                          num_output=num_output)
+      conv = tf.nn.relu(octree_conv(data, kernel, octree, curr_depth=2,
+                                    num_output=num_output, kernel_size=3,
+                                    stride=1))
+      expected, expected_mask = octree_pooling(conv, octree, curr_depth=2)
+
+      # a weighted sum to get distinct gradients of all the outputs
+      weight = constant_op.constant(
+          rng.randn(1, num_output, 8 * len(octrees), 1).astype(np.float32))
+      grad = tf.gradients(tf.reduce_sum(fused * weight), [data, kernel])
+      grad_expected = tf.gradients(tf.reduce_sum(expected * weight),
+                                   [data, kernel])
+
+      actual, expected, mask, expected_mask, grad, grad_expected = sess.run(
+          [fused, expected, mask, expected_mask, grad, grad_expected])
+    self.assertAllClose(expected, actual, atol=1e-5)
+    self.assertAllEqual(expected_mask, mask)
+    self.assertAllClose(grad_expected[0], grad[0], atol=1e-4)
+    self.assertAllClose(grad_expected[1], grad[1], atol=1e-4)
+
+  def testForward_0(self):
+    # one full octree
+    self._VerifyValuesNew([[1, 1, 1, 1, 1, 1, 1, 1]], 3, 4, 0)
+
+  def testForward_1(self):
+    # a batch of two sparse octrees, the empty parents are padded with zero
+    self._VerifyValuesNew([[1, 0, 0, 1, 0, 1, 0, 0], [0, 1, 1, 0, 0, 0, 0, 1]],
+                          5, 6, 1)
+
+  def testForward_2(self):
+    # every group of siblings is non-positive, the maximum is the first node
+    self._VerifyValuesNew([[1, 1, 0, 1, 0, 0, 1, 1]], 3, 4, 2, negative=True)
+
+
+if __name__ == '__main__':
+  test.main()
@@ -0,0 +1,66 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import octree_database
+from cext import octree_decode_points
+from cext import octree_encode
+from cext import points_to_octree
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+class OctreeEncodeTest(test.TestCase):
+
+  def _VerifyValuesNew(self, n_shape, n_point, depth, seed):
+    rng = np.random.RandomState(seed)
+    in_points = rng.uniform(-0.4, 0.4, [n_shape, 3 * n_point])
+    in_points = in_points.astype(np.float32)
+    in_normals = rng.randn(n_shape, 3 * n_point).astype(np.float32)
+
+    with self.test_session() as sess:
+      octree = points_to_octree(in_points, in_normals, depth=depth)
+      record = octree_encode(octree, in_points)
+      octrees, records = sess.run([octree, record])
+      # compressed and raw octrees may share a batch
+      mixed = np.array([records[0]] + list(octrees[1:]), dtype=object)
+      outputs = sess.run([octree_database(octrees), octree_database(records),
+                          octree_database(mixed), octree_decode_points(records)])
+    expected, actual, actual_mixed, points = outputs
+
+    self.assertTrue(all(len(r) < len(o) for r, o in zip(records, octrees)))
+    # the structure is exact, the signal is quantized to 16 bits
+    for data, octree, _ in [actual, actual_mixed]:
+      self.assertAllClose(expected[0], data, rtol=0, atol=1.0 / 32767)
+      self.assertAllEqual(expected[1], octree)
+    # the points to 16 bits in their bounding box
+    self.assertAllClose(in_points, points, rtol=0, atol=0.8 / 65535)
+
+  def testForward_0(self):
+    self._VerifyValuesNew(1, 500, 4, 0)
+
+  def testForward_1(self):
+    self._VerifyValuesNew(3, 2000, 6, 1)
+
+  def testForward_2(self):
+    # the 64-bit keys
+    self._VerifyValuesNew(2, 1000, 9, 2)
+
+  def testInvalidRecord(self):
+    with self.test_session() as sess:
+      record = octree_encode(points_to_octree(np.zeros([1, 3], np.float32),
+                                              np.ones([1, 3], np.float32),
+                                              depth=3),
+                             np.zeros([1, 3], np.float32))
+      record = sess.run(record)
+      with self.assertRaises(tf.errors.DataLossError):
+        sess.run(octree_decode_points([record[0][:-4]]))
+
+
+if __name__ == '__main__':
+  test.main()
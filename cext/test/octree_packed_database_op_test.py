@@ -0,0 +1,67 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import octree_database
+from cext import octree_pack
+from cext import octree_packed_database
+from util.pack_dataset import write_octree_pack
+from octree_test_util import make_octree
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+class OctreePackedDatabaseTest(test.TestCase):
+
+  def _VerifyValuesNew(self, octrees, points, batch_size, batches):
+    with self.test_session() as sess:
+      records = sess.run(octree_pack(octrees, points))
+    filename = os.path.join(self.get_temp_dir(), 'test.octpack')
+    write_octree_pack(filename, records, len(octrees), 2, 1, 7,
+                      points.shape[1] // 3)
+
+    with self.test_session() as sess:
+      packed = octree_packed_database(filename, batch_size, shuffle=False)
+      for batch in batches:
+        data, octree, actual_points = sess.run(packed)
+        expected_data, expected_octree, _ = sess.run(
+            octree_database([octrees[i] for i in batch]))
+        self.assertAllEqual(expected_octree, octree)
+        self.assertAllEqual(expected_data, data)
+        self.assertAllEqual(points[batch], actual_points)
+
+  def testForward_0(self):
+    # three shapes of different sizes, the second batch starts a new epoch
+    octrees = [make_octree([1, 1, 1, 1, 1, 1, 1, 1], 0),
+               make_octree([1, 0, 0, 1, 0, 1, 0, 0], 1),
+               make_octree([0, 1, 1, 0, 0, 0, 0, 1], 2)]
+    points = np.random.RandomState(3).rand(3, 3 * 10).astype(np.float32)
+    self._VerifyValuesNew(octrees, points, 2, [[0, 1], [2, 0]])
+
+  def testForward_1(self):
+    # a batch of one shape
+    octrees = [make_octree([0, 0, 1, 0, 0, 0, 0, 0], 4)]
+    points = np.random.RandomState(5).rand(1, 3 * 4).astype(np.float32)
+    self._VerifyValuesNew(octrees, points, 1, [[0], [0]])
+
+  def testTruncatedRecord(self):
+    # the header claims more points than the record holds
+    octrees = [make_octree([0, 1, 0, 0, 0, 0, 0, 0], 6)]
+    points = np.random.RandomState(7).rand(1, 3 * 4).astype(np.float32)
+    with self.test_session() as sess:
+      records = sess.run(octree_pack(octrees, points))
+    filename = os.path.join(self.get_temp_dir(), 'truncated.octpack')
+    write_octree_pack(filename, records, 1, 2, 1, 7, 4 + 100)
+
+    with self.test_session() as sess:
+      with self.assertRaises(tf.errors.DataLossError):
+        sess.run(octree_packed_database(filename, 1, shuffle=False))
+
+
+if __name__ == '__main__':
+  test.main()
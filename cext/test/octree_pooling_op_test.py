@@ -0,0 +1,64 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.framework import constant_op
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import octree_database
+from cext import octree_pooling
+from octree_test_util import make_octree
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+class OctreePoolingTest(test.TestCase):
+
+  def _VerifyValuesNew(self, nonempty, channel, seed):
+    # pool the nodes of depth 2 into depth 1, the empty parents get zero
+    rng = np.random.RandomState(seed)
+    octrees = [make_octree(o, i) for i, o in enumerate(nonempty)]
+    children = np.cumsum(np.concatenate(nonempty)) - 1
+    children[np.concatenate(nonempty) == 0] = -1
+    height = 8 * np.count_nonzero(np.concatenate(nonempty))
+    # integer values for ties, the first maximum wins
+    in_data = rng.randint(-2, 3, [1, channel, height, 1]).astype(np.float32)
+    in_grad = rng.randn(1, channel, len(children), 1).astype(np.float32)
+
+    groups = in_data[0, :, :, 0].reshape(channel, -1, 8)
+    expected_mask = np.argmax(groups, axis=2)
+    expected = np.zeros([1, channel, len(children), 1], np.float32)
+    expected_grad = np.zeros_like(in_data)
+    for p, g in enumerate(children):
+      if g == -1: continue
+      for c in range(channel):
+        expected[0, c, p, 0] = groups[c, g].max()
+        expected_grad[0, c, 8 * g + expected_mask[c, g], 0] = in_grad[0, c, p, 0]
+
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        _, octree, _ = sess.run(octree_database(octrees))
+        data = constant_op.constant(in_data)
+        pooled, mask = octree_pooling(data, octree, curr_depth=2)
+        grad = tf.gradients(pooled, data, grad_ys=constant_op.constant(in_grad))
+        actual, actual_mask, actual_grad = sess.run([pooled, mask, grad[0]])
+      self.assertEqual(np.uint8, actual_mask.dtype)
+      self.assertAllEqual(expected, actual)
+      self.assertAllEqual(expected_mask, actual_mask[0, :, :, 0])
+      self.assertAllEqual(expected_grad, actual_grad)
+
+  def testForward_0(self):
+    # one full octree
+    self._VerifyValuesNew([[1, 1, 1, 1, 1, 1, 1, 1]], 3, 0)
+
+  def testForward_1(self):
+    # a batch of two sparse octrees
+    self._VerifyValuesNew([[1, 0, 0, 1, 0, 1, 0, 0], [0, 1, 1, 0, 0, 0, 0, 1]],
+                          4, 1)
+
+
+if __name__ == '__main__':
+  test.main()
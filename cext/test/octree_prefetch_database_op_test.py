@@ -0,0 +1,82 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import octree_database
+from cext import octree_encode
+from cext import octree_prefetch_database
+from cext import points_to_octree
+from cext import primitive_points_suffix_index
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+def _write_records(filename, octrees, points=None):
+  with tf.python_io.TFRecordWriter(filename) as writer:
+    for i, octree in enumerate(octrees):
+      feature = {'octree': tf.train.Feature(
+          bytes_list=tf.train.BytesList(value=[octree]))}
+      if points is not None:
+        feature['points'] = tf.train.Feature(
+            float_list=tf.train.FloatList(value=points[i]))
+      example = tf.train.Example(features=tf.train.Features(feature=feature))
+      writer.write(example.SerializeToString())
+
+
+class OctreePrefetchDatabaseTest(test.TestCase):
+
+  def _VerifyValuesNew(self, compressed, num_threads):
+    n_shape, n_point, depth, batch_size = 5, 64, 4, 2
+    rng = np.random.RandomState(7)
+    in_points = rng.uniform(-0.4, 0.4, [n_shape, 3 * n_point])
+    in_points = in_points.astype(np.float32)
+    in_normals = rng.randn(n_shape, 3 * n_point).astype(np.float32)
+
+    with self.test_session() as sess:
+      octree = points_to_octree(in_points, in_normals, depth=depth)
+      octrees, records = sess.run([octree, octree_encode(octree, in_points)])
+    # the first file holds the raw octrees and the points, the second one the
+    # compressed records of the same shapes
+    filenames = [os.path.join(self.get_temp_dir(), 'raw.tfrecords'),
+                 os.path.join(self.get_temp_dir(), 'compressed.tfrecords')]
+    _write_records(filenames[0], octrees, in_points)
+    _write_records(filenames[1], records)
+    if compressed:
+      shapes = list(records) * 2
+    else:
+      shapes = list(octrees) + list(records)
+
+    with self.test_session() as sess:
+      reader = octree_prefetch_database(
+          filenames[1:] if compressed else filenames, batch_size,
+          n_point=n_point, shuffle=False, prefetch=2, num_threads=num_threads)
+      # the batches come in the order of the records, over two epochs
+      for b in range(2 * len(shapes) // batch_size):
+        index = [(b * batch_size + i) % len(shapes) for i in range(batch_size)]
+        data, octree, node_position, stall = sess.run(reader)
+        batch = np.array([shapes[i] for i in index], dtype=object)
+        expected_data, expected_octree, _ = sess.run(octree_database(batch))
+        self.assertAllEqual(expected_octree, octree)
+        self.assertAllEqual(expected_data, data)
+        # the compressed points are quantized
+        points = in_points[[i % n_shape for i in index]]
+        expected_position = sess.run(primitive_points_suffix_index(points))
+        self.assertAllClose(expected_position, node_position, atol=1e-4)
+        self.assertGreaterEqual(stall, 0)
+
+  def testForward_0(self):
+    self._VerifyValuesNew(False, 1)
+
+  def testForward_1(self):
+    self._VerifyValuesNew(False, 3)
+
+  def testForward_2(self):
+    self._VerifyValuesNew(True, 2)
+
+
+if __name__ == '__main__':
+  test.main()
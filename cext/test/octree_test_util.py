@@ -0,0 +1,23 @@
+# helpers shared by the octree op tests
+import numpy as np
+
+
+def make_octree(nonempty, seed):
+  # octree of depth 2, the nodes of depth 1 marked in nonempty are split
+  rng = np.random.RandomState(seed)
+  xyz = [(j >> 2 & 1, j >> 1 & 1, j & 1) for j in range(8)]
+  key_1 = [x | y << 8 | z << 16 for x, y, z in xyz]
+  key_2 = [(2 * x + cx) | (2 * y + cy) << 8 | (2 * z + cz) << 16
+           for j, (x, y, z) in enumerate(xyz) if nonempty[j]
+           for cx, cy, cz in xyz]
+  children_1 = np.cumsum(nonempty) - 1
+  children_1[np.logical_not(nonempty)] = -1
+  n_2 = len(key_2)
+  node_num = [1, 8, n_2]
+  header = [9 + n_2, n_2, 2, 1] + node_num + [0, 1, 9, 9 + n_2]
+  key = np.array([0] + key_1 + key_2, dtype=np.int32)
+  children = np.concatenate([[0], children_1, -np.ones(n_2)]).astype(np.int32)
+  signal = rng.rand(3 * n_2).astype(np.float32)
+  label = rng.randint(0, 4, n_2).astype(np.int32)
+  return b''.join([np.array(header, dtype=np.int32).tobytes(), key.tobytes(),
+                   children.tobytes(), signal.tobytes(), label.tobytes()])
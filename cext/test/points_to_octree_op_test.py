@@ -0,0 +1,108 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import octree_database
+from cext import points_to_octree
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+def _shuffle_key(x, y, z, depth):
+  key = 0
+  for d in range(depth):
+    key |= ((x >> d & 1) << (3 * d + 2)) | ((y >> d & 1) << (3 * d + 1)) | \
+           ((z >> d & 1) << (3 * d))
+  return key
+
+
+def _build_octree(points, normals, depth):
+  # the reference octree with full_layer 1, points in [-0.5, 0.5)
+  cells = np.clip(((points + 0.5) * 2 ** depth).astype(np.int32),
+                  0, 2 ** depth - 1)
+  codes = np.array([_shuffle_key(x, y, z, depth) for x, y, z in cells.T])
+  nempty = [None] * (depth + 1)
+  nempty[depth] = np.unique(codes)
+  for d in range(depth - 1, -1, -1):
+    nempty[d] = np.unique(nempty[d + 1] >> 3)
+  nempty[0] = np.arange(1)
+  nodes, children = [np.zeros(1, np.int64)], []
+  for d in range(depth + 1):
+    if d > 0:
+      nodes.append((nempty[d - 1][:, None] << 3 | np.arange(8)).reshape(-1))
+    child = -np.ones(len(nodes[d]), np.int32)
+    mask = np.isin(nodes[d], nempty[d])
+    child[mask] = np.arange(np.count_nonzero(mask))
+    children.append(child)
+  signal = np.zeros([3, len(nodes[depth])], np.float32)
+  for i, c in enumerate(codes):
+    signal[:, np.searchsorted(nodes[depth], c)] += normals[:, i]
+  norm = np.linalg.norm(signal, axis=0)
+  signal[:, norm > 0] /= norm[norm > 0]
+  return nodes, children, signal
+
+
+class PointsToOctreeTest(test.TestCase):
+
+  def _VerifyValuesNew(self, n_shape, n_point, depth, seed):
+    rng = np.random.RandomState(seed)
+    in_points = rng.uniform(-0.4, 0.4, [n_shape, 3, n_point]).astype(np.float32)
+    in_normals = rng.randn(n_shape, 3, n_point).astype(np.float32)
+
+    with self.test_session() as sess:
+      octree = points_to_octree(in_points.reshape(n_shape, -1),
+                                in_normals.reshape(n_shape, -1),
+                                depth=depth, full_layer=1)
+      octrees = sess.run(octree)
+      # the octrees are read back by the database op
+      data, _, _ = sess.run(octree_database(octree))
+
+    expected_data = []
+    for i in range(n_shape):
+      nodes, children, signal = _build_octree(in_points[i], in_normals[i],
+                                              depth)
+      buffer = np.frombuffer(octrees[i], dtype=np.int32)
+      node_num = [len(n) for n in nodes]
+      total = sum(node_num)
+      header = [total, node_num[-1], depth, 1] + node_num + \
+               list(np.cumsum([0] + node_num))
+      self.assertAllEqual(header, buffer[:len(header)])
+      # the keys take two ints each past depth 8
+      key_ints, bits = (2, 16) if depth > 8 else (1, 8)
+      key = buffer[len(header):len(header) + key_ints * total]
+      key = key.view(np.int64) if key_ints == 2 else key
+      mask = (1 << bits) - 1
+      xyz = np.stack([key & mask, key >> bits & mask, key >> 2 * bits & mask])
+      codes = [_shuffle_key(x, y, z, d) for d in range(depth + 1)
+               for x, y, z in xyz[:, sum(node_num[:d]):sum(node_num[:d + 1])].T]
+      self.assertAllEqual(np.concatenate(nodes), codes)
+      child = buffer[len(header) + key_ints * total:]
+      self.assertAllEqual(np.concatenate(children), child[:total])
+      actual_signal = child[total:].view(np.float32)
+      self.assertAllClose(signal.reshape(-1),
+                          actual_signal[:signal.size], rtol=1e-5, atol=1e-6)
+      self.assertAllEqual(np.zeros(node_num[-1]), actual_signal[signal.size:])
+      expected_data.append(signal)
+    self.assertAllClose(np.concatenate(expected_data, axis=1)[None, :, :, None],
+                        data, rtol=1e-5, atol=1e-6)
+
+  def testForward_0(self):
+    # a few points, most of the leaves are empty
+    self._VerifyValuesNew(1, 20, 3, 0)
+
+  def testForward_1(self):
+    # a batch of two shapes with many points per leaf
+    self._VerifyValuesNew(2, 2000, 4, 1)
+
+  def testForward_2(self):
+    # deeper than 8, the keys are 64-bit
+    self._VerifyValuesNew(2, 200, 9, 2)
+
+
+if __name__ == '__main__':
+  test.main()
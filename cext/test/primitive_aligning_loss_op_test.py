@@ -17,27 +17,29 @@ os.environ['CUDA_VISIBLE_DEVICES'] = '0'
 class PrimitiveAligningLossTest(test.TestCase):
 
   def _VerifyValuesNew(self, in_q, in_dir, expected):
-    with self.test_session() as sess:
-      q = constant_op.constant(in_q)
-      direction = constant_op.constant(in_dir)
-      data_out = primitive_aligning_loss(q, direction)
-      actual = sess.run(data_out)
-    self.assertAllClose(expected, actual.flatten(), atol=1e-6)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        q = constant_op.constant(in_q)
+        direction = constant_op.constant(in_dir)
+        data_out = primitive_aligning_loss(q, direction)
+        actual = sess.run(data_out)
+      self.assertAllClose(expected, actual.flatten(), atol=1e-6)
 
   def _VerifyGradientsNew(self, in_q, in_dir, n_cube, batch_size):
-    with self.test_session() as sess:
-      q = constant_op.constant(in_q, shape=[batch_size, 4*n_cube])
-      direction = constant_op.constant(in_dir)
-      data_out = primitive_aligning_loss(q, direction)
-      ret = gradient_checker.compute_gradient(
-          q,
-          [batch_size, 4*n_cube],
-          data_out,
-          [1],
-          x_init_value=np.asfarray(in_q).reshape([batch_size, 4*n_cube])
-          )
-      # print(ret)
-      self.assertAllClose(ret[0], ret[1], atol=5e-4)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        q = constant_op.constant(in_q, shape=[batch_size, 4*n_cube])
+        direction = constant_op.constant(in_dir)
+        data_out = primitive_aligning_loss(q, direction)
+        ret = gradient_checker.compute_gradient(
+            q,
+            [batch_size, 4*n_cube],
+            data_out,
+            [1],
+            x_init_value=np.asfarray(in_q).reshape([batch_size, 4*n_cube])
+            )
+        # print(ret)
+        self.assertAllClose(ret[0], ret[1], atol=5e-4)
 
   def testForward_0(self):
     # upright direction
@@ -9,6 +9,7 @@ from tensorflow.python.ops import gradient_checker
 
 sys.path.append('../..')
 from cext import primitive_consistency_loss
+from cext import primitive_cube_transforms
 
 os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
 os.environ['CUDA_VISIBLE_DEVICES'] = '0'
@@ -17,36 +18,42 @@ os.environ['CUDA_VISIBLE_DEVICES'] = '0'
 class PrimitiveConsistencyLossTest(test.TestCase):
 
   def _VerifyValuesNew(self, in_z, in_q, in_t, in_pos, scale, expected):
-    with self.test_session() as sess:
-      z = constant_op.constant(in_z)
-      q = constant_op.constant(in_q)
-      t = constant_op.constant(in_t)
-      pos = constant_op.constant(in_pos)
-      data_out = primitive_consistency_loss(z, q, t, pos, scale=scale)
-      actual = sess.run(data_out)
-    self.assertAllClose(expected, actual.flatten(), atol=1e-8)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        z = constant_op.constant(in_z)
+        q = constant_op.constant(in_q)
+        t = constant_op.constant(in_t)
+        pos = constant_op.constant(in_pos)
+        transforms = primitive_cube_transforms(z, q, t)
+        data_out = primitive_consistency_loss(z, q, t, pos, transforms,
+            scale=scale)
+        actual = sess.run(data_out)
+      self.assertAllClose(expected, actual.flatten(), atol=1e-8)
 
   def _VerifyGradientsNew(self, in_z, in_q, in_t, in_pos, scale, n_cube,
       batch_size):
-    with self.test_session():
-      z = constant_op.constant(in_z, shape=[batch_size, 3*n_cube])
-      q = constant_op.constant(in_q, shape=[batch_size, 4*n_cube])
-      t = constant_op.constant(in_t, shape=[batch_size, 3*n_cube])
-      pos = constant_op.constant(in_pos)
-      data_out = primitive_consistency_loss(z, q, t, pos, scale=scale)
-      ret = gradient_checker.compute_gradient(
-          [z, q, t],
-          [[batch_size, 3*n_cube], [batch_size, 4*n_cube], [batch_size, 3*n_cube]],
-          data_out,
-          [1],
-          x_init_value=[np.asfarray(in_z).reshape([batch_size, 3*n_cube]),
-                        np.asfarray(in_q).reshape([batch_size, 4*n_cube]),
-                        np.asfarray(in_t).reshape([batch_size, 3*n_cube])]
-          )
-      # print(ret)
-      self.assertAllClose(ret[0][0], ret[0][1], atol=5e-4)
-      self.assertAllClose(ret[1][0], ret[1][1], atol=5e-4)
-      self.assertAllClose(ret[2][0], ret[2][1], atol=5e-4)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu):
+        z = constant_op.constant(in_z, shape=[batch_size, 3*n_cube])
+        q = constant_op.constant(in_q, shape=[batch_size, 4*n_cube])
+        t = constant_op.constant(in_t, shape=[batch_size, 3*n_cube])
+        pos = constant_op.constant(in_pos)
+        transforms = primitive_cube_transforms(z, q, t)
+        data_out = primitive_consistency_loss(z, q, t, pos, transforms,
+            scale=scale)
+        ret = gradient_checker.compute_gradient(
+            [z, q, t],
+            [[batch_size, 3*n_cube], [batch_size, 4*n_cube], [batch_size, 3*n_cube]],
+            data_out,
+            [1],
+            x_init_value=[np.asfarray(in_z).reshape([batch_size, 3*n_cube]),
+                          np.asfarray(in_q).reshape([batch_size, 4*n_cube]),
+                          np.asfarray(in_t).reshape([batch_size, 3*n_cube])]
+            )
+        # print(ret)
+        self.assertAllClose(ret[0][0], ret[0][1], atol=5e-4)
+        self.assertAllClose(ret[1][0], ret[1][1], atol=5e-4)
+        self.assertAllClose(ret[2][0], ret[2][1], atol=5e-4)
 
 
   def testForward_0(self):
@@ -88,6 +95,36 @@ class PrimitiveConsistencyLossTest(test.TestCase):
     expected = [0.380892]
     self._VerifyValuesNew(in_z, in_q, in_t, in_pos, scale, expected)
 
+  def testForward_3(self):
+    # two cube, many points per shape, the nearest point search goes through
+    # more than one level of the point tree; the coordinates are multiples of
+    # 1/64 so the distances are exact in float
+    rng = np.random.RandomState(11)
+    batch_size = 2
+    n_point = 300
+    in_z = [[0.25, 0.125, 0.375, 0.5, 0.25, 0.125]] * batch_size
+    in_q = [[1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0]] * batch_size
+    in_t = [[0.25, -0.125, 0.0, -0.25, 0.375, 0.125]] * batch_size
+    scale = 0.5
+    points = rng.randint(-32, 32, size=[3, batch_size * n_point]) / 64.0
+    batch_index = np.repeat(np.arange(batch_size), n_point)
+    in_pos = np.concatenate([points, batch_index[np.newaxis]]).astype(np.float32)
+
+    grid = np.stack(np.meshgrid([-1, 0, 1], [-1, 0, 1], [-1, 0, 1],
+                                indexing='ij'), axis=-1).reshape(-1, 3)
+    samples = grid[np.any(grid != 0, axis=1)] * scale
+    distances = []
+    for b in range(batch_size):
+      shape_points = points[:, batch_index == b].T
+      for c in range(2):
+        z = np.array(in_z[b][3*c:3*c+3])
+        t = np.array(in_t[b][3*c:3*c+3])
+        sample_points = samples * z + t
+        diff = sample_points[:, np.newaxis, :] - shape_points[np.newaxis]
+        distances.append(np.min(np.sum(diff ** 2, axis=2), axis=1))
+    expected = [np.mean(distances)]
+    self._VerifyValuesNew(in_z, in_q, in_t, in_pos, scale, expected)
+
   def testBackward_0(self):
     in_z = [[0.1, 0.1, 0.1], [0.1, 0.1, 0.1]]
     in_q = [[1.0, 0.0, 0.0, 0.0], [1.0, 0.0, 0.0, 0.0]]
@@ -0,0 +1,133 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.framework import constant_op
+from tensorflow.python.platform import test
+from tensorflow.python.ops import gradient_checker
+
+sys.path.append('../..')
+from cext import primitive_point_cube_assignment
+from cext import primitive_coverage_assigned_loss
+from cext import primitive_coverage_split_assigned_loss
+from cext import primitive_coverage_loss
+from cext import primitive_coverage_split_loss
+from cext import primitive_cube_transforms
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+class PrimitiveCoverageAssignedLossTest(test.TestCase):
+
+  def _VerifyValuesNew(self, in_z, in_q, in_t, in_pos):
+    # the assigned losses are the losses which search the nearest cubes
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        z = constant_op.constant(in_z)
+        q = constant_op.constant(in_q)
+        t = constant_op.constant(in_t)
+        pos = constant_op.constant(in_pos)
+        transforms = primitive_cube_transforms(z, q, t)
+        index, _, count = primitive_point_cube_assignment(z, q, t, pos,
+            transforms)
+        loss = primitive_coverage_assigned_loss(z, q, t, pos, index, transforms)
+        split_loss = primitive_coverage_split_assigned_loss(z, q, t, pos, index,
+            transforms)
+        expected_loss = primitive_coverage_loss(z, q, t, pos, transforms)
+        expected_split_loss = primitive_coverage_split_loss(z, q, t, pos,
+            transforms)
+        actual = sess.run([loss, split_loss, count])
+        expected = sess.run([expected_loss, expected_split_loss])
+      self.assertAllClose(expected[0], actual[0], atol=1e-6)
+      self.assertAllClose(expected[1][0], actual[1], atol=1e-6)
+      self.assertAllEqual(expected[1][1], actual[2])
+
+  def _VerifyGradientsNew(self, in_z, in_q, in_t, in_pos, n_cube, batch_size,
+      split):
+    loss_op = (primitive_coverage_split_assigned_loss if split else
+               primitive_coverage_assigned_loss)
+    loss_shape = [batch_size, n_cube] if split else [1]
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu):
+        z = constant_op.constant(in_z, shape=[batch_size, 3*n_cube])
+        q = constant_op.constant(in_q, shape=[batch_size, 4*n_cube])
+        t = constant_op.constant(in_t, shape=[batch_size, 3*n_cube])
+        pos = constant_op.constant(in_pos)
+        transforms = primitive_cube_transforms(z, q, t)
+        index = primitive_point_cube_assignment(z, q, t, pos,
+            transforms)[0].eval()
+        data_out = loss_op(z, q, t, pos, constant_op.constant(index),
+            transforms)
+        ret = gradient_checker.compute_gradient(
+            [z, q, t],
+            [[batch_size, 3*n_cube], [batch_size, 4*n_cube], [batch_size, 3*n_cube]],
+            data_out,
+            loss_shape,
+            x_init_value=[np.asfarray(in_z).reshape([batch_size, 3*n_cube]),
+                          np.asfarray(in_q).reshape([batch_size, 4*n_cube]),
+                          np.asfarray(in_t).reshape([batch_size, 3*n_cube])]
+            )
+        self.assertAllClose(ret[0][0], ret[0][1], atol=1e-4)
+        self.assertAllClose(ret[1][0], ret[1][1], atol=1e-4)
+        self.assertAllClose(ret[2][0], ret[2][1], atol=1e-4)
+
+  def testForward_0(self):
+    # points outside two cubes
+    in_z = [[0.1, 0.1, 0.1, 0.2, 0.3, 0.4], [0.1, 0.1, 0.1, 0.2, 0.3, 0.4]]
+    in_q = [[1.0, 0.0, 0.0, 0.0, 0.5, 0.5, 0.5, 0.5], [1.0, 0.0, 0.0, 0.0, 0.5, 0.5, 0.5, 0.5]]
+    in_t = [[0.1, 0.1, 0.1, 0.2, 0.3, 0.4], [0.1, 0.1, 0.1, 0.2, 0.3, 0.4]]
+    in_pos = [[0.2, 0.3, 0.7, 0.2, 0.3, 0.7],
+              [0.2, 0.3, 0.8, 0.2, 0.3, 0.8],
+              [0.2, 0.3, 0.9, 0.2, 0.3, 0.9],
+              [0.0, 0.0, 0.0, 1.0, 1.0, 1.0]]
+    self._VerifyValuesNew(in_z, in_q, in_t, in_pos)
+
+  def testForward_1(self):
+    # random cubes and points
+    batch_size, n_cube, n_point = 3, 5, 200
+    np.random.seed(0)
+    in_z = np.random.uniform(0.05, 0.2, [batch_size, n_cube * 3])
+    in_q = np.random.uniform(-1.0, 1.0, [batch_size, n_cube * 4])
+    in_t = np.random.uniform(-0.5, 0.5, [batch_size, n_cube * 3])
+    in_pos = np.random.uniform(-0.6, 0.6, [4, n_point])
+    in_pos[3] = np.sort(np.random.randint(0, batch_size, n_point))
+    self._VerifyValuesNew(in_z.astype(np.float32), in_q.astype(np.float32),
+        in_t.astype(np.float32), in_pos.astype(np.float32))
+
+  def testBackward_0(self):
+    # two point to two cube
+    in_z = [[0.1, 0.1, 0.1, 0.1, 0.1, 0.1], [0.1, 0.1, 0.1, 0.1, 0.1, 0.1]]
+    in_q = [[1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0], [1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0]]
+    in_t = [[0.1, 0.1, 0.1, 0.8, 0.8, 0.8], [0.1, 0.1, 0.1, 0.8, 0.8, 0.8]]
+    batch_size = 2
+    n_cube = 2
+    in_pos = [[0.3, 0.6, 0.3, 0.6],
+              [0.3, 0.6, 0.3, 0.6],
+              [0.3, 0.6, 0.3, 0.6],
+              [0.0, 0.0, 1.0, 1.0]]
+    self._VerifyGradientsNew(in_z, in_q, in_t, in_pos, n_cube, batch_size,
+        split=False)
+    self._VerifyGradientsNew(in_z, in_q, in_t, in_pos, n_cube, batch_size,
+        split=True)
+
+  def testBackward_1(self):
+    # rotated cubes
+    in_z = [[0.1, 0.2, 0.3, 0.2, 0.1, 0.1]]
+    in_q = [[0.9, 0.1, 0.3, 0.2, 0.5, 0.5, 0.5, 0.5]]
+    in_t = [[0.1, 0.1, 0.1, 0.6, 0.5, 0.4]]
+    batch_size = 1
+    n_cube = 2
+    in_pos = [[0.5, 0.7, -0.3],
+              [0.5, 0.1, 0.2],
+              [-0.4, 0.9, 0.5],
+              [0.0, 0.0, 0.0]]
+    self._VerifyGradientsNew(in_z, in_q, in_t, in_pos, n_cube, batch_size,
+        split=False)
+    self._VerifyGradientsNew(in_z, in_q, in_t, in_pos, n_cube, batch_size,
+        split=True)
+
+
+if __name__ == '__main__':
+  test.main()
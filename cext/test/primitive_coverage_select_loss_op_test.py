@@ -9,6 +9,7 @@ from tensorflow.python.ops import gradient_checker
 
 sys.path.append('../..')
 from cext import primitive_coverage_select_loss
+from cext import primitive_cube_transforms
 
 os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
 os.environ['CUDA_VISIBLE_DEVICES'] = '0'
@@ -17,37 +18,43 @@ os.environ['CUDA_VISIBLE_DEVICES'] = '0'
 class PrimitiveCoverageSelectLossTest(test.TestCase):
 
   def _VerifyValuesNew(self, in_z, in_q, in_t, in_mask, in_pos, expected):
-    with self.test_session() as sess:
-      z = constant_op.constant(in_z)
-      q = constant_op.constant(in_q)
-      t = constant_op.constant(in_t)
-      mask = constant_op.constant(in_mask)
-      pos = constant_op.constant(in_pos)
-      data_out = primitive_coverage_select_loss(z, q, t, mask, pos)
-      actual = sess.run(data_out)
-    self.assertAllClose(expected, actual.flatten(), atol=1e-8)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        z = constant_op.constant(in_z)
+        q = constant_op.constant(in_q)
+        t = constant_op.constant(in_t)
+        mask = constant_op.constant(in_mask)
+        pos = constant_op.constant(in_pos)
+        transforms = primitive_cube_transforms(z, q, t)
+        data_out = primitive_coverage_select_loss(z, q, t, mask, pos,
+            transforms)
+        actual = sess.run(data_out)
+      self.assertAllClose(expected, actual.flatten(), atol=1e-8)
 
   def _VerifyGradientsNew(self, in_z, in_q, in_t, in_mask, in_pos, n_cube, batch_size):
-    with self.test_session():
-      z = constant_op.constant(in_z, shape=[batch_size, 3*n_cube])
-      q = constant_op.constant(in_q, shape=[batch_size, 4*n_cube])
-      t = constant_op.constant(in_t, shape=[batch_size, 3*n_cube])
-      mask = constant_op.constant(in_mask)
-      pos = constant_op.constant(in_pos)
-      data_out = primitive_coverage_select_loss(z, q, t, mask, pos)
-      ret = gradient_checker.compute_gradient(
-          [z, q, t],
-          [[batch_size, 3*n_cube], [batch_size, 4*n_cube], [batch_size, 3*n_cube]],
-          data_out,
-          [1],
-          x_init_value=[np.asfarray(in_z).reshape([batch_size, 3*n_cube]),
-                        np.asfarray(in_q).reshape([batch_size, 4*n_cube]),
-                        np.asfarray(in_t).reshape([batch_size, 3*n_cube])]
-          )
-      # print(ret)
-      self.assertAllClose(ret[0][0], ret[0][1], atol=5e-5)
-      self.assertAllClose(ret[1][0], ret[1][1], atol=5e-5)
-      self.assertAllClose(ret[2][0], ret[2][1], atol=5e-5)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu):
+        z = constant_op.constant(in_z, shape=[batch_size, 3*n_cube])
+        q = constant_op.constant(in_q, shape=[batch_size, 4*n_cube])
+        t = constant_op.constant(in_t, shape=[batch_size, 3*n_cube])
+        mask = constant_op.constant(in_mask)
+        pos = constant_op.constant(in_pos)
+        transforms = primitive_cube_transforms(z, q, t)
+        data_out = primitive_coverage_select_loss(z, q, t, mask, pos,
+            transforms)
+        ret = gradient_checker.compute_gradient(
+            [z, q, t],
+            [[batch_size, 3*n_cube], [batch_size, 4*n_cube], [batch_size, 3*n_cube]],
+            data_out,
+            [1],
+            x_init_value=[np.asfarray(in_z).reshape([batch_size, 3*n_cube]),
+                          np.asfarray(in_q).reshape([batch_size, 4*n_cube]),
+                          np.asfarray(in_t).reshape([batch_size, 3*n_cube])]
+            )
+        # print(ret)
+        self.assertAllClose(ret[0][0], ret[0][1], atol=5e-5)
+        self.assertAllClose(ret[1][0], ret[1][1], atol=5e-5)
+        self.assertAllClose(ret[2][0], ret[2][1], atol=5e-5)
 
   def testForward_0(self):
     # point outside one cube
@@ -18,25 +18,27 @@ os.environ['CUDA_VISIBLE_DEVICES'] = '0'
 class PrimitiveCubeAreaTest(test.TestCase):
 
   def _VerifyValuesNew(self, in_z, expected):
-    with self.test_session() as sess:
-      z = constant_op.constant(in_z)
-      data_out = primitive_cube_area_average_loss(z)
-      actual = sess.run(data_out)
-    self.assertAllClose(expected, actual.flatten(), atol=1e-8)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        z = constant_op.constant(in_z)
+        data_out = primitive_cube_area_average_loss(z)
+        actual = sess.run(data_out)
+      self.assertAllClose(expected, actual.flatten(), atol=1e-8)
 
   def _VerifyGradientsNew(self, in_z, n_cube, batch_size):
-    with self.test_session():
-      z = constant_op.constant(in_z, shape=[batch_size, 3*n_cube])
-      data_out = primitive_cube_area_average_loss(z)
-      ret = gradient_checker.compute_gradient(
-          z,
-          [batch_size, 3*n_cube],
-          data_out,
-          [1],
-          x_init_value=np.asfarray(in_z).reshape([batch_size, 3*n_cube])
-          )
-      # print(ret)
-      self.assertAllClose(ret[0], ret[1], atol=5e-5)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu):
+        z = constant_op.constant(in_z, shape=[batch_size, 3*n_cube])
+        data_out = primitive_cube_area_average_loss(z)
+        ret = gradient_checker.compute_gradient(
+            z,
+            [batch_size, 3*n_cube],
+            data_out,
+            [1],
+            x_init_value=np.asfarray(in_z).reshape([batch_size, 3*n_cube])
+            )
+        # print(ret)
+        self.assertAllClose(ret[0], ret[1], atol=5e-5)
 
   def testForward_0(self):
     # one cube
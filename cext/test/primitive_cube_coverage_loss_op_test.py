@@ -10,6 +10,7 @@ from tensorflow.python.ops import gradient_checker
 sys.path.append('../..')
 from cext import primitive_cube_coverage_loss
 from cext import primitive_group_points
+from cext import primitive_cube_transforms
 
 os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
 os.environ['CUDA_VISIBLE_DEVICES'] = '0'
@@ -19,49 +20,55 @@ class PrimitiveCubeCoverageLossTest(test.TestCase):
 
   def _VerifyValuesNew(self, src_z, src_q, src_t, des_z, des_q, des_t, in_pos,
       n_src_cube, expected):
-    with self.test_session() as sess:
-      sz = constant_op.constant(src_z)
-      sq = constant_op.constant(src_q)
-      st = constant_op.constant(src_t)
-      dz = constant_op.constant(des_z)
-      dq = constant_op.constant(des_q)
-      dt = constant_op.constant(des_t)
-      pos = constant_op.constant(in_pos)
-      points_index = primitive_group_points(sz, sq, st, pos)
-      data_out, relation_out = primitive_cube_coverage_loss(dz, dq, dt, pos, points_index,
-          n_src_cube=n_src_cube)
-      [actual, pi, relation] = sess.run([data_out, points_index, relation_out])
-      # print('\npoints_index: ', pi)
-      # print('points_relation: ', relation)
-    self.assertAllClose(expected[0], actual.flatten(), atol=1e-8)
-    self.assertAllEqual(expected[1], relation)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        sz = constant_op.constant(src_z)
+        sq = constant_op.constant(src_q)
+        st = constant_op.constant(src_t)
+        dz = constant_op.constant(des_z)
+        dq = constant_op.constant(des_q)
+        dt = constant_op.constant(des_t)
+        pos = constant_op.constant(in_pos)
+        src_transforms = primitive_cube_transforms(sz, sq, st)
+        points_index = primitive_group_points(sz, sq, st, pos, src_transforms)
+        des_transforms = primitive_cube_transforms(dz, dq, dt)
+        data_out, relation_out = primitive_cube_coverage_loss(dz, dq, dt, pos,
+            points_index, des_transforms, n_src_cube=n_src_cube)
+        [actual, pi, relation] = sess.run([data_out, points_index, relation_out])
+        # print('\npoints_index: ', pi)
+        # print('points_relation: ', relation)
+      self.assertAllClose(expected[0], actual.flatten(), atol=1e-8)
+      self.assertAllEqual(expected[1], relation)
 
   def _VerifyGradientsNew(self, src_z, src_q, src_t, des_z, des_q, des_t,
       in_pos, n_src_cube, n_des_cube, batch_size):
-    with self.test_session():
-      sz = constant_op.constant(src_z, shape=[batch_size, 3*n_src_cube])
-      sq = constant_op.constant(src_q, shape=[batch_size, 4*n_src_cube])
-      st = constant_op.constant(src_t, shape=[batch_size, 3*n_src_cube])
-      dz = constant_op.constant(des_z, shape=[batch_size, 3*n_des_cube])
-      dq = constant_op.constant(des_q, shape=[batch_size, 4*n_des_cube])
-      dt = constant_op.constant(des_t, shape=[batch_size, 3*n_des_cube])
-      pos = constant_op.constant(in_pos)
-      points_index = primitive_group_points(sz, sq, st, pos)
-      data_out, _ = primitive_cube_coverage_loss(dz, dq, dt, pos, points_index,
-          n_src_cube=n_src_cube)
-      ret = gradient_checker.compute_gradient(
-          [dz, dq, dt],
-          [[batch_size, 3*n_des_cube], [batch_size, 4*n_des_cube], [batch_size, 3*n_des_cube]],
-          data_out,
-          [1],
-          x_init_value=[np.asfarray(des_z).reshape([batch_size, 3*n_des_cube]),
-                        np.asfarray(des_q).reshape([batch_size, 4*n_des_cube]),
-                        np.asfarray(des_t).reshape([batch_size, 3*n_des_cube])]
-          )
-      # print(ret)
-      self.assertAllClose(ret[0][0], ret[0][1], atol=5e-5)
-      self.assertAllClose(ret[1][0], ret[1][1], atol=5e-5)
-      self.assertAllClose(ret[2][0], ret[2][1], atol=5e-5)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu):
+        sz = constant_op.constant(src_z, shape=[batch_size, 3*n_src_cube])
+        sq = constant_op.constant(src_q, shape=[batch_size, 4*n_src_cube])
+        st = constant_op.constant(src_t, shape=[batch_size, 3*n_src_cube])
+        dz = constant_op.constant(des_z, shape=[batch_size, 3*n_des_cube])
+        dq = constant_op.constant(des_q, shape=[batch_size, 4*n_des_cube])
+        dt = constant_op.constant(des_t, shape=[batch_size, 3*n_des_cube])
+        pos = constant_op.constant(in_pos)
+        src_transforms = primitive_cube_transforms(sz, sq, st)
+        points_index = primitive_group_points(sz, sq, st, pos, src_transforms)
+        des_transforms = primitive_cube_transforms(dz, dq, dt)
+        data_out, _ = primitive_cube_coverage_loss(dz, dq, dt, pos,
+            points_index, des_transforms, n_src_cube=n_src_cube)
+        ret = gradient_checker.compute_gradient(
+            [dz, dq, dt],
+            [[batch_size, 3*n_des_cube], [batch_size, 4*n_des_cube], [batch_size, 3*n_des_cube]],
+            data_out,
+            [1],
+            x_init_value=[np.asfarray(des_z).reshape([batch_size, 3*n_des_cube]),
+                          np.asfarray(des_q).reshape([batch_size, 4*n_des_cube]),
+                          np.asfarray(des_t).reshape([batch_size, 3*n_des_cube])]
+            )
+        # print(ret)
+        self.assertAllClose(ret[0][0], ret[0][1], atol=5e-5)
+        self.assertAllClose(ret[1][0], ret[1][1], atol=5e-5)
+        self.assertAllClose(ret[2][0], ret[2][1], atol=5e-5)
 
   def testForward_degenerate(self):
     # one src cube cover no point
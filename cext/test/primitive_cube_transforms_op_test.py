@@ -0,0 +1,72 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.framework import constant_op
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import primitive_cube_transforms
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+def rotation_matrix(q):
+  w, x, y, z = q / np.linalg.norm(q)
+  return np.array([
+      [1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w)],
+      [2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w)],
+      [2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y)]])
+
+
+class PrimitiveCubeTransformsTest(test.TestCase):
+
+  def _VerifyValuesNew(self, in_z, in_q, in_t):
+    in_z = np.array(in_z, dtype=np.float32)
+    in_q = np.array(in_q, dtype=np.float32)
+    in_t = np.array(in_t, dtype=np.float32)
+    with self.test_session() as sess:
+      transforms = sess.run(primitive_cube_transforms(
+          constant_op.constant(in_z), constant_op.constant(in_q),
+          constant_op.constant(in_t)))
+
+    n = in_z.size // 3
+    z = np.reshape(in_z, [n, 3])
+    q = np.reshape(in_q, [n, 4])
+    t = np.reshape(in_t, [n, 3])
+    self.assertEqual(27, transforms.shape[0])
+    self.assertEqual(0, transforms.shape[1] % 16)
+    self.assertGreaterEqual(transforms.shape[1], n)
+    for k in range(n):
+      r = rotation_matrix(q[k].astype(np.float64))
+      self.assertAllClose(np.reshape(r, [9]), transforms[0:9, k], atol=1e-6)
+      self.assertAllClose(np.reshape(r.T, [9]), transforms[9:18, k],
+                          atol=1e-6)
+      self.assertAllClose(-np.dot(r.T, t[k]), transforms[18:21, k],
+                          atol=1e-6)
+      self.assertAllClose(z[k], transforms[21:24, k])
+      self.assertAllClose(t[k], transforms[24:27, k])
+    self.assertAllEqual(np.zeros([27, transforms.shape[1] - n]),
+                        transforms[:, n:])
+
+  def testForward_0(self):
+    # the identity rotation and a quarter turn around z
+    in_z = [[0.1, 0.2, 0.3, 0.4, 0.5, 0.6]]
+    in_q = [[1.0, 0.0, 0.0, 0.0, 0.5, 0.0, 0.0, 0.5]]
+    in_t = [[0.1, 0.2, 0.3, -0.1, -0.2, -0.3]]
+    self._VerifyValuesNew(in_z, in_q, in_t)
+
+  def testForward_1(self):
+    # unnormalized quaternions, more cubes than one row of padding
+    rng = np.random.RandomState(5)
+    batch_size, n_cube = 3, 7
+    in_z = rng.uniform(0.05, 0.3, [batch_size, 3 * n_cube])
+    in_q = rng.uniform(-2.0, 2.0, [batch_size, 4 * n_cube])
+    in_t = rng.uniform(-0.5, 0.5, [batch_size, 3 * n_cube])
+    self._VerifyValuesNew(in_z, in_q, in_t)
+
+
+if __name__ == '__main__':
+  test.main()
@@ -16,11 +16,12 @@ os.environ['CUDA_VISIBLE_DEVICES'] = '0'
 class PrimitiveCubeVolumeTest(test.TestCase):
 
   def _VerifyValuesNew(self, in_z, expected):
-    with self.test_session() as sess:
-      z = constant_op.constant(in_z)
-      data_out = primitive_cube_volume(z)
-      actual = sess.run(data_out)
-    self.assertAllClose(expected, actual.flatten(), atol=1e-8)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        z = constant_op.constant(in_z)
+        data_out = primitive_cube_volume(z)
+        actual = sess.run(data_out)
+      self.assertAllClose(expected, actual.flatten(), atol=1e-8)
 
   def testForward_0(self):
     # one cube
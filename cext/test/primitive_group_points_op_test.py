@@ -8,6 +8,7 @@ from tensorflow.python.platform import test
 
 sys.path.append('../..')
 from cext import primitive_group_points
+from cext import primitive_cube_transforms
 
 os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
 os.environ['CUDA_VISIBLE_DEVICES'] = '0'
@@ -16,14 +17,16 @@ os.environ['CUDA_VISIBLE_DEVICES'] = '0'
 class PrimitiveGroupPointsTest(test.TestCase):
 
   def _VerifyValuesNew(self, in_z, in_q, in_t, in_pos, expected):
-    with self.test_session() as sess:
-      z = constant_op.constant(in_z)
-      q = constant_op.constant(in_q)
-      t = constant_op.constant(in_t)
-      pos = constant_op.constant(in_pos)
-      data_out = primitive_group_points(z, q, t, pos)
-      actual = sess.run(data_out)
-    self.assertAllEqual(expected, actual.flatten())
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        z = constant_op.constant(in_z)
+        q = constant_op.constant(in_q)
+        t = constant_op.constant(in_t)
+        pos = constant_op.constant(in_pos)
+        transforms = primitive_cube_transforms(z, q, t)
+        data_out = primitive_group_points(z, q, t, pos, transforms)
+        actual = sess.run(data_out)
+      self.assertAllEqual(expected, actual.flatten())
 
   def testForward_0(self):
     # two cube, multiple points
@@ -0,0 +1,74 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.framework import constant_op
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import primitive_point_cube_assignment
+from cext import primitive_group_points
+from cext import primitive_cube_transforms
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+class PrimitivePointCubeAssignmentTest(test.TestCase):
+
+  def _VerifyValuesNew(self, in_z, in_q, in_t, in_pos, expected):
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        z = constant_op.constant(in_z)
+        q = constant_op.constant(in_q)
+        t = constant_op.constant(in_t)
+        pos = constant_op.constant(in_pos)
+        transforms = primitive_cube_transforms(z, q, t)
+        data_out = primitive_point_cube_assignment(z, q, t, pos, transforms)
+        actual = sess.run(data_out)
+      self.assertAllEqual(expected[0], actual[0])
+      self.assertAllClose(expected[1], actual[1], atol=1e-6)
+      self.assertAllEqual(expected[2], actual[2])
+
+  def testForward_0(self):
+    # two cube, multiple points
+    in_z = [[0.1, 0.1, 0.1, 0.1, 0.1, 0.1], [0.1, 0.1, 0.1, 0.1, 0.1, 0.1]]
+    in_q = [[1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0], [1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0]]
+    in_t = [[0.1, 0.1, 0.1, 0.8, 0.8, 0.8], [0.1, 0.1, 0.1, 0.8, 0.8, 0.8]]
+    in_pos = [[0.0, 0.1, 0.6, 0.5, 0.7, 0.2, 0.0, 0.1, 0.6, 0.5, 0.7, 0.2],
+              [0.0, 0.1, 0.6, 0.5, 0.8, 0.2, 0.0, 0.1, 0.6, 0.5, 0.8, 0.2],
+              [0.0, 0.1, 0.6, 0.5, 0.9, 0.2, 0.0, 0.1, 0.6, 0.5, 0.9, 0.2],
+              [0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0]]
+    index = [0, 0, 1, 1, 1, 0, 2, 2, 3, 3, 3, 2]
+    distance = [0, 0, 0.03, 0.12, 0, 0, 0, 0, 0.03, 0.12, 0, 0]
+    count = [[3, 3], [3, 3]]
+    self._VerifyValuesNew(in_z, in_q, in_t, in_pos, [index, distance, count])
+
+  def testForward_1(self):
+    # the index is the one of PrimitiveGroupPoints
+    batch_size, n_cube, n_point = 3, 5, 200
+    np.random.seed(0)
+    in_z = np.random.uniform(0.05, 0.2, [batch_size, n_cube * 3])
+    in_q = np.random.uniform(-1.0, 1.0, [batch_size, n_cube * 4])
+    in_t = np.random.uniform(-0.5, 0.5, [batch_size, n_cube * 3])
+    in_pos = np.random.uniform(-0.6, 0.6, [4, n_point])
+    in_pos[3] = np.sort(np.random.randint(0, batch_size, n_point))
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        z = constant_op.constant(in_z, dtype=tf.float32)
+        q = constant_op.constant(in_q, dtype=tf.float32)
+        t = constant_op.constant(in_t, dtype=tf.float32)
+        pos = constant_op.constant(in_pos, dtype=tf.float32)
+        transforms = primitive_cube_transforms(z, q, t)
+        index, _, count = primitive_point_cube_assignment(z, q, t, pos,
+            transforms)
+        group = primitive_group_points(z, q, t, pos, transforms)
+        index, count, group = sess.run([index, count, group])
+      self.assertAllEqual(group, index)
+      self.assertAllEqual(np.bincount(index, minlength=batch_size * n_cube),
+                          count.flatten())
+
+
+if __name__ == '__main__':
+  test.main()
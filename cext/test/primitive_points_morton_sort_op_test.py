@@ -0,0 +1,74 @@
+import os
+import sys
+import numpy as np
+
+import tensorflow as tf
+from tensorflow.python.framework import constant_op
+from tensorflow.python.platform import test
+
+sys.path.append('../..')
+from cext import primitive_group_points
+from cext import primitive_points_morton_sort
+from cext import primitive_cube_transforms
+
+os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'
+os.environ['CUDA_VISIBLE_DEVICES'] = '0'
+
+
+class PrimitivePointsMortonSortTest(test.TestCase):
+
+  def _VerifyValuesNew(self, in_pos, expected_index, depth=10):
+    with self.test_session() as sess:
+      pos = constant_op.constant(in_pos, dtype=tf.float32)
+      out_pos, out_index = sess.run(primitive_points_morton_sort(pos,
+                                                                 depth=depth))
+    self.assertAllEqual(expected_index, out_index)
+    self.assertAllEqual(np.array(in_pos)[:, expected_index], out_pos)
+
+  def testForward_0(self):
+    # the corners of the unit cube, in the order of the Morton curve whose
+    # codes hold x in the highest bit of each level
+    corners = [(x, y, z) for x in (0, 1) for y in (0, 1) for z in (0, 1)]
+    order = [7, 2, 5, 0, 6, 3, 1, 4]
+    in_pos = np.array([list(corners[i]) + [0] for i in order])
+    self._VerifyValuesNew(np.transpose(in_pos), np.argsort(order))
+
+  def testForward_1(self):
+    # two shapes of two points each, the shapes keep their order and the
+    # bounding box is taken per shape
+    in_pos = [[0.9, 0.1, 5.0, 3.0],
+              [0.9, 0.1, 5.0, 3.0],
+              [0.9, 0.1, 5.0, 3.0],
+              [0.0, 0.0, 1.0, 1.0]]
+    self._VerifyValuesNew(in_pos, [1, 0, 3, 2], depth=1)
+
+  def testForward_2(self):
+    # the points of interleaved shapes, a per-point result computed on the
+    # sorted points goes back to the original order
+    rng = np.random.RandomState(3)
+    n_point, batch_size, n_cube = 600, 3, 4
+    in_pos = rng.uniform(-0.5, 0.5, [4, n_point]).astype(np.float32)
+    in_pos[3] = rng.randint(0, batch_size, n_point)
+    in_z = rng.uniform(0.05, 0.2, [batch_size, 3 * n_cube]).astype(np.float32)
+    in_q = rng.randn(batch_size, n_cube, 4)
+    in_q /= np.linalg.norm(in_q, axis=2, keepdims=True)
+    in_q = np.reshape(in_q, [batch_size, 4 * n_cube]).astype(np.float32)
+    in_t = rng.uniform(-0.4, 0.4, [batch_size, 3 * n_cube]).astype(np.float32)
+
+    with self.test_session() as sess:
+      pos, index = primitive_points_morton_sort(in_pos)
+      transforms = primitive_cube_transforms(in_z, in_q, in_t)
+      group = primitive_group_points(in_z, in_q, in_t, pos, transforms)
+      restored = tf.gather(group, tf.invert_permutation(index))
+      expected = primitive_group_points(in_z, in_q, in_t, in_pos, transforms)
+      out_pos, out_index, restored, expected = sess.run(
+          [pos, index, restored, expected])
+
+    self.assertAllEqual(np.arange(n_point), np.sort(out_index))
+    self.assertAllEqual(in_pos[:, out_index], out_pos)
+    self.assertTrue(np.all(np.diff(out_pos[3]) >= 0))
+    self.assertAllEqual(expected, restored)
+
+
+if __name__ == '__main__':
+  test.main()
@@ -16,11 +16,12 @@ os.environ['CUDA_VISIBLE_DEVICES'] = '0'
 class PrimitiveGroupPointsTest(test.TestCase):
 
   def _VerifyValuesNew(self, in_pos, expected):
-    with self.test_session() as sess:
-      pos = constant_op.constant(in_pos)
-      data_out = primitive_points_suffix_index(pos)
-      actual = sess.run(data_out)
-    self.assertAllClose(expected, actual, atol=1e-6)
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        pos = constant_op.constant(in_pos)
+        data_out = primitive_points_suffix_index(pos)
+        actual = sess.run(data_out)
+      self.assertAllClose(expected, actual, atol=1e-6)
 
   def testForward_0(self):
     # batch size 2, two points
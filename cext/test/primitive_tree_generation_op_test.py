@@ -17,16 +17,17 @@ class PrimitiveGroupPointsTest(test.TestCase):
 
   def _VerifyValuesNew(self, n1, n2, n3, in_mask, in_relation_1, in_relation_2,
       expected):
-    with self.test_session() as sess:
-      mask = constant_op.constant(in_mask)
-      relation_1 = constant_op.constant(in_relation_1)
-      relation_2 = constant_op.constant(in_relation_2)
-      data_out = primitive_tree_generation(mask, relation_1, relation_2,
-          n_part_1=n1, n_part_2=n2, n_part_3=n3)
-      actual = sess.run(data_out)
-    self.assertAllEqual(expected[0], actual[0])
-    self.assertAllEqual(expected[1], actual[1])
-    self.assertAllEqual(expected[2], actual[2])
+    for use_gpu in [False, True]:
+      with self.test_session(use_gpu=use_gpu) as sess:
+        mask = constant_op.constant(in_mask)
+        relation_1 = constant_op.constant(in_relation_1)
+        relation_2 = constant_op.constant(in_relation_2)
+        data_out = primitive_tree_generation(mask, relation_1, relation_2,
+            n_part_1=n1, n_part_2=n2, n_part_3=n3)
+        actual = sess.run(data_out)
+      self.assertAllEqual(expected[0], actual[0])
+      self.assertAllEqual(expected[1], actual[1])
+      self.assertAllEqual(expected[2], actual[2])
 
   def testForward_0(self):
     # complete
@@ -103,7 +103,7 @@ sys.stdout.flush()
 
 
 def initial_loss_function(cube_params_1, cube_params_2, cube_params_3,
-    node_position):
+    node_position, assignments=(None, None, None)):
   with tf.name_scope('initial_loss_function'):
     [coverage_distance_1,
      cube_volume_1,
@@ -112,7 +112,7 @@ def initial_loss_function(cube_params_1, cube_params_2, cube_params_3,
      aligning_distance_1,
      symmetry_distance_1,
      cube_area_average_distance_1
-    ] = compute_loss_phase_one(cube_params_1, node_position)
+    ] = compute_loss_phase_one(cube_params_1, node_position, assignments[0])
 
     loss_1 = (coverage_distance_1 * FLAGS.coverage_weight +
               consistency_distance_1 * FLAGS.consistency_weight +
@@ -128,7 +128,7 @@ def initial_loss_function(cube_params_1, cube_params_2, cube_params_3,
      aligning_distance_2,
      symmetry_distance_2
     ] = compute_loss_phase_merge(cube_params_1, cube_params_2, n_part_1,
-        node_position, phase='two')
+        node_position, phase='two', src_assignment=assignments[0])
 
     loss_2 = (coverage_distance_2 * FLAGS.coverage_weight +
               consistency_distance_2 * FLAGS.consistency_weight +
@@ -143,7 +143,7 @@ def initial_loss_function(cube_params_1, cube_params_2, cube_params_3,
      aligning_distance_3,
      symmetry_distance_3
     ] = compute_loss_phase_merge(cube_params_2, cube_params_3, n_part_2,
-        node_position, phase='three')
+        node_position, phase='three', src_assignment=assignments[1])
 
     loss_3 = (coverage_distance_3 * FLAGS.coverage_weight +
               consistency_distance_3 * FLAGS.consistency_weight +
@@ -155,12 +155,12 @@ def initial_loss_function(cube_params_1, cube_params_2, cube_params_3,
 
 
 def mask_predict_loss_function(logit_1, logit_2, logit_3, cube_params_1,
-    cube_params_2, cube_params_3, node_position):
+    cube_params_2, cube_params_3, node_position, assignments=None):
   with tf.name_scope('mask_predict_loss_function'):
     sparseness_loss = mask_sparseness_loss(logit_1, logit_2, logit_3)
     similarity_loss, relation_12, relation_23 = shape_similarity_loss(logit_1,
         logit_2, logit_3, cube_params_1, cube_params_2, cube_params_3,
-        node_position, n_part_1, n_part_2)
+        node_position, n_part_1, n_part_2, assignments)
     completeness_loss = mask_completeness_loss(logit_1, logit_2, logit_3,
         relation_12, relation_23)
     loss = (FLAGS.sparseness_weight*sparseness_loss +
@@ -170,14 +170,15 @@ def mask_predict_loss_function(logit_1, logit_2, logit_3, cube_params_1,
 
 
 def cube_update_loss_function(logit_1, logit_2, logit_3, cube_params_1,
-    cube_params_2, cube_params_3, node_position):
+    cube_params_2, cube_params_3, node_position,
+    assignments=(None, None, None)):
   with tf.name_scope('cube_update_loss_function'):
     logit = tf.concat([logit_1, logit_2, logit_3], axis=1)
     mask = tf.cast(logit > 0.5, tf.int32)
     _, _, relation_12 = cube_coverage_loss(cube_params_1, cube_params_2, n_part_1,
-        node_position) # [bs, n_part_1]
+        node_position, assignments[0]) # [bs, n_part_1]
     _, _, relation_23 = cube_coverage_loss(cube_params_2, cube_params_3, n_part_2,
-        node_position) # [bs, n_part_2]
+        node_position, assignments[1]) # [bs, n_part_2]
     mask_1, mask_2, mask_3 = primitive_tree_generation(mask, relation_12,
         relation_23, n_part_1, n_part_2, n_part_3)
     cube_params_z = tf.concat([cube_params_1[0], cube_params_2[0], cube_params_3[0]], axis=1)
@@ -237,14 +238,19 @@ def train_network():
   logit_3 = mask_predict_net(latent_code, n_part_3, name='phase_3',
       is_training=True, reuse=False)
 
+  # the nearest cube of every point at each level, computed once and shared
+  # by all the coverage losses below
+  assignments = [point_cube_assignment(cube_params, node_position)
+      for cube_params in [cube_params_1, cube_params_2, cube_params_3]]
+
   mask_predict_loss, sparseness_loss, similarity_loss, completeness_loss = \
       mask_predict_loss_function(
           logit_1, logit_2, logit_3,
           cube_params_1, cube_params_2, cube_params_3,
-          node_position
+          node_position, assignments
           )
   original_tree_loss = initial_loss_function(cube_params_1, cube_params_2,
-      cube_params_3, node_position)
+      cube_params_3, node_position, assignments)
   [selected_tree_loss_1,
    selected_coverage_distance_1,
    selected_consistency_distance_1,
@@ -259,7 +265,7 @@ def train_network():
    selected_mutex_distance_3,
    _, _, _
   ] = cube_update_loss_function(logit_1, logit_2, logit_3, cube_params_1,
-      cube_params_2, cube_params_3, node_position)
+      cube_params_2, cube_params_3, node_position, assignments)
   selected_tree_loss = selected_tree_loss_1 + selected_tree_loss_2 + selected_tree_loss_3  
   fitting_loss = selected_tree_loss * FLAGS.selected_tree_weight + original_tree_loss
 
@@ -360,14 +366,19 @@ def test_network():
   predict_2 = tf.cast(logit_2 > 0.5, tf.int32)
   predict_3 = tf.cast(logit_3 > 0.5, tf.int32)
 
+  # the nearest cube of every point at each level, computed once and shared
+  # by all the coverage losses below
+  assignments = [point_cube_assignment(cube_params, node_position)
+      for cube_params in [cube_params_1, cube_params_2, cube_params_3]]
+
   mask_predict_loss, sparseness_loss, similarity_loss, completeness_loss = \
       mask_predict_loss_function(
           logit_1, logit_2, logit_3,
           cube_params_1, cube_params_2, cube_params_3,
-          node_position
+          node_position, assignments
           )
   original_tree_loss = initial_loss_function(cube_params_1, cube_params_2,
-      cube_params_3, node_position)
+      cube_params_3, node_position, assignments)
   [selected_tree_loss_1,
    selected_coverage_distance_1,
    selected_consistency_distance_1,
@@ -382,7 +393,7 @@ def test_network():
    selected_mutex_distance_3,
    mask_1, mask_2, mask_3
   ] = cube_update_loss_function(logit_1, logit_2, logit_3, cube_params_1,
-      cube_params_2, cube_params_3, node_position)
+      cube_params_2, cube_params_3, node_position, assignments)
   selected_tree_loss = selected_tree_loss_1 + selected_tree_loss_2 + selected_tree_loss_3  
   fitting_loss = selected_tree_loss * FLAGS.selected_tree_weight + original_tree_loss
   
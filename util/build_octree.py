@@ -0,0 +1,87 @@
+"""Build the octree TFRecords from raw point clouds with the points_to_octree op.
+
+Each input file holds one shape, the points and their normals as 6 columns
+x y z nx ny nz, either a .npy array or a text file. A record gets the octree
+and n_points points sampled from the shape, the features read by
+data_loader.py, so a dataset can be rebuilt at another depth in one pass.
+
+  $ python build_octree.py --input data/airplane_train.txt \
+      --output data/airplane_octree_points_d6_train.tfrecords --depth 6
+"""
+import argparse
+import os
+import sys
+
+import numpy as np
+import tensorflow as tf
+
+sys.path.append('..')
+from cext import points_to_octree
+
+
+def _load_points(filename):
+  if filename.endswith('.npy'):
+    data = np.load(filename)
+  else:
+    data = np.loadtxt(filename)
+  assert data.ndim == 2 and data.shape[1] == 6, filename
+  # the planar layout [3, n] of the points feature
+  points = np.ascontiguousarray(data[:, :3].T, dtype=np.float32)
+  normals = np.ascontiguousarray(data[:, 3:].T, dtype=np.float32)
+  return points, normals
+
+
+def _sample_points(points, n_points, rng):
+  n = points.shape[1]
+  index = rng.choice(n, n_points, replace=n < n_points)
+  return points[:, index].reshape(-1)
+
+
+def build_dataset(input_list, output_file, depth, full_layer, radius,
+                  n_points, seed):
+  with open(input_list) as f:
+    root = os.path.dirname(input_list)
+    filenames = [os.path.join(root, line.strip()) for line in f if line.strip()]
+
+  in_points = tf.placeholder(tf.float32, [1, None])
+  in_normals = tf.placeholder(tf.float32, [1, None])
+  out_octree = points_to_octree(in_points, in_normals, depth=depth,
+                                full_layer=full_layer, radius=radius)
+
+  rng = np.random.RandomState(seed)
+  with tf.Session() as sess, tf.python_io.TFRecordWriter(output_file) as writer:
+    for filename in filenames:
+      points, normals = _load_points(filename)
+      octree = sess.run(out_octree, feed_dict={
+          in_points: points.reshape(1, -1), in_normals: normals.reshape(1, -1)})
+      feature = {
+          'octree': tf.train.Feature(
+              bytes_list=tf.train.BytesList(value=[octree[0]])),
+          'points': tf.train.Feature(float_list=tf.train.FloatList(
+              value=_sample_points(points, n_points, rng)))}
+      example = tf.train.Example(features=tf.train.Features(feature=feature))
+      writer.write(example.SerializeToString())
+  print('built {} octrees into {}'.format(len(filenames), output_file))
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument('--input', type=str, required=True,
+                      help='list of the point cloud files, one per line, '
+                           'relative to the list')
+  parser.add_argument('--output', type=str, required=True,
+                      help='the TFRecords to write')
+  parser.add_argument('--depth', type=int, default=5,
+                      help='octree depth')
+  parser.add_argument('--full_layer', type=int, default=2,
+                      help='the layers up to it hold all their nodes')
+  parser.add_argument('--radius', type=float, default=0.5,
+                      help='half size of the octree cube centered at the '
+                           'origin, <= 0 for the bounding cube of each shape')
+  parser.add_argument('--n_points', type=int, default=5000,
+                      help='points per shape in the points feature')
+  parser.add_argument('--seed', type=int, default=0,
+                      help='seed of the point sampling')
+  args = parser.parse_args()
+  build_dataset(args.input, args.output, args.depth, args.full_layer,
+                args.radius, args.n_points, args.seed)
@@ -0,0 +1,74 @@
+"""Compress a TFRecord dataset of octrees and points.
+
+Each shape becomes a single record in the octree feature, made by the
+octree_encode op: the octree is kept as the occupancy bytes of its non-empty
+nodes, and its signal and the points are quantized to 16 bits. Such records
+are several times smaller. The reader ops decode them as they go.
+data_loader() reads them like the raw TFRecords, by convention they are
+named *.octz.
+
+  $ python compress_dataset.py --input data/airplane_octree_points_d5_train.tfrecords \
+      --output data/airplane_octree_points_d5_train.octz
+"""
+import argparse
+import sys
+
+import numpy as np
+import tensorflow as tf
+
+sys.path.append('..')
+from cext import octree_encode
+
+
+def _read_tfrecords(filename, n_points):
+  for serialized in tf.python_io.tf_record_iterator(filename):
+    feature = tf.train.Example.FromString(serialized).features.feature
+    points = feature['points'].float_list.value
+    assert len(points) == n_points * 3
+    yield feature['octree'].bytes_list.value[0], points
+
+
+def compress_dataset(input_file, output_file, n_points, chunk_size):
+  in_octree = tf.placeholder(tf.string, [None])
+  in_points = tf.placeholder(tf.float32, [None, n_points * 3])
+  out_record = octree_encode(in_octree, in_points)
+
+  in_bytes, out_bytes, num_shape = 0, 0, 0
+  with tf.Session() as sess, tf.python_io.TFRecordWriter(output_file) as writer:
+    def write(chunk):
+      octrees, points = zip(*chunk)
+      records = sess.run(out_record, feed_dict={
+          in_octree: octrees, in_points: np.array(points, dtype=np.float32)})
+      for record in records:
+        example = tf.train.Example(features=tf.train.Features(feature={
+            'octree': tf.train.Feature(
+                bytes_list=tf.train.BytesList(value=[record]))}))
+        writer.write(example.SerializeToString())
+      return sum(len(r) for r in records)
+
+    chunk = []
+    for octree, points in _read_tfrecords(input_file, n_points):
+      chunk.append((octree, points))
+      in_bytes += len(octree) + 4 * len(points)
+      num_shape += 1
+      if len(chunk) == chunk_size:
+        out_bytes += write(chunk)
+        chunk = []
+    if chunk:
+      out_bytes += write(chunk)
+  print('compressed {} shapes into {}, {:.1f}x smaller'.format(
+      num_shape, output_file, in_bytes / max(out_bytes, 1)))
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument('--input', type=str, required=True,
+                      help='TFRecords with octree and points features')
+  parser.add_argument('--output', type=str, required=True,
+                      help='the compressed TFRecords to write, e.g. *.octz')
+  parser.add_argument('--n_points', type=int, default=5000,
+                      help='points per shape in the points feature')
+  parser.add_argument('--chunk_size', type=int, default=256,
+                      help='shapes compressed per session run')
+  args = parser.parse_args()
+  compress_dataset(args.input, args.output, args.n_points, args.chunk_size)
@@ -4,7 +4,10 @@ import numpy as np
 import tensorflow as tf
 
 sys.path.append('..')
-from cext import octree_database
+from cext import octree_augment
+from cext import octree_packed_database
+from cext import octree_prefetch_database
+from cext import primitive_points_morton_sort
 from cext import primitive_points_suffix_index
 
 def _add_data_to_queue(data, octree, points, test):
@@ -18,21 +21,38 @@ def _add_data_to_queue(data, octree, points, test):
   return data, octree, points
 
 
-def read_and_decode(filename_queue, batch_size, n_points, test=False):
-  reader = tf.TFRecordReader()
-  keys, serialized_examples = reader.read_up_to(filename_queue, batch_size)
-  feature = {'octree': tf.FixedLenFeature([], tf.string),
-             'points': tf.FixedLenFeature([n_points*3], tf.float32)}
-  features = tf.parse_example(serialized_examples, features=feature)
-  octree = features['octree']
-  points = features['points']
-  [data, octree, _] = octree_database(octree)
+def read_prefetched(dataset, batch_size, n_points, test=False):
+  # the TFRecords, raw or compressed by compress_dataset.py, are read, decoded
+  # and merged ahead of the steps by the worker threads of a single op
+  data, octree, node_position, stall = octree_prefetch_database(
+      [dataset], batch_size, n_point=n_points, shuffle=not test)
+  tf.summary.scalar('reader_stall', stall)
+  return data, octree, node_position
+
+
+def read_packed(dataset, batch_size, test=False):
+  # the octree pack written by pack_dataset.py, read in order with the
+  # neighbors precomputed
+  [data, octree, points] = octree_packed_database(dataset, batch_size,
+                                                  shuffle=False)
   return _add_data_to_queue(data, octree, points, test)
 
 
-def data_loader(dataset, batch_size, n_points=5000, test=False):
+def data_loader(dataset, batch_size, n_points=5000, test=False, augment=False,
+                morton_order=False):
   with tf.name_scope('read_and_decode'):
-    filename_queue = tf.train.string_input_producer([dataset])
-    data, octree, points = read_and_decode(filename_queue, batch_size, n_points, test)
-    node_position = primitive_points_suffix_index(points)
+    if dataset.endswith('.octpack'):
+      data, octree, points = read_packed(dataset, batch_size, test)
+      node_position = primitive_points_suffix_index(points)
+    else:
+      data, octree, node_position = read_prefetched(dataset, batch_size,
+                                                    n_points, test)
+    if augment:
+      # random flips and axis permutations of each shape
+      data, octree, node_position, _ = octree_augment(data, octree,
+                                                      node_position)
+    if morton_order:
+      # the points of each shape along a Morton curve, the losses only sum
+      # over the points so their order does not matter otherwise
+      node_position, _ = primitive_points_morton_sort(node_position)
   return data, octree, node_position
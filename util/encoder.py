@@ -3,58 +3,55 @@ import tensorflow as tf
 
 sys.path.append('..')
 from cext import octree_conv
+from cext import octree_conv_relu_pool
 from cext import octree_pooling
 
 
-def encoder(data, octree, is_training=True, reuse=None):
+def octree_conv_relu_pool_block(data, kernel, octree, curr_depth, num_output,
+                                fused, name):
+  # the fused op keeps the full-resolution activations out of memory, it only
+  # has a CPU kernel
+  if fused:
+    [octpool, _] = octree_conv_relu_pool(data, kernel, octree,
+        curr_depth=curr_depth, num_output=num_output, name=name)
+    return octpool
+  octconv = octree_conv(data, kernel, octree, curr_depth=curr_depth,
+      num_output=num_output, kernel_size=3, stride=1)
+  octconv = tf.nn.relu(octconv)
+  [octpool, _] = octree_pooling(octconv, octree, curr_depth=curr_depth,
+      name=name)
+  return octpool
+
+
+def encoder(data, octree, is_training=True, reuse=None, fused=False):
   with tf.variable_scope('encoder', reuse=reuse):
-    # octconv1
+    # octconv1 and octpool1
     with tf.variable_scope('octconv1'):
       kernel = tf.get_variable('weights', shape=[16, 3, 3**3], dtype=tf.float32,
           initializer=tf.contrib.layers.variance_scaling_initializer())
-      octconv1 = octree_conv(data, kernel, octree, curr_depth=5,
-          num_output=16, kernel_size=3, stride=1)
-      octconv1 = tf.nn.relu(octconv1)
-
-    # octpool1
-    [octpool1, _] = octree_pooling(octconv1, octree, curr_depth=5,
-        name='octpool1')
+    octpool1 = octree_conv_relu_pool_block(data, kernel, octree, 5, 16,
+        fused, 'octpool1')
 
-    # octconv2
+    # octconv2 and octpool2
     with tf.variable_scope('octconv2'):
       kernel = tf.get_variable('weights', shape=[32, 16, 3**3], dtype=tf.float32,
           initializer=tf.contrib.layers.variance_scaling_initializer())
-      octconv2 = octree_conv(octpool1, kernel, octree, curr_depth=4,
-          num_output=32, kernel_size=3, stride=1)
-      octconv2 = tf.nn.relu(octconv2)
+    octpool2 = octree_conv_relu_pool_block(octpool1, kernel, octree, 4, 32,
+        fused, 'octpool2')
 
-    # octpool2
-    [octpool2, _] = octree_pooling(octconv2, octree, curr_depth=4,
-        name='octpool2')
-
-    # octconv3
+    # octconv3 and octpool3
     with tf.variable_scope('octconv3'):
       kernel = tf.get_variable('weights', shape=[64, 32, 3**3], dtype=tf.float32,
           initializer=tf.contrib.layers.variance_scaling_initializer())
-      octconv3 = octree_conv(octpool2, kernel, octree, curr_depth=3,
-          num_output=64, kernel_size=3, stride=1)
-      octconv3 = tf.nn.relu(octconv3)
-
-    # octpool3
-    [octpool3, _] = octree_pooling(octconv3, octree, curr_depth=3,
-        name='octpool3')
+    octpool3 = octree_conv_relu_pool_block(octpool2, kernel, octree, 3, 64,
+        fused, 'octpool3')
 
-    # octconv4
+    # octconv4 and octpool4
     with tf.variable_scope('octconv4'):
       kernel = tf.get_variable('weights', shape=[128, 64, 3**3], dtype=tf.float32,
           initializer=tf.contrib.layers.variance_scaling_initializer())
-      octconv4 = octree_conv(octpool3, kernel, octree, curr_depth=2,
-          num_output=128, kernel_size=3, stride=1)
-      octconv4 = tf.nn.relu(octconv4)
-
-    # octpool4
-    [octpool4, _] = octree_pooling(octconv4, octree, curr_depth=2,
-        name='octpool4')
+    octpool4 = octree_conv_relu_pool_block(octpool3, kernel, octree, 2, 128,
+        fused, 'octpool4')
 
     # conv5
     with tf.variable_scope('conv5'):
@@ -15,8 +15,12 @@ from cext import primitive_cube_area_average_loss
 from cext import primitive_cube_volume
 from cext import primitive_group_points
 from cext import primitive_points_suffix_index
+from cext import primitive_point_cube_assignment
+from cext import primitive_coverage_assigned_loss
+from cext import primitive_cube_transforms
 # mask prediction
 from cext import primitive_coverage_split_loss
+from cext import primitive_coverage_split_assigned_loss
 from cext import primitive_consistency_split_loss
 from cext import primitive_tree_generation
 # cube update
@@ -25,10 +29,38 @@ from cext import primitive_consistency_select_loss
 from cext import primitive_mutex_select_loss
 
 
-def coverage_loss(cube_params, node_position):
+def cube_transforms(cube_params):
+  ## The rotation, inverse translation and size of every cube, computed once
+  ## and shared by all the losses of the same cubes.
+  with tf.name_scope('cube_transforms'):
+    transforms = primitive_cube_transforms(cube_params[0], cube_params[1],
+        cube_params[2])
+  return transforms
+
+
+def point_cube_assignment(cube_params, node_position, transforms=None):
+  ## The nearest cube of every point, shared by the coverage losses of the same
+  ## cubes: [index [n_point], distance [n_point], point count [bs, n_cube]].
+  if transforms is None:
+    transforms = cube_transforms(cube_params)
+  with tf.name_scope('point_cube_assignment'):
+    assignment = primitive_point_cube_assignment(cube_params[0],
+        cube_params[1], cube_params[2], node_position, transforms)
+  return assignment
+
+
+def coverage_loss(cube_params, node_position, assignment=None,
+    transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(cube_params)
   with tf.name_scope('coverage'):
-    distance = primitive_coverage_loss(cube_params[0], cube_params[1],
-        cube_params[2], node_position)
+    if assignment is None:
+      distance = primitive_coverage_loss(cube_params[0], cube_params[1],
+          cube_params[2], node_position, transforms)
+    else:
+      distance = primitive_coverage_assigned_loss(cube_params[0],
+          cube_params[1], cube_params[2], node_position, assignment[0],
+          transforms)
     distance = tf.reduce_sum(distance)
     volume = primitive_cube_volume(cube_params[0])
     volume = tf.reduce_sum(volume)
@@ -36,31 +68,43 @@ def coverage_loss(cube_params, node_position):
 
 
 def cube_coverage_loss(src_cube_params, des_cube_params, n_src_cube,
-    node_position):
+    node_position, src_assignment=None, des_transforms=None):
+  if des_transforms is None:
+    des_transforms = cube_transforms(des_cube_params)
   with tf.name_scope('cube_coverage'):
-    points_index = primitive_group_points(src_cube_params[0],
-        src_cube_params[1], src_cube_params[2], node_position)
+    if src_assignment is None:
+      points_index = primitive_group_points(src_cube_params[0],
+          src_cube_params[1], src_cube_params[2], node_position,
+          cube_transforms(src_cube_params))
+    else:
+      points_index = src_assignment[0]
     volume = primitive_cube_volume(des_cube_params[0])
     volume = tf.reduce_sum(volume)
     distance, relation = primitive_cube_coverage_loss(des_cube_params[0],
         des_cube_params[1], des_cube_params[2], node_position, points_index,
-        n_src_cube=n_src_cube)
+        des_transforms, n_src_cube=n_src_cube)
     distance = tf.reduce_sum(distance)
   return distance, volume, relation
 
 
-def consistency_loss(cube_params, node_position, num_sample=26):
+def consistency_loss(cube_params, node_position, num_sample=26,
+    transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(cube_params)
   with tf.name_scope('consistency'):
     distance = primitive_consistency_loss(cube_params[0], cube_params[1],
-        cube_params[2], node_position, scale=1, num_sample=num_sample)
+        cube_params[2], node_position, transforms, scale=1,
+        num_sample=num_sample)
     distance = tf.reduce_sum(distance)
   return distance
 
 
-def mutex_loss(cube_params):
+def mutex_loss(cube_params, transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(cube_params)
   with tf.name_scope('mutex'):
     distance = primitive_mutex_loss(cube_params[0], cube_params[1],
-        cube_params[2], scale=0.8)
+        cube_params[2], transforms, scale=0.8)
     distance = tf.reduce_sum(distance)
   return distance
 
@@ -77,10 +121,12 @@ def aligning_loss(cube_params):
   return distance
 
 
-def symmetry_loss(cube_params):
+def symmetry_loss(cube_params, transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(cube_params)
   with tf.name_scope('symmetry'):
     distance = primitive_symmetry_loss(cube_params[0], cube_params[1],
-        cube_params[2], scale=1, depth=0)  # depth == 0, means symmetry plane is 0
+        cube_params[2], transforms, scale=1, depth=0)  # depth == 0, means symmetry plane is 0
     distance = tf.reduce_sum(distance)
   return distance
 
@@ -92,46 +138,64 @@ def cube_area_average_loss(cube_params):
   return distance
 
 
-def compute_loss_phase_one(cube_params, node_position):
+def compute_loss_phase_one(cube_params, node_position, assignment=None):
   with tf.name_scope('compute_loss_phase_one'):
-    coverage_distance, volume = coverage_loss(cube_params, node_position)
-    consistency_distance = consistency_loss(cube_params, node_position)
-    mutex_distance = mutex_loss(cube_params)
+    transforms = cube_transforms(cube_params)
+    coverage_distance, volume = coverage_loss(cube_params, node_position,
+        assignment, transforms)
+    consistency_distance = consistency_loss(cube_params, node_position,
+        transforms=transforms)
+    mutex_distance = mutex_loss(cube_params, transforms)
     aligning_distance = aligning_loss(cube_params)
-    symmetry_distance = symmetry_loss(cube_params)
+    symmetry_distance = symmetry_loss(cube_params, transforms)
     cube_area_average_distance = cube_area_average_loss(cube_params)
   return [coverage_distance, volume, consistency_distance, mutex_distance,
       aligning_distance, symmetry_distance, cube_area_average_distance]
 
 
 def compute_loss_phase_merge(src_cube_params, des_cube_params, num_part_src, 
-    node_position, phase='two'):
+    node_position, phase='two', src_assignment=None):
   with tf.name_scope('compute_loss_phase_' + phase):
+    des_transforms = cube_transforms(des_cube_params)
     coverage_distance, volume, _ = cube_coverage_loss(src_cube_params,
-        des_cube_params, num_part_src, node_position)
+        des_cube_params, num_part_src, node_position, src_assignment,
+        des_transforms)
     consistency_distance = consistency_loss(des_cube_params, node_position,
-        num_sample=26 if phase == 'two' else 96)
-    mutex_distance = mutex_loss(des_cube_params)
+        num_sample=26 if phase == 'two' else 96, transforms=des_transforms)
+    mutex_distance = mutex_loss(des_cube_params, des_transforms)
     aligning_distance = aligning_loss(des_cube_params)
-    symmetry_distance = symmetry_loss(des_cube_params)
+    symmetry_distance = symmetry_loss(des_cube_params, des_transforms)
   return [coverage_distance, volume, consistency_distance, mutex_distance,
       aligning_distance, symmetry_distance]
 
 
-def coverage_split_loss(latent_code, node_position):
+def coverage_split_loss(latent_code, node_position, assignment=None,
+    transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(latent_code)
   with tf.name_scope('coverage'):
     ## The output `distance` of one cube, is the distance summation of all the
     ## points belong to the cube. The number of the points one cube contains is
     ## stored in `point_count`.
-    distance, point_count = primitive_coverage_split_loss(latent_code[0],
-        latent_code[1], latent_code[2], node_position)
+    if assignment is None:
+      distance, point_count = primitive_coverage_split_loss(latent_code[0],
+          latent_code[1], latent_code[2], node_position, transforms)
+    else:
+      distance = primitive_coverage_split_assigned_loss(latent_code[0],
+          latent_code[1], latent_code[2], node_position, assignment[0],
+          transforms)
+      point_count = assignment[2]
   return distance, point_count
 
 
-def consistency_split_loss(latent_code, node_position, num_sample=26):
+def consistency_split_loss(latent_code, node_position, num_sample=26,
+    transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(latent_code)
   with tf.name_scope('consistency'):
     distance = primitive_consistency_split_loss(latent_code[0], latent_code[1],
-        latent_code[2], node_position, scale=1, num_sample=num_sample)
+        latent_code[2], node_position, transforms, scale=1,
+        num_sample=num_sample)
   return distance
 
 
@@ -143,20 +207,31 @@ def mask_sparseness_loss(logit_1, logit_2, logit_3):
 
 
 def shape_similarity_loss(logit_1, logit_2, logit_3, cube_params_1,
-    cube_params_2, cube_params_3, node_position, n_part_1, n_part_2):
+    cube_params_2, cube_params_3, node_position, n_part_1, n_part_2,
+    assignments=None):
   with tf.name_scope('shape_similarity_loss'):
+    ## one nearest cube pass per level serves both the grouping of the points
+    ## and the split coverage loss
+    transforms_1, transforms_2, transforms_3 = [cube_transforms(cube_params)
+        for cube_params in [cube_params_1, cube_params_2, cube_params_3]]
+    if assignments is None:
+      assignments = [point_cube_assignment(cube_params, node_position,
+          transforms) for cube_params, transforms in
+          zip([cube_params_1, cube_params_2, cube_params_3],
+              [transforms_1, transforms_2, transforms_3])]
+    assignment_1, assignment_2, assignment_3 = assignments
     _, _, relation_12 = cube_coverage_loss(cube_params_1, cube_params_2, n_part_1,
-        node_position) # [bs, n_part_1]
+        node_position, assignment_1, transforms_2) # [bs, n_part_1]
     _, _, relation_23 = cube_coverage_loss(cube_params_2, cube_params_3, n_part_2,
-        node_position) # [bs, n_part_2]
-    coverage_loss_1, point_count_1 = coverage_split_loss(cube_params_1, node_position) # [bs, n_part_1]
-    coverage_loss_2, point_count_2 = coverage_split_loss(cube_params_2, node_position) # [bs, n_part_2]
-    coverage_loss_3, point_count_3 = coverage_split_loss(cube_params_3, node_position) # [bs, n_part_3]
+        node_position, assignment_2, transforms_3) # [bs, n_part_2]
+    coverage_loss_1, point_count_1 = coverage_split_loss(cube_params_1, node_position, assignment_1, transforms_1) # [bs, n_part_1]
+    coverage_loss_2, point_count_2 = coverage_split_loss(cube_params_2, node_position, assignment_2, transforms_2) # [bs, n_part_2]
+    coverage_loss_3, point_count_3 = coverage_split_loss(cube_params_3, node_position, assignment_3, transforms_3) # [bs, n_part_3]
     total_coverage_loss = tf.concat([coverage_loss_1, coverage_loss_2, coverage_loss_3], axis=1) # [bs, n1+n2+n3]
     point_count = tf.cast(tf.concat([point_count_1, point_count_2, point_count_3], axis=1), tf.float32) # [bs, n1+n2+n3]
-    consistency_loss_1 = consistency_split_loss(cube_params_1, node_position, num_sample=26) # [bs, n_part_1]
-    consistency_loss_2 = consistency_split_loss(cube_params_2, node_position, num_sample=26) # [bs, n_part_2]
-    consistency_loss_3 = consistency_split_loss(cube_params_3, node_position, num_sample=26) # [bs, n_part_3]
+    consistency_loss_1 = consistency_split_loss(cube_params_1, node_position, num_sample=26, transforms=transforms_1) # [bs, n_part_1]
+    consistency_loss_2 = consistency_split_loss(cube_params_2, node_position, num_sample=26, transforms=transforms_2) # [bs, n_part_2]
+    consistency_loss_3 = consistency_split_loss(cube_params_3, node_position, num_sample=26, transforms=transforms_3) # [bs, n_part_3]
     total_consistency_loss = tf.concat([consistency_loss_1, consistency_loss_2, consistency_loss_3], axis=1) # [bs, n1+n2+n3]
 
     def compute_chamfer_distance(logit):
@@ -191,33 +266,44 @@ def mask_completeness_loss(logit_1, logit_2, logit_3, relation_12, relation_23):
   return loss
 
 
-def coverage_select_loss(cube_params, mask, node_position):
+def coverage_select_loss(cube_params, mask, node_position, transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(cube_params)
   with tf.name_scope('select_coverage'):
     distance = primitive_coverage_select_loss(cube_params[0], cube_params[1],
-        cube_params[2], mask, node_position)
+        cube_params[2], mask, node_position, transforms)
     distance = tf.reduce_sum(distance)
   return distance
 
 
-def consistency_select_loss(cube_params, mask, node_position, num_sample=26):
+def consistency_select_loss(cube_params, mask, node_position, num_sample=26,
+    transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(cube_params)
   with tf.name_scope('select_consistency'):
     distance = primitive_consistency_select_loss(cube_params[0], cube_params[1],
-        cube_params[2], mask, node_position, scale=1, num_sample=num_sample)
+        cube_params[2], mask, node_position, transforms, scale=1,
+        num_sample=num_sample)
     distance = tf.reduce_sum(distance)
   return distance
 
 
-def mutex_select_loss(cube_params, mask):
+def mutex_select_loss(cube_params, mask, transforms=None):
+  if transforms is None:
+    transforms = cube_transforms(cube_params)
   with tf.name_scope('select_mutex'):
     distance = primitive_mutex_select_loss(cube_params[0], cube_params[1],
-        cube_params[2], mask, scale=0.8)
+        cube_params[2], mask, transforms, scale=0.8)
     distance = tf.reduce_sum(distance)
   return distance
 
 
 def compute_selected_tree_loss(cube_params, mask, node_position, phase='one'):
   with tf.name_scope('compute_tree_loss_' + phase):
-    coverage_distance = coverage_select_loss(cube_params, mask, node_position)
-    consistency_distance = consistency_select_loss(cube_params, mask, node_position)
-    mutex_distance = mutex_select_loss(cube_params, mask)
+    transforms = cube_transforms(cube_params)
+    coverage_distance = coverage_select_loss(cube_params, mask, node_position,
+        transforms)
+    consistency_distance = consistency_select_loss(cube_params, mask,
+        node_position, transforms=transforms)
+    mutex_distance = mutex_select_loss(cube_params, mask, transforms)
   return coverage_distance, consistency_distance, mutex_distance
@@ -0,0 +1,105 @@
+"""Pack a TFRecord dataset of octrees and points into an octree pack.
+
+An octree pack is an aligned binary file which is memory mapped by the
+octree_packed_database op. Each record holds a shape's octree with the node
+numbers and neighbors computed in advance, plus its points, so a batch is
+merged with offsets and copies only, see OctreePackHeader in cext/src/octree.h.
+
+  $ python pack_dataset.py --input data/airplane_octree_points_d5_train.tfrecords \
+      --output data/airplane_octree_points_d5_train.octpack
+"""
+import argparse
+import struct
+import sys
+
+import numpy as np
+import tensorflow as tf
+
+sys.path.append('..')
+from cext import octree_pack
+
+_MAGIC = b'OCTPACK\0'
+_VERSION = 1
+_ALIGNMENT = 64
+# OctreePackHeader: magic, version, num_shape, depth, full_layer,
+# content_flags, n_point and the reserved ints
+_HEADER = struct.Struct('=8s6i32x')
+
+
+def _align(size):
+  return (size + _ALIGNMENT - 1) // _ALIGNMENT * _ALIGNMENT
+
+
+def write_octree_pack(filename, records, num_shape, depth, full_layer,
+                      content_flags, n_point):
+  """Write num_shape records made by octree_pack into an octree pack."""
+  offsets = [_align(_HEADER.size + 8 * (num_shape + 1))]
+  with open(filename, 'wb') as f:
+    f.write(_HEADER.pack(_MAGIC, _VERSION, num_shape, depth, full_layer,
+                         content_flags, n_point))
+    f.seek(offsets[0])
+    for record in records:
+      assert len(record) % _ALIGNMENT == 0
+      f.write(record)
+      offsets.append(offsets[-1] + len(record))
+    assert len(offsets) == num_shape + 1
+    f.seek(_HEADER.size)
+    f.write(struct.pack('=%dq' % len(offsets), *offsets))
+
+
+def _read_tfrecords(filename, n_points):
+  for serialized in tf.python_io.tf_record_iterator(filename):
+    feature = tf.train.Example.FromString(serialized).features.feature
+    points = feature['points'].float_list.value
+    assert len(points) == n_points * 3
+    yield feature['octree'].bytes_list.value[0], points
+
+
+def pack_dataset(input_file, output_file, n_points, content_flags,
+                 chunk_size):
+  num_shape = sum(1 for _ in tf.python_io.tf_record_iterator(input_file))
+  octree, _ = next(_read_tfrecords(input_file, n_points))
+  _, _, depth, full_layer = struct.unpack_from('=4i', octree)
+
+  in_octree = tf.placeholder(tf.string, [None])
+  in_points = tf.placeholder(tf.float32, [None, n_points * 3])
+  out_record = octree_pack(in_octree, in_points, content_flags=content_flags)
+
+  with tf.Session() as sess:
+    def pack(chunk):
+      octrees, points = zip(*chunk)
+      return sess.run(out_record, feed_dict={
+          in_octree: octrees, in_points: np.array(points, dtype=np.float32)})
+
+    def records():
+      chunk = []
+      for item in _read_tfrecords(input_file, n_points):
+        chunk.append(item)
+        if len(chunk) == chunk_size:
+          for record in pack(chunk):
+            yield record
+          chunk = []
+      if chunk:
+        for record in pack(chunk):
+          yield record
+
+    write_octree_pack(output_file, records(), num_shape, depth, full_layer,
+                      content_flags, n_points)
+  print('packed {} shapes into {}'.format(num_shape, output_file))
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument('--input', type=str, required=True,
+                      help='TFRecords with octree and points features')
+  parser.add_argument('--output', type=str, required=True,
+                      help='the octree pack to write')
+  parser.add_argument('--n_points', type=int, default=5000,
+                      help='points per shape in the points feature')
+  parser.add_argument('--content_flags', type=int, default=7,
+                      help='octree content, 7 for keys, children and neighbors')
+  parser.add_argument('--chunk_size', type=int, default=256,
+                      help='shapes packed per session run')
+  args = parser.parse_args()
+  pack_dataset(args.input, args.output, args.n_points, args.content_flags,
+               args.chunk_size)